@@ -0,0 +1,230 @@
+﻿/*
+ * ps3m2ts
+ *
+ * Copyright (R) 2009-> Henning M. Stephansen
+ * Feel free to use the code by any means, hopefully you can submit your improvements, ideas etc
+ * to henningms@gmail.com or leave a comment at my blog http://www.henning.ms
+ *
+ */
+
+using System;
+using System.Collections.Generic;
+using System.Diagnostics;
+using System.Globalization;
+using System.IO;
+using System.Text.RegularExpressions;
+
+namespace ps3m2ts.Bench
+{
+    /// <summary>
+    /// Runs ps3m2ts end to end on synthetic input for every combination of batch size and job count,
+    /// with the stand-in tools installed in the working directory, and reports the throughput of the
+    /// run and of each stage. Stage figures come from the "transfer" events of the run's /jsonlog, so
+    /// they are measured by ps3m2ts itself.
+    /// </summary>
+    class BenchmarkRun
+    {
+        #region Constants
+
+        private static readonly Regex TransferEvent = new Regex("\"event\":\"transfer\".*\"work\":\"([^\"]*)\".*\"bytes\":(\\d+).*\"duration_ms\":([0-9.]+)");
+        private static readonly Regex JobEvent = new Regex("\"event\":\"job\".*\"status\":\"([^\"]*)\"");
+        private static readonly String[] Stages = { "extract", "transcode", "mux", "remux" };
+
+        #endregion
+
+        #region Constructor
+
+        public BenchmarkRun(Dictionary<String, String> Options)
+        {
+            this.Options = Options;
+        }
+
+        #endregion
+
+        #region Private Fields
+
+        private class StageResult
+        {
+            public long Bytes;
+            public double Seconds;
+        }
+
+        private class Result
+        {
+            public int Converted;
+            public int Failed;
+            public long InputBytes;
+            public TimeSpan WallTime;
+            public Dictionary<String, StageResult> Stages = new Dictionary<String, StageResult>();
+        }
+
+        private readonly Dictionary<String, String> Options;
+
+        #endregion
+
+        #region Public Methods
+
+        public void Run()
+        {
+            String work = Path.GetFullPath(Options["work"]);
+            if (!Directory.Exists(work)) Directory.CreateDirectory(work);
+
+            // ps3m2ts looks for its tools in the working directory
+            StubTools.Install(work);
+            Environment.CurrentDirectory = work;
+            Environment.SetEnvironmentVariable(StubTools.TranscodePassesVariable, Options["passes"]);
+
+            List<int> batches = ParseList(Options["batches"]);
+            List<int> jobCounts = ParseList(Options["jobs"]);
+
+            var inputs = new Dictionary<int, String>();
+            foreach (int batch in batches) inputs[batch] = Generate(work, batch);
+
+            Console.WriteLine();
+            Console.WriteLine("batch  jobs  ok/failed    wall s    MB/s    extract  transcode      mux    remux  (stage MB/s per job)");
+
+            foreach (int batch in batches)
+            {
+                foreach (int jobs in jobCounts)
+                {
+                    Result result = Measure(work, inputs[batch], batch, jobs);
+
+                    String line = String.Format(CultureInfo.InvariantCulture, "{0,5}  {1,4}  {2,4}/{3,-6} {4,7:0.0} {5,7:0.0}  ",
+                                                batch, jobs, result.Converted, result.Failed, result.WallTime.TotalSeconds,
+                                                result.InputBytes / 1048576.0 / Math.Max(0.001, result.WallTime.TotalSeconds));
+
+                    foreach (String stage in Stages)
+                    {
+                        StageResult stageResult;
+                        if (result.Stages.TryGetValue(stage, out stageResult) && stageResult.Seconds > 0)
+                            line += String.Format(CultureInfo.InvariantCulture, "{0,9:0.0}", stageResult.Bytes / 1048576.0 / stageResult.Seconds);
+                        else
+                            line += String.Format("{0,9}", "-");
+                    }
+
+                    Console.WriteLine(line);
+                }
+            }
+        }
+
+        #endregion
+
+        #region Private Methods
+
+        /// <summary>
+        /// The directory with batch input files, generated unless an earlier run left them there. The
+        /// audio codecs of /audio take turns.
+        /// </summary>
+        private String Generate(String work, int batch)
+        {
+            long size = long.Parse(Options["size"]) << 20;
+            int clusterMs = int.Parse(Options["cluster"]);
+            bool cues = !Options.ContainsKey("nocues");
+            String[] codecs = Options["audio"].Split(',');
+
+            String directory = Path.Combine(work, String.Format(CultureInfo.InvariantCulture, "input-{0}x{1}MB-{2}ms{3}",
+                                                                batch, Options["size"], clusterMs, cues ? "" : "-nocues"));
+            if (!Directory.Exists(directory)) Directory.CreateDirectory(directory);
+
+            var watch = Stopwatch.StartNew();
+            long written = 0;
+
+            for (int i = 0; i < batch; i++)
+            {
+                String codec = CodecId(codecs[i % codecs.Length]);
+                String file = Path.Combine(directory, String.Format(CultureInfo.InvariantCulture, "bench-{0:00}-{1}.mkv",
+                                                                    i + 1, codecs[i % codecs.Length].Trim().ToLowerInvariant()));
+                if (File.Exists(file)) continue;
+
+                var generator = new MkvGenerator(size, codec);
+                generator.ClusterMs = clusterMs;
+                generator.Cues = cues;
+                generator.Seed = i + 1;
+                generator.Write(file);
+
+                written += new FileInfo(file).Length;
+            }
+
+            if (written > 0)
+                Console.WriteLine(String.Format(CultureInfo.InvariantCulture, "Generated {0:0.0} MB of input in '{1}' at {2:0.0} MB/s.",
+                                                written / 1048576.0, directory, written / 1048576.0 / Math.Max(0.001, watch.Elapsed.TotalSeconds)));
+
+            return directory;
+        }
+
+        /// <summary>
+        /// One ps3m2ts run over input into a fresh destination, so nothing counts as up to date.
+        /// </summary>
+        private Result Measure(String work, String input, int batch, int jobs)
+        {
+            String name = String.Format(CultureInfo.InvariantCulture, "b{0}-j{1}", batch, jobs);
+            String destination = Path.Combine(work, "output-" + name);
+            String events = Path.Combine(work, "events-" + name + ".jsonl");
+
+            if (Directory.Exists(destination)) Directory.Delete(destination, true);
+            Directory.CreateDirectory(destination);
+            if (File.Exists(events)) File.Delete(events);
+
+            String arguments = String.Format(CultureInfo.InvariantCulture, "\"{0}\" /dest \"{1}\" /jobs={2} /jsonlog \"{3}\"",
+                                             input, destination, jobs, events);
+            if (Options.ContainsKey("pipeline")) arguments += " /pipeline";
+
+            var ps3m2ts = new ProcessSupervisor("bench", Path.Combine(work, Path.GetFileName(typeof(MatroskaReader).Assembly.Location)), arguments);
+            ps3m2ts.NoProgressTimeout = TimeSpan.Zero;
+
+            var result = new Result();
+            result.WallTime = ps3m2ts.Run().WallTime;
+
+            foreach (String file in Directory.GetFiles(input, "*.mkv")) result.InputBytes += new FileInfo(file).Length;
+
+            foreach (String line in File.ReadAllLines(events))
+            {
+                Match transfer = TransferEvent.Match(line);
+                if (transfer.Success)
+                {
+                    StageResult stage;
+                    if (!result.Stages.TryGetValue(transfer.Groups[1].Value, out stage))
+                    {
+                        stage = new StageResult();
+                        result.Stages.Add(transfer.Groups[1].Value, stage);
+                    }
+
+                    stage.Bytes += long.Parse(transfer.Groups[2].Value, CultureInfo.InvariantCulture);
+                    stage.Seconds += double.Parse(transfer.Groups[3].Value, CultureInfo.InvariantCulture) / 1000;
+                    continue;
+                }
+
+                Match job = JobEvent.Match(line);
+                if (job.Success)
+                {
+                    if (job.Groups[1].Value == "failed") result.Failed++;
+                    else result.Converted++;
+                }
+            }
+
+            if (!Options.ContainsKey("keep")) Directory.Delete(destination, true);
+
+            return result;
+        }
+
+        private static String CodecId(String name)
+        {
+            switch (name.Trim().ToLowerInvariant())
+            {
+                case "dts": return MkvGenerator.Dts;
+                case "ac3": return MkvGenerator.Ac3;
+                case "flac": return MkvGenerator.Flac;
+                default: throw new ArgumentException("Unknown audio codec '" + name + "'.");
+            }
+        }
+
+        private static List<int> ParseList(String list)
+        {
+            var values = new List<int>();
+            foreach (String value in list.Split(',')) values.Add(Math.Max(1, int.Parse(value.Trim(), CultureInfo.InvariantCulture)));
+            return values;
+        }
+
+        #endregion
+    }
+}
@@ -0,0 +1,365 @@
+﻿/*
+ * ps3m2ts
+ *
+ * Copyright (R) 2009-> Henning M. Stephansen
+ * Feel free to use the code by any means, hopefully you can submit your improvements, ideas etc
+ * to henningms@gmail.com or leave a comment at my blog http://www.henning.ms
+ *
+ */
+
+using System;
+using System.Collections.Generic;
+using System.Diagnostics;
+using System.Globalization;
+using System.IO;
+
+namespace ps3m2ts.Bench
+{
+    /// <summary>
+    /// Times the byte-crunching loops of the native stages on in-memory data: EBML element and block
+    /// header decoding, demuxing, AVCC to Annex B rewriting, PES/TS packetizing and CRC-32/MPEG-2, plus
+    /// the Annex B start code scan of a raw H.264 reader for comparison. Each benchmark is warmed up,
+    /// calibrated to a sample length and sampled several times; the median is reported in ns/byte and
+    /// GB/s and can be checked against a baseline file written by an earlier run.
+    /// </summary>
+    class MicroBenchmarks
+    {
+        #region Constructor
+
+        public MicroBenchmarks(Dictionary<String, String> Options)
+        {
+            this.Options = Options;
+        }
+
+        #endregion
+
+        #region Private Fields
+
+        private class Benchmark
+        {
+            public String Name;
+
+            /// <summary>Bytes one call of Run processes.</summary>
+            public long Bytes;
+            public Action Run;
+        }
+
+        private readonly Dictionary<String, String> Options;
+
+        /// <summary>Results go here so the JIT can't drop the work.</summary>
+        private static long Sink;
+
+        #endregion
+
+        #region Public Methods
+
+        /// <summary>
+        /// Runs every benchmark matching /filter. Returns false if one is slower than the baseline by
+        /// more than /tolerance percent.
+        /// </summary>
+        public bool Run()
+        {
+            int samples = int.Parse(Options["samples"]);
+            var warmup = TimeSpan.FromMilliseconds(int.Parse(Options["warmup"]));
+            var sampleTime = TimeSpan.FromMilliseconds(int.Parse(Options["time"]));
+            double tolerance = double.Parse(Options["tolerance"], CultureInfo.InvariantCulture) / 100;
+
+            Dictionary<String, double> baseline = Options.ContainsKey("baseline") ? ReadBaseline(Options["baseline"]) : null;
+            var results = new Dictionary<String, double>();
+            bool passed = true;
+
+            Console.WriteLine("benchmark                    ns/byte      GB/s   spread  baseline");
+
+            foreach (Benchmark benchmark in CreateBenchmarks())
+            {
+                if (Options.ContainsKey("filter") && benchmark.Name.IndexOf(Options["filter"], StringComparison.OrdinalIgnoreCase) < 0)
+                    continue;
+
+                double spread;
+                double nsPerByte = Measure(benchmark, samples, warmup, sampleTime, out spread);
+                results[benchmark.Name] = nsPerByte;
+
+                String comparison = "";
+                double previous;
+                if (baseline != null && baseline.TryGetValue(benchmark.Name, out previous) && previous > 0)
+                {
+                    double change = nsPerByte / previous - 1;
+                    comparison = String.Format(CultureInfo.InvariantCulture, "{0:+0.0;-0.0}%", change * 100);
+
+                    if (change > tolerance)
+                    {
+                        comparison += " slower";
+                        passed = false;
+                    }
+                }
+
+                Console.WriteLine(String.Format(CultureInfo.InvariantCulture, "{0,-24} {1,11:0.0000} {2,9:0.00} {3,7:0.0}%  {4}",
+                                                benchmark.Name, nsPerByte, 1 / nsPerByte, spread * 100, comparison));
+            }
+
+            if (Options.ContainsKey("savebaseline")) WriteBaseline(Options["savebaseline"], results);
+
+            return passed;
+        }
+
+        #endregion
+
+        #region Private Methods
+
+        /// <summary>
+        /// Warms up for warmup, sizes a sample to about sampleTime, and returns the median ns/byte of the
+        /// samples; spread is (slowest - fastest) / median.
+        /// </summary>
+        private static double Measure(Benchmark benchmark, int samples, TimeSpan warmup, TimeSpan sampleTime, out double spread)
+        {
+            GC.Collect();
+            GC.WaitForPendingFinalizers();
+
+            long calls = 0;
+            var watch = Stopwatch.StartNew();
+            while (watch.Elapsed < warmup || calls == 0)
+            {
+                benchmark.Run();
+                calls++;
+            }
+
+            long callsPerSample = Math.Max(1, (long)(calls * sampleTime.TotalMilliseconds / Math.Max(1, watch.Elapsed.TotalMilliseconds)));
+            var nsPerByte = new List<double>();
+
+            for (int sample = 0; sample < Math.Max(1, samples); sample++)
+            {
+                watch = Stopwatch.StartNew();
+                for (long call = 0; call < callsPerSample; call++) benchmark.Run();
+                watch.Stop();
+
+                double ns = watch.ElapsedTicks * 1000000000.0 / Stopwatch.Frequency;
+                nsPerByte.Add(ns / (callsPerSample * benchmark.Bytes));
+            }
+
+            nsPerByte.Sort();
+            double median = nsPerByte[nsPerByte.Count / 2];
+            spread = (nsPerByte[nsPerByte.Count - 1] - nsPerByte[0]) / median;
+
+            return median;
+        }
+
+        private static List<Benchmark> CreateBenchmarks()
+        {
+            var benchmarks = new List<Benchmark>();
+            var random = new Random(1);
+
+            // EBML: a cluster of small Void elements with 1 and 2 byte sizes between tiny blocks
+            var elements = new MemoryStream();
+            for (int i = 0; i < 50000; i++)
+            {
+                MkvGenerator.WriteElement(elements, 0xEC, new byte[random.Next(0, 200)]);
+                MkvGenerator.WriteElement(elements, MatroskaReader.SimpleBlock, new byte[] { 0x81, 0, 0, 0x80, 0 });
+            }
+            MatroskaReader ebml = OpenCluster(elements.ToArray());
+            benchmarks.Add(Create("ebml-element-headers", elements.Length, delegate { Sink += Demux(ebml); }));
+
+            // a typical file: 12 Mbps video with AC-3
+            var file = new MemoryStream();
+            new MkvGenerator(32 << 20, MkvGenerator.Ac3).Write(file);
+            var demuxer = new MatroskaReader(new MemoryStream(file.ToArray(), false));
+            demuxer.ReadHeaders();
+            benchmarks.Add(Create("matroska-demux", file.Length - demuxer.FirstClusterPosition, delegate { Sink += Demux(demuxer); }));
+
+            // Annex B with 1-60 KB NAL units and an emulation prevented zero now and then
+            byte[] annexB = new byte[8 << 20];
+            random.NextBytes(annexB);
+            for (int position = 0; position + 4 < annexB.Length; )
+            {
+                annexB[position] = 0; annexB[position + 1] = 0; annexB[position + 2] = 1;
+                int end = Math.Min(annexB.Length, position + random.Next(1000, 60000));
+                for (int i = position + 3; i < end; i++)
+                {
+                    if (annexB[i] <= 1) annexB[i] = (byte)((i % 512 == 0) ? 0 : 2);
+                }
+                position = end;
+            }
+            benchmarks.Add(Create("h264-start-codes", annexB.Length, delegate
+                {
+                    int count = 0;
+                    for (int position = FindStartCode(annexB, 0, annexB.Length); position >= 0;
+                         position = FindStartCode(annexB, position + 3, annexB.Length))
+                        count++;
+                    Sink += count;
+                }));
+            benchmarks.Add(Create("h264-nal-scan", annexB.Length, delegate { Sink += ScanNalTypes(annexB, 0, annexB.Length).Count; }));
+
+            // AVCC: access units of 1-3 NAL units with 4 byte lengths, every 24th a keyframe
+            H264.DecoderConfig config = H264.ParseAvcC(new byte[] { 1, 0x64, 0, 0x29, 0xFF, 0xE1, 0, 4, 0x67, 0x64, 0, 0x29, 1, 0, 4, 0x68, 0xEE, 0x3C, 0x80 });
+            var units = new List<KeyValuePair<int, int>>();
+            var avcc = new MemoryStream();
+            for (int unit = 0; unit < 200; unit++)
+            {
+                int start = (int)avcc.Length;
+                for (int nal = random.Next(1, 4); nal > 0; nal--)
+                {
+                    int length = random.Next(500, 40000);
+                    avcc.Write(new byte[] { (byte)(length >> 24), (byte)(length >> 16), (byte)(length >> 8), (byte)length }, 0, 4);
+
+                    byte[] payload = new byte[length];
+                    random.NextBytes(payload);
+                    payload[0] = (byte)((unit % 24 == 0) ? 0x65 : 0x41);
+                    avcc.Write(payload, 0, length);
+                }
+                units.Add(new KeyValuePair<int, int>(start, (int)avcc.Length - start));
+            }
+            byte[] avccData = avcc.ToArray();
+            byte[] converted = new byte[H264.MaxAnnexBLength(config, avccData.Length)];
+            benchmarks.Add(Create("avcc-to-annexb", avccData.Length, delegate
+                {
+                    int index = 0;
+                    foreach (KeyValuePair<int, int> unit in units)
+                        Sink += H264.AvccToAnnexB(config, avccData, unit.Key, unit.Value, (index++ % 24) == 0, converted);
+                }));
+
+            // PES/TS: the same access units with AC-3 frames in between, into M2TS packets
+            byte[] ac3 = new byte[2560];
+            random.NextBytes(ac3);
+            benchmarks.Add(Create("pes-ts-packetize", avccData.Length + units.Count * ac3.Length, delegate
+                {
+                    var packetizer = new TSPacketizer(Stream.Null, true);
+                    packetizer.AddStream(TSPacketizer.VideoPid, TSPacketizer.StreamTypeH264, 0xE0);
+                    packetizer.AddStream(TSPacketizer.AudioPid, TSPacketizer.StreamTypeAC3, 0xBD);
+
+                    long pts = 90000;
+                    int index = 0;
+                    foreach (KeyValuePair<int, int> unit in units)
+                    {
+                        packetizer.WritePes(TSPacketizer.VideoPid, avccData, unit.Key, unit.Value, pts, pts, (index++ % 24) == 0);
+                        packetizer.WritePes(TSPacketizer.AudioPid, ac3, 0, ac3.Length, pts, pts, true);
+                        pts += 3754;
+                    }
+
+                    packetizer.Flush();
+                    Sink += packetizer.PacketsWritten;
+                    packetizer.Dispose();
+                }));
+
+            byte[] crcData = new byte[1 << 20];
+            random.NextBytes(crcData);
+            benchmarks.Add(Create("crc32-mpeg2", crcData.Length, delegate { Sink += Crc32Mpeg2.Compute(crcData, 0, crcData.Length); }));
+
+            return benchmarks;
+        }
+
+        private static Benchmark Create(String name, long bytes, Action run)
+        {
+            var benchmark = new Benchmark();
+            benchmark.Name = name;
+            benchmark.Bytes = bytes;
+            benchmark.Run = run;
+            return benchmark;
+        }
+
+        /// <summary>
+        /// A reader positioned on a Cluster holding body, behind the smallest headers ReadHeaders takes.
+        /// </summary>
+        private static MatroskaReader OpenCluster(byte[] body)
+        {
+            var file = new MemoryStream();
+            MkvGenerator.WriteElement(file, MatroskaReader.EBMLHeader, new byte[0]);
+
+            var cluster = new MemoryStream();
+            MkvGenerator.WriteElement(cluster, MatroskaReader.Cluster, body);
+            MkvGenerator.WriteElement(file, MatroskaReader.Segment, cluster.ToArray());
+
+            var reader = new MatroskaReader(new MemoryStream(file.ToArray(), false));
+            reader.ReadHeaders();
+            return reader;
+        }
+
+        /// <summary>
+        /// Reads every block from the first cluster on and returns how many there were.
+        /// </summary>
+        private static int Demux(MatroskaReader reader)
+        {
+            reader.SeekCluster(reader.FirstClusterPosition);
+
+            var block = new MatroskaBlock();
+            int blocks = 0;
+            while (reader.ReadBlock(block)) blocks++;
+            block.Release();
+
+            return blocks;
+        }
+
+        /// <summary>
+        /// Finds the next 00 00 01 start code at or after offset. Returns -1 when there is none.
+        /// </summary>
+        private static int FindStartCode(byte[] data, int offset, int end)
+        {
+            // step by three: a start code always has a zero at one of every three positions we land on
+            for (int i = offset + 2; i < end; )
+            {
+                byte b = data[i];
+
+                if (b > 1) i += 3;
+                else if (b == 1)
+                {
+                    if (data[i - 1] == 0 && data[i - 2] == 0) return i - 2;
+                    i += 3;
+                }
+                else i++;
+            }
+
+            return -1;
+        }
+
+        /// <summary>
+        /// Lists the NAL unit types of an Annex B buffer in stream order, the way a demuxer of raw H.264
+        /// would.
+        /// </summary>
+        private static List<int> ScanNalTypes(byte[] data, int offset, int count)
+        {
+            var types = new List<int>();
+            int end = offset + count;
+            int position = FindStartCode(data, offset, end);
+
+            while (position >= 0 && position + 3 < end)
+            {
+                types.Add(data[position + 3] & 0x1F);
+                position = FindStartCode(data, position + 3, end);
+            }
+
+            return types;
+        }
+
+        /// <summary>
+        /// "name ns/byte" per line; lines starting with # are comments.
+        /// </summary>
+        private static Dictionary<String, double> ReadBaseline(String path)
+        {
+            var baseline = new Dictionary<String, double>();
+            if (!File.Exists(path)) return baseline;
+
+            foreach (String line in File.ReadAllLines(path))
+            {
+                if (line.StartsWith("#")) continue;
+
+                String[] fields = line.Split(new[] { ' ', '\t' }, StringSplitOptions.RemoveEmptyEntries);
+                double nsPerByte;
+                if (fields.Length >= 2 && double.TryParse(fields[1], NumberStyles.Float, CultureInfo.InvariantCulture, out nsPerByte))
+                    baseline[fields[0]] = nsPerByte;
+            }
+
+            return baseline;
+        }
+
+        private static void WriteBaseline(String path, Dictionary<String, double> results)
+        {
+            using (var writer = new StreamWriter(path))
+            {
+                writer.WriteLine("# ps3m2ts.Bench /micro baseline, ns/byte (" + Environment.MachineName + ", " + Environment.ProcessorCount + " cores)");
+
+                foreach (KeyValuePair<String, double> result in results)
+                    writer.WriteLine(result.Key + " " + result.Value.ToString("0.000000", CultureInfo.InvariantCulture));
+            }
+        }
+
+        #endregion
+    }
+}
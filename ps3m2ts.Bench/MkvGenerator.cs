@@ -0,0 +1,406 @@
+﻿/*
+ * ps3m2ts
+ *
+ * Copyright (R) 2009-> Henning M. Stephansen
+ * Feel free to use the code by any means, hopefully you can submit your improvements, ideas etc
+ * to henningms@gmail.com or leave a comment at my blog http://www.henning.ms
+ *
+ */
+
+using System;
+using System.Collections.Generic;
+using System.IO;
+using System.Text;
+
+namespace ps3m2ts.Bench
+{
+    /// <summary>
+    /// Writes synthetic Matroska files: one H.264 High@L4.1 track at 23.976 fps with a keyframe every two
+    /// seconds, and one DTS, AC-3 or FLAC track at its usual bitrate. Payloads are random bytes with the
+    /// right sync words, good enough for the demuxers and the stand-in tools but not for a decoder.
+    /// The file is streamed cluster by cluster, so its size is only limited by the disk.
+    /// </summary>
+    class MkvGenerator
+    {
+        #region Constants
+
+        public const String Dts = "A_DTS";
+        public const String Ac3 = "A_AC3";
+        public const String Flac = "A_FLAC";
+
+        private const long FrameDurationNs = 41708333;
+        private const int GopLength = 48;
+        private const int PoolSize = 4 << 20;
+
+        // elements MatroskaReader skips and so doesn't name
+        private const uint MuxingApp = 0x4D80;
+        private const uint WritingApp = 0x5741;
+        private const uint Video = 0xE0;
+        private const uint PixelWidth = 0xB0;
+        private const uint PixelHeight = 0xBA;
+        private const uint Audio = 0xE1;
+        private const uint SamplingFrequency = 0xB5;
+        private const uint Channels = 0x9F;
+
+        #endregion
+
+        #region Constructor
+
+        public MkvGenerator(long Size, String AudioCodec)
+        {
+            this.Size = Size;
+            this.AudioCodec = AudioCodec;
+            this.VideoKbps = 12000;
+            this.ClusterMs = 2000;
+            this.Cues = true;
+            this.Seed = 1;
+        }
+
+        #endregion
+
+        #region Private Fields
+
+        private byte[] Pool;
+        private Random Random;
+
+        #endregion
+
+        #region Public Properties
+
+        /// <summary>Approximate file size in bytes; the duration follows from it and the bitrates.</summary>
+        public long Size { get; private set; }
+
+        /// <summary>Dts, Ac3 or Flac.</summary>
+        public String AudioCodec { get; private set; }
+
+        public int VideoKbps { get; set; }
+
+        /// <summary>Shortest cluster; a new one starts at the first keyframe after this long.</summary>
+        public int ClusterMs { get; set; }
+
+        /// <summary>Write a Cues index (and the SeekHead pointing to it).</summary>
+        public bool Cues { get; set; }
+
+        public int Seed { get; set; }
+
+        #endregion
+
+        #region Public Methods
+
+        /// <summary>
+        /// Bitrate MediaInfo reports for the audio codec, in kbps.
+        /// </summary>
+        public static int AudioKbps(String codec)
+        {
+            switch (codec)
+            {
+                case Dts: return 1509;
+                case Ac3: return 640;
+                default: return 1000;
+            }
+        }
+
+        /// <summary>
+        /// Duration of one audio frame in nanoseconds: 512 samples for DTS, 1536 for AC-3, 4096 for FLAC.
+        /// </summary>
+        public static long AudioFrameNs(String codec)
+        {
+            switch (codec)
+            {
+                case Dts: return 512 * 1000000000L / 48000;
+                case Ac3: return 1536 * 1000000000L / 48000;
+                default: return 4096 * 1000000000L / 48000;
+            }
+        }
+
+        public void Write(String path)
+        {
+            using (var output = new FileStream(path, FileMode.Create, FileAccess.Write, FileShare.None, 1 << 20))
+                Write(output);
+        }
+
+        /// <summary>
+        /// Writes the file to a seekable stream; the segment size and Cues position are patched in.
+        /// </summary>
+        public void Write(Stream output)
+        {
+            Random = new Random(Seed);
+            Pool = new byte[PoolSize];
+            Random.NextBytes(Pool);
+
+            // no start code emulation in the "NAL units"
+            for (int i = 0; i < Pool.Length; i++)
+            {
+                if (Pool[i] == 0) Pool[i] = 1;
+            }
+
+            int audioKbps = AudioKbps(AudioCodec);
+            double seconds = Size * 8.0 / ((VideoKbps + audioKbps) * 1000.0);
+            long frames = Math.Max(GopLength, (long)(seconds * 1000000000 / FrameDurationNs));
+            long durationNs = frames * FrameDurationNs;
+
+            int clusterMs = Math.Max(100, Math.Min(30000, ClusterMs));
+            long averageFrame = VideoKbps * 1000L / 8 * FrameDurationNs / 1000000000;
+            long audioFrameNs = AudioFrameNs(AudioCodec);
+            int audioFrame = (int)(audioKbps * 1000L / 8 * audioFrameNs / 1000000000);
+
+            WriteElement(output, MatroskaReader.EBMLHeader, Master(Bytes(MatroskaReader.DocType, Encoding.ASCII.GetBytes("matroska"))));
+
+            // the segment size is patched in at the end
+            WriteId(output, MatroskaReader.Segment);
+            long segmentSizePosition = output.Position;
+            output.Write(new byte[8], 0, 8);
+            long segmentStart = output.Position;
+
+            long seekPositionOffset = -1;
+            if (Cues)
+            {
+                byte[] seek = Master(Bytes(MatroskaReader.SeekID, new byte[] { 0x1C, 0x53, 0xBB, 0x6B }),
+                                     Bytes(MatroskaReader.SeekPosition, new byte[8]));
+                byte[] seekHead = Master(Bytes(MatroskaReader.Seek, seek));
+                WriteElement(output, MatroskaReader.SeekHead, seekHead);
+                seekPositionOffset = output.Position - 8;
+            }
+
+            WriteElement(output, MatroskaReader.Info, Master(UInt(MatroskaReader.TimecodeScale, 1000000),
+                                                             Bytes(MatroskaReader.SegmentDuration, Float(durationNs / 1000000.0)),
+                                                             Bytes(MuxingApp, Encoding.ASCII.GetBytes("ps3m2ts.Bench")),
+                                                             Bytes(WritingApp, Encoding.ASCII.GetBytes("ps3m2ts.Bench"))));
+
+            byte[] videoTrack = Master(UInt(MatroskaReader.TrackNumber, 1), UInt(MatroskaReader.TrackType, MatroskaTrack.VideoType),
+                                       Bytes(MatroskaReader.CodecID, Encoding.ASCII.GetBytes("V_MPEG4/ISO/AVC")),
+                                       Bytes(MatroskaReader.CodecPrivate, AvcC()),
+                                       UInt(MatroskaReader.DefaultDuration, FrameDurationNs),
+                                       Bytes(Video, Master(UInt(PixelWidth, 1920), UInt(PixelHeight, 1080))));
+            byte[] audioTrack = Master(UInt(MatroskaReader.TrackNumber, 2), UInt(MatroskaReader.TrackType, MatroskaTrack.AudioType),
+                                       Bytes(MatroskaReader.CodecID, Encoding.ASCII.GetBytes(AudioCodec)),
+                                       (AudioCodec == Flac) ? Bytes(MatroskaReader.CodecPrivate, FlacHeader()) : new byte[0],
+                                       Bytes(Audio, Master(Bytes(SamplingFrequency, Float(48000)), UInt(Channels, 6))));
+            WriteElement(output, MatroskaReader.Tracks, Master(Bytes(MatroskaReader.TrackEntry, videoTrack),
+                                                               Bytes(MatroskaReader.TrackEntry, audioTrack)));
+
+            var cuePoints = new List<KeyValuePair<long, long>>();
+            var cluster = new MemoryStream(1 << 20);
+            long clusterStartMs = -clusterMs;
+            long audioNs = 0;
+
+            for (long frame = 0; frame < frames; frame++)
+            {
+                long timeNs = frame * FrameDurationNs;
+                long timeMs = timeNs / 1000000;
+                bool keyframe = (frame % GopLength == 0);
+
+                if (keyframe && timeMs - clusterStartMs >= clusterMs)
+                {
+                    if (cluster.Length > 0) WriteCluster(output, clusterStartMs, cluster);
+
+                    clusterStartMs = timeMs;
+                    cuePoints.Add(new KeyValuePair<long, long>(timeMs, output.Position - segmentStart));
+                }
+
+                // an I frame is three P frames; the average stays at the video bitrate
+                long size = keyframe ? averageFrame * 3 : averageFrame;
+                size = size * GopLength / (GopLength + 2);
+                size = size * Random.Next(75, 126) / 100;
+                WriteVideoBlock(cluster, (short)(timeMs - clusterStartMs), keyframe, (int)size);
+
+                for (; audioNs < timeNs + FrameDurationNs && audioNs < durationNs; audioNs += audioFrameNs)
+                    WriteAudioBlock(cluster, (short)(audioNs / 1000000 - clusterStartMs), audioFrame);
+            }
+
+            if (cluster.Length > 0) WriteCluster(output, clusterStartMs, cluster);
+
+            if (Cues)
+            {
+                long cuesPosition = output.Position - segmentStart;
+
+                var cues = new MemoryStream();
+                foreach (KeyValuePair<long, long> cuePoint in cuePoints)
+                {
+                    byte[] positions = Master(UInt(MatroskaReader.CueTrack, 1), UInt(MatroskaReader.CueClusterPosition, cuePoint.Value));
+                    WriteElement(cues, MatroskaReader.CuePoint, Master(UInt(MatroskaReader.CueTime, cuePoint.Key),
+                                                                       Bytes(MatroskaReader.CueTrackPositions, positions)));
+                }
+                WriteElement(output, MatroskaReader.Cues, cues.ToArray());
+
+                output.Position = seekPositionOffset;
+                output.Write(BigEndian(cuesPosition, 8), 0, 8);
+                output.Position = output.Length;
+            }
+
+            long segmentSize = output.Length - segmentStart;
+            output.Position = segmentSizePosition;
+            byte[] sizeField = BigEndian(segmentSize, 8);
+            sizeField[0] = 0x01;
+            output.Write(sizeField, 0, 8);
+            output.Position = output.Length;
+        }
+
+        #endregion
+
+        #region Private Methods
+
+        private void WriteCluster(Stream output, long timecodeMs, MemoryStream blocks)
+        {
+            byte[] timecode = UInt(MatroskaReader.ClusterTimecode, timecodeMs);
+
+            WriteId(output, MatroskaReader.Cluster);
+            WriteSize(output, timecode.Length + blocks.Length);
+            output.Write(timecode, 0, timecode.Length);
+            blocks.WriteTo(output);
+
+            blocks.SetLength(0);
+        }
+
+        /// <summary>
+        /// One NAL unit with a 4-byte length prefix: IDR slice for keyframes, non-IDR slice otherwise.
+        /// </summary>
+        private void WriteVideoBlock(Stream cluster, short timecode, bool keyframe, int size)
+        {
+            size = Math.Max(16, Math.Min(size, PoolSize - 16));
+
+            WriteBlockHeader(cluster, 1, timecode, keyframe, 4 + size);
+            cluster.Write(BigEndian(size, 4), 0, 4);
+            cluster.WriteByte(keyframe ? (byte)0x65 : (byte)0x41);
+            WritePayload(cluster, size - 1);
+        }
+
+        private void WriteAudioBlock(Stream cluster, short timecode, int size)
+        {
+            byte[] sync;
+            switch (AudioCodec)
+            {
+                case Dts: sync = new byte[] { 0x7F, 0xFE, 0x80, 0x01 }; break;
+                case Ac3: sync = new byte[] { 0x0B, 0x77 }; break;
+                default: sync = new byte[] { 0xFF, 0xF8 }; break;
+            }
+
+            // FLAC frames vary with the signal
+            if (AudioCodec == Flac) size = size * Random.Next(80, 121) / 100;
+
+            WriteBlockHeader(cluster, 2, timecode, true, size);
+            cluster.Write(sync, 0, sync.Length);
+            WritePayload(cluster, size - sync.Length);
+        }
+
+        private static void WriteBlockHeader(Stream cluster, int track, short timecode, bool keyframe, int payload)
+        {
+            WriteId(cluster, MatroskaReader.SimpleBlock);
+            WriteSize(cluster, 4 + payload);
+            cluster.WriteByte((byte)(0x80 | track));
+            cluster.WriteByte((byte)(timecode >> 8));
+            cluster.WriteByte((byte)timecode);
+            cluster.WriteByte(keyframe ? (byte)0x80 : (byte)0);
+        }
+
+        private void WritePayload(Stream cluster, int count)
+        {
+            cluster.Write(Pool, Random.Next(PoolSize - count), count);
+        }
+
+        /// <summary>
+        /// avcC record for High profile level 4.1 with one SPS and one PPS.
+        /// </summary>
+        private static byte[] AvcC()
+        {
+            byte[] sps = { 0x67, 0x64, 0x00, 0x29, 0xAC, 0x2C, 0xA5, 0x01, 0xE0, 0x08, 0x9F, 0x97, 0x01, 0x10 };
+            byte[] pps = { 0x68, 0xEE, 0x3C, 0x80 };
+
+            var avcC = new MemoryStream();
+            avcC.Write(new byte[] { 1, 0x64, 0x00, 0x29, 0xFF, 0xE1 }, 0, 6);
+            avcC.Write(BigEndian(sps.Length, 2), 0, 2);
+            avcC.Write(sps, 0, sps.Length);
+            avcC.WriteByte(1);
+            avcC.Write(BigEndian(pps.Length, 2), 0, 2);
+            avcC.Write(pps, 0, pps.Length);
+
+            return avcC.ToArray();
+        }
+
+        /// <summary>
+        /// "fLaC" and a STREAMINFO block for 48 kHz, 6 channels, 24 bits.
+        /// </summary>
+        private static byte[] FlacHeader()
+        {
+            byte[] header = new byte[4 + 4 + 34];
+            Encoding.ASCII.GetBytes("fLaC").CopyTo(header, 0);
+            header[4] = 0x80;
+            header[7] = 34;
+
+            // block sizes 4096, then 20 bits of sample rate, 3 of channels - 1, 5 of bits per sample - 1
+            header[8] = 0x10; header[10] = 0x10;
+            header[18] = 0x0B; header[19] = 0xB8; header[20] = 0x0B; header[21] = 0x70;
+
+            return header;
+        }
+
+        internal static void WriteElement(Stream output, uint id, byte[] body)
+        {
+            WriteId(output, id);
+            WriteSize(output, body.Length);
+            output.Write(body, 0, body.Length);
+        }
+
+        internal static void WriteId(Stream output, uint id)
+        {
+            int length = (id > 0xFFFFFF) ? 4 : (id > 0xFFFF) ? 3 : (id > 0xFF) ? 2 : 1;
+            output.Write(BigEndian(id, length), 0, length);
+        }
+
+        /// <summary>
+        /// Shortest EBML size; all ones is reserved for "unknown".
+        /// </summary>
+        internal static void WriteSize(Stream output, long size)
+        {
+            int length = 1;
+            while (length < 8 && size >= (1L << (7 * length)) - 1) length++;
+
+            byte[] field = BigEndian(size, length);
+            field[0] |= (byte)(0x80 >> (length - 1));
+            output.Write(field, 0, length);
+        }
+
+        private static byte[] Bytes(uint id, byte[] body)
+        {
+            var element = new MemoryStream();
+            WriteElement(element, id, body);
+            return element.ToArray();
+        }
+
+        private static byte[] UInt(uint id, long value)
+        {
+            int length = 1;
+            while (length < 8 && (value >> (8 * length)) != 0) length++;
+
+            return Bytes(id, BigEndian(value, length));
+        }
+
+        private static byte[] Float(double value)
+        {
+            byte[] bytes = BitConverter.GetBytes(value);
+            if (BitConverter.IsLittleEndian) Array.Reverse(bytes);
+            return bytes;
+        }
+
+        private static byte[] Master(params byte[][] children)
+        {
+            var body = new MemoryStream();
+            foreach (byte[] child in children) body.Write(child, 0, child.Length);
+            return body.ToArray();
+        }
+
+        private static byte[] BigEndian(long value, int length)
+        {
+            byte[] bytes = new byte[length];
+            for (int i = length - 1; i >= 0; i--)
+            {
+                bytes[i] = (byte)value;
+                value >>= 8;
+            }
+
+            return bytes;
+        }
+
+        #endregion
+    }
+}
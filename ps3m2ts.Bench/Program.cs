@@ -0,0 +1,137 @@
+﻿/*
+ * ps3m2ts
+ *
+ * Copyright (R) 2009-> Henning M. Stephansen
+ * Feel free to use the code by any means, hopefully you can submit your improvements, ideas etc
+ * to henningms@gmail.com or leave a comment at my blog http://www.henning.ms
+ *
+ */
+
+using System;
+using System.Collections.Generic;
+using System.Reflection;
+
+namespace ps3m2ts.Bench
+{
+    class Program
+    {
+        static int Main(string[] args)
+        {
+            // copied into the working directory under a tool's name, this is that tool
+            String tool = StubTools.ToolName(Assembly.GetEntryAssembly().Location);
+            if (tool != null) return StubTools.Run(tool, args);
+
+            if ((args.Length > 0) && (args[0] == "/?"))
+            {
+                DisplayHelp();
+                return 0;
+            }
+
+            Dictionary<string, string> options = ParseCommandLineArgs(args);
+
+            if (options.ContainsKey("micro"))
+                return new MicroBenchmarks(options).Run() ? 0 : 1;
+
+            new BenchmarkRun(options).Run();
+            return 0;
+        }
+
+        static Dictionary<string, string> ParseCommandLineArgs(string[] args)
+        {
+            var options = new Dictionary<string, string>();
+
+            for (int i = 0; i < args.Length; i++)
+            {
+                switch (args[i].ToLower())
+                {
+                    case "/work":
+                        i++;
+                        if (i < args.Length) options["work"] = args[i];
+                        break;
+
+                    case "/baseline":
+                        i++;
+                        if (i < args.Length) options["baseline"] = args[i];
+                        break;
+
+                    case "/savebaseline":
+                        i++;
+                        if (i < args.Length) options["savebaseline"] = args[i];
+                        break;
+
+                    case "/micro":
+                        options["micro"] = "true";
+                        break;
+
+                    case "/nocues":
+                        options["nocues"] = "true";
+                        break;
+
+                    case "/pipeline":
+                        options["pipeline"] = "true";
+                        break;
+
+                    case "/keep":
+                        options["keep"] = "true";
+                        break;
+
+                    default:
+                        int equals = args[i].IndexOf('=');
+                        if (args[i].StartsWith("/") && equals > 0)
+                            options[args[i].Substring(1, equals - 1).ToLower()] = args[i].Substring(equals + 1).Trim('"');
+                        break;
+                }
+            }
+
+            // set defaults
+            if (!options.ContainsKey("work")) options.Add("work", System.IO.Path.Combine(System.IO.Path.GetTempPath(), "ps3m2ts-bench"));
+            if (!options.ContainsKey("size")) options.Add("size", "256");
+            if (!options.ContainsKey("audio")) options.Add("audio", "dts,ac3");
+            if (!options.ContainsKey("cluster")) options.Add("cluster", "2000");
+            if (!options.ContainsKey("batches")) options.Add("batches", "1,4");
+            if (!options.ContainsKey("jobs")) options.Add("jobs", "1,2,4");
+            if (!options.ContainsKey("passes")) options.Add("passes", "1");
+            if (!options.ContainsKey("samples")) options.Add("samples", "5");
+            if (!options.ContainsKey("warmup")) options.Add("warmup", "500");
+            if (!options.ContainsKey("time")) options.Add("time", "1000");
+            if (!options.ContainsKey("tolerance")) options.Add("tolerance", "10");
+
+            return options;
+        }
+
+        static void DisplayHelp()
+        {
+            Console.WriteLine("ps3m2ts.Bench usage: ps3m2ts.Bench [/work \"<dir>\"] [/size=<MB>] [/audio=<list>]");
+            Console.WriteLine("    [/cluster=<ms>] [/nocues] [/batches=<list>] [/jobs=<list>] [/pipeline]");
+            Console.WriteLine("    [/passes=<n>] [/keep]");
+            Console.WriteLine("ps3m2ts.Bench /micro [/filter=<text>] [/samples=<n>] [/warmup=<ms>] [/time=<ms>]");
+            Console.WriteLine("    [/baseline \"<file>\" [/tolerance=<percent>]] [/savebaseline \"<file>\"]");
+            Console.WriteLine("");
+
+            Console.WriteLine("  /work \"<dir>\"\t\t Where inputs, outputs and the stand-in tools go");
+            Console.WriteLine("\t\t\t (default: ps3m2ts-bench in the temp directory).");
+            Console.WriteLine("  /size=<MB>\t\t Size of each synthetic .mkv (default 256).");
+            Console.WriteLine("  /audio=<list>\t\t Audio codecs the files take turns with: dts, ac3,");
+            Console.WriteLine("\t\t\t flac (default dts,ac3).");
+            Console.WriteLine("  /cluster=<ms>\t\t Shortest cluster duration (default 2000).");
+            Console.WriteLine("  /nocues\t\t Write the files without a Cues index.");
+            Console.WriteLine("  /batches=<list>\t Files per run (default 1,4).");
+            Console.WriteLine("  /jobs=<list>\t\t /jobs values to run every batch with (default 1,2,4).");
+            Console.WriteLine("  /pipeline\t\t Run ps3m2ts with /pipeline.");
+            Console.WriteLine("  /passes=<n>\t\t CPU passes the eac3to stand-in makes over every byte");
+            Console.WriteLine("\t\t\t (default 1).");
+            Console.WriteLine("  /keep\t\t\t Keep the outputs of every run.");
+            Console.WriteLine("");
+            Console.WriteLine("  /micro\t\t Time the parsing and muxing loops on in-memory data instead.");
+            Console.WriteLine("  /filter=<text>\t Only the benchmarks whose name contains <text>.");
+            Console.WriteLine("  /samples=<n>\t\t Samples per benchmark; the median counts (default 5).");
+            Console.WriteLine("  /warmup=<ms>\t\t Warm-up time per benchmark (default 500).");
+            Console.WriteLine("  /time=<ms>\t\t Length of one sample (default 1000).");
+            Console.WriteLine("  /baseline \"<file>\"\t Compare with a saved baseline; exits with 1 when a");
+            Console.WriteLine("\t\t\t benchmark is slower by more than /tolerance (default 10%).");
+            Console.WriteLine("  /savebaseline \"<file>\" Save the results as a baseline.");
+            Console.WriteLine("");
+            Console.WriteLine("Outside Windows, run it with mono; ps3m2ts and the stand-ins are started the same way.");
+        }
+    }
+}
@@ -0,0 +1,19 @@
+﻿using System.Reflection;
+using System.Runtime.CompilerServices;
+using System.Runtime.InteropServices;
+
+[assembly: AssemblyTitle("ps3m2ts.Bench")]
+[assembly: AssemblyDescription("End-to-end benchmark for ps3m2ts with synthetic input and stand-in tools")]
+[assembly: AssemblyConfiguration("")]
+[assembly: AssemblyCompany("")]
+[assembly: AssemblyProduct("ps3m2ts")]
+[assembly: AssemblyCopyright("Copyright © Henning M. Stephansen 2009")]
+[assembly: AssemblyTrademark("")]
+[assembly: AssemblyCulture("")]
+
+[assembly: ComVisible(false)]
+
+[assembly: Guid("7e3c7a33-abdf-4063-858d-c6733ddda0c4")]
+
+[assembly: AssemblyVersion("1.0.0.0")]
+[assembly: AssemblyFileVersion("1.0.0.0")]
@@ -0,0 +1,480 @@
+﻿/*
+ * ps3m2ts
+ *
+ * Copyright (R) 2009-> Henning M. Stephansen
+ * Feel free to use the code by any means, hopefully you can submit your improvements, ideas etc
+ * to henningms@gmail.com or leave a comment at my blog http://www.henning.ms
+ *
+ */
+
+using System;
+using System.Collections.Generic;
+using System.Globalization;
+using System.IO;
+using System.Text;
+using System.Text.RegularExpressions;
+
+namespace ps3m2ts.Bench
+{
+    /// <summary>
+    /// Stand-ins for MediaInfo, mkvextract, eac3to and tsMuxeR. The benchmark copies itself into the
+    /// working directory under the tools' names; started under one of them, it behaves like that tool:
+    /// same arguments, same progress lines, and the same sequential reads and writes (real demuxing
+    /// of the synthetic files, a CRC pass per byte in place of the DTS decode).
+    /// </summary>
+    static class StubTools
+    {
+        #region Constants
+
+        /// <summary>CRC passes eac3to makes over every byte; set by the benchmark.</summary>
+        public const String TranscodePassesVariable = "PS3M2TS_BENCH_TRANSCODE_PASSES";
+
+        public static readonly String[] Names = { "MediaInfo.exe", "mediainfo.exe", "mkvextract.exe", "eac3to\\eac3to.exe", "tsmuxer.exe" };
+
+        private const int ChunkSize = 1 << 20;
+
+        /// <summary>TS packets are 188 bytes (192 in M2TS) for every 184 bytes of payload.</summary>
+        private const double PacketOverhead = 192.0 / 184;
+
+        private const long SplitSize = 4L << 30;
+
+        private static readonly Regex MetaTrack = new Regex("^([^,]+),\\s*\"([^\"]+)\"(?:.*track=(\\d+))?");
+
+        #endregion
+
+        #region Public Methods
+
+        /// <summary>
+        /// The tool an executable path stands in for, or null for the benchmark itself. eac3to lives in
+        /// "eac3to\eac3to.exe", which outside Windows is a single file name with a backslash in it.
+        /// </summary>
+        public static String ToolName(String path)
+        {
+            String name = path.Substring(Math.Max(path.LastIndexOf('\\'), path.LastIndexOf('/')) + 1).ToLowerInvariant();
+            if (name.EndsWith(".exe")) name = name.Substring(0, name.Length - 4);
+
+            switch (name)
+            {
+                case "mediainfo":
+                case "mkvextract":
+                case "eac3to":
+                case "tsmuxer":
+                    return name;
+
+                default:
+                    return null;
+            }
+        }
+
+        /// <summary>
+        /// Copies the benchmark into directory under every tool name, with the ps3m2ts assembly it
+        /// needs next to it.
+        /// </summary>
+        public static void Install(String directory)
+        {
+            String bench = typeof(StubTools).Assembly.Location;
+            String ps3m2ts = typeof(MatroskaReader).Assembly.Location;
+
+            File.Copy(ps3m2ts, Path.Combine(directory, Path.GetFileName(ps3m2ts)), true);
+
+            foreach (String name in Names)
+            {
+                String target = Path.Combine(directory, name);
+                String folder = Path.GetDirectoryName(target);
+                if (!Directory.Exists(folder)) Directory.CreateDirectory(folder);
+
+                File.Copy(bench, target, true);
+            }
+        }
+
+        public static int Run(String tool, String[] args)
+        {
+            try
+            {
+                switch (tool)
+                {
+                    case "mediainfo":
+                        MediaInfo(args[args.Length - 1]);
+                        break;
+
+                    case "mkvextract":
+                        MkvExtract(args[1], args, 2);
+                        break;
+
+                    case "eac3to":
+                        Eac3to(args[0], args[1]);
+                        break;
+
+                    case "tsmuxer":
+                        TsMuxer(args[0], args[1]);
+                        break;
+                }
+
+                return 0;
+            }
+            catch (Exception ex)
+            {
+                Console.Error.WriteLine(tool + " (stand-in): " + ex.Message);
+                return 2;
+            }
+        }
+
+        #endregion
+
+        #region Private Methods
+
+        /// <summary>
+        /// "-f file": the General, Video and Audio sections with the fields ps3m2ts reads.
+        /// </summary>
+        private static void MediaInfo(String file)
+        {
+            MatroskaReader reader;
+            long length;
+
+            using (var input = new FileStream(file, FileMode.Open, FileAccess.Read))
+            {
+                reader = new MatroskaReader(input);
+                reader.ReadHeaders();
+                length = input.Length;
+            }
+
+            double seconds = reader.DurationNs / 1000000000.0;
+            String duration = String.Format(CultureInfo.InvariantCulture, "{0}mn {1}s", (int)(seconds / 60), (int)(seconds % 60));
+            int totalKbps = (int)(length * 8 / Math.Max(1, seconds) / 1000);
+
+            var text = new StringBuilder();
+            text.AppendLine("General");
+            text.AppendLine("Complete name                    : " + file);
+            text.AppendLine("Format                           : Matroska");
+            text.AppendLine("File size                        : " + length);
+            text.AppendLine("Duration                         : " + duration);
+            text.AppendLine("Overall bit rate                 : " + totalKbps + " Kbps");
+            text.AppendLine();
+
+            var audio = new List<MatroskaTrack>();
+            foreach (MatroskaTrack track in reader.TrackList)
+            {
+                if (track.Type == MatroskaTrack.AudioType) audio.Add(track);
+            }
+
+            foreach (MatroskaTrack track in reader.TrackList)
+            {
+                if (track.Type != MatroskaTrack.VideoType) continue;
+
+                int audioKbps = 0;
+                foreach (MatroskaTrack audioTrack in audio) audioKbps += MkvGenerator.AudioKbps(audioTrack.CodecID);
+
+                text.AppendLine("Video");
+                text.AppendLine("ID                               : " + track.Number);
+                text.AppendLine("Format                           : AVC");
+                text.AppendLine("Format/Info                      : Advanced Video Codec");
+                text.AppendLine("Format profile                   : High@L4.1");
+                text.AppendLine("Codec ID                         : " + track.CodecID);
+                text.AppendLine("Duration                         : " + duration);
+                text.AppendLine("Bit rate                         : " + Math.Min(32000, totalKbps - audioKbps) + " Kbps");
+                text.AppendLine("Width                            : 1920 pixels");
+                text.AppendLine("Height                           : 1080 pixels");
+                text.AppendLine("Display aspect ratio             : 16:9");
+                text.AppendLine("Frame rate                       : 23.976 fps");
+                text.AppendLine("Language                         : English");
+                text.AppendLine();
+            }
+
+            foreach (MatroskaTrack track in audio)
+            {
+                String format = (track.CodecID == MkvGenerator.Dts) ? "DTS" : (track.CodecID == MkvGenerator.Ac3) ? "AC-3" : "FLAC";
+
+                text.AppendLine("Audio");
+                text.AppendLine("ID                               : " + track.Number);
+                text.AppendLine("Format                           : " + format);
+                text.AppendLine("Codec ID                         : " + track.CodecID);
+                text.AppendLine("Duration                         : " + duration);
+                text.AppendLine("Bit rate mode                    : Constant");
+                text.AppendLine("Bit rate                         : " + MkvGenerator.AudioKbps(track.CodecID) + " Kbps");
+                text.AppendLine("Language                         : English");
+                text.AppendLine();
+            }
+
+            Console.Write(text.ToString());
+        }
+
+        /// <summary>
+        /// "tracks file n:out ...": writes the blocks of each listed track to its file, the video as an
+        /// Annex B stream, printing "Progress: n%" like mkvextract.
+        /// </summary>
+        private static void MkvExtract(String file, String[] args, int first)
+        {
+            var outputs = new Dictionary<int, Stream>();
+
+            try
+            {
+                for (int i = first; i < args.Length; i++)
+                {
+                    int colon = args[i].IndexOf(':');
+                    outputs[int.Parse(args[i].Substring(0, colon))] = new FileStream(args[i].Substring(colon + 1), FileMode.Create,
+                                                                                    FileAccess.Write, FileShare.None, ChunkSize);
+                }
+
+                using (var input = new FileStream(file, FileMode.Open, FileAccess.Read, FileShare.Read, ChunkSize))
+                {
+                    var reader = new MatroskaReader(input);
+                    reader.ReadHeaders();
+
+                    var block = new MatroskaBlock();
+                    int percent = -1;
+
+                    try
+                    {
+                        while (reader.ReadBlock(block))
+                        {
+                            Stream output;
+                            if (outputs.TryGetValue(block.TrackNumber, out output))
+                            {
+                                MatroskaTrack track = reader.FindTrack(block.TrackNumber);
+                                if (track.Type == MatroskaTrack.VideoType) WriteAnnexB(output, block.Data, block.Length);
+                                else output.Write(block.Data, 0, block.Length);
+                            }
+
+                            percent = Report("Progress: {0}%\r", reader.Position, reader.Length, percent);
+                        }
+                    }
+                    finally
+                    {
+                        block.Release();
+                    }
+                }
+
+                Console.WriteLine("Progress: 100%");
+            }
+            finally
+            {
+                foreach (Stream output in outputs.Values) output.Close();
+            }
+        }
+
+        /// <summary>
+        /// "in.dts out.ac3": reads the DTS track, burns CPU on every byte and writes the AC-3 track at
+        /// 640 of the 1509 kbps, redrawing "process: n%" with backspaces like eac3to.
+        /// </summary>
+        private static void Eac3to(String input, String output)
+        {
+            int passes;
+            if (!int.TryParse(Environment.GetEnvironmentVariable(TranscodePassesVariable), out passes)) passes = 1;
+
+            double ratio = (double)MkvGenerator.AudioKbps(MkvGenerator.Ac3) / MkvGenerator.AudioKbps(MkvGenerator.Dts);
+            var buffer = new byte[ChunkSize];
+            int percent = -1;
+
+            using (var source = new FileStream(input, FileMode.Open, FileAccess.Read, FileShare.Read, ChunkSize))
+            using (var target = new FileStream(output, FileMode.Create, FileAccess.Write, FileShare.None, ChunkSize))
+            {
+                int read;
+                while ((read = source.Read(buffer, 0, buffer.Length)) > 0)
+                {
+                    uint crc = 0;
+                    for (int pass = 0; pass < passes; pass++) crc ^= Crc32Mpeg2.Compute(buffer, 0, read);
+                    buffer[0] ^= (byte)crc;
+
+                    target.Write(buffer, 0, (int)(read * ratio));
+                    percent = Report("process: {0}%\b\b\b\b\b\b\b\b\b\b\b\b\b", source.Position, source.Length, percent);
+                }
+            }
+
+            Console.WriteLine("Done.");
+        }
+
+        /// <summary>
+        /// "file.meta output": reads every track the .meta file lists (demuxing the ones taken from the
+        /// .mkv) and writes them with transport stream overhead, printing "n% complete" like tsMuxeR.
+        /// Blu-ray and AVCHD output is a folder, split output a series of ".split.n" files.
+        /// </summary>
+        private static void TsMuxer(String metafile, String output)
+        {
+            String[] lines = File.ReadAllLines(metafile);
+            bool folder = lines[0].Contains("--blu-ray") || lines[0].Contains("--avchd");
+            bool split = lines[0].Contains("--split-size");
+
+            var containerTracks = new Dictionary<String, List<int>>();
+            var externalFiles = new List<String>();
+            long total = 0;
+
+            for (int i = 1; i < lines.Length; i++)
+            {
+                Match match = MetaTrack.Match(lines[i]);
+                if (!match.Success) continue;
+
+                String file = match.Groups[2].Value;
+                if (match.Groups[3].Success)
+                {
+                    if (!containerTracks.ContainsKey(file))
+                    {
+                        containerTracks.Add(file, new List<int>());
+                        total += new FileInfo(file).Length;
+                    }
+
+                    containerTracks[file].Add(int.Parse(match.Groups[3].Value));
+                }
+                else
+                {
+                    externalFiles.Add(file);
+                    total += new FileInfo(file).Length;
+                }
+            }
+
+            if (folder)
+            {
+                String stream = Path.Combine(Path.Combine(Path.Combine(output, "BDMV"), "STREAM"), "00000.m2ts");
+                Directory.CreateDirectory(Path.GetDirectoryName(stream));
+                output = stream;
+            }
+
+            var writer = new SplitWriter(output, split ? SplitSize : 0);
+            long done = 0;
+            int percent = -1;
+
+            try
+            {
+                foreach (KeyValuePair<String, List<int>> container in containerTracks)
+                {
+                    using (var input = new FileStream(container.Key, FileMode.Open, FileAccess.Read, FileShare.Read, ChunkSize))
+                    {
+                        var reader = new MatroskaReader(input);
+                        reader.ReadHeaders();
+
+                        var block = new MatroskaBlock();
+                        long position = reader.Position;
+
+                        try
+                        {
+                            while (reader.ReadBlock(block))
+                            {
+                                if (container.Value.Contains(block.TrackNumber)) writer.Write(block.Data, block.Length);
+
+                                done += reader.Position - position;
+                                position = reader.Position;
+                                percent = Report("{0}% complete\n", done, total, percent);
+                            }
+                        }
+                        finally
+                        {
+                            block.Release();
+                        }
+
+                        done += input.Length - position;
+                    }
+                }
+
+                var buffer = new byte[ChunkSize];
+                foreach (String file in externalFiles)
+                {
+                    using (var input = new FileStream(file, FileMode.Open, FileAccess.Read, FileShare.Read, ChunkSize))
+                    {
+                        int read;
+                        while ((read = input.Read(buffer, 0, buffer.Length)) > 0)
+                        {
+                            writer.Write(buffer, read);
+
+                            done += read;
+                            percent = Report("{0}% complete\n", done, total, percent);
+                        }
+                    }
+                }
+            }
+            finally
+            {
+                writer.Close();
+            }
+
+            Console.WriteLine("Mux successful complete");
+        }
+
+        /// <summary>
+        /// Rewrites 4-byte NAL length prefixes as start codes.
+        /// </summary>
+        private static void WriteAnnexB(Stream output, byte[] data, int length)
+        {
+            byte[] startCode = { 0, 0, 0, 1 };
+            int position = 0;
+
+            while (position + 4 <= length)
+            {
+                int size = (data[position] << 24) | (data[position + 1] << 16) | (data[position + 2] << 8) | data[position + 3];
+                position += 4;
+                size = Math.Min(size, length - position);
+
+                output.Write(startCode, 0, 4);
+                output.Write(data, position, size);
+                position += size;
+            }
+        }
+
+        /// <summary>
+        /// Prints format with the whole percentage done when it changed, and returns it.
+        /// </summary>
+        private static int Report(String format, long done, long total, int last)
+        {
+            int percent = (total > 0) ? (int)(done * 100 / total) : 0;
+            if (percent == last) return last;
+
+            Console.Write(String.Format(CultureInfo.InvariantCulture, format, percent));
+            Console.Out.Flush();
+            return percent;
+        }
+
+        /// <summary>
+        /// Writes packet-sized padding along with the payload, starting a new ".split.n" file every
+        /// split bytes when split is set.
+        /// </summary>
+        private class SplitWriter
+        {
+            private readonly String Output;
+            private readonly long Split;
+            private readonly byte[] Padding = new byte[ChunkSize];
+            private Stream Current;
+            private int Part;
+
+            public SplitWriter(String Output, long Split)
+            {
+                this.Output = Output;
+                this.Split = Split;
+            }
+
+            public void Write(byte[] data, int count)
+            {
+                if (Current == null || (Split > 0 && Current.Length >= Split)) Next();
+
+                Current.Write(data, 0, count);
+
+                int padding = (int)(count * (PacketOverhead - 1));
+                while (padding > 0)
+                {
+                    int chunk = Math.Min(padding, Padding.Length);
+                    Current.Write(Padding, 0, chunk);
+                    padding -= chunk;
+                }
+            }
+
+            public void Close()
+            {
+                if (Current == null) Next();
+                Current.Close();
+            }
+
+            private void Next()
+            {
+                if (Current != null) Current.Close();
+
+                String file = Output;
+                if (Split > 0)
+                {
+                    Part++;
+                    file = Path.Combine(Path.GetDirectoryName(Output), Path.GetFileNameWithoutExtension(Output) + ".split." + Part + Path.GetExtension(Output));
+                }
+
+                Current = new FileStream(file, FileMode.Create, FileAccess.Write, FileShare.None, ChunkSize);
+            }
+        }
+
+        #endregion
+    }
+}
@@ -0,0 +1,224 @@
+﻿/*
+ * ps3m2ts
+ *
+ * Copyright (R) 2009-> Henning M. Stephansen
+ * Feel free to use the code by any means, hopefully you can submit your improvements, ideas etc
+ * to henningms@gmail.com or leave a comment at my blog http://www.henning.ms
+ *
+ */
+
+using System;
+using System.Collections.Generic;
+using System.IO;
+using System.Text;
+
+namespace ps3m2ts
+{
+    /// <summary>
+    /// The device a path is stored on, so I/O can be limited per disk. On Linux the mount is looked up
+    /// in /proc/self/mountinfo and whether it spins in /sys/dev/block; elsewhere every drive root counts
+    /// as a device of its own and is taken not to spin.
+    /// </summary>
+    class BlockDevice
+    {
+        #region Constructor
+
+        private BlockDevice(String Id, String Name, bool Rotational)
+        {
+            this.Id = Id;
+            this.Name = Name;
+            this.Rotational = Rotational;
+        }
+
+        #endregion
+
+        #region Private Fields
+
+        private class Mount
+        {
+            public String Point;
+            public String Device;
+            public String Source;
+        }
+
+        private static readonly object Sync = new object();
+        private static List<Mount> Mounts;
+        private static readonly Dictionary<String, BlockDevice> Devices = new Dictionary<String, BlockDevice>(StringComparer.OrdinalIgnoreCase);
+
+        #endregion
+
+        #region Public Properties
+
+        /// <summary>"major:minor" on Linux, the drive root elsewhere.</summary>
+        public String Id { get; private set; }
+
+        public String Name { get; private set; }
+
+        /// <summary>True for spinning disks, which lose most of their throughput to interleaved access.</summary>
+        public bool Rotational { get; private set; }
+
+        #endregion
+
+        #region Public Methods
+
+        /// <summary>
+        /// The device path is stored on. Paths that don't exist yet are looked up by their directory.
+        /// </summary>
+        public static BlockDevice Of(String path)
+        {
+            String fullPath = System.IO.Path.GetFullPath(path);
+
+            lock (Sync)
+            {
+                if (Mounts == null) Mounts = ReadMounts();
+
+                Mount mount = null;
+                foreach (Mount candidate in Mounts)
+                {
+                    if (IsUnder(fullPath, candidate.Point) && (mount == null || candidate.Point.Length >= mount.Point.Length))
+                        mount = candidate;
+                }
+
+                String id = (mount != null) ? mount.Device : System.IO.Path.GetPathRoot(fullPath);
+
+                BlockDevice device;
+                if (!Devices.TryGetValue(id, out device))
+                {
+                    device = (mount != null) ? FromSysfs(mount) : new BlockDevice(id, id, false);
+                    Devices.Add(id, device);
+                }
+
+                return device;
+            }
+        }
+
+        #endregion
+
+        #region Private Methods
+
+        private static bool IsUnder(String path, String point)
+        {
+            if (!path.StartsWith(point, StringComparison.Ordinal)) return false;
+            return point == "/" || path.Length == point.Length || path[point.Length] == '/';
+        }
+
+        /// <summary>
+        /// Mount points and device numbers from /proc/self/mountinfo; empty where there is none.
+        /// </summary>
+        private static List<Mount> ReadMounts()
+        {
+            var mounts = new List<Mount>();
+            if (!File.Exists("/proc/self/mountinfo")) return mounts;
+
+            try
+            {
+                // id parent major:minor root mount-point options [optional fields] - type source options
+                foreach (String line in File.ReadAllLines("/proc/self/mountinfo"))
+                {
+                    String[] fields = line.Split(' ');
+                    int separator = Array.IndexOf(fields, "-");
+                    if (fields.Length < 5 || separator < 0 || separator + 2 >= fields.Length) continue;
+
+                    var mount = new Mount();
+                    mount.Device = fields[2];
+                    mount.Point = Unescape(fields[4]);
+                    mount.Source = fields[separator + 2];
+                    mounts.Add(mount);
+                }
+            }
+            catch (IOException)
+            {
+            }
+            catch (UnauthorizedAccessException)
+            {
+            }
+
+            return mounts;
+        }
+
+        /// <summary>
+        /// Name and rotational flag of a mounted block device. A partition has no queue of its own, it
+        /// shares the one of its disk. Virtual file systems (major 0) don't spin.
+        /// </summary>
+        private static BlockDevice FromSysfs(Mount mount)
+        {
+            String sysfs = "/sys/dev/block/" + mount.Device;
+            String name = mount.Source;
+            bool rotational = false;
+
+            try
+            {
+                foreach (String line in ReadLines(sysfs + "/uevent"))
+                {
+                    if (line.StartsWith("DEVNAME=")) name = line.Substring(8);
+                }
+
+                String[] queue = ReadLines(sysfs + "/queue/rotational");
+                if (queue.Length == 0) queue = ReadLines(DiskOf(Path.GetFileName(name)) + "/queue/rotational");
+
+                rotational = (queue.Length > 0 && queue[0].Trim() == "1");
+            }
+            catch (IOException)
+            {
+            }
+            catch (UnauthorizedAccessException)
+            {
+            }
+
+            return new BlockDevice(mount.Device, name, rotational);
+        }
+
+        /// <summary>
+        /// The /sys/block directory of the disk partition is on ("/sys/block/sda" for "sda1"), or an
+        /// empty string. The partition's own directory is a symlink into the disk's, but .NET takes
+        /// "link/.." apart as text instead of following the link, so the disk is found by name.
+        /// </summary>
+        private static String DiskOf(String partition)
+        {
+            if (partition.Length == 0 || !Directory.Exists("/sys/block")) return "";
+
+            foreach (String disk in Directory.GetDirectories("/sys/block"))
+            {
+                if (Directory.Exists(Path.Combine(disk, partition))) return disk;
+            }
+
+            return "";
+        }
+
+        private static String[] ReadLines(String path)
+        {
+            return File.Exists(path) ? File.ReadAllLines(path) : new String[0];
+        }
+
+        /// <summary>
+        /// mountinfo writes spaces, tabs and backslashes in paths as octal escapes ("\040").
+        /// </summary>
+        private static String Unescape(String field)
+        {
+            if (field.IndexOf('\\') < 0) return field;
+
+            var result = new StringBuilder();
+            for (int i = 0; i < field.Length; i++)
+            {
+                if (field[i] == '\\' && i + 3 < field.Length)
+                {
+                    try
+                    {
+                        result.Append((char)Convert.ToInt32(field.Substring(i + 1, 3), 8));
+                        i += 3;
+                        continue;
+                    }
+                    catch (FormatException)
+                    {
+                    }
+                }
+
+                result.Append(field[i]);
+            }
+
+            return result.ToString();
+        }
+
+        #endregion
+    }
+}
@@ -0,0 +1,105 @@
+﻿/*
+ * ps3m2ts
+ *
+ * Copyright (R) 2009-> Henning M. Stephansen
+ * Feel free to use the code by any means, hopefully you can submit your improvements, ideas etc
+ * to henningms@gmail.com or leave a comment at my blog http://www.henning.ms
+ *
+ */
+
+using System.Collections.Generic;
+using System.Threading;
+
+namespace ps3m2ts
+{
+    /// <summary>
+    /// Blocking producer/consumer queue with a fixed capacity. Producers wait while it is full, consumers
+    /// wait while it is empty, and Complete wakes everybody up once no more items will arrive.
+    /// </summary>
+    class BoundedQueue<T>
+    {
+        private readonly Queue<T> Items;
+        private readonly int Capacity;
+        private bool Completed;
+
+        public BoundedQueue(int Capacity)
+        {
+            this.Capacity = Capacity;
+            this.Items = new Queue<T>(Capacity);
+        }
+
+        public int Count
+        {
+            get
+            {
+                lock (Items)
+                {
+                    return Items.Count;
+                }
+            }
+        }
+
+        /// <summary>
+        /// Adds an item, waiting for room. Returns false if the queue was completed in the meantime.
+        /// </summary>
+        public bool Enqueue(T item)
+        {
+            lock (Items)
+            {
+                while (Items.Count >= Capacity && !Completed) Monitor.Wait(Items);
+                if (Completed) return false;
+
+                Items.Enqueue(item);
+                Monitor.PulseAll(Items);
+                return true;
+            }
+        }
+
+        /// <summary>
+        /// Takes the next item, waiting for one. Returns false once the queue is completed and drained.
+        /// </summary>
+        public bool TryDequeue(out T item)
+        {
+            lock (Items)
+            {
+                while (Items.Count == 0 && !Completed) Monitor.Wait(Items);
+
+                if (Items.Count == 0)
+                {
+                    item = default(T);
+                    return false;
+                }
+
+                item = Items.Dequeue();
+                Monitor.PulseAll(Items);
+                return true;
+            }
+        }
+
+        /// <summary>
+        /// Marks the end of the stream. Items already queued can still be dequeued.
+        /// </summary>
+        public void Complete()
+        {
+            lock (Items)
+            {
+                Completed = true;
+                Monitor.PulseAll(Items);
+            }
+        }
+
+        /// <summary>
+        /// Removes and returns everything still queued, for releasing resources after an abort.
+        /// </summary>
+        public List<T> Drain()
+        {
+            lock (Items)
+            {
+                var remaining = new List<T>(Items);
+                Items.Clear();
+                Monitor.PulseAll(Items);
+                return remaining;
+            }
+        }
+    }
+}
@@ -0,0 +1,239 @@
+﻿/*
+ * ps3m2ts
+ *
+ * Copyright (R) 2009-> Henning M. Stephansen
+ * Feel free to use the code by any means, hopefully you can submit your improvements, ideas etc
+ * to henningms@gmail.com or leave a comment at my blog http://www.henning.ms
+ *
+ */
+
+using System;
+using System.Collections.Generic;
+using System.Globalization;
+using System.Threading;
+
+namespace ps3m2ts
+{
+    /// <summary>
+    /// Shared pool of byte buffers in power-of-two size classes. Block payloads and packet batches are
+    /// rented as leases and handed from stage to stage, so a remux of a 50 GB file allocates a handful
+    /// of buffers instead of one per block. Its counters are exported with the metrics.
+    /// </summary>
+    class BufferPool
+    {
+        #region Constants
+
+        private const int MinClass = 12;   // 4 KB
+        private const int MaxClass = 26;   // 64 MB
+
+        /// <summary>Idle bytes kept per size class; anything beyond is left to the GC.</summary>
+        private const long RetainedBytesPerClass = 32L << 20;
+
+        #endregion
+
+        #region Constructor
+
+        public BufferPool()
+        {
+            Classes = new Stack<byte[]>[MaxClass + 1];
+            for (int i = MinClass; i <= MaxClass; i++) Classes[i] = new Stack<byte[]>();
+
+            FreeLeases = new Stack<BufferLease>();
+        }
+
+        #endregion
+
+        #region Private Fields
+
+        private static readonly BufferPool SharedPool = new BufferPool();
+
+        private readonly Stack<byte[]>[] Classes;
+        private readonly Stack<BufferLease> FreeLeases;
+
+        private long RentCount;
+        private long ReturnCount;
+        private long AllocationCount;
+        private long AllocatedBytes;
+
+        #endregion
+
+        #region Public Properties
+
+        public static BufferPool Shared
+        {
+            get { return SharedPool; }
+        }
+
+        #endregion
+
+        #region Public Methods
+
+        /// <summary>
+        /// Rents a buffer of at least minimumLength bytes. The caller owns the lease until it hands it on
+        /// or releases it.
+        /// </summary>
+        public BufferLease Rent(int minimumLength)
+        {
+            Interlocked.Increment(ref RentCount);
+
+            int sizeClass = GetClass(minimumLength);
+            byte[] buffer = null;
+            BufferLease lease = null;
+
+            if (sizeClass <= MaxClass)
+            {
+                Stack<byte[]> stack = Classes[sizeClass];
+                lock (stack)
+                {
+                    if (stack.Count > 0) buffer = stack.Pop();
+                }
+            }
+
+            if (buffer == null)
+            {
+                int length = (sizeClass <= MaxClass) ? (1 << sizeClass) : minimumLength;
+                buffer = new byte[length];
+
+                Interlocked.Increment(ref AllocationCount);
+                Interlocked.Add(ref AllocatedBytes, length);
+            }
+
+            lock (FreeLeases)
+            {
+                if (FreeLeases.Count > 0) lease = FreeLeases.Pop();
+            }
+
+            if (lease == null) lease = new BufferLease(this);
+
+            lease.Attach(buffer);
+            return lease;
+        }
+
+        /// <summary>
+        /// Counters since the process started, combined with the GC collection counts.
+        /// </summary>
+        public BufferPoolStatistics GetStatistics()
+        {
+            var statistics = new BufferPoolStatistics();
+            statistics.Rents = Interlocked.Read(ref RentCount);
+            statistics.Returns = Interlocked.Read(ref ReturnCount);
+            statistics.Allocations = Interlocked.Read(ref AllocationCount);
+            statistics.AllocatedBytes = Interlocked.Read(ref AllocatedBytes);
+            statistics.Gen0Collections = GC.CollectionCount(0);
+            statistics.Gen1Collections = GC.CollectionCount(1);
+            statistics.Gen2Collections = GC.CollectionCount(2);
+            statistics.Timestamp = DateTime.UtcNow;
+            return statistics;
+        }
+
+        #endregion
+
+        #region Private Methods
+
+        internal void Return(BufferLease lease)
+        {
+            Interlocked.Increment(ref ReturnCount);
+
+            byte[] buffer = lease.Detach();
+            int sizeClass = GetClass(buffer.Length);
+
+            if (sizeClass <= MaxClass && buffer.Length == (1 << sizeClass))
+            {
+                Stack<byte[]> stack = Classes[sizeClass];
+                lock (stack)
+                {
+                    if ((long)(stack.Count + 1) * buffer.Length <= Math.Max(RetainedBytesPerClass, buffer.Length))
+                        stack.Push(buffer);
+                }
+            }
+
+            lock (FreeLeases)
+            {
+                FreeLeases.Push(lease);
+            }
+        }
+
+        private static int GetClass(int length)
+        {
+            int sizeClass = MinClass;
+            while (sizeClass <= MaxClass && (1 << sizeClass) < length) sizeClass++;
+            return sizeClass;
+        }
+
+        #endregion
+    }
+
+    /// <summary>
+    /// A rented buffer with a single owner at a time. A stage that hands the lease on doesn't touch it
+    /// again; the last owner calls Release once and the buffer goes back to the pool.
+    /// </summary>
+    class BufferLease
+    {
+        private readonly BufferPool Pool;
+        private int References;
+
+        internal BufferLease(BufferPool Pool)
+        {
+            this.Pool = Pool;
+        }
+
+        public byte[] Buffer { get; private set; }
+
+        /// <summary>Number of valid bytes, maintained by whoever fills the buffer.</summary>
+        public int Length;
+
+        public int Capacity
+        {
+            get { return Buffer.Length; }
+        }
+
+        public void Release()
+        {
+            int remaining = Interlocked.Decrement(ref References);
+
+            if (remaining == 0) Pool.Return(this);
+            else if (remaining < 0) throw new InvalidOperationException("Buffer lease released more than once.");
+        }
+
+        internal void Attach(byte[] buffer)
+        {
+            Buffer = buffer;
+            Length = 0;
+            References = 1;
+        }
+
+        internal byte[] Detach()
+        {
+            byte[] buffer = Buffer;
+            Buffer = null;
+            return buffer;
+        }
+    }
+
+    struct BufferPoolStatistics
+    {
+        public long Rents;
+        public long Returns;
+        public long Allocations;
+        public long AllocatedBytes;
+        public int Gen0Collections;
+        public int Gen1Collections;
+        public int Gen2Collections;
+        public DateTime Timestamp;
+
+        /// <summary>
+        /// One log line describing what happened between since and this snapshot.
+        /// </summary>
+        public string Describe(BufferPoolStatistics since)
+        {
+            double seconds = Math.Max((Timestamp - since.Timestamp).TotalSeconds, 0.001);
+            double allocatedMB = (AllocatedBytes - since.AllocatedBytes) / 1048576.0;
+
+            return String.Format(CultureInfo.InvariantCulture,
+                                 "Buffer pool: {0} rents, {1} new buffers ({2:0.0} MB, {3:0.0} MB/s), {4} outstanding; GC gen0/1/2: {5}/{6}/{7}.",
+                                 Rents - since.Rents, Allocations - since.Allocations, allocatedMB, allocatedMB / seconds,
+                                 Rents - Returns, Gen0Collections - since.Gen0Collections,
+                                 Gen1Collections - since.Gen1Collections, Gen2Collections - since.Gen2Collections);
+        }
+    }
+}
@@ -0,0 +1,318 @@
+﻿/*
+ * ps3m2ts
+ *
+ * Copyright (R) 2009-> Henning M. Stephansen
+ * Feel free to use the code by any means, hopefully you can submit your improvements, ideas etc
+ * to henningms@gmail.com or leave a comment at my blog http://www.henning.ms
+ *
+ */
+
+using System;
+using System.Collections.Generic;
+using System.Globalization;
+using System.IO;
+using System.Runtime.InteropServices;
+using System.Threading;
+
+namespace ps3m2ts
+{
+    /// <summary>
+    /// Finds the CPU and I/O slot counts that move the most bytes per second (/jobs=auto). Every
+    /// interval it measures what each stage class read, and while jobs queue for a class it tries one
+    /// slot more (or fewer); a step that doesn't pay off is taken back. It never adds a slot that the
+    /// free memory can't hold or while jobs wait for disk space, and gives one back when memory runs low.
+    /// </summary>
+    class ConcurrencyTuner
+    {
+        #region Constants
+
+        /// <summary>A step up has to raise the throughput by this much to be kept, a step down may lose at most this much.</summary>
+        private const double MinimumGain = 0.05;
+
+        /// <summary>Intervals to stay put after a step was taken back, before probing again.</summary>
+        private const int HoldIntervals = 3;
+
+        /// <summary>Memory left free for everything else on the machine.</summary>
+        private const long MemoryHeadroom = 512L * 1048576;
+
+        /// <summary>Assumed size of a slot until its stage has reported a peak RSS.</summary>
+        private const long DefaultSlotMemory = 256L * 1048576;
+
+        #endregion
+
+        #region Constructor
+
+        public ConcurrencyTuner(JobScheduler Scheduler, TimeSpan Interval, Logger Log)
+        {
+            this.Scheduler = Scheduler;
+            this.Interval = Interval;
+            this.Log = Log;
+
+            Classes = new List<GateTuning>();
+            Classes.Add(new GateTuning(Scheduler.CpuGate, Math.Min(Scheduler.Jobs, ResourceGovernor.CoreCount), "transcode"));
+            Classes.Add(new GateTuning(Scheduler.IOGate, Scheduler.Jobs, "extract", "mux", "remux"));
+        }
+
+        #endregion
+
+        #region Private Fields
+
+        /// <summary>
+        /// Climbing state of one gate.
+        /// </summary>
+        private class GateTuning
+        {
+            public readonly StageGate Gate;
+            public readonly int Maximum;
+            public readonly String[] Stages;
+
+            public long LastBytes;
+            public int Direction = 1;
+            public int Hold;
+            public int SaturatedSamples;
+            public int Samples;
+
+            /// <summary>Limit and throughput before the step being judged; Previous is 0 when there is none.</summary>
+            public int Previous;
+            public double PreviousRate;
+
+            public GateTuning(StageGate Gate, int Maximum, params String[] Stages)
+            {
+                this.Gate = Gate;
+                this.Maximum = Math.Max(1, Maximum);
+                this.Stages = Stages;
+            }
+        }
+
+        private readonly JobScheduler Scheduler;
+        private readonly TimeSpan Interval;
+        private readonly Logger Log;
+        private readonly List<GateTuning> Classes;
+
+        private Thread Tuner;
+        private readonly ManualResetEvent Stopped = new ManualResetEvent(false);
+
+        #endregion
+
+        #region Public Methods
+
+        public void Start()
+        {
+            foreach (GateTuning tuning in Classes)
+            {
+                tuning.Gate.Limit = Math.Min(tuning.Gate.Limit, tuning.Maximum);
+                tuning.LastBytes = ReadBytes(tuning);
+            }
+
+            Log.Log(String.Format(CultureInfo.InvariantCulture, "Tuning: starting with {0} cpu and {1} io slot(s), {2} job(s) at most; adjusting every {3:0} s.",
+                                  Scheduler.CpuGate.Limit, Scheduler.IOGate.Limit, Scheduler.Jobs, Interval.TotalSeconds));
+
+            Tuner = new Thread(Run);
+            Tuner.Name = "tuner";
+            Tuner.IsBackground = true;
+            Tuner.Start();
+        }
+
+        public void Stop()
+        {
+            if (Tuner == null) return;
+
+            Stopped.Set();
+            Tuner.Join();
+            Tuner = null;
+
+            Log.Log(String.Format(CultureInfo.InvariantCulture, "Tuning: ended with {0} cpu and {1} io slot(s).",
+                                  Scheduler.CpuGate.Limit, Scheduler.IOGate.Limit));
+        }
+
+        #endregion
+
+        #region Private Methods
+
+        /// <summary>
+        /// Samples once a second whether the gates are saturated and decides once per interval.
+        /// </summary>
+        private void Run()
+        {
+            DateTime next = DateTime.UtcNow + Interval;
+
+            while (!Stopped.WaitOne(1000, false))
+            {
+                foreach (GateTuning tuning in Classes)
+                {
+                    tuning.Samples++;
+                    if (tuning.Gate.Waiting > 0) tuning.SaturatedSamples++;
+                }
+
+                if (DateTime.UtcNow < next) continue;
+                next = DateTime.UtcNow + Interval;
+
+                foreach (GateTuning tuning in Classes) Adjust(tuning);
+            }
+        }
+
+        private void Adjust(GateTuning tuning)
+        {
+            long bytes = ReadBytes(tuning);
+            double rate = (bytes - tuning.LastBytes) / 1048576.0 / Interval.TotalSeconds;
+            tuning.LastBytes = bytes;
+
+            // jobs queued for a slot most of the interval: more slots could be used
+            bool demand = tuning.SaturatedSamples * 2 >= tuning.Samples && tuning.Samples > 0;
+            tuning.SaturatedSamples = 0;
+            tuning.Samples = 0;
+
+            StageGate gate = tuning.Gate;
+            int limit = gate.Limit;
+            long available = AvailableMemory();
+            long slotMemory = SlotMemory(tuning);
+
+            if (available >= 0 && available < MemoryHeadroom && limit > 1)
+            {
+                tuning.Previous = 0;
+                Change(tuning, limit - 1, rate, String.Format(CultureInfo.InvariantCulture, "only {0:0} MB of memory free", available / 1048576.0));
+                return;
+            }
+
+            // judge the last step against the interval before it
+            if (tuning.Previous > 0)
+            {
+                int previous = tuning.Previous;
+                double previousRate = tuning.PreviousRate;
+                tuning.Previous = 0;
+
+                // more slots have to pay off; fewer only must not cost throughput
+                bool better = (limit > previous) ? rate > previousRate * (1 + MinimumGain) : rate >= previousRate * (1 - MinimumGain);
+                if (better)
+                {
+                    Log.Event("tune", "gate", gate.Name, "from", previous, "to", limit, "mbps", rate, "reason", "kept");
+                    Log.Log(String.Format(CultureInfo.InvariantCulture, "Tuning: keeping {0} {1} slot(s), {2:0.0} MB/s against {3:0.0} MB/s with {4}.",
+                                          limit, gate.Name, rate, previousRate, previous));
+                    return;
+                }
+
+                tuning.Direction = -tuning.Direction;
+                tuning.Hold = HoldIntervals;
+                Change(tuning, previous, rate, String.Format(CultureInfo.InvariantCulture, "{0:0.0} MB/s with {1} against {2:0.0} MB/s with {3}",
+                                                             rate, limit, previousRate, previous));
+                return;
+            }
+
+            if (tuning.Hold > 0)
+            {
+                tuning.Hold--;
+                return;
+            }
+
+            // nothing queued: the limit isn't what holds the class back, so there is nothing to learn
+            if (!demand || rate <= 0) return;
+
+            if (tuning.Direction > 0)
+            {
+                if (limit >= tuning.Maximum)
+                {
+                    tuning.Direction = -1;
+                    return;
+                }
+
+                if (available >= 0 && available - slotMemory < MemoryHeadroom) return;
+                if (gate == Scheduler.IOGate && Scheduler.Space.Waiting > 0) return;
+
+                tuning.Previous = limit;
+                tuning.PreviousRate = rate;
+                Change(tuning, limit + 1, rate, "jobs are waiting for a slot");
+            }
+            else
+            {
+                if (limit <= 1)
+                {
+                    tuning.Direction = 1;
+                    return;
+                }
+
+                tuning.Previous = limit;
+                tuning.PreviousRate = rate;
+                Change(tuning, limit - 1, rate, "trying whether fewer slots do as well");
+            }
+        }
+
+        private void Change(GateTuning tuning, int limit, double rate, String reason)
+        {
+            int from = tuning.Gate.Limit;
+            tuning.Gate.Limit = limit;
+
+            Log.Event("tune", "gate", tuning.Gate.Name, "from", from, "to", limit, "mbps", rate, "reason", reason);
+            Log.Log(String.Format(CultureInfo.InvariantCulture, "Tuning: {0} slots {1} -> {2} at {3:0.0} MB/s: {4}.",
+                                  tuning.Gate.Name, from, limit, rate, reason));
+        }
+
+        private static long ReadBytes(GateTuning tuning)
+        {
+            long bytes = 0;
+            foreach (String stage in tuning.Stages) bytes += Metrics.BytesRead.Labels(stage).Value;
+            return bytes;
+        }
+
+        /// <summary>
+        /// Memory one more slot may take: the largest peak RSS its stages have shown so far.
+        /// </summary>
+        private static long SlotMemory(GateTuning tuning)
+        {
+            long peak = 0;
+            foreach (String stage in tuning.Stages) peak = Math.Max(peak, ResourceAccounting.PeakRss(stage));
+            return (peak > 0) ? peak : DefaultSlotMemory;
+        }
+
+        /// <summary>
+        /// Physical memory available to new work, or -1 where that can't be told. Memory-backed scratch
+        /// (/ramscratch on tmpfs) is already taken out.
+        /// </summary>
+        private static long AvailableMemory()
+        {
+            try
+            {
+                if (File.Exists("/proc/meminfo"))
+                {
+                    foreach (String line in File.ReadAllLines("/proc/meminfo"))
+                    {
+                        // "MemAvailable:    1234567 kB"
+                        if (!line.StartsWith("MemAvailable:", StringComparison.Ordinal)) continue;
+
+                        String[] fields = line.Split(new[] { ' ' }, StringSplitOptions.RemoveEmptyEntries);
+                        return long.Parse(fields[1], CultureInfo.InvariantCulture) * 1024;
+                    }
+                }
+                else if (Environment.OSVersion.Platform == PlatformID.Win32NT)
+                {
+                    var status = new MemoryStatus();
+                    status.Length = Marshal.SizeOf(typeof(MemoryStatus));
+                    if (GlobalMemoryStatusEx(ref status)) return (long)status.AvailablePhysical;
+                }
+            }
+            catch
+            {
+            }
+
+            return -1;
+        }
+
+        [StructLayout(LayoutKind.Sequential)]
+        private struct MemoryStatus
+        {
+            public int Length;
+            public int MemoryLoad;
+            public ulong TotalPhysical;
+            public ulong AvailablePhysical;
+            public ulong TotalPageFile;
+            public ulong AvailablePageFile;
+            public ulong TotalVirtual;
+            public ulong AvailableVirtual;
+            public ulong AvailableExtendedVirtual;
+        }
+
+        [DllImport("kernel32.dll", SetLastError = true)]
+        private static extern bool GlobalMemoryStatusEx(ref MemoryStatus status);
+
+        #endregion
+    }
+}
@@ -0,0 +1,722 @@
+﻿/*
+ * ps3m2ts
+ *
+ * Copyright (R) 2009-> Henning M. Stephansen
+ * Feel free to use the code by any means, hopefully you can submit your improvements, ideas etc
+ * to henningms@gmail.com or leave a comment at my blog http://www.henning.ms
+ *
+ */
+
+using System;
+using System.Collections.Generic;
+using System.IO;
+using System.Threading;
+
+namespace ps3m2ts
+{
+    /// <summary>
+    /// Conversion of one input file, split into the stages probe, extract, transcode, mux and cleanup.
+    /// </summary>
+    class ConversionJob
+    {
+        #region Constants
+
+        /// <summary>eac3to's default AC-3 bitrate in kbps.</summary>
+        private const int Ac3BitRate = 640;
+
+        /// <summary>Transport stream packets and PES headers add a few percent to the elementary streams.</summary>
+        private const double TSOverhead = 1.08;
+
+        #endregion
+
+        #region Constructor
+
+        public ConversionJob(String InputFile, Dictionary<string, string> Options, Logger Log)
+        {
+            this.InputFile = InputFile;
+            this.Options = Options;
+            this.Log = Log;
+            this.Id = Interlocked.Increment(ref LastId);
+            this.Context = new Logger.Context();
+            this.Context.Job = Id;
+
+            Destination = string.Empty;
+
+            if (Options.ContainsKey("destination")) Destination = Options["destination"];
+
+            if (Destination == string.Empty) Destination = Path.GetDirectoryName(InputFile);
+            if (Destination == string.Empty) Destination = ".";
+
+            Journal = JobJournal.For(Destination);
+            Manifest = ConversionManifest.For(Destination);
+
+            // /scratch gives every input a directory of its own, so same-named inputs no longer collide
+            if (Options.ContainsKey("scratch"))
+                Scratch = ScratchDirectory.For(Options["scratch"], InputFile, long.Parse(Options["scratchbudget"]) * 1048576);
+            else
+                Scratch = ScratchDirectory.WorkingDirectory();
+
+            String memoryRoot = Options.ContainsKey("ramdir") ? Options["ramdir"] : MemoryTier.DefaultPath;
+            if (int.Parse(Options["ramscratch"]) > 0 && memoryRoot != null)
+                Scratch.UseMemory(MemoryTier.For(memoryRoot, long.Parse(Options["ramscratch"]) * 1048576), InputFile);
+        }
+
+        #endregion
+
+        #region Private Fields
+
+        private static int LastId;
+
+        private readonly Dictionary<string, string> Options;
+        private readonly Logger Log;
+        private DateTime Started;
+
+        /// <summary>
+        /// MediaInfo results by path, size and timestamp, from the first estimate until the job is cleaned
+        /// up; ProbeKeys are the entries this job added, so /watch doesn't keep every version it saw.
+        /// </summary>
+        private static readonly Dictionary<String, List<Support.MediaInfo>> ProbeCache = new Dictionary<String, List<Support.MediaInfo>>(StringComparer.OrdinalIgnoreCase);
+        private readonly List<String> ProbeKeys = new List<String>();
+        private readonly JobJournal Journal;
+        private readonly ConversionManifest Manifest;
+        private String ManifestKey;
+
+        /// <summary>Why the last probe failed; estimates don't probe again after that, the Probe stage does.</summary>
+        private Exception ProbeError;
+
+        private List<Support.MediaInfo> TrackList;
+        private bool Dts;
+        private bool FastPath;
+
+        #endregion
+
+        #region Public Properties
+
+        /// <summary>Numbers the jobs of a run; ties the events of one job together in the event log.</summary>
+        public int Id { get; private set; }
+
+        /// <summary>Logging context of the job between its stages (waiting for a slot, for space).</summary>
+        public Logger.Context Context { get; private set; }
+
+        public String InputFile { get; private set; }
+        public String Destination { get; private set; }
+
+        /// <summary>False when probing found nothing to convert; the remaining stages are skipped.</summary>
+        public bool Convertible { get; private set; }
+
+        /// <summary>Where the intermediates go: the working directory, or a directory of its own with /scratch.</summary>
+        public ScratchDirectory Scratch { get; private set; }
+
+        /// <summary>Path of the intermediates (.h264, .dts, .ac3, .meta) without their extension.</summary>
+        public String IntermediateName
+        {
+            get { return Scratch.GetIntermediateName(InputFile); }
+        }
+
+        /// <summary>
+        /// Names no other job may use while this one runs: its intermediates and its output. The output is
+        /// named after the input file alone, even where /scratch keeps the intermediates apart.
+        /// </summary>
+        public String[] ReservedNames
+        {
+            get { return new[] { IntermediateName, Support.GetOutputFile(InputFile, Destination, Options["outputformat"]) }; }
+        }
+
+        /// <summary>The first stage that failed, if any. A failed job is cleaned up but keeps its source.</summary>
+        public Exception Error { get; set; }
+
+        /// <summary>Seconds EstimateCost predicted for the whole job.</summary>
+        public double EstimatedCost { get; private set; }
+
+        /// <summary>When the job should finish, counted from the start of the batch (with /order).</summary>
+        public TimeSpan? EstimatedFinish { get; set; }
+
+        /// <summary>When the output was committed; null until then.</summary>
+        public DateTime? FinishedUtc { get; private set; }
+
+        /// <summary>Held from probe to cleanup so no other job uses the same intermediate names.</summary>
+        public IDisposable NameReservation { get; set; }
+
+        /// <summary>Held from probe to cleanup so concurrent jobs don't run the disks full.</summary>
+        public IDisposable SpaceReservation { get; set; }
+
+        #endregion
+
+        #region Public Methods
+
+        /// <summary>
+        /// Estimated seconds this job takes, from its size and probed tracks. The probe is cached, so
+        /// the later Probe stage doesn't run MediaInfo again. A file that can't be probed is costed by
+        /// its size alone; its job reports the error when it gets to it.
+        /// </summary>
+        public double EstimateCost(JobCostModel model)
+        {
+            long size = File.Exists(InputFile) ? new FileInfo(InputFile).Length : 0;
+            List<Support.MediaInfo> fileTrackList;
+
+            try
+            {
+                fileTrackList = ReadMediaFile(false);
+            }
+            catch (Exception)
+            {
+                fileTrackList = null;
+            }
+
+            if (fileTrackList == null || fileTrackList.Count == 0)
+            {
+                EstimatedCost = model.Seconds("mux", size);
+                return EstimatedCost;
+            }
+
+            var tracks = SelectTracks(fileTrackList);
+            bool fast = NativeRemuxer.CanRemux(tracks, Options["outputformat"], (Options.ContainsKey("split")));
+            EstimatedCost = model.Seconds(fast ? "remux" : "mux", size);
+
+            if (tracks.Count > 1 && tracks[1].CodecID == "A_DTS")
+            {
+                long dtsBytes = (long)(tracks[1].BitRate * 1000.0 / 8 * JobCostModel.ParseDuration(tracks[1].Duration));
+                EstimatedCost += model.Seconds("extract", size) + model.Seconds("transcode", dtsBytes);
+            }
+
+            return EstimatedCost;
+        }
+
+        /// <summary>
+        /// Bytes the intermediates and the output are expected to take, by the directory they are written
+        /// to. Audio sizes come from the probed bitrate and duration; the video is taken to be the rest of
+        /// the input.
+        /// </summary>
+        public Dictionary<String, long> EstimateSpace()
+        {
+            var space = new Dictionary<String, long>();
+            long size = File.Exists(InputFile) ? new FileInfo(InputFile).Length : 0;
+            long scratch = 0;
+            long output = size;
+
+            Dictionary<String, long> intermediates = EstimateIntermediates();
+            if (intermediates.Count > 0)
+            {
+                // intermediates placed in the memory tier take no disk space
+                foreach (KeyValuePair<String, long> intermediate in intermediates)
+                {
+                    if (!Scratch.IsInMemory(intermediate.Key)) scratch += intermediate.Value;
+                }
+
+                output = Math.Max(0, size - intermediates[".dts"]) + intermediates[".ac3"];
+            }
+
+            // segments after the first are muxed into scratch before they are stitched into the output
+            if (FastPath && Options.ContainsKey("segments")) scratch += (long)(output * TSOverhead);
+
+            space[Scratch.Path] = scratch;
+
+            long sum;
+            space.TryGetValue(Destination, out sum);
+            space[Destination] = sum + (long)(output * TSOverhead);
+
+            return space;
+        }
+
+        /// <summary>
+        /// What the job has written so far, in the form of EstimateSpace: its scratch directory and its
+        /// partial output.
+        /// </summary>
+        public Dictionary<String, long> WrittenSpace()
+        {
+            var space = new Dictionary<String, long>();
+            space[Scratch.Path] = Scratch.UsedBytes();
+
+            long sum;
+            space.TryGetValue(Destination, out sum);
+            space[Destination] = sum + Support.PartialOutputBytes(InputFile, Destination, Options["outputformat"]);
+
+            return space;
+        }
+
+        /// <summary>
+        /// Places the intermediates that fit the memory tier there, smallest first; the rest stay on disk.
+        /// </summary>
+        public void PlaceIntermediates()
+        {
+            var intermediates = new List<KeyValuePair<String, long>>(EstimateIntermediates());
+            intermediates.Sort((a, b) => a.Value.CompareTo(b.Value));
+
+            foreach (KeyValuePair<String, long> intermediate in intermediates)
+                Scratch.Place(InputFile, intermediate.Key, intermediate.Value);
+        }
+
+        /// <summary>
+        /// True if the manifest says this version of the input was already converted with the same
+        /// options and the outputs are still there. Doesn't probe the file; /force always says no.
+        /// </summary>
+        public bool IsUpToDate()
+        {
+            if (!File.Exists(InputFile)) return false;
+
+            ManifestKey = ConversionManifest.GetKey(InputFile, Options);
+            return !Options.ContainsKey("force") && Manifest.IsUpToDate(InputFile, ManifestKey);
+        }
+
+        /// <summary>
+        /// Runs every stage in order, holding the scheduler's CPU or I/O slot around the heavy ones.
+        /// </summary>
+        public void Run(JobScheduler scheduler)
+        {
+            using (Logger.Enter(Context))
+            using (scheduler.ReserveName(ReservedNames))
+            {
+                try
+                {
+                    using (Log.BeginStage(Id, "probe")) Probe();
+                }
+                catch (Exception ex)
+                {
+                    Error = ex;
+                    Metrics.Failures.Labels("probe").Increment();
+                    Cleanup();
+                    ReportResources();
+                    throw;
+                }
+
+                if (!Convertible)
+                {
+                    Cleanup();
+                    ReportResources();
+                    return;
+                }
+
+                PlaceIntermediates();
+
+                IDisposable space;
+                try
+                {
+                    space = scheduler.ReserveSpace(EstimateSpace(), WrittenSpace, InputFile, Log);
+                }
+                catch (Exception ex)
+                {
+                    Error = ex;
+                    Metrics.Failures.Labels("probe").Increment();
+                    Cleanup();
+                    ReportResources();
+                    throw;
+                }
+
+                using (space)
+                {
+                    String stage = "extract";
+                    try
+                    {
+                        using (NeedsSlot("extract") ? scheduler.EnterStage(StageClass.IO, StagePaths("extract")) : null)
+                        using (Log.BeginStage(Id, "extract")) Extract();
+
+                        stage = "transcode";
+                        using (NeedsSlot("transcode") ? scheduler.EnterStage(StageClass.Cpu) : null)
+                        using (Log.BeginStage(Id, "transcode")) Transcode();
+
+                        stage = "mux";
+                        using (scheduler.EnterStage(StageClass.IO, StagePaths("mux")))
+                        using (Log.BeginStage(Id, "mux")) Mux(scheduler);
+                    }
+                    catch (Exception ex)
+                    {
+                        Error = ex;
+                        Metrics.Failures.Labels(stage).Increment();
+                        throw;
+                    }
+                    finally
+                    {
+                        using (Log.BeginStage(Id, "cleanup")) Cleanup();
+                        ReportResources();
+                    }
+                }
+            }
+        }
+
+        /// <summary>
+        /// False for a stage with nothing to do, so it doesn't queue for a slot (or count as demand for
+        /// one): files without DTS audio are neither extracted nor transcoded. Valid after Probe.
+        /// </summary>
+        public bool NeedsSlot(String stage)
+        {
+            return (stage != "extract" && stage != "transcode") || Dts;
+        }
+
+        /// <summary>
+        /// Where stage reads and writes heavily: extract streams the input into the scratch directory,
+        /// mux streams the input (or the extracted tracks) into the destination. Valid after Probe.
+        /// </summary>
+        public String[] StagePaths(String stage)
+        {
+            switch (stage)
+            {
+                case "extract":
+                    return Dts ? new[] { InputFile, Scratch.Path } : new String[0];
+
+                case "mux":
+                    return new[] { Dts ? Scratch.Path : InputFile, Destination };
+
+                default:
+                    return new String[0];
+            }
+        }
+
+        /// <summary>
+        /// Reads the tracks with MediaInfo and picks the first video and audio track.
+        /// </summary>
+        public void Probe()
+        {
+            Started = DateTime.Now;
+            TraceRecorder.NameJob(Id, Path.GetFileName(InputFile));
+            Log.Event("job_start", "input", InputFile, "input_bytes", File.Exists(InputFile) ? new FileInfo(InputFile).Length : 0);
+
+            if (Journal.IsComplete(InputFile, JobJournal.Done) &&
+                Support.OutputExists(InputFile, Destination, Options["outputformat"]))
+            {
+                Log.Log("Skipping file '" + InputFile + "', an earlier run already converted it.");
+                return;
+            }
+
+            Log.Log("Processing file '" + InputFile + "'...");
+
+            var fileTrackList = ReadMediaFile(true);
+            if (fileTrackList == null || fileTrackList.Count == 0) return;
+
+            TrackList = SelectTracks(fileTrackList);
+
+            if (TrackList[1].Type == Support.MediaType.Audio && TrackList[1].CodecID == "A_DTS")
+                Dts = true;
+
+            // files that are already compatible skip the meta file and tsMuxeR entirely
+            FastPath = NativeRemuxer.CanRemux(TrackList, Options["outputformat"], (Options.ContainsKey("split")));
+            Convertible = true;
+        }
+
+        /// <summary>
+        /// Extracts the tracks of files whose DTS audio must be transcoded.
+        /// </summary>
+        public void Extract()
+        {
+            if (!Dts) return;
+
+            if (Journal.IsComplete(InputFile, "extract"))
+            {
+                Log.Log("Resuming '" + InputFile + "' with the tracks an earlier run extracted.");
+                return;
+            }
+
+            Scratch.Ensure();
+
+            var progress = StartProgress("extract", InputFile);
+            Support.ExtractMKV(InputFile, Scratch, TrackList, Log, progress);
+            progress.Complete();
+            CheckScratchBudget();
+            Scratch.Spill(InputFile);
+            CountWritten("extract", IntermediatePath(".h264"), IntermediatePath(".ac3"), IntermediatePath(".dts"));
+
+            Journal.Complete(InputFile, "extract", IntermediatePath(".h264"), IntermediatePath(".ac3"), IntermediatePath(".dts"));
+        }
+
+        /// <summary>
+        /// Converts DTS audio to AC-3 with eac3to.
+        /// </summary>
+        public void Transcode()
+        {
+            if (!Dts)
+            {
+                Metrics.TranscodesSkipped.Labels("no_dts").Increment();
+                return;
+            }
+
+            if (Journal.IsComplete(InputFile, "transcode"))
+            {
+                Metrics.TranscodesSkipped.Labels("resumed").Increment();
+                Log.Log("Resuming '" + InputFile + "' with the AC-3 track an earlier run transcoded.");
+                UseTranscodedAudio();
+                return;
+            }
+
+            var progress = StartProgress("transcode", IntermediatePath(".dts"));
+            List<Support.MediaInfo> NewTrackList = Support.ConvertDTS(InputFile, Scratch, TrackList, Log, progress);
+            if (NewTrackList != null) TrackList = NewTrackList;
+            progress.Complete();
+            CheckScratchBudget();
+
+            // a spilled AC-3 track moves, so the track list is pointed at it again
+            Scratch.Spill(InputFile);
+            if (NewTrackList != null) UseTranscodedAudio();
+            CountWritten("transcode", IntermediatePath(".ac3"));
+
+            Journal.Complete(InputFile, "transcode", IntermediatePath(".ac3"));
+        }
+
+        /// <summary>
+        /// Remuxes natively when possible, otherwise writes the .meta file and runs tsMuxeR. The output
+        /// is written as .partial and only renamed into place once it is complete. Segments beyond the
+        /// first run on extra I/O slots taken from scheduler while they are free.
+        /// </summary>
+        public void Mux(JobScheduler scheduler)
+        {
+            var remuxed = false;
+            var progress = StartProgress(FastPath ? "remux" : "mux", InputFile);
+            var outputFile = Support.GetPartialOutputFile(InputFile, Destination, Options["outputformat"]);
+
+            if (FastPath)
+            {
+                Log.Log("Fast path: '" + InputFile + "' is H.264 " + TrackList[0].Level + " with AC-3, remuxing natively...");
+
+                if (Options.ContainsKey("segments"))
+                {
+                    Scratch.Ensure();
+                    remuxed = SegmentedRemuxer.Remux(InputFile, outputFile, Scratch.GetIntermediateName(InputFile), TrackList, Options["outputformat"],
+                                                     int.Parse(Options["segments"]), () => scheduler.TryEnterStage(StageClass.IO, StagePaths("mux")),
+                                                     Log, progress);
+                }
+                else
+                    remuxed = NativeRemuxer.Remux(InputFile, outputFile, TrackList, Options["outputformat"], Log, progress);
+
+                // tsMuxeR starts over from the beginning of the file
+                if (!remuxed) progress = StartProgress("mux", InputFile);
+            }
+
+            if (!remuxed)
+            {
+                Scratch.Ensure();
+
+                String metafile = Support.WriteTSMuxerMetaFile(InputFile, Scratch, TrackList, (Options.ContainsKey("split")), Options["outputformat"]);
+                Log.Log("Written .meta file:" + Environment.NewLine + metafile);
+
+                Support.TSMuxerMuxFile(InputFile, Scratch, outputFile, Log, progress);
+            }
+
+            progress.Complete();
+
+            List<String> outputs = Support.CommitPartialOutput(InputFile, Destination, Options["outputformat"]);
+            CountWritten(progress.Stage, outputs.ToArray());
+            Journal.Complete(InputFile, JobJournal.Done);
+
+            if (ManifestKey == null) ManifestKey = ConversionManifest.GetKey(InputFile, Options);
+            Manifest.Add(InputFile, ManifestKey, outputs);
+
+            FinishedUtc = DateTime.UtcNow;
+
+            Log.Log("Finished processing file '" + InputFile + "'.");
+            Log.Log("-------------------------------------------------------------------");
+        }
+
+        /// <summary>
+        /// Removes the intermediates (the whole scratch directory with /scratch), and the source if
+        /// requested and the conversion succeeded. Drops the job's cached probes and records how the job
+        /// ended in the event log.
+        /// </summary>
+        public void Cleanup()
+        {
+            try
+            {
+                if (!Convertible) return;
+
+                Support.Cleanup(InputFile, Scratch, (Error == null) && (Options.ContainsKey("deletesource")));
+
+                // a failed mux leaves nothing behind; after a crash the next run simply overwrites it
+                if (Error != null) Support.DeletePartialOutput(InputFile, Destination, Options["outputformat"]);
+            }
+            finally
+            {
+                lock (ProbeCache)
+                {
+                    foreach (String key in ProbeKeys) ProbeCache.Remove(key);
+                    ProbeKeys.Clear();
+                }
+
+                String status = (Error != null) ? "failed" : (Convertible ? "converted" : "skipped");
+                Metrics.Files.Labels(status).Increment();
+                Log.Event("job", "input", InputFile, "status", status,
+                          "duration_ms", DateTime.Now - Started, "error", (Error != null) ? Error.Message : null);
+            }
+        }
+
+        /// <summary>
+        /// Logs what every stage of a converted job used as a table, and one "resources" event per stage.
+        /// Call once the job is done; its accounting is dropped afterwards.
+        /// </summary>
+        public void ReportResources()
+        {
+            List<KeyValuePair<String, ResourceUsage>> stages = ResourceAccounting.Take(Id);
+            if (stages.Count == 0 || !Convertible) return;
+
+            Log.Log("Resources of '" + Path.GetFileName(InputFile) + "':");
+            Log.Log(ResourceAccounting.Header);
+
+            foreach (KeyValuePair<String, ResourceUsage> pair in stages)
+            {
+                ResourceUsage usage = pair.Value;
+                Log.Log(ResourceAccounting.Describe(pair.Key, usage));
+                Log.Event("resources", "work", pair.Key, "wall_ms", usage.WallTime, "user_ms", usage.UserTime,
+                          "system_ms", usage.SystemTime, "peak_rss_bytes", usage.PeakRss, "read_bytes", usage.ReadBytes,
+                          "write_bytes", usage.WriteBytes, "minor_faults", usage.MinorFaults, "major_faults", usage.MajorFaults);
+            }
+        }
+
+        #endregion
+
+        #region Private Methods
+
+        private String IntermediatePath(String extension)
+        {
+            return Scratch.GetIntermediatePath(InputFile, extension);
+        }
+
+        /// <summary>
+        /// Expected size of each intermediate by extension; empty when nothing is extracted (no DTS).
+        /// mkvextract writes the video and the DTS track, eac3to the AC-3 track next to them.
+        /// </summary>
+        private Dictionary<String, long> EstimateIntermediates()
+        {
+            var intermediates = new Dictionary<String, long>();
+
+            var fileTrackList = ReadMediaFile(false);
+            if (fileTrackList == null || fileTrackList.Count == 0) return intermediates;
+
+            var tracks = SelectTracks(fileTrackList);
+            if (tracks.Count < 2 || tracks[1].CodecID != "A_DTS") return intermediates;
+
+            long size = File.Exists(InputFile) ? new FileInfo(InputFile).Length : 0;
+            double duration = JobCostModel.ParseDuration(tracks[1].Duration);
+
+            intermediates[".dts"] = (long)(tracks[1].BitRate * 1000.0 / 8 * duration);
+            intermediates[".ac3"] = (long)(Ac3BitRate * 1000.0 / 8 * duration);
+            intermediates[".h264"] = Math.Max(0, size - intermediates[".dts"]);
+
+            return intermediates;
+        }
+
+        /// <summary>
+        /// Adds the size of the files (or Blu-ray folders) a stage wrote to its bytes-written metric.
+        /// </summary>
+        private static void CountWritten(String stage, params String[] paths)
+        {
+            long bytes = 0;
+
+            foreach (String path in paths)
+            {
+                try
+                {
+                    if (File.Exists(path))
+                        bytes += new FileInfo(path).Length;
+                    else if (Directory.Exists(path))
+                        foreach (String file in Directory.GetFiles(path, "*", SearchOption.AllDirectories))
+                            bytes += new FileInfo(file).Length;
+                }
+                catch (IOException)
+                {
+                }
+            }
+
+            Metrics.BytesWritten.Labels(stage).Add(bytes);
+        }
+
+        private void CheckScratchBudget()
+        {
+            String exceeded = Scratch.CheckBudget();
+            if (exceeded != null) throw new IOException("'" + InputFile + "': " + exceeded);
+        }
+
+        /// <summary>
+        /// The first video and the first audio track.
+        /// </summary>
+        private static List<Support.MediaInfo> SelectTracks(List<Support.MediaInfo> fileTrackList)
+        {
+            var video = false;
+            var audio = false;
+
+            var tracks = new List<Support.MediaInfo>();
+
+            foreach (var TrackInfo in fileTrackList)
+            {
+                if (TrackInfo.Type == Support.MediaType.Video && video == false)
+                {
+                    tracks.Add(TrackInfo);
+                    video = true;
+                }
+                else if (TrackInfo.Type == Support.MediaType.Audio && audio == false)
+                {
+                    tracks.Add(TrackInfo);
+                    audio = true;
+                }
+            }
+
+            return tracks;
+        }
+
+        /// <summary>
+        /// Probes the input, or reuses the result of an earlier probe of the same version of it. After a
+        /// failed probe only retry (the Probe stage) runs MediaInfo again; estimates fail right away.
+        /// </summary>
+        private List<Support.MediaInfo> ReadMediaFile(bool retry)
+        {
+            if (ProbeError != null && !retry)
+                throw new IOException("Probing '" + InputFile + "' failed: " + ProbeError.Message, ProbeError);
+
+            var info = new FileInfo(InputFile);
+            String key = info.FullName + "|" + info.Length + "|" + info.LastWriteTimeUtc.Ticks;
+
+            lock (ProbeCache)
+            {
+                List<Support.MediaInfo> cached;
+                if (ProbeCache.TryGetValue(key, out cached)) return cached;
+            }
+
+            List<Support.MediaInfo> fileTrackList;
+            try
+            {
+                fileTrackList = Support.ReadMediaFile(InputFile, Log);
+                ProbeError = null;
+            }
+            catch (Exception ex)
+            {
+                ProbeError = ex;
+                throw;
+            }
+
+            if (fileTrackList != null)
+            {
+                lock (ProbeCache)
+                {
+                    ProbeCache[key] = fileTrackList;
+                    ProbeKeys.Add(key);
+                }
+            }
+
+            return fileTrackList;
+        }
+
+        /// <summary>
+        /// Points the DTS track (or the transcoded track, if it was spilled to disk) at the .ac3 file, as
+        /// ConvertDTS does after running eac3to.
+        /// </summary>
+        private void UseTranscodedAudio()
+        {
+            for (int i = 0; i < TrackList.Count; i++)
+            {
+                Support.MediaInfo track = TrackList[i];
+                if (track.Type != Support.MediaType.Audio || (track.CodecID != "A_DTS" && track.Filename == null)) continue;
+
+                track.CodecID = "A_AC3";
+                track.TrackID = 0;
+                track.Filename = IntermediatePath(".ac3");
+                TrackList[i] = track;
+            }
+        }
+
+        /// <summary>
+        /// Tracks a stage whose work is proportional to the size of file (0 if it doesn't exist).
+        /// </summary>
+        private ProgressTracker StartProgress(String stage, String file)
+        {
+            long length = File.Exists(file) ? new FileInfo(file).Length : 0;
+            return new ProgressTracker(Id, Path.GetFileName(InputFile), stage, length);
+        }
+
+        #endregion
+    }
+}
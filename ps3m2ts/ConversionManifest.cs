@@ -0,0 +1,178 @@
+﻿/*
+ * ps3m2ts
+ *
+ * Copyright (R) 2009-> Henning M. Stephansen
+ * Feel free to use the code by any means, hopefully you can submit your improvements, ideas etc
+ * to henningms@gmail.com or leave a comment at my blog http://www.henning.ms
+ *
+ */
+
+using System;
+using System.Collections.Generic;
+using System.Globalization;
+using System.IO;
+using System.Security.Cryptography;
+using System.Text;
+
+namespace ps3m2ts
+{
+    /// <summary>
+    /// Make-style record of what every input produced, kept as ps3m2ts.manifest in the destination. An
+    /// input whose fingerprint (size, timestamp and optionally a sampled hash) and effective options
+    /// match its last entry, and whose outputs all still exist, is up to date and isn't converted again.
+    /// </summary>
+    class ConversionManifest
+    {
+        #region Constants
+
+        public const String FileName = "ps3m2ts.manifest";
+
+        #endregion
+
+        #region Constructor
+
+        private ConversionManifest(String Path)
+        {
+            this.Path = Path;
+            this.Records = new Dictionary<String, Record>(StringComparer.OrdinalIgnoreCase);
+
+            Load();
+        }
+
+        #endregion
+
+        #region Private Fields
+
+        private class Record
+        {
+            public String Key;
+            public String[] Outputs;
+        }
+
+        private static readonly Dictionary<String, ConversionManifest> Manifests = new Dictionary<String, ConversionManifest>(StringComparer.OrdinalIgnoreCase);
+
+        private readonly Dictionary<String, Record> Records;
+
+        #endregion
+
+        #region Public Properties
+
+        public String Path { get; private set; }
+
+        #endregion
+
+        #region Public Methods
+
+        /// <summary>
+        /// The manifest of a destination directory; jobs sharing a destination share the instance.
+        /// </summary>
+        public static ConversionManifest For(String destination)
+        {
+            String path = System.IO.Path.GetFullPath(System.IO.Path.Combine(destination, FileName));
+
+            lock (Manifests)
+            {
+                ConversionManifest manifest;
+                if (!Manifests.TryGetValue(path, out manifest))
+                {
+                    manifest = new ConversionManifest(path);
+                    Manifests.Add(path, manifest);
+                }
+
+                return manifest;
+            }
+        }
+
+        /// <summary>
+        /// Key of one version of input converted with the given options. The options that change the
+        /// output are format and split; the rest only change how fast it's produced.
+        /// </summary>
+        public static String GetKey(String input, Dictionary<string, string> options)
+        {
+            var info = new FileInfo(input);
+            var key = new StringBuilder();
+
+            key.Append(info.Length.ToString(CultureInfo.InvariantCulture)).Append(':');
+            key.Append(info.LastWriteTimeUtc.Ticks.ToString(CultureInfo.InvariantCulture));
+
+            if (options.ContainsKey("hashinputs")) key.Append(':').Append(JobJournal.SampledHash(input));
+
+            String effective = "format=" + options["outputformat"] + ";split=" + options.ContainsKey("split");
+            using (var md5 = MD5.Create())
+            {
+                byte[] hash = md5.ComputeHash(Encoding.UTF8.GetBytes(effective));
+                key.Append('/').Append(BitConverter.ToString(hash, 0, 8).Replace("-", "").ToLowerInvariant());
+            }
+
+            return key.ToString();
+        }
+
+        /// <summary>
+        /// True if input was converted with this key before and everything it produced is still there.
+        /// </summary>
+        public bool IsUpToDate(String input, String key)
+        {
+            Record record;
+
+            lock (Records)
+            {
+                if (!Records.TryGetValue(System.IO.Path.GetFullPath(input), out record)) return false;
+            }
+
+            if (record.Key != key || record.Outputs.Length == 0) return false;
+
+            foreach (String output in record.Outputs)
+            {
+                if (!File.Exists(output) && !Directory.Exists(output)) return false;
+            }
+
+            return true;
+        }
+
+        /// <summary>
+        /// Records the outputs input produced under key; the newest line for an input wins on load.
+        /// </summary>
+        public void Add(String input, String key, IList<String> outputs)
+        {
+            var record = new Record();
+            record.Key = key;
+            record.Outputs = new String[outputs.Count];
+            for (int i = 0; i < outputs.Count; i++) record.Outputs[i] = System.IO.Path.GetFullPath(outputs[i]);
+
+            String line = key + "\t" + System.IO.Path.GetFullPath(input) + "\t" + String.Join("|", record.Outputs);
+
+            lock (Records)
+            {
+                using (var stream = new FileStream(Path, FileMode.Append, FileAccess.Write, FileShare.Read, 4096, FileOptions.WriteThrough))
+                using (var writer = new StreamWriter(stream))
+                {
+                    writer.WriteLine(line);
+                }
+
+                Records[System.IO.Path.GetFullPath(input)] = record;
+            }
+        }
+
+        #endregion
+
+        #region Private Methods
+
+        private void Load()
+        {
+            if (!File.Exists(Path)) return;
+
+            foreach (String line in File.ReadAllLines(Path))
+            {
+                String[] fields = line.Split('\t');
+                if (fields.Length != 3) continue;
+
+                var record = new Record();
+                record.Key = fields[0];
+                record.Outputs = fields[2].Split(new[] { '|' }, StringSplitOptions.RemoveEmptyEntries);
+                Records[fields[1]] = record;
+            }
+        }
+
+        #endregion
+    }
+}
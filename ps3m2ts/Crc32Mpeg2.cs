@@ -0,0 +1,46 @@
+﻿/*
+ * ps3m2ts
+ *
+ * Copyright (R) 2009-> Henning M. Stephansen
+ * Feel free to use the code by any means, hopefully you can submit your improvements, ideas etc
+ * to henningms@gmail.com or leave a comment at my blog http://www.henning.ms
+ *
+ */
+
+namespace ps3m2ts
+{
+    /// <summary>
+    /// CRC-32/MPEG-2 (polynomial 0x04C11DB7, no reflection, no final xor) used by PSI sections.
+    /// </summary>
+    class Crc32Mpeg2
+    {
+        private static readonly uint[] Table = CreateTable();
+
+        public static uint Compute(byte[] data, int offset, int count)
+        {
+            uint crc = 0xFFFFFFFF;
+            int end = offset + count;
+
+            for (int i = offset; i < end; i++)
+                crc = (crc << 8) ^ Table[((crc >> 24) ^ data[i]) & 0xFF];
+
+            return crc;
+        }
+
+        private static uint[] CreateTable()
+        {
+            var table = new uint[256];
+
+            for (uint i = 0; i < 256; i++)
+            {
+                uint crc = i << 24;
+                for (int bit = 0; bit < 8; bit++)
+                    crc = ((crc & 0x80000000) != 0) ? (crc << 1) ^ 0x04C11DB7 : crc << 1;
+
+                table[i] = crc;
+            }
+
+            return table;
+        }
+    }
+}
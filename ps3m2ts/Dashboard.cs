@@ -0,0 +1,346 @@
+﻿/*
+ * ps3m2ts
+ *
+ * Copyright (R) 2009-> Henning M. Stephansen
+ * Feel free to use the code by any means, hopefully you can submit your improvements, ideas etc
+ * to henningms@gmail.com or leave a comment at my blog http://www.henning.ms
+ *
+ */
+
+using System;
+using System.Collections.Generic;
+using System.Globalization;
+using System.IO;
+using System.Runtime.InteropServices;
+using System.Threading;
+
+namespace ps3m2ts
+{
+    /// <summary>
+    /// Full-screen view of a batch (/tui): one row per active job with its stage, percentage, MB/s and
+    /// ETA, the aggregate throughput, the queue and the scratch space in use, and the last few log lines
+    /// below. Workers only store their latest progress event; a background thread redraws at a fixed
+    /// rate, and the log's console output goes to the view instead of scrolling through it.
+    /// </summary>
+    class Dashboard
+    {
+        #region Constants
+
+        /// <summary>Time between two redraws, in milliseconds.</summary>
+        private const int RedrawInterval = 500;
+
+        /// <summary>A job whose stage completed stays on screen this long unless its next stage starts.</summary>
+        private static readonly TimeSpan Linger = TimeSpan.FromSeconds(5);
+
+        /// <summary>The scratch directory is measured at most this often; it means listing every file.</summary>
+        private static readonly TimeSpan ScratchInterval = TimeSpan.FromSeconds(5);
+
+        /// <summary>Log lines kept below the jobs.</summary>
+        private const int LogLines = 5;
+
+        #endregion
+
+        #region Constructor
+
+        public Dashboard(JobScheduler Scheduler, String ScratchRoot, Logger Log)
+        {
+            this.Scheduler = Scheduler;
+            this.ScratchRoot = ScratchRoot;
+            this.Log = Log;
+
+            Rows = new Dictionary<int, Row>();
+            Recent = new Queue<String>();
+        }
+
+        #endregion
+
+        #region Private Fields
+
+        private class Row
+        {
+            public ProgressEvent Progress;
+            public DateTime Updated;
+        }
+
+        private readonly JobScheduler Scheduler;
+        private readonly String ScratchRoot;
+        private readonly Logger Log;
+
+        /// <summary>Latest event by job id; the only thing workers touch.</summary>
+        private readonly Dictionary<int, Row> Rows;
+        private readonly Queue<String> Recent;
+
+        private Thread Drawer;
+        private volatile bool Stopping;
+        private DateTime Started;
+        private long CompletedBytes;
+        private int PreviousLines;
+        private long ScratchBytes;
+        private DateTime ScratchMeasured;
+
+        #endregion
+
+        #region Public Methods
+
+        /// <summary>
+        /// Takes over the console. Returns false, leaving the console alone, when it isn't a terminal.
+        /// </summary>
+        public bool Start()
+        {
+            if (!OutputIsTerminal()) return false;
+
+            try
+            {
+                if (Console.WindowWidth <= 0 || Console.WindowHeight <= 0) return false;
+                Console.Clear();
+                Console.CursorVisible = false;
+            }
+            catch (IOException)
+            {
+                return false;
+            }
+
+            Started = DateTime.UtcNow;
+            ProgressTracker.Changed += Update;
+            Log.ConsoleRedirect = AddLogLine;
+
+            Drawer = new Thread(delegate()
+                {
+                    while (!Stopping)
+                    {
+                        Draw();
+                        Thread.Sleep(RedrawInterval);
+                    }
+                });
+            Drawer.Name = "dashboard";
+            Drawer.IsBackground = true;
+            Drawer.Start();
+
+            return true;
+        }
+
+        /// <summary>
+        /// Draws the final state once more and gives the console back to the log, below the view.
+        /// </summary>
+        public void Stop()
+        {
+            if (Drawer == null) return;
+
+            ProgressTracker.Changed -= Update;
+            Stopping = true;
+            Drawer.Join();
+            Drawer = null;
+
+            Log.Flush();
+            Log.ConsoleRedirect = null;
+            Draw();
+
+            try
+            {
+                Console.SetCursorPosition(0, Math.Min(PreviousLines, Console.BufferHeight - 1));
+                Console.CursorVisible = true;
+            }
+            catch (IOException)
+            {
+            }
+        }
+
+        #endregion
+
+        #region Private Methods
+
+        /// <summary>
+        /// Called on the worker threads; only swaps the job's row.
+        /// </summary>
+        private void Update(ProgressEvent e)
+        {
+            var row = new Row();
+            row.Progress = e;
+            row.Updated = DateTime.UtcNow;
+
+            lock (Rows)
+            {
+                Rows[e.JobId] = row;
+                if (e.Completed) CompletedBytes += e.Bytes;
+            }
+        }
+
+        /// <summary>
+        /// Called on the log's writer thread instead of writing to the console.
+        /// </summary>
+        private void AddLogLine(String text)
+        {
+            lock (Recent)
+            {
+                foreach (String line in text.Split(new[] { '\r', '\n' }, StringSplitOptions.RemoveEmptyEntries))
+                    Recent.Enqueue(line.Replace('\t', ' '));
+
+                while (Recent.Count > LogLines) Recent.Dequeue();
+            }
+        }
+
+        private void Draw()
+        {
+            var lines = new List<String>();
+            DateTime now = DateTime.UtcNow;
+            var active = new List<ProgressEvent>();
+            long done;
+
+            lock (Rows)
+            {
+                var finished = new List<int>();
+                foreach (KeyValuePair<int, Row> pair in Rows)
+                {
+                    if (pair.Value.Progress.Completed && now - pair.Value.Updated > Linger) finished.Add(pair.Key);
+                    else active.Add(pair.Value.Progress);
+                }
+
+                foreach (int job in finished) Rows.Remove(job);
+                done = CompletedBytes;
+            }
+
+            // in the order the jobs started; two inputs can have the same file name
+            active.Sort((a, b) => a.JobId.CompareTo(b.JobId));
+
+            double current = 0;
+            long running = 0;
+            foreach (ProgressEvent e in active)
+            {
+                if (e.Completed) continue;
+                current += e.MBps;
+                running += e.Bytes;
+            }
+
+            double elapsed = Math.Max(0.001, (now - Started).TotalSeconds);
+            int width;
+            int height;
+            try
+            {
+                width = Math.Max(40, Console.WindowWidth - 1);
+                height = Math.Max(10, Console.WindowHeight - 1);
+            }
+            catch (IOException)
+            {
+                return;
+            }
+
+            lines.Add(String.Format(CultureInfo.InvariantCulture, "ps3m2ts  {0:00}:{1:00}:{2:00}  {3:0.0} MB/s now, {4:0.0} MB/s average, {5:0.0} MB done",
+                                    (int)(now - Started).TotalHours, (now - Started).Minutes, (now - Started).Seconds,
+                                    current, (done + running) / 1048576.0 / elapsed, (done + running) / 1048576.0));
+            lines.Add(String.Format(CultureInfo.InvariantCulture, "queued {0}  cpu {1}/{2}  io {3}/{4}  space reserved {5:0} MB{6}",
+                                    Metrics.Read("ps3m2ts_queue_depth"), Scheduler.CpuGate.Active, Scheduler.CpuGate.Limit,
+                                    Scheduler.IOGate.Active, Scheduler.IOGate.Limit, Scheduler.Space.ReservedBytes / 1048576.0,
+                                    (ScratchRoot != null) ? String.Format(CultureInfo.InvariantCulture, "  scratch {0:0} MB", MeasureScratch(now) / 1048576.0) : ""));
+            lines.Add("");
+
+            int nameWidth = Math.Max(10, width - 50);
+            lines.Add(String.Format(CultureInfo.InvariantCulture, "{0} {1,-10} {2,7} {3,9} {4,9} {5,9}", Fit("file", nameWidth), "stage", "done", "MB", "MB/s", "ETA"));
+
+            int rows = Math.Max(1, height - lines.Count - LogLines - 2);
+            for (int i = 0; i < active.Count && i < rows; i++)
+            {
+                ProgressEvent e = active[i];
+                String eta = e.Completed ? "done" : e.Eta.HasValue ? String.Format(CultureInfo.InvariantCulture, "{0:00}:{1:00}:{2:00}",
+                                                                                     (int)e.Eta.Value.TotalHours, e.Eta.Value.Minutes, e.Eta.Value.Seconds) : "-";
+
+                lines.Add(String.Format(CultureInfo.InvariantCulture, "{0} {1,-10} {2,7} {3,9:0.0} {4,9:0.0} {5,9}",
+                                        Fit(e.Job, nameWidth), e.Stage, (e.Percent >= 0) ? e.Percent.ToString("0.0", CultureInfo.InvariantCulture) + "%" : "-",
+                                        e.Bytes / 1048576.0, e.MBps, eta));
+            }
+
+            if (active.Count > rows) lines.Add("... and " + (active.Count - rows) + " more");
+
+            lines.Add("");
+            lock (Recent) foreach (String text in Recent) lines.Add(text);
+
+            try
+            {
+                // overwrite in place; lines left over from a longer previous frame are blanked
+                Console.SetCursorPosition(0, 0);
+                for (int i = 0; i < Math.Max(lines.Count, PreviousLines); i++)
+                {
+                    String text = (i < lines.Count) ? lines[i] : "";
+                    Console.WriteLine(Fit(text, width));
+                }
+
+                PreviousLines = lines.Count;
+            }
+            catch (IOException)
+            {
+            }
+        }
+
+        private long MeasureScratch(DateTime now)
+        {
+            if (now - ScratchMeasured < ScratchInterval) return ScratchBytes;
+            ScratchMeasured = now;
+
+            long used = 0;
+            try
+            {
+                if (Directory.Exists(ScratchRoot))
+                    foreach (String file in Directory.GetFiles(ScratchRoot, "*", SearchOption.AllDirectories))
+                        used += new FileInfo(file).Length;
+            }
+            catch (IOException)
+            {
+                // a job removed its directory while listing; keep the last figure
+                return ScratchBytes;
+            }
+            catch (UnauthorizedAccessException)
+            {
+                return ScratchBytes;
+            }
+
+            ScratchBytes = used;
+            return used;
+        }
+
+        /// <summary>
+        /// False when standard output goes to a file or pipe, where redrawing would only fill it with
+        /// escape sequences.
+        /// </summary>
+        private static bool OutputIsTerminal()
+        {
+            try
+            {
+                if (Environment.OSVersion.Platform == PlatformID.Win32NT)
+                    return GetFileType(GetStdHandle(StandardOutputHandle)) == FileTypeChar;
+
+                return isatty(1) == 1;
+            }
+            catch (DllNotFoundException)
+            {
+            }
+            catch (EntryPointNotFoundException)
+            {
+            }
+
+            // can't tell; the console calls in Start fail where there is no console at all
+            return true;
+        }
+
+        private const int StandardOutputHandle = -11;
+        private const int FileTypeChar = 2;
+
+        [DllImport("kernel32.dll")]
+        private static extern IntPtr GetStdHandle(int handle);
+
+        [DllImport("kernel32.dll")]
+        private static extern int GetFileType(IntPtr handle);
+
+        [DllImport("libc")]
+        private static extern int isatty(int descriptor);
+
+        /// <summary>
+        /// text cut or padded to exactly width characters.
+        /// </summary>
+        private static String Fit(String text, int width)
+        {
+            if (text.Length > width) return text.Substring(0, Math.Max(0, width - 3)) + "...";
+            return text.PadRight(width);
+        }
+
+        #endregion
+    }
+}
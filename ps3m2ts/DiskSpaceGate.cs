@@ -0,0 +1,342 @@
+﻿/*
+ * ps3m2ts
+ *
+ * Copyright (R) 2009-> Henning M. Stephansen
+ * Feel free to use the code by any means, hopefully you can submit your improvements, ideas etc
+ * to henningms@gmail.com or leave a comment at my blog http://www.henning.ms
+ *
+ */
+
+using System;
+using System.Collections.Generic;
+using System.Globalization;
+using System.IO;
+using System.Threading;
+
+namespace ps3m2ts
+{
+    /// <summary>
+    /// Reserves disk space for jobs before they write anything. A job states how many bytes its
+    /// intermediates and output will take on which volumes, and waits until every one of them has that
+    /// much free space left over after the reservations of the jobs already running. A running job's
+    /// files already show in the free space, so only the part of its reservation it hasn't written yet
+    /// is counted against the others; the reservation is held until the job is cleaned up.
+    /// </summary>
+    class DiskSpaceGate
+    {
+        #region Constants
+
+        /// <summary>Space left free on every volume for everything else.</summary>
+        private const long Headroom = 256L * 1048576;
+
+        /// <summary>How often a waiting job looks at the free space again when nothing is released.</summary>
+        private static readonly TimeSpan PollInterval = TimeSpan.FromSeconds(30);
+
+        #endregion
+
+        #region Constructor
+
+        public DiskSpaceGate()
+        {
+            Reservations = new List<Reservation>();
+        }
+
+        #endregion
+
+        #region Private Fields
+
+        private static readonly StringComparer PathComparer =
+            (Path.DirectorySeparatorChar == '\\') ? StringComparer.OrdinalIgnoreCase : StringComparer.Ordinal;
+
+        private readonly object Sync = new object();
+        private readonly List<Reservation> Reservations;
+        private int WaitingCount;
+
+        #endregion
+
+        #region Public Properties
+
+        /// <summary>Bytes running jobs were estimated to need, all volumes together, written or not.</summary>
+        public long ReservedBytes
+        {
+            get
+            {
+                long total = 0;
+                lock (Sync)
+                {
+                    foreach (Reservation reservation in Reservations)
+                        foreach (long bytes in reservation.Needed.Values) total += bytes;
+                }
+                return total;
+            }
+        }
+
+        /// <summary>Jobs waiting for space right now.</summary>
+        public int Waiting
+        {
+            get
+            {
+                lock (Sync)
+                {
+                    return WaitingCount;
+                }
+            }
+        }
+
+        #endregion
+
+        #region Public Methods
+
+        /// <summary>
+        /// Waits until bytes (by the directory they are written to) fit on their volumes and holds them
+        /// until the returned object is disposed. written tells, in the same form, how much of that the
+        /// job has written so far. A job that doesn't fit waits for others to finish; one that doesn't
+        /// fit with no other job running fails, as nothing would ever free space for it.
+        /// </summary>
+        public IDisposable Reserve(IDictionary<String, long> bytes, Func<IDictionary<String, long>> written, String what, Logger Log)
+        {
+            Dictionary<String, long> needed = ByVolume(bytes);
+            bool logged = false;
+
+            lock (Sync)
+            {
+                String volume;
+                while ((volume = FindShortVolume(needed)) != null)
+                {
+                    if (Reservations.Count == 0)
+                        throw new IOException(String.Format(CultureInfo.InvariantCulture,
+                                                            "'{0}' needs {1:0} MB on '{2}' plus {3:0} MB kept free, but only {4:0} MB is free with no other file converting.",
+                                                            what, needed[volume] / 1048576.0, volume, Headroom / 1048576.0, FreeBytes(volume) / 1048576.0));
+
+                    if (!logged)
+                    {
+                        Log.Log(String.Format(CultureInfo.InvariantCulture,
+                                              "Waiting for {0:0} MB on '{1}' before converting '{2}' ({3:0} MB free, {4:0} MB reserved by running jobs).",
+                                              needed[volume] / 1048576.0, volume, what, FreeBytes(volume) / 1048576.0, Outstanding(volume) / 1048576.0));
+                        logged = true;
+                    }
+
+                    WaitingCount++;
+                    Monitor.Wait(Sync, PollInterval);
+                    WaitingCount--;
+                }
+
+                var reservation = new Reservation(this, needed, written);
+                Reservations.Add(reservation);
+                return reservation;
+            }
+        }
+
+        /// <summary>
+        /// The preflight check of a batch: what the jobs need on each volume against what is free. Jobs
+        /// that together don't fit are run as space allows; a single job that can't fit at all is an error
+        /// worth knowing about before hours of converting. A file that can't be probed is left out; its
+        /// job reports the error when it gets to it.
+        /// </summary>
+        public static void Plan(IList<ConversionJob> jobs, Logger Log)
+        {
+            var total = new Dictionary<String, long>(PathComparer);
+            var largest = new Dictionary<String, long>(PathComparer);
+
+            foreach (ConversionJob job in jobs)
+            {
+                Dictionary<String, long> space;
+                try
+                {
+                    space = job.EstimateSpace();
+                }
+                catch (Exception ex)
+                {
+                    Log.Log("Warning: No space estimate for '" + job.InputFile + "': " + ex.Message);
+                    continue;
+                }
+
+                foreach (KeyValuePair<String, long> volumeBytes in ByVolume(space))
+                {
+                    long sum, max;
+                    total.TryGetValue(volumeBytes.Key, out sum);
+                    largest.TryGetValue(volumeBytes.Key, out max);
+
+                    total[volumeBytes.Key] = sum + volumeBytes.Value;
+                    largest[volumeBytes.Key] = Math.Max(max, volumeBytes.Value);
+                }
+            }
+
+            foreach (KeyValuePair<String, long> volumeBytes in total)
+            {
+                long free = FreeBytes(volumeBytes.Key);
+                if (free < 0) continue;
+
+                Log.Log(String.Format(CultureInfo.InvariantCulture,
+                                      "Space: '{0}' needs about {1:0} MB for all files, {2:0} MB for the largest; {3:0} MB free.",
+                                      volumeBytes.Key, volumeBytes.Value / 1048576.0, largest[volumeBytes.Key] / 1048576.0, free / 1048576.0));
+
+                if (largest[volumeBytes.Key] + Headroom > free)
+                    Log.Log("Warning: the largest file doesn't fit on '" + volumeBytes.Key + "'; it will fail unless space is freed.");
+            }
+        }
+
+        /// <summary>
+        /// Root of the mounted volume path is on: the drive on Windows, the deepest mount point elsewhere.
+        /// </summary>
+        public static String VolumeOf(String path)
+        {
+            String fullPath = Path.GetFullPath(path);
+            String volume = Path.GetPathRoot(fullPath);
+
+            try
+            {
+                foreach (DriveInfo drive in DriveInfo.GetDrives())
+                {
+                    String root = drive.RootDirectory.FullName;
+                    if (root.Length <= volume.Length || !IsUnder(fullPath, root)) continue;
+
+                    volume = root;
+                }
+            }
+            catch (IOException)
+            {
+            }
+            catch (UnauthorizedAccessException)
+            {
+            }
+
+            return volume;
+        }
+
+        /// <summary>
+        /// Bytes available to this user on volume, or -1 if that can't be found out.
+        /// </summary>
+        public static long FreeBytes(String volume)
+        {
+            try
+            {
+                return new DriveInfo(volume).AvailableFreeSpace;
+            }
+            catch (Exception)
+            {
+                return -1;
+            }
+        }
+
+        #endregion
+
+        #region Private Methods
+
+        private static bool IsUnder(String path, String root)
+        {
+            if (!path.StartsWith(root, (PathComparer == StringComparer.Ordinal) ? StringComparison.Ordinal : StringComparison.OrdinalIgnoreCase))
+                return false;
+
+            return path.Length == root.Length || root.EndsWith(Path.DirectorySeparatorChar.ToString()) ||
+                   path[root.Length] == Path.DirectorySeparatorChar;
+        }
+
+        private static Dictionary<String, long> ByVolume(IDictionary<String, long> bytes)
+        {
+            var volumes = new Dictionary<String, long>(PathComparer);
+
+            foreach (KeyValuePair<String, long> directoryBytes in bytes)
+            {
+                if (directoryBytes.Value <= 0) continue;
+
+                String volume = VolumeOf(directoryBytes.Key);
+                long sum;
+                volumes.TryGetValue(volume, out sum);
+                volumes[volume] = sum + directoryBytes.Value;
+            }
+
+            return volumes;
+        }
+
+        /// <summary>
+        /// The first volume needed doesn't fit on, or null if all fit. Called under Sync.
+        /// </summary>
+        private String FindShortVolume(Dictionary<String, long> needed)
+        {
+            foreach (KeyValuePair<String, long> volumeBytes in needed)
+            {
+                long free = FreeBytes(volumeBytes.Key);
+                if (free < 0) continue;
+
+                if (free - Outstanding(volumeBytes.Key) - Headroom < volumeBytes.Value) return volumeBytes.Key;
+            }
+
+            return null;
+        }
+
+        /// <summary>
+        /// What running jobs still have to write to volume: each reservation less what its job has
+        /// written there already, which the free space already shows. Called under Sync.
+        /// </summary>
+        private long Outstanding(String volume)
+        {
+            long total = 0;
+
+            foreach (Reservation reservation in Reservations)
+            {
+                long needed;
+                if (!reservation.Needed.TryGetValue(volume, out needed)) continue;
+
+                long written;
+                reservation.Written().TryGetValue(volume, out written);
+                total += Math.Max(0, needed - written);
+            }
+
+            return total;
+        }
+
+        private void Release(Reservation reservation)
+        {
+            lock (Sync)
+            {
+                Reservations.Remove(reservation);
+                Monitor.PulseAll(Sync);
+            }
+        }
+
+        private class Reservation : IDisposable
+        {
+            private DiskSpaceGate Gate;
+            public readonly Dictionary<String, long> Needed;
+            private readonly Func<IDictionary<String, long>> WrittenBytes;
+
+            public Reservation(DiskSpaceGate Gate, Dictionary<String, long> Needed, Func<IDictionary<String, long>> WrittenBytes)
+            {
+                this.Gate = Gate;
+                this.Needed = Needed;
+                this.WrittenBytes = WrittenBytes;
+            }
+
+            /// <summary>
+            /// Bytes written so far by volume; nothing when that can't be told, which keeps the whole
+            /// reservation in force.
+            /// </summary>
+            public Dictionary<String, long> Written()
+            {
+                if (WrittenBytes == null) return new Dictionary<String, long>(PathComparer);
+
+                try
+                {
+                    return ByVolume(WrittenBytes());
+                }
+                catch (IOException)
+                {
+                }
+                catch (UnauthorizedAccessException)
+                {
+                }
+
+                return new Dictionary<String, long>(PathComparer);
+            }
+
+            public void Dispose()
+            {
+                if (Gate != null) Gate.Release(this);
+                Gate = null;
+            }
+        }
+
+        #endregion
+    }
+}
@@ -0,0 +1,163 @@
+﻿/*
+ * ps3m2ts
+ *
+ * Copyright (R) 2009-> Henning M. Stephansen
+ * Feel free to use the code by any means, hopefully you can submit your improvements, ideas etc
+ * to henningms@gmail.com or leave a comment at my blog http://www.henning.ms
+ *
+ */
+
+using System;
+using System.IO;
+
+namespace ps3m2ts
+{
+    /// <summary>
+    /// H.264 helpers for turning Matroska (AVCC, length prefixed) frames into an Annex B elementary stream.
+    /// </summary>
+    class H264
+    {
+        public const int NalSPS = 7;
+        public const int NalPPS = 8;
+        public const int NalAUD = 9;
+
+        private static readonly byte[] StartCode = { 0, 0, 0, 1 };
+        private static readonly byte[] AccessUnitDelimiter = { 0, 0, 0, 1, NalAUD, 0xF0 };
+
+        public class DecoderConfig
+        {
+            public int Profile;
+            public int Level;
+            public int NalLengthSize;
+
+            /// <summary>SPS and PPS NAL units in Annex B form, sent in front of every keyframe.</summary>
+            public byte[] ParameterSets;
+        }
+
+        /// <summary>
+        /// Parses an AVCDecoderConfigurationRecord (the Matroska CodecPrivate of V_MPEG4/ISO/AVC).
+        /// </summary>
+        public static DecoderConfig ParseAvcC(byte[] avcC)
+        {
+            if (avcC == null || avcC.Length < 7 || avcC[0] != 1)
+                throw new InvalidDataException("Invalid AVC decoder configuration record.");
+
+            var config = new DecoderConfig();
+            config.Profile = avcC[1];
+            config.Level = avcC[3];
+            config.NalLengthSize = (avcC[4] & 0x03) + 1;
+
+            if (config.NalLengthSize == 3)
+                throw new InvalidDataException("Invalid NAL length size.");
+
+            var parameterSets = new MemoryStream();
+            int position = 5;
+
+            // SPS count lives in the low 5 bits, PPS count is a full byte
+            for (int pass = 0; pass < 2; pass++)
+            {
+                int count = (pass == 0) ? (avcC[position] & 0x1F) : avcC[position];
+                position++;
+
+                for (int i = 0; i < count; i++)
+                {
+                    int length = (avcC[position] << 8) | avcC[position + 1];
+                    position += 2;
+
+                    if (position + length > avcC.Length)
+                        throw new InvalidDataException("Truncated AVC decoder configuration record.");
+
+                    parameterSets.Write(StartCode, 0, StartCode.Length);
+                    parameterSets.Write(avcC, position, length);
+                    position += length;
+                }
+            }
+
+            config.ParameterSets = parameterSets.ToArray();
+            return config;
+        }
+
+        /// <summary>
+        /// Upper bound of the Annex B size of a count byte AVCC access unit.
+        /// </summary>
+        public static int MaxAnnexBLength(DecoderConfig config, int count)
+        {
+            // with 4 byte lengths every NAL keeps its size; shorter lengths grow by at most 3 bytes per NAL
+            int growth = (config.NalLengthSize == 4) ? count : count * 4;
+            return growth + AccessUnitDelimiter.Length + config.ParameterSets.Length;
+        }
+
+        /// <summary>
+        /// Rewrites one length prefixed access unit into Annex B form. An access unit delimiter is inserted
+        /// when missing, and keyframes get the parameter sets unless they already carry an SPS.
+        /// output must hold MaxAnnexBLength bytes. Returns the number of bytes written.
+        /// </summary>
+        public static int AvccToAnnexB(DecoderConfig config, byte[] data, int offset, int count, bool keyframe, byte[] output)
+        {
+            int end = offset + count;
+            int lengthSize = config.NalLengthSize;
+
+            int written = 0;
+            bool first = true;
+            bool hasSPS = false;
+
+            for (int position = offset; position + lengthSize <= end; )
+            {
+                int length = 0;
+                for (int i = 0; i < lengthSize; i++) length = (length << 8) | data[position + i];
+                position += lengthSize;
+
+                if (length <= 0 || position + length > end)
+                    throw new InvalidDataException("Corrupt NAL length in H.264 frame.");
+
+                int nalType = data[position] & 0x1F;
+
+                if (first)
+                {
+                    first = false;
+
+                    if (nalType != NalAUD)
+                    {
+                        Buffer.BlockCopy(AccessUnitDelimiter, 0, output, written, AccessUnitDelimiter.Length);
+                        written += AccessUnitDelimiter.Length;
+                    }
+
+                    hasSPS = keyframe && ContainsNal(data, position - lengthSize, end, lengthSize, NalSPS);
+                }
+
+                if (keyframe && !hasSPS && nalType != NalAUD)
+                {
+                    Buffer.BlockCopy(config.ParameterSets, 0, output, written, config.ParameterSets.Length);
+                    written += config.ParameterSets.Length;
+                    hasSPS = true;
+                }
+
+                Buffer.BlockCopy(StartCode, 0, output, written, StartCode.Length);
+                written += StartCode.Length;
+                Buffer.BlockCopy(data, position, output, written, length);
+                written += length;
+
+                position += length;
+            }
+
+            return written;
+        }
+
+        private static bool ContainsNal(byte[] data, int position, int end, int lengthSize, int type)
+        {
+            while (position + lengthSize < end)
+            {
+                int length = 0;
+                for (int i = 0; i < lengthSize; i++) length = (length << 8) | data[position + i];
+                position += lengthSize;
+
+                if (length <= 0 || position + length > end) return false;
+                if ((data[position] & 0x1F) == type) return true;
+
+                position += length;
+            }
+
+            return false;
+        }
+    }
+}
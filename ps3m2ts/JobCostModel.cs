@@ -0,0 +1,271 @@
+﻿/*
+ * ps3m2ts
+ *
+ * Copyright (R) 2009-> Henning M. Stephansen
+ * Feel free to use the code by any means, hopefully you can submit your improvements, ideas etc
+ * to henningms@gmail.com or leave a comment at my blog http://www.henning.ms
+ *
+ */
+
+using System;
+using System.Collections.Generic;
+using System.Globalization;
+using System.IO;
+using System.Text.RegularExpressions;
+
+namespace ps3m2ts
+{
+    /// <summary>
+    /// Estimates how long a job takes from its size and probed tracks, using the throughput each stage
+    /// reached in earlier runs (ps3m2ts.stats in the working directory, next to the helper tools). Every
+    /// completed stage feeds a moving average back into the model.
+    /// </summary>
+    class JobCostModel
+    {
+        #region Constants
+
+        public const String FileName = "ps3m2ts.stats";
+
+        /// <summary>Weight of the newest sample in the moving average.</summary>
+        private const double Smoothing = 0.3;
+
+        #endregion
+
+        #region Constructor
+
+        public JobCostModel(String Path)
+        {
+            this.Path = Path;
+
+            // MB/s until a run has measured better numbers
+            Rates = new Dictionary<String, double>();
+            Rates["extract"] = 60;
+            Rates["transcode"] = 10;
+            Rates["remux"] = 80;
+            Rates["mux"] = 40;
+
+            Load();
+        }
+
+        #endregion
+
+        #region Private Fields
+
+        private static readonly Regex DurationPart = new Regex(@"(\d+)\s*(h|mn|min|ms|s)\b");
+
+        private readonly Dictionary<String, double> Rates;
+
+        #endregion
+
+        #region Public Properties
+
+        public String Path { get; private set; }
+
+        #endregion
+
+        #region Public Methods
+
+        /// <summary>
+        /// Throughput of stage in MB/s.
+        /// </summary>
+        public double Rate(String stage)
+        {
+            lock (Rates)
+            {
+                double rate;
+                return Rates.TryGetValue(stage, out rate) ? rate : 40;
+            }
+        }
+
+        /// <summary>
+        /// Seconds stage needs for bytes.
+        /// </summary>
+        public double Seconds(String stage, long bytes)
+        {
+            return bytes / 1048576.0 / Math.Max(Rate(stage), 0.01);
+        }
+
+        /// <summary>
+        /// Folds a completed stage into the moving average. Stages too short to time are ignored.
+        /// </summary>
+        public void Learn(String stage, long bytes, TimeSpan elapsed)
+        {
+            if (bytes <= 0 || elapsed.TotalSeconds < 1) return;
+
+            double rate = bytes / 1048576.0 / elapsed.TotalSeconds;
+
+            lock (Rates)
+            {
+                double old;
+                Rates[stage] = Rates.TryGetValue(stage, out old) ? old + Smoothing * (rate - old) : rate;
+            }
+        }
+
+        public void Save()
+        {
+            try
+            {
+                using (var writer = new StreamWriter(Path))
+                {
+                    lock (Rates)
+                    {
+                        foreach (KeyValuePair<String, double> rate in Rates)
+                            writer.WriteLine(rate.Key + "\t" + rate.Value.ToString("0.###", CultureInfo.InvariantCulture));
+                    }
+                }
+            }
+            catch
+            {
+                // the statistics are a hint; losing them only costs accuracy
+            }
+        }
+
+        /// <summary>
+        /// Parses a MediaInfo duration ("6731234" ms, "1h 52mn", "1h 52mn 11s 234ms" or "01:52:11.234")
+        /// into seconds. Returns 0 if it can't.
+        /// </summary>
+        public static double ParseDuration(String duration)
+        {
+            if (String.IsNullOrEmpty(duration)) return 0;
+            duration = duration.Trim();
+
+            double value;
+            if (Double.TryParse(duration, NumberStyles.Float, CultureInfo.InvariantCulture, out value)) return value / 1000;
+
+            TimeSpan clock;
+            if (duration.Contains(":") && TimeSpan.TryParse(duration, out clock)) return clock.TotalSeconds;
+
+            double seconds = 0;
+            foreach (Match part in DurationPart.Matches(duration))
+            {
+                double amount = Double.Parse(part.Groups[1].Value, CultureInfo.InvariantCulture);
+
+                switch (part.Groups[2].Value)
+                {
+                    case "h": seconds += amount * 3600; break;
+                    case "mn":
+                    case "min": seconds += amount * 60; break;
+                    case "s": seconds += amount; break;
+                    case "ms": seconds += amount / 1000; break;
+                }
+            }
+
+            return seconds;
+        }
+
+        /// <summary>
+        /// Orders jobs by estimated cost: "sjf" puts the shortest first (lowest mean completion time),
+        /// "lpt" the longest first (shortest makespan on several workers). Sets each job's EstimatedFinish
+        /// and returns the estimated makespan.
+        /// </summary>
+        public TimeSpan Order(List<ConversionJob> jobs, String policy, int workers)
+        {
+            var costs = new Dictionary<ConversionJob, double>();
+            var inputOrder = new Dictionary<ConversionJob, int>();
+
+            for (int i = 0; i < jobs.Count; i++)
+            {
+                costs[jobs[i]] = jobs[i].EstimateCost(this);
+                inputOrder[jobs[i]] = i;
+            }
+
+            // List.Sort isn't stable; ties keep their input order
+            int sign = (policy == "lpt") ? -1 : 1;
+            jobs.Sort(delegate(ConversionJob a, ConversionJob b)
+                {
+                    int result = sign * costs[a].CompareTo(costs[b]);
+                    return (result != 0) ? result : inputOrder[a].CompareTo(inputOrder[b]);
+                });
+
+            var costList = new List<double>();
+            foreach (ConversionJob job in jobs) costList.Add(costs[job]);
+
+            List<TimeSpan> finish = PredictFinish(costList, workers);
+            TimeSpan makespan = TimeSpan.Zero;
+
+            for (int i = 0; i < jobs.Count; i++)
+            {
+                jobs[i].EstimatedFinish = finish[i];
+                if (finish[i] > makespan) makespan = finish[i];
+            }
+
+            return makespan;
+        }
+
+        /// <summary>
+        /// Logs the estimated against the actual finish time of every job that has both.
+        /// </summary>
+        public static void Report(List<ConversionJob> jobs, DateTime startedUtc, TimeSpan estimatedMakespan, Logger log)
+        {
+            TimeSpan makespan = TimeSpan.Zero;
+
+            foreach (ConversionJob job in jobs)
+            {
+                if (!job.EstimatedFinish.HasValue || !job.FinishedUtc.HasValue) continue;
+
+                TimeSpan actual = job.FinishedUtc.Value - startedUtc;
+                if (actual > makespan) makespan = actual;
+
+                log.Log("Schedule: '" + System.IO.Path.GetFileName(job.InputFile) + "' estimated to finish at " +
+                        Format(job.EstimatedFinish.Value) + ", finished at " + Format(actual) + ".");
+            }
+
+            log.Log("Schedule: estimated makespan " + Format(estimatedMakespan) + ", actual " + Format(makespan) + ".");
+        }
+
+        /// <summary>
+        /// Where each job finishes (from the start of the batch) if jobs are started in list order on
+        /// the given number of workers, each taking the next job as soon as it is free.
+        /// </summary>
+        public static List<TimeSpan> PredictFinish(IList<double> costs, int workers)
+        {
+            var free = new double[Math.Max(1, workers)];
+            var finish = new List<TimeSpan>();
+
+            foreach (double cost in costs)
+            {
+                int earliest = 0;
+                for (int i = 1; i < free.Length; i++)
+                {
+                    if (free[i] < free[earliest]) earliest = i;
+                }
+
+                free[earliest] += cost;
+                finish.Add(TimeSpan.FromSeconds(free[earliest]));
+            }
+
+            return finish;
+        }
+
+        #endregion
+
+        #region Private Methods
+
+        private static String Format(TimeSpan time)
+        {
+            return String.Format(CultureInfo.InvariantCulture, "{0:00}:{1:00}:{2:00}", (int)time.TotalHours, time.Minutes, time.Seconds);
+        }
+
+        private void Load()
+        {
+            if (!File.Exists(Path)) return;
+
+            try
+            {
+                foreach (String line in File.ReadAllLines(Path))
+                {
+                    String[] fields = line.Split('\t');
+
+                    double rate;
+                    if (fields.Length == 2 && Double.TryParse(fields[1], NumberStyles.Float, CultureInfo.InvariantCulture, out rate) && rate > 0)
+                        Rates[fields[0]] = rate;
+                }
+            }
+            catch
+            {
+            }
+        }
+
+        #endregion
+    }
+}
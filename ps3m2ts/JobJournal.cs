@@ -0,0 +1,252 @@
+﻿/*
+ * ps3m2ts
+ *
+ * Copyright (R) 2009-> Henning M. Stephansen
+ * Feel free to use the code by any means, hopefully you can submit your improvements, ideas etc
+ * to henningms@gmail.com or leave a comment at my blog http://www.henning.ms
+ *
+ */
+
+using System;
+using System.Collections.Generic;
+using System.Globalization;
+using System.IO;
+using System.Security.Cryptography;
+using System.Text;
+
+namespace ps3m2ts
+{
+    /// <summary>
+    /// Append-only record of the stages each input has completed, kept as ps3m2ts.journal in the
+    /// destination. Every line is written through to disk, so after a crash a rerun knows which files are
+    /// done and which intermediates it can trust (a torn last line is simply ignored). Entries belong to
+    /// one version of an input: a changed size or timestamp makes them void.
+    /// </summary>
+    class JobJournal
+    {
+        #region Constants
+
+        public const String FileName = "ps3m2ts.journal";
+
+        /// <summary>Stage recorded once the output has been renamed into place.</summary>
+        public const String Done = "done";
+
+        /// <summary>Bytes hashed at the start, middle and end of an intermediate.</summary>
+        private const int SampleSize = 1 << 20;
+
+        #endregion
+
+        #region Constructor
+
+        private JobJournal(String Path)
+        {
+            this.Path = Path;
+            this.Entries = new Dictionary<String, List<Entry>>(StringComparer.OrdinalIgnoreCase);
+
+            Load();
+        }
+
+        #endregion
+
+        #region Private Fields
+
+        private class Entry
+        {
+            public String Stage;
+            public String Fingerprint;
+            public Dictionary<String, String> Hashes;
+        }
+
+        private static readonly Dictionary<String, JobJournal> Journals = new Dictionary<String, JobJournal>(StringComparer.OrdinalIgnoreCase);
+
+        private readonly Dictionary<String, List<Entry>> Entries;
+
+        #endregion
+
+        #region Public Properties
+
+        public String Path { get; private set; }
+
+        #endregion
+
+        #region Public Methods
+
+        /// <summary>
+        /// The journal of a destination directory; jobs sharing a destination share the instance.
+        /// </summary>
+        public static JobJournal For(String destination)
+        {
+            String path = System.IO.Path.GetFullPath(System.IO.Path.Combine(destination, FileName));
+
+            lock (Journals)
+            {
+                JobJournal journal;
+                if (!Journals.TryGetValue(path, out journal))
+                {
+                    journal = new JobJournal(path);
+                    Journals.Add(path, journal);
+                }
+
+                return journal;
+            }
+        }
+
+        /// <summary>
+        /// True if stage was completed for this version of input and every intermediate it produced
+        /// is still there with the same content.
+        /// </summary>
+        public bool IsComplete(String input, String stage)
+        {
+            Entry entry = Find(input, stage);
+            if (entry == null) return false;
+
+            foreach (KeyValuePair<String, String> hash in entry.Hashes)
+            {
+                if (!File.Exists(hash.Key) || SampledHash(hash.Key) != hash.Value) return false;
+            }
+
+            return true;
+        }
+
+        /// <summary>
+        /// Records that stage completed for input, along with the sampled hashes of the given intermediates.
+        /// </summary>
+        public void Complete(String input, String stage, params String[] intermediates)
+        {
+            var line = new StringBuilder();
+            line.Append(stage).Append('\t').Append(Fingerprint(input)).Append('\t').Append(System.IO.Path.GetFullPath(input));
+
+            var entry = new Entry();
+            entry.Stage = stage;
+            entry.Fingerprint = Fingerprint(input);
+            entry.Hashes = new Dictionary<String, String>(StringComparer.OrdinalIgnoreCase);
+
+            foreach (String file in intermediates)
+            {
+                if (!File.Exists(file)) continue;
+
+                String path = System.IO.Path.GetFullPath(file);
+                String hash = SampledHash(path);
+                entry.Hashes[path] = hash;
+                line.Append('\t').Append(path).Append('=').Append(hash);
+            }
+
+            lock (Entries)
+            {
+                // write-through, so the record survives a crash right after this stage
+                using (var stream = new FileStream(Path, FileMode.Append, FileAccess.Write, FileShare.Read, 4096, FileOptions.WriteThrough))
+                using (var writer = new StreamWriter(stream))
+                {
+                    writer.WriteLine(line.ToString());
+                }
+
+                Add(System.IO.Path.GetFullPath(input), entry);
+            }
+        }
+
+        /// <summary>
+        /// Hash of the length and three 1 MB samples of file. Cheap enough for multi-gigabyte intermediates
+        /// and good enough to notice a truncated or rewritten one.
+        /// </summary>
+        public static String SampledHash(String file)
+        {
+            using (var md5 = MD5.Create())
+            using (var input = new FileStream(file, FileMode.Open, FileAccess.Read, FileShare.Read))
+            {
+                long length = input.Length;
+                var buffer = new byte[SampleSize];
+
+                byte[] lengthBytes = BitConverter.GetBytes(length);
+                md5.TransformBlock(lengthBytes, 0, lengthBytes.Length, null, 0);
+
+                foreach (long offset in new[] { 0, (length - SampleSize) / 2, length - SampleSize })
+                {
+                    input.Position = Math.Max(0, offset);
+
+                    int read = 0, count;
+                    while (read < buffer.Length && (count = input.Read(buffer, read, buffer.Length - read)) > 0) read += count;
+
+                    md5.TransformBlock(buffer, 0, read, null, 0);
+                }
+
+                md5.TransformFinalBlock(buffer, 0, 0);
+                return BitConverter.ToString(md5.Hash).Replace("-", "").ToLowerInvariant();
+            }
+        }
+
+        #endregion
+
+        #region Private Methods
+
+        private static String Fingerprint(String input)
+        {
+            var info = new FileInfo(input);
+            return info.Length.ToString(CultureInfo.InvariantCulture) + ":" +
+                   info.LastWriteTimeUtc.Ticks.ToString(CultureInfo.InvariantCulture);
+        }
+
+        private Entry Find(String input, String stage)
+        {
+            String fingerprint = Fingerprint(input);
+
+            lock (Entries)
+            {
+                List<Entry> entries;
+                if (!Entries.TryGetValue(System.IO.Path.GetFullPath(input), out entries)) return null;
+
+                // the last record of a stage wins
+                for (int i = entries.Count - 1; i >= 0; i--)
+                {
+                    if (entries[i].Stage == stage && entries[i].Fingerprint == fingerprint) return entries[i];
+                }
+            }
+
+            return null;
+        }
+
+        private void Add(String input, Entry entry)
+        {
+            List<Entry> entries;
+            if (!Entries.TryGetValue(input, out entries))
+            {
+                entries = new List<Entry>();
+                Entries.Add(input, entries);
+            }
+
+            entries.Add(entry);
+        }
+
+        private void Load()
+        {
+            if (!File.Exists(Path)) return;
+
+            foreach (String line in File.ReadAllLines(Path))
+            {
+                String[] fields = line.Split('\t');
+                if (fields.Length < 3) continue;
+
+                var entry = new Entry();
+                entry.Stage = fields[0];
+                entry.Fingerprint = fields[1];
+                entry.Hashes = new Dictionary<String, String>(StringComparer.OrdinalIgnoreCase);
+
+                bool valid = true;
+                for (int i = 3; i < fields.Length; i++)
+                {
+                    int separator = fields[i].LastIndexOf('=');
+                    if (separator <= 0)
+                    {
+                        valid = false;
+                        break;
+                    }
+
+                    entry.Hashes[fields[i].Substring(0, separator)] = fields[i].Substring(separator + 1);
+                }
+
+                if (valid) Add(fields[2], entry);
+            }
+        }
+
+        #endregion
+    }
+}
@@ -0,0 +1,364 @@
+﻿/*
+ * ps3m2ts
+ *
+ * Copyright (R) 2009-> Henning M. Stephansen
+ * Feel free to use the code by any means, hopefully you can submit your improvements, ideas etc
+ * to henningms@gmail.com or leave a comment at my blog http://www.henning.ms
+ *
+ */
+
+using System;
+using System.Collections.Generic;
+using System.Diagnostics;
+using System.Threading;
+
+namespace ps3m2ts
+{
+    public enum StageClass
+    {
+        Cpu = 0,
+        IO = 1
+    }
+
+    /// <summary>
+    /// Runs conversion jobs on a fixed number of worker threads. Inside a job, CPU-heavy stages (audio
+    /// transcoding) and I/O-heavy stages (extracting, muxing) are additionally limited by their own gates,
+    /// so e.g. four jobs can be in flight while only two of them hammer the disk.
+    /// </summary>
+    class JobScheduler
+    {
+        #region Constructor
+
+        public JobScheduler(int Jobs, int CpuSlots, int IOSlots, int HddSlots, int SsdSlots)
+        {
+            this.Jobs = Math.Max(1, Jobs);
+            this.CpuGate = new StageGate("cpu", CpuSlots);
+            this.IOGate = new StageGate("io", IOSlots);
+            this.Space = new DiskSpaceGate();
+            this.HddSlots = Math.Max(1, HddSlots);
+            this.SsdSlots = Math.Max(1, SsdSlots);
+            this.ActiveNames = new Dictionary<string, int>(StringComparer.OrdinalIgnoreCase);
+            this.DeviceGates = new Dictionary<string, StageGate>(StringComparer.OrdinalIgnoreCase);
+            this.Devices = new Dictionary<string, BlockDevice>(StringComparer.OrdinalIgnoreCase);
+            this.Started = DateTime.UtcNow;
+
+            AddGauges(CpuGate);
+            AddGauges(IOGate);
+        }
+
+        #endregion
+
+        #region Private Fields
+
+        private readonly Dictionary<string, int> ActiveNames;
+        private readonly int HddSlots;
+        private readonly int SsdSlots;
+        private readonly Dictionary<string, StageGate> DeviceGates;
+        private readonly Dictionary<string, BlockDevice> Devices;
+        private readonly DateTime Started;
+
+        #endregion
+
+        #region Public Properties
+
+        public int Jobs { get; private set; }
+        public StageGate CpuGate { get; private set; }
+        public StageGate IOGate { get; private set; }
+        public DiskSpaceGate Space { get; private set; }
+
+        #endregion
+
+        #region Public Methods
+
+        /// <summary>
+        /// Holds a slot of the given stage class until the returned object is disposed.
+        /// </summary>
+        public IDisposable EnterStage(StageClass stage)
+        {
+            return EnterStage(stage, new string[0]);
+        }
+
+        /// <summary>
+        /// Holds a slot of the given stage class and one on every device the stage reads or writes
+        /// (paths), so a spinning disk serves one stream at a time while other devices stay busy.
+        /// Device slots are taken first and in a fixed order, so two stages can't wait for each other and
+        /// a job queued for a busy disk doesn't sit on a class slot a job on another device could use.
+        /// </summary>
+        public IDisposable EnterStage(StageClass stage, params string[] paths)
+        {
+            var gates = new SortedDictionary<string, StageGate>(StringComparer.Ordinal);
+
+            foreach (string path in paths)
+            {
+                BlockDevice device = BlockDevice.Of(path);
+                gates[device.Id] = GetDeviceGate(device);
+            }
+
+            var waited = Stopwatch.StartNew();
+            var slots = new List<IDisposable>();
+            foreach (StageGate gate in gates.Values) slots.Add(gate.Enter());
+            slots.Add((stage == StageClass.Cpu) ? CpuGate.Enter() : IOGate.Enter());
+
+            RecordWait((stage == StageClass.Cpu) ? "wait cpu" : "wait io", waited);
+            return new StageSlots(slots);
+        }
+
+        /// <summary>
+        /// Like EnterStage, but only takes the slots if all of them are free right now; otherwise takes
+        /// none and returns null. For extra parallelism within a stage that already holds its slots,
+        /// which must not wait or it could wait for itself.
+        /// </summary>
+        public IDisposable TryEnterStage(StageClass stage, params string[] paths)
+        {
+            var gates = new SortedDictionary<string, StageGate>(StringComparer.Ordinal);
+
+            foreach (string path in paths)
+            {
+                BlockDevice device = BlockDevice.Of(path);
+                gates[device.Id] = GetDeviceGate(device);
+            }
+
+            var slots = new List<IDisposable>();
+            var all = new List<StageGate>(gates.Values);
+            all.Add((stage == StageClass.Cpu) ? CpuGate : IOGate);
+
+            foreach (StageGate gate in all)
+            {
+                IDisposable slot = gate.TryEnter();
+                if (slot == null)
+                {
+                    new StageSlots(slots).Dispose();
+                    return null;
+                }
+
+                slots.Add(slot);
+            }
+
+            return new StageSlots(slots);
+        }
+
+        /// <summary>
+        /// How busy each device was since the scheduler was created, one line per device.
+        /// </summary>
+        public List<string> DescribeDevices()
+        {
+            var lines = new List<string>();
+            double elapsed = Math.Max(1, (DateTime.UtcNow - Started).TotalSeconds);
+
+            lock (DeviceGates)
+            {
+                foreach (KeyValuePair<string, StageGate> pair in DeviceGates)
+                {
+                    BlockDevice device = Devices[pair.Key];
+                    StageGate gate = pair.Value;
+
+                    lines.Add(string.Format(System.Globalization.CultureInfo.InvariantCulture,
+                                            "Device '{0}' ({1}, {2} at a time): busy {3:0.0}% of {4:0}s, {5} stage(s), at most {6} at once.",
+                                            device.Name, device.Rotational ? "spinning" : "solid state", gate.Limit,
+                                            100.0 * gate.Busy.TotalSeconds / elapsed, elapsed, gate.Entered, gate.Peak));
+                }
+            }
+
+            return lines;
+        }
+
+        /// <summary>
+        /// Holds disk space for a job's intermediates and output until the returned object is disposed;
+        /// waits while it doesn't fit, and throws if it can't fit at all.
+        /// </summary>
+        public IDisposable ReserveSpace(IDictionary<string, long> bytes, Func<IDictionary<string, long>> written, string what, Logger log)
+        {
+            var waited = Stopwatch.StartNew();
+            IDisposable reservation = Space.Reserve(bytes, written, what, log);
+
+            RecordWait("wait space", waited);
+            return reservation;
+        }
+
+        /// <summary>
+        /// Intermediates and outputs are named after the input file, so two inputs with the same name
+        /// must not convert at the same time. Waits until no other job holds any of the names, then takes
+        /// all of them at once.
+        /// </summary>
+        public IDisposable ReserveName(params string[] names)
+        {
+            var waited = Stopwatch.StartNew();
+
+            lock (ActiveNames)
+            {
+                while (Array.Exists(names, name => ActiveNames.ContainsKey(name))) Monitor.Wait(ActiveNames);
+                foreach (string name in names) ActiveNames[name] = Thread.CurrentThread.ManagedThreadId;
+            }
+
+            RecordWait("wait name", waited);
+
+            return new NameReservation(this, names);
+        }
+
+        /// <summary>
+        /// Runs work for every item on up to Jobs threads and returns when all items are done. An exception
+        /// in one item is passed to onError and doesn't stop the others.
+        /// </summary>
+        public void Run<T>(IList<T> items, Action<T> work, Action<T, Exception> onError)
+        {
+            int next = 0;
+            var workers = new List<Thread>();
+
+            Metrics.Gauge("ps3m2ts_queue_depth", "Jobs waiting for a stage.", "stage", "jobs", () => Math.Max(0, items.Count - next));
+
+            ThreadStart worker = delegate
+                {
+                    while (true)
+                    {
+                        int index = Interlocked.Increment(ref next) - 1;
+                        if (index >= items.Count) return;
+
+                        try
+                        {
+                            work(items[index]);
+                        }
+                        catch (Exception ex)
+                        {
+                            onError(items[index], ex);
+                        }
+                    }
+                };
+
+            int threads = Math.Min(Jobs, items.Count);
+
+            // a single job runs on the calling thread, exactly like the serial loop used to
+            if (threads <= 1)
+            {
+                worker();
+                return;
+            }
+
+            for (int i = 0; i < threads; i++)
+            {
+                var thread = new Thread(worker);
+                thread.Name = "job " + (i + 1);
+                thread.Start();
+                workers.Add(thread);
+            }
+
+            foreach (Thread thread in workers) thread.Join();
+        }
+
+        /// <summary>
+        /// Runs work for every item taken from queue on Jobs threads until the queue is completed and
+        /// drained. The workers stay up in between, so items are started as soon as they are queued.
+        /// </summary>
+        public void Run<T>(BoundedQueue<T> queue, Action<T> work, Action<T, Exception> onError)
+        {
+            var workers = new List<Thread>();
+
+            ThreadStart worker = delegate
+                {
+                    T item;
+                    while (queue.TryDequeue(out item))
+                    {
+                        try
+                        {
+                            work(item);
+                        }
+                        catch (Exception ex)
+                        {
+                            onError(item, ex);
+                        }
+                    }
+                };
+
+            for (int i = 0; i < Jobs; i++)
+            {
+                var thread = new Thread(worker);
+                thread.Name = "job " + (i + 1);
+                thread.Start();
+                workers.Add(thread);
+            }
+
+            foreach (Thread thread in workers) thread.Join();
+        }
+
+        #endregion
+
+        #region Private Methods
+
+        /// <summary>
+        /// Shows a wait in the trace; waits too short to see aren't recorded.
+        /// </summary>
+        private static void RecordWait(string name, Stopwatch waited)
+        {
+            if (waited.ElapsedMilliseconds >= 1) TraceRecorder.Record(name, "wait", waited.Elapsed);
+        }
+
+        private static void AddGauges(StageGate gate)
+        {
+            Metrics.Gauge("ps3m2ts_gate_active", "Slots held, by gate (cpu, io or device).", "gate", gate.Name, () => gate.Active);
+            Metrics.Gauge("ps3m2ts_gate_waiting", "Jobs waiting for a slot, by gate.", "gate", gate.Name, () => gate.Waiting);
+        }
+
+        private StageGate GetDeviceGate(BlockDevice device)
+        {
+            lock (DeviceGates)
+            {
+                StageGate gate;
+                if (!DeviceGates.TryGetValue(device.Id, out gate))
+                {
+                    gate = new StageGate(device.Name, device.Rotational ? HddSlots : SsdSlots);
+                    DeviceGates.Add(device.Id, gate);
+                    Devices.Add(device.Id, device);
+                    AddGauges(gate);
+                }
+
+                return gate;
+            }
+        }
+
+        private void ReleaseName(string[] names)
+        {
+            lock (ActiveNames)
+            {
+                foreach (string name in names) ActiveNames.Remove(name);
+                Monitor.PulseAll(ActiveNames);
+            }
+        }
+
+        private class StageSlots : IDisposable
+        {
+            private List<IDisposable> Slots;
+
+            public StageSlots(List<IDisposable> Slots)
+            {
+                this.Slots = Slots;
+            }
+
+            public void Dispose()
+            {
+                if (Slots == null) return;
+
+                for (int i = Slots.Count - 1; i >= 0; i--) Slots[i].Dispose();
+                Slots = null;
+            }
+        }
+
+        private class NameReservation : IDisposable
+        {
+            private JobScheduler Scheduler;
+            private readonly string[] Names;
+
+            public NameReservation(JobScheduler Scheduler, string[] Names)
+            {
+                this.Scheduler = Scheduler;
+                this.Names = Names;
+            }
+
+            public void Dispose()
+            {
+                if (Scheduler != null) Scheduler.ReleaseName(Names);
+                Scheduler = null;
+            }
+        }
+
+        #endregion
+    }
+}
@@ -1,10 +1,31 @@
 ﻿using System;
+using System.Globalization;
 using System.IO;
+using System.Text;
+using System.Threading;
 
 namespace ps3m2ts
 {
+    /// <summary>
+    /// Log lines are pushed onto a lock-free stack by any number of threads and written in batches by a
+    /// background thread, so a job logging tool output never waits for the disk or the console. The
+    /// file is flushed once per batch, on Close, at process exit and on an unhandled exception.
+    /// With an event log open, every line and event is also written there as one JSON object per line,
+    /// tagged with the job and stage the logging thread is working on. While something else owns the
+    /// console (/tui), log lines go to ConsoleRedirect and status lines are dropped.
+    /// </summary>
     public class Logger
     {
+        #region Constants
+
+        /// <summary>How often the writer thread picks up queued lines, in milliseconds.</summary>
+        private const int FlushInterval = 100;
+
+        /// <summary>Status lines shown per second at most; the rest are dropped.</summary>
+        private const int StatusLinesPerSecond = 5;
+
+        #endregion
+
         #region Constructor
 
         public Logger(String AppName, Boolean LogToFile) : this(AppName, LogToFile, Environment.CurrentDirectory)
@@ -20,53 +41,418 @@ namespace ps3m2ts
                 String LogFileName = String.Format(@"{0}\{1} {2:yyyy-MM-dd HH-mm-ss}.log", LogDirectory, AppName,
                                                    DateTime.Now);
                 LogWriter = new StreamWriter(LogFileName);
-                LogWriter.AutoFlush = true;
             }
+
+            AppDomain.CurrentDomain.ProcessExit += delegate { Close(); };
+            AppDomain.CurrentDomain.UnhandledException += delegate(object sender, UnhandledExceptionEventArgs e)
+                {
+                    Log("Error: " + e.ExceptionObject);
+                    Flush();
+                };
+
+            Writer = new Thread(WriteLoop);
+            Writer.Name = "log writer";
+            Writer.IsBackground = true;
+            Writer.Start();
         }
 
         #endregion
 
         #region Private Fields
 
+        private enum EntryKind
+        {
+            Log,
+            Status,
+            Event
+        }
+
+        private class Entry
+        {
+            public DateTime Time;
+            public EntryKind Kind;
+            public String Text;
+            public Context Context;
+            public object[] Fields;
+            public Entry Next;
+        }
+
+        /// <summary>
+        /// Job and stage a thread is working on; attached to its log lines and events.
+        /// </summary>
+        public class Context
+        {
+            public int Job;
+            public String Stage;
+        }
+
+        [ThreadStatic]
+        private static Context CurrentContext;
+
         private readonly Boolean LogToFile;
         private readonly StreamWriter LogWriter;
+        private StreamWriter EventWriter;
+        private readonly Thread Writer;
+        private readonly AutoResetEvent Signal = new AutoResetEvent(false);
+
+        /// <summary>Newest entry first; producers push with a compare-and-swap, the writer takes them all.</summary>
+        private Entry Head;
+
+        /// <summary>Serializes draining; producers never take it.</summary>
+        private readonly object WriterSync = new object();
+
+        private volatile bool Closed;
+        private DateTime StatusWindow;
+        private int StatusLines;
+
+        #endregion
+
+        #region Public Properties
+
+        /// <summary>
+        /// Receives the log lines meant for the console, on the writer thread, instead of the console.
+        /// </summary>
+        public Action<String> ConsoleRedirect { get; set; }
 
         #endregion
 
         #region Public Methods
 
+        /// <summary>
+        /// The job and stage of the calling thread, or null; pass it to Enter on a helper thread.
+        /// </summary>
+        public static Context Current
+        {
+            get { return CurrentContext; }
+        }
+
+        /// <summary>
+        /// Makes context the calling thread's until the returned object is disposed.
+        /// </summary>
+        public static IDisposable Enter(Context context)
+        {
+            return new ContextScope(context, null, null);
+        }
+
+        /// <summary>
+        /// Starts appending JSON events to path (see Event).
+        /// </summary>
+        public void OpenEventLog(String path)
+        {
+            var writer = new StreamWriter(path, true, new UTF8Encoding(false));
+            lock (WriterSync) EventWriter = writer;
+        }
+
+        /// <summary>
+        /// Marks the calling thread as running stage of job until the returned object is disposed, which
+        /// records a "stage" event with its duration (and a trace span with /trace). What the thread used
+        /// meanwhile is added to the stage's resource accounting.
+        /// </summary>
+        public IDisposable BeginStage(int job, String stage)
+        {
+            var context = new Context();
+            context.Job = job;
+            context.Stage = stage;
+
+            return new ContextScope(context, this, DateTime.Now);
+        }
+
         public void Log(String LogText)
         {
-            if ((LogToFile) && (LogWriter != null))
+            Push(EntryKind.Log, LogText, null);
+        }
+
+        /// <summary>
+        /// Records an event in the event log, if one is open: name followed by key/value pairs, e.g.
+        /// Event("transfer", "bytes", 1024L, "duration_ms", 12.5). Strings, numbers, booleans, DateTime
+        /// and TimeSpan (as milliseconds) values are written as JSON.
+        /// </summary>
+        public void Event(String name, params object[] fields)
+        {
+            if (EventWriter == null) return;
+
+            Push(EntryKind.Event, name, fields);
+        }
+
+        /// <summary>
+        /// Writes a transient status line (progress, tool output) to the console only, never to the log
+        /// file. Bursts beyond a few lines per second are dropped.
+        /// </summary>
+        public void Status(String StatusText)
+        {
+            Push(EntryKind.Status, StatusText, null);
+        }
+
+        /// <summary>
+        /// Writes everything queued so far before returning.
+        /// </summary>
+        public void Flush()
+        {
+            Drain();
+        }
+
+        public void Close()
+        {
+            if (Closed) return;
+            Closed = true;
+
+            Signal.Set();
+            if (Thread.CurrentThread != Writer) Writer.Join(1000);
+
+            Drain();
+
+            try
+            {
+                if (LogWriter != null) LogWriter.Close();
+                if (EventWriter != null) EventWriter.Close();
+            }
+            catch
+            {
+            }
+        }
+
+        #endregion
+
+        #region Private Methods
+
+        private void Push(EntryKind kind, String text, object[] fields)
+        {
+            var entry = new Entry();
+            entry.Time = DateTime.Now;
+            entry.Kind = kind;
+            entry.Text = text;
+            entry.Context = CurrentContext;
+            entry.Fields = fields;
+
+            Entry head;
+            do
+            {
+                head = Head;
+                entry.Next = head;
+            } while (Interlocked.CompareExchange(ref Head, entry, head) != head);
+        }
+
+        private void WriteLoop()
+        {
+            while (!Closed)
+            {
+                Signal.WaitOne(FlushInterval, false);
+                Drain();
+            }
+        }
+
+        /// <summary>
+        /// Takes every queued entry at once and writes them oldest first, flushing the file once.
+        /// </summary>
+        private void Drain()
+        {
+            lock (WriterSync)
             {
-                LogText = String.Format("[{0:HH:mm:ss}] {1}", DateTime.Now, LogText);
+                Entry taken = Interlocked.Exchange(ref Head, null);
+                if (taken == null) return;
+
+                // the stack hands them over newest first
+                Entry oldest = null;
+                while (taken != null)
+                {
+                    Entry next = taken.Next;
+                    taken.Next = oldest;
+                    oldest = taken;
+                    taken = next;
+                }
+
+                for (Entry entry = oldest; entry != null; entry = entry.Next)
+                {
+                    Action<String> redirect = ConsoleRedirect;
+
+                    if (entry.Kind == EntryKind.Status)
+                    {
+                        if (redirect == null && AllowStatus(entry.Time)) Console.WriteLine(entry.Text);
+                        continue;
+                    }
+
+                    if (EventWriter != null) WriteEvent(entry);
+                    if (entry.Kind == EntryKind.Event) continue;
+
+                    String LogText = entry.Text;
+
+                    if ((LogToFile) && (LogWriter != null))
+                    {
+                        LogText = String.Format("[{0:HH:mm:ss}] {1}", entry.Time, LogText);
+                        try
+                        {
+                            LogWriter.WriteLine(LogText);
+                        }
+                        catch
+                        {
+                        }
+                    }
+
+                    if (redirect != null) redirect(entry.Text);
+                    else Console.WriteLine(LogText);
+                }
+
                 try
                 {
-                    LogWriter.WriteLine(LogText);
+                    if (LogWriter != null) LogWriter.Flush();
+                    if (EventWriter != null) EventWriter.Flush();
                 }
                 catch
                 {
                 }
             }
-
-            Console.WriteLine(LogText);
         }
 
-        public void Close()
+        /// <summary>
+        /// {"ts":"...","event":"...","job":n,"stage":"...",...}; a log line is a "log" event with its message.
+        /// </summary>
+        private void WriteEvent(Entry entry)
         {
+            var json = new StringBuilder(128);
+            json.Append("{\"ts\":");
+            AppendJson(json, entry.Time);
+            json.Append(",\"event\":");
+            AppendJson(json, (entry.Kind == EntryKind.Log) ? "log" : entry.Text);
+
+            if (entry.Context != null)
+            {
+                json.Append(",\"job\":").Append(entry.Context.Job.ToString(CultureInfo.InvariantCulture));
+                json.Append(",\"stage\":");
+                AppendJson(json, entry.Context.Stage);
+            }
+
+            if (entry.Kind == EntryKind.Log)
+            {
+                json.Append(",\"message\":");
+                AppendJson(json, entry.Text);
+            }
+            else if (entry.Fields != null)
+            {
+                for (int i = 0; i + 1 < entry.Fields.Length; i += 2)
+                {
+                    json.Append(',');
+                    AppendJson(json, Convert.ToString(entry.Fields[i], CultureInfo.InvariantCulture));
+                    json.Append(':');
+                    AppendJson(json, entry.Fields[i + 1]);
+                }
+            }
+
+            json.Append('}');
+
             try
             {
-                LogWriter.Flush();
-                LogWriter.Close();
+                EventWriter.WriteLine(json.ToString());
             }
             catch
             {
             }
         }
 
-        #endregion
+        private static void AppendJson(StringBuilder json, object value)
+        {
+            if (value == null)
+            {
+                json.Append("null");
+            }
+            else if (value is bool)
+            {
+                json.Append((bool)value ? "true" : "false");
+            }
+            else if (value is DateTime)
+            {
+                json.Append('"').Append(((DateTime)value).ToUniversalTime().ToString("yyyy-MM-dd'T'HH:mm:ss.fff'Z'", CultureInfo.InvariantCulture)).Append('"');
+            }
+            else if (value is TimeSpan)
+            {
+                json.Append(((TimeSpan)value).TotalMilliseconds.ToString("0.###", CultureInfo.InvariantCulture));
+            }
+            else if (value is double || value is float)
+            {
+                json.Append(Convert.ToDouble(value).ToString("0.###", CultureInfo.InvariantCulture));
+            }
+            else if (value is int || value is long)
+            {
+                json.Append(Convert.ToInt64(value).ToString(CultureInfo.InvariantCulture));
+            }
+            else
+            {
+                String text = value.ToString();
+                json.Append('"');
 
-        #region Private Methods
+                foreach (char c in text)
+                {
+                    switch (c)
+                    {
+                        case '"': json.Append("\\\""); break;
+                        case '\\': json.Append("\\\\"); break;
+                        case '\n': json.Append("\\n"); break;
+                        case '\r': json.Append("\\r"); break;
+                        case '\t': json.Append("\\t"); break;
+                        default:
+                            if (c < ' ') json.Append("\\u").Append(((int)c).ToString("x4"));
+                            else json.Append(c);
+                            break;
+                    }
+                }
+
+                json.Append('"');
+            }
+        }
+
+        private bool AllowStatus(DateTime time)
+        {
+            if (time - StatusWindow >= TimeSpan.FromSeconds(1))
+            {
+                StatusWindow = time;
+                StatusLines = 0;
+            }
+
+            return (++StatusLines <= StatusLinesPerSecond);
+        }
+
+        private class ContextScope : IDisposable
+        {
+            private readonly Context Previous;
+            private readonly Context Context;
+            private readonly Logger Owner;
+            private readonly DateTime? Started;
+            private readonly IDisposable Span;
+            private readonly IDisposable Resources;
+            private bool Disposed;
+
+            public ContextScope(Context Context, Logger Owner, DateTime? Started)
+            {
+                this.Previous = CurrentContext;
+                this.Context = Context;
+                this.Owner = Owner;
+                this.Started = Started;
+
+                CurrentContext = Context;
+
+                if (Owner != null) Span = TraceRecorder.Span(Context.Stage, "stage");
+
+                // only the outermost stage on a thread counts, or its time would be added twice
+                if (Previous == null || Previous.Stage == null) Resources = ResourceAccounting.Measure(Context, Owner != null);
+            }
+
+            public void Dispose()
+            {
+                if (Disposed) return;
+                Disposed = true;
+
+                if (Span != null) Span.Dispose();
+                if (Resources != null) Resources.Dispose();
+
+                if (Owner != null && Started.HasValue)
+                {
+                    TimeSpan duration = DateTime.Now - Started.Value;
+                    Metrics.StageSeconds.Labels(Context.Stage).Observe(duration);
+                    Owner.Event("stage", "start", Started.Value, "duration_ms", duration);
+                }
+
+                CurrentContext = Previous;
+            }
+        }
 
         ~Logger()
         {
@@ -75,4 +461,4 @@ namespace ps3m2ts
 
         #endregion
     }
-}
\ No newline at end of file
+}
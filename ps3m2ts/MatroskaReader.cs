@@ -0,0 +1,750 @@
+﻿/*
+ * ps3m2ts
+ *
+ * Copyright (R) 2009-> Henning M. Stephansen
+ * Feel free to use the code by any means, hopefully you can submit your improvements, ideas etc
+ * to henningms@gmail.com or leave a comment at my blog http://www.henning.ms
+ *
+ */
+
+using System;
+using System.Collections.Generic;
+using System.IO;
+using System.Text;
+
+namespace ps3m2ts
+{
+    /// <summary>
+    /// Forward-only Matroska demuxer. Reads the segment headers and then hands out one block at a time,
+    /// so memory use is bounded by the largest single block regardless of the file size.
+    /// </summary>
+    class MatroskaReader
+    {
+        #region Element IDs
+
+        public const uint EBMLHeader = 0x1A45DFA3;
+        public const uint DocType = 0x4282;
+        public const uint Segment = 0x18538067;
+        public const uint SeekHead = 0x114D9B74;
+        public const uint Seek = 0x4DBB;
+        public const uint SeekID = 0x53AB;
+        public const uint SeekPosition = 0x53AC;
+        public const uint Info = 0x1549A966;
+        public const uint TimecodeScale = 0x2AD7B1;
+        public const uint SegmentDuration = 0x4489;
+        public const uint Tracks = 0x1654AE6B;
+        public const uint TrackEntry = 0xAE;
+        public const uint TrackNumber = 0xD7;
+        public const uint TrackType = 0x83;
+        public const uint CodecID = 0x86;
+        public const uint CodecPrivate = 0x63A2;
+        public const uint DefaultDuration = 0x23E383;
+        public const uint ContentEncodings = 0x6D80;
+        public const uint ContentEncoding = 0x6240;
+        public const uint ContentEncodingType = 0x5033;
+        public const uint ContentCompression = 0x5034;
+        public const uint ContentCompAlgo = 0x4254;
+        public const uint ContentCompSettings = 0x4255;
+        public const uint Cluster = 0x1F43B675;
+        public const uint ClusterTimecode = 0xE7;
+        public const uint SimpleBlock = 0xA3;
+        public const uint BlockGroup = 0xA0;
+        public const uint Block = 0xA1;
+        public const uint ReferenceBlock = 0xFB;
+        public const uint Cues = 0x1C53BB6B;
+        public const uint CuePoint = 0xBB;
+        public const uint CueTime = 0xB3;
+        public const uint CueTrackPositions = 0xB7;
+        public const uint CueTrack = 0xF7;
+        public const uint CueClusterPosition = 0xF1;
+
+        #endregion
+
+        #region Constructor
+
+        public MatroskaReader(Stream Input)
+        {
+            this.Input = Input;
+            this.TimecodeScaleNs = 1000000;
+            this.TrackList = new List<MatroskaTrack>();
+        }
+
+        #endregion
+
+        #region Private Fields
+
+        private const long UnknownSize = -1;
+
+        private readonly Stream Input;
+        private long SegmentEnd;
+        private long ClusterEnd;
+        private long ClusterTimecodeValue;
+        private bool InCluster;
+        private long CuesPosition;
+        private readonly byte[] Scratch = new byte[8];
+
+        #endregion
+
+        #region Public Properties
+
+        public long TimecodeScaleNs { get; private set; }
+        public double DurationNs { get; private set; }
+        public List<MatroskaTrack> TrackList { get; private set; }
+
+        /// <summary>Offset of the Segment payload; Cues and SeekHead positions are relative to it.</summary>
+        public long SegmentDataStart { get; private set; }
+
+        /// <summary>Offset of the first Cluster element.</summary>
+        public long FirstClusterPosition { get; private set; }
+
+        /// <summary>Offset where ReadBlock stops; the end of the segment unless narrowed for a partial read.</summary>
+        public long EndPosition { get; set; }
+
+        public long Position
+        {
+            get { return Input.Position; }
+        }
+
+        public long Length
+        {
+            get { return Input.Length; }
+        }
+
+        #endregion
+
+        #region Public Methods
+
+        /// <summary>
+        /// Reads the EBML header and every top level element up to the first Cluster.
+        /// </summary>
+        public void ReadHeaders()
+        {
+            long size;
+            uint id = ReadElementHeader(out size);
+
+            if (id != EBMLHeader)
+                throw new InvalidDataException("Not an EBML file.");
+
+            long end = Input.Position + size;
+            while (Input.Position < end)
+            {
+                long childSize;
+                uint childId = ReadElementHeader(out childSize);
+
+                if (childId == DocType)
+                {
+                    String docType = ReadString(childSize);
+                    if (docType != "matroska" && docType != "webm")
+                        throw new InvalidDataException("Unsupported EBML document type '" + docType + "'.");
+                }
+                else Skip(childSize);
+            }
+
+            id = ReadElementHeader(out size);
+            if (id != Segment)
+                throw new InvalidDataException("Segment element not found.");
+
+            SegmentDataStart = Input.Position;
+            SegmentEnd = (size == UnknownSize) ? Input.Length : Math.Min(Input.Length, Input.Position + size);
+
+            while (Input.Position < SegmentEnd)
+            {
+                long position = Input.Position;
+                id = ReadElementHeader(out size);
+
+                if (id == Cluster)
+                {
+                    FirstClusterPosition = position;
+                    EndPosition = SegmentEnd;
+                    Input.Position = position;
+                    return;
+                }
+
+                if (id == Cues) CuesPosition = position;
+
+                if (id == Info) ReadInfo(Input.Position + size);
+                else if (id == SeekHead) ReadSeekHead(Input.Position + size);
+                else if (id == Tracks) ReadTracks(Input.Position + size);
+                else if (size == UnknownSize) throw new InvalidDataException("Unknown-sized top level element.");
+                else Skip(size);
+            }
+
+            throw new InvalidDataException("No clusters found.");
+        }
+
+        public MatroskaTrack FindTrack(int Number)
+        {
+            foreach (MatroskaTrack track in TrackList)
+            {
+                if (track.Number == Number) return track;
+            }
+
+            return null;
+        }
+
+        /// <summary>
+        /// Positions the reader on the Cluster element at the given file offset.
+        /// </summary>
+        public void SeekCluster(long position)
+        {
+            Input.Position = position;
+            InCluster = false;
+        }
+
+        /// <summary>
+        /// Reads the index entries of one track, usually the video track whose cue points are keyframes.
+        /// Returns an empty list when the file has no Cues. The read position is left untouched.
+        /// </summary>
+        public List<MatroskaCuePoint> ReadCues(int trackNumber)
+        {
+            var cuePoints = new List<MatroskaCuePoint>();
+            if (CuesPosition <= 0 || CuesPosition >= Input.Length) return cuePoints;
+
+            long restore = Input.Position;
+            Input.Position = CuesPosition;
+
+            long size;
+            if (ReadElementHeader(out size) == Cues && size != UnknownSize)
+            {
+                long end = Input.Position + size;
+                while (Input.Position < end)
+                {
+                    long pointSize;
+                    uint id = ReadElementHeader(out pointSize);
+
+                    if (id != CuePoint)
+                    {
+                        Skip(pointSize);
+                        continue;
+                    }
+
+                    long pointEnd = Input.Position + pointSize;
+                    long time = 0;
+
+                    while (Input.Position < pointEnd)
+                    {
+                        long childSize;
+                        uint childId = ReadElementHeader(out childSize);
+
+                        if (childId == CueTime) time = (long)ReadUInt(childSize);
+                        else if (childId == CueTrackPositions)
+                        {
+                            long positionsEnd = Input.Position + childSize;
+                            long track = 0;
+                            long clusterPosition = -1;
+
+                            while (Input.Position < positionsEnd)
+                            {
+                                long valueSize;
+                                uint valueId = ReadElementHeader(out valueSize);
+
+                                if (valueId == CueTrack) track = (long)ReadUInt(valueSize);
+                                else if (valueId == CueClusterPosition) clusterPosition = (long)ReadUInt(valueSize);
+                                else Skip(valueSize);
+                            }
+
+                            if (track == trackNumber && clusterPosition >= 0)
+                            {
+                                var cuePoint = new MatroskaCuePoint();
+                                cuePoint.TimeNs = time * TimecodeScaleNs;
+                                cuePoint.ClusterPosition = SegmentDataStart + clusterPosition;
+                                cuePoints.Add(cuePoint);
+                            }
+                        }
+                        else Skip(childSize);
+                    }
+                }
+            }
+
+            Input.Position = restore;
+            return cuePoints;
+        }
+
+        /// <summary>
+        /// Reads the next block of any track. Returns false at the end of the segment. Laced frames are
+        /// returned back to back in block.Data, and header-stripped frames have their header restored.
+        /// </summary>
+        public bool ReadBlock(MatroskaBlock block)
+        {
+            while (true)
+            {
+                if (!InCluster)
+                {
+                    if (Input.Position >= EndPosition) return false;
+
+                    long size;
+                    uint id = ReadElementHeader(out size);
+
+                    if (id == Cluster)
+                    {
+                        InCluster = true;
+                        ClusterEnd = (size == UnknownSize) ? SegmentEnd : Input.Position + size;
+                        ClusterTimecodeValue = 0;
+                    }
+                    else if (size == UnknownSize) return false;
+                    else Skip(size);
+
+                    continue;
+                }
+
+                if (Input.Position >= ClusterEnd)
+                {
+                    InCluster = false;
+                    continue;
+                }
+
+                long elementPosition = Input.Position;
+                long elementSize;
+                uint elementId = ReadElementHeader(out elementSize);
+
+                if (elementId == Cluster || elementId == Cues || elementId == Tracks || elementId == Info)
+                {
+                    // an unknown-sized cluster ends where the next top level element starts
+                    Input.Position = elementPosition;
+                    InCluster = false;
+                    continue;
+                }
+
+                if (elementId == ClusterTimecode)
+                {
+                    ClusterTimecodeValue = (long)ReadUInt(elementSize);
+                }
+                else if (elementId == SimpleBlock)
+                {
+                    ReadBlockPayload(block, elementSize);
+                    block.Keyframe = (block.Flags & 0x80) != 0;
+                    return true;
+                }
+                else if (elementId == BlockGroup)
+                {
+                    if (ReadBlockGroup(block, Input.Position + elementSize)) return true;
+                }
+                else Skip(elementSize);
+            }
+        }
+
+        #endregion
+
+        #region Private Methods
+
+        private void ReadInfo(long end)
+        {
+            while (Input.Position < end)
+            {
+                long size;
+                uint id = ReadElementHeader(out size);
+
+                if (id == TimecodeScale) TimecodeScaleNs = (long)ReadUInt(size);
+                else if (id == SegmentDuration) DurationNs = ReadFloat(size);
+                else Skip(size);
+            }
+
+            DurationNs *= TimecodeScaleNs;
+        }
+
+        private void ReadSeekHead(long end)
+        {
+            while (Input.Position < end)
+            {
+                long size;
+                uint id = ReadElementHeader(out size);
+
+                if (id != Seek)
+                {
+                    Skip(size);
+                    continue;
+                }
+
+                long seekEnd = Input.Position + size;
+                ulong target = 0;
+                long position = -1;
+
+                while (Input.Position < seekEnd)
+                {
+                    long childSize;
+                    uint childId = ReadElementHeader(out childSize);
+
+                    if (childId == SeekID) target = ReadUInt(childSize);
+                    else if (childId == SeekPosition) position = (long)ReadUInt(childSize);
+                    else Skip(childSize);
+                }
+
+                if (target == Cues && position >= 0) CuesPosition = SegmentDataStart + position;
+            }
+        }
+
+        private void ReadTracks(long end)
+        {
+            while (Input.Position < end)
+            {
+                long size;
+                uint id = ReadElementHeader(out size);
+
+                if (id == TrackEntry) TrackList.Add(ReadTrackEntry(Input.Position + size));
+                else Skip(size);
+            }
+        }
+
+        private MatroskaTrack ReadTrackEntry(long end)
+        {
+            var track = new MatroskaTrack();
+
+            while (Input.Position < end)
+            {
+                long size;
+                uint id = ReadElementHeader(out size);
+
+                if (id == TrackNumber) track.Number = (int)ReadUInt(size);
+                else if (id == TrackType) track.Type = (int)ReadUInt(size);
+                else if (id == CodecID) track.CodecID = ReadString(size);
+                else if (id == CodecPrivate) track.CodecPrivate = ReadBytes(size);
+                else if (id == DefaultDuration) track.DefaultDurationNs = (long)ReadUInt(size);
+                else if (id == ContentEncodings) ReadContentEncodings(track, Input.Position + size);
+                else Skip(size);
+            }
+
+            return track;
+        }
+
+        private void ReadContentEncodings(MatroskaTrack track, long end)
+        {
+            while (Input.Position < end)
+            {
+                long size;
+                uint id = ReadElementHeader(out size);
+
+                if (id != ContentEncoding)
+                {
+                    Skip(size);
+                    continue;
+                }
+
+                long encodingEnd = Input.Position + size;
+                while (Input.Position < encodingEnd)
+                {
+                    long childSize;
+                    uint childId = ReadElementHeader(out childSize);
+
+                    if (childId == ContentEncodingType)
+                    {
+                        if (ReadUInt(childSize) != 0) track.Unsupported = "encrypted track";
+                    }
+                    else if (childId == ContentCompression)
+                    {
+                        long compressionEnd = Input.Position + childSize;
+                        ulong algorithm = 0;
+
+                        while (Input.Position < compressionEnd)
+                        {
+                            long settingSize;
+                            uint settingId = ReadElementHeader(out settingSize);
+
+                            if (settingId == ContentCompAlgo) algorithm = ReadUInt(settingSize);
+                            else if (settingId == ContentCompSettings) track.StrippedHeader = ReadBytes(settingSize);
+                            else Skip(settingSize);
+                        }
+
+                        // only header stripping can be undone without a decompressor
+                        if (algorithm != 3) track.Unsupported = "compressed track (algorithm " + algorithm + ")";
+                    }
+                    else Skip(childSize);
+                }
+            }
+        }
+
+        private bool ReadBlockGroup(MatroskaBlock block, long end)
+        {
+            bool found = false;
+            bool referenced = false;
+
+            while (Input.Position < end)
+            {
+                long size;
+                uint id = ReadElementHeader(out size);
+
+                if (id == Block)
+                {
+                    ReadBlockPayload(block, size);
+                    found = true;
+                }
+                else if (id == ReferenceBlock)
+                {
+                    referenced = true;
+                    Skip(size);
+                }
+                else Skip(size);
+            }
+
+            block.Keyframe = !referenced;
+            return found;
+        }
+
+        private void ReadBlockPayload(MatroskaBlock block, long size)
+        {
+            long end = Input.Position + size;
+
+            int trackNumber = (int)ReadVarInt(true);
+            ReadFully(Scratch, 0, 3);
+
+            block.TrackNumber = trackNumber;
+            block.TimecodeNs = (ClusterTimecodeValue + (short)((Scratch[0] << 8) | Scratch[1])) * TimecodeScaleNs;
+            block.Flags = Scratch[2];
+
+            MatroskaTrack track = FindTrack(trackNumber);
+            byte[] header = (track != null) ? track.StrippedHeader : null;
+            int headerLength = (header != null) ? header.Length : 0;
+
+            int lacing = (block.Flags >> 1) & 0x03;
+            int payloadLength = (int)(end - Input.Position);
+
+            if (lacing == 0)
+            {
+                block.FrameCount = 1;
+                block.Reset(payloadLength + headerLength);
+                if (headerLength > 0) block.Append(header, 0, headerLength);
+                block.AppendFrom(this, payloadLength);
+                return;
+            }
+
+            int frameCount = Input.ReadByte() + 1;
+            var frameSizes = new int[frameCount];
+            int laced = 0;
+
+            if (lacing == 1)
+            {
+                // Xiph lacing
+                for (int i = 0; i < frameCount - 1; i++)
+                {
+                    int value;
+                    do
+                    {
+                        value = Input.ReadByte();
+                        frameSizes[i] += value;
+                    } while (value == 255);
+
+                    laced += frameSizes[i];
+                }
+            }
+            else if (lacing == 3)
+            {
+                // EBML lacing, sizes after the first are signed differences
+                if (frameCount > 1)
+                {
+                    frameSizes[0] = (int)ReadVarInt(true);
+                    laced = frameSizes[0];
+                }
+
+                for (int i = 1; i < frameCount - 1; i++)
+                {
+                    long start = Input.Position;
+                    long raw = (long)ReadVarInt(true);
+                    int length = (int)(Input.Position - start);
+                    long bias = (1L << (7 * length - 1)) - 1;
+
+                    frameSizes[i] = frameSizes[i - 1] + (int)(raw - bias);
+                    laced += frameSizes[i];
+                }
+            }
+
+            int dataLength = (int)(end - Input.Position);
+
+            if (lacing == 2)
+            {
+                // fixed lacing
+                for (int i = 0; i < frameCount; i++) frameSizes[i] = dataLength / frameCount;
+            }
+            else
+            {
+                frameSizes[frameCount - 1] = dataLength - laced;
+            }
+
+            block.FrameCount = frameCount;
+            block.Reset(dataLength + headerLength * frameCount);
+
+            for (int i = 0; i < frameCount; i++)
+            {
+                if (headerLength > 0) block.Append(header, 0, headerLength);
+                block.AppendFrom(this, frameSizes[i]);
+            }
+
+            Input.Position = end;
+        }
+
+        internal void ReadFully(byte[] buffer, int offset, int count)
+        {
+            while (count > 0)
+            {
+                int read = Input.Read(buffer, offset, count);
+                if (read <= 0) throw new EndOfStreamException("Unexpected end of Matroska file.");
+
+                offset += read;
+                count -= read;
+            }
+        }
+
+        /// <summary>
+        /// Reads an element ID and its data size. Size is UnknownSize for live-style elements.
+        /// </summary>
+        private uint ReadElementHeader(out long size)
+        {
+            uint id = (uint)ReadVarInt(false);
+            long start = Input.Position;
+            ulong value = ReadVarInt(true);
+            int length = (int)(Input.Position - start);
+
+            size = (value == (1UL << (7 * length)) - 1) ? UnknownSize : (long)value;
+            return id;
+        }
+
+        /// <summary>
+        /// Reads an EBML variable length integer. IDs keep their length marker bit, sizes don't.
+        /// </summary>
+        private ulong ReadVarInt(bool stripMarker)
+        {
+            int first = Input.ReadByte();
+            if (first < 0) throw new EndOfStreamException("Unexpected end of Matroska file.");
+            if (first == 0) throw new InvalidDataException("Invalid EBML variable length integer.");
+
+            int length = 1;
+            int mask = 0x80;
+            while ((first & mask) == 0)
+            {
+                mask >>= 1;
+                length++;
+            }
+
+            ulong value = (ulong)(stripMarker ? (first & (mask - 1)) : first);
+
+            if (length > 1)
+            {
+                ReadFully(Scratch, 0, length - 1);
+                for (int i = 0; i < length - 1; i++) value = (value << 8) | Scratch[i];
+            }
+
+            return value;
+        }
+
+        private ulong ReadUInt(long size)
+        {
+            ulong value = 0;
+            for (long i = 0; i < size; i++)
+            {
+                int b = Input.ReadByte();
+                if (b < 0) throw new EndOfStreamException("Unexpected end of Matroska file.");
+                value = (value << 8) | (uint)b;
+            }
+
+            return value;
+        }
+
+        private double ReadFloat(long size)
+        {
+            byte[] data = ReadBytes(size);
+            if (BitConverter.IsLittleEndian) Array.Reverse(data);
+
+            if (size == 4) return BitConverter.ToSingle(data, 0);
+            if (size == 8) return BitConverter.ToDouble(data, 0);
+            return 0;
+        }
+
+        private String ReadString(long size)
+        {
+            return Encoding.UTF8.GetString(ReadBytes(size)).TrimEnd('\0');
+        }
+
+        private byte[] ReadBytes(long size)
+        {
+            var data = new byte[size];
+            ReadFully(data, 0, (int)size);
+            return data;
+        }
+
+        private void Skip(long size)
+        {
+            if (size == UnknownSize) throw new InvalidDataException("Cannot skip an unknown-sized element.");
+            Input.Seek(size, SeekOrigin.Current);
+        }
+
+        #endregion
+    }
+
+    class MatroskaTrack
+    {
+        public const int VideoType = 1;
+        public const int AudioType = 2;
+
+        public int Number;
+        public int Type;
+        public String CodecID;
+        public byte[] CodecPrivate;
+        public long DefaultDurationNs;
+        public byte[] StrippedHeader;
+
+        /// <summary>Set when the track uses a content encoding we can't undo.</summary>
+        public String Unsupported;
+    }
+
+    class MatroskaCuePoint
+    {
+        public long TimeNs;
+        public long ClusterPosition;
+    }
+
+    /// <summary>
+    /// A demuxed block. The payload lives in a pooled lease that is reused from block to block; Detach
+    /// hands it to the next stage, which releases it when done.
+    /// </summary>
+    class MatroskaBlock
+    {
+        public int TrackNumber;
+        public long TimecodeNs;
+        public bool Keyframe;
+        public byte Flags;
+        public int FrameCount;
+
+        public BufferLease Lease;
+        public int Length;
+
+        public byte[] Data
+        {
+            get { return Lease.Buffer; }
+        }
+
+        /// <summary>
+        /// Takes the payload lease away from the block, so the next ReadBlock rents a fresh one.
+        /// </summary>
+        public BufferLease Detach()
+        {
+            BufferLease lease = Lease;
+            lease.Length = Length;
+            Lease = null;
+            return lease;
+        }
+
+        public void Release()
+        {
+            if (Lease != null) Lease.Release();
+            Lease = null;
+        }
+
+        internal void Reset(int capacity)
+        {
+            if (Lease != null && Lease.Capacity < capacity) Release();
+            if (Lease == null) Lease = BufferPool.Shared.Rent(capacity);
+
+            Length = 0;
+        }
+
+        internal void Append(byte[] source, int offset, int count)
+        {
+            Buffer.BlockCopy(source, offset, Lease.Buffer, Length, count);
+            Length += count;
+        }
+
+        internal void AppendFrom(MatroskaReader reader, int count)
+        {
+            reader.ReadFully(Lease.Buffer, Length, count);
+            Length += count;
+        }
+    }
+}
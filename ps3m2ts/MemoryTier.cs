@@ -0,0 +1,174 @@
+﻿/*
+ * ps3m2ts
+ *
+ * Copyright (R) 2009-> Henning M. Stephansen
+ * Feel free to use the code by any means, hopefully you can submit your improvements, ideas etc
+ * to henningms@gmail.com or leave a comment at my blog http://www.henning.ms
+ *
+ */
+
+using System;
+using System.Collections.Generic;
+using System.Globalization;
+using System.IO;
+
+namespace ps3m2ts
+{
+    /// <summary>
+    /// Memory-backed directory (tmpfs such as /dev/shm, or a RAM disk) that intermediates are placed in
+    /// while they fit its budget. Whatever doesn't fit spills to the job's scratch directory on disk.
+    /// Jobs sharing a root share the budget.
+    /// </summary>
+    class MemoryTier
+    {
+        #region Constructor
+
+        private MemoryTier(String Path, long Budget)
+        {
+            this.Path = Path;
+            this.Budget = Budget;
+        }
+
+        #endregion
+
+        #region Private Fields
+
+        private static readonly Dictionary<String, MemoryTier> Tiers = new Dictionary<String, MemoryTier>(StringComparer.OrdinalIgnoreCase);
+
+        private readonly object Sync = new object();
+        private long Reserved;
+        private int Hits;
+        private int Spills;
+        private long HitBytes;
+        private long SpillBytes;
+
+        #endregion
+
+        #region Public Properties
+
+        public String Path { get; private set; }
+
+        /// <summary>Bytes the intermediates in memory may take together.</summary>
+        public long Budget { get; private set; }
+
+        /// <summary>tmpfs where there is one (Linux), otherwise null and /ramdir has to name a RAM disk.</summary>
+        public static String DefaultPath
+        {
+            get { return Directory.Exists("/dev/shm") ? "/dev/shm" : null; }
+        }
+
+        #endregion
+
+        #region Public Methods
+
+        /// <summary>
+        /// The tier rooted at path; the first caller's budget counts.
+        /// </summary>
+        public static MemoryTier For(String path, long budget)
+        {
+            String fullPath = System.IO.Path.GetFullPath(path);
+
+            lock (Tiers)
+            {
+                MemoryTier tier;
+                if (!Tiers.TryGetValue(fullPath, out tier))
+                {
+                    tier = new MemoryTier(fullPath, budget);
+                    Tiers.Add(fullPath, tier);
+                }
+
+                return tier;
+            }
+        }
+
+        /// <summary>
+        /// Takes bytes of the budget for one intermediate and returns true, or counts a spill and returns
+        /// false if they don't fit. An intermediate already in memory from an earlier run is always kept
+        /// there (force), so resuming finds it where the journal says it is.
+        /// </summary>
+        public bool Reserve(long bytes, bool force)
+        {
+            lock (Sync)
+            {
+                if (!force && Reserved + bytes > Budget)
+                {
+                    Spills++;
+                    SpillBytes += bytes;
+                    return false;
+                }
+
+                Reserved += bytes;
+                Hits++;
+                HitBytes += bytes;
+                return true;
+            }
+        }
+
+        /// <summary>
+        /// Grows a reservation to the size the intermediate actually reached; false if that doesn't fit.
+        /// </summary>
+        public bool Grow(long bytes)
+        {
+            lock (Sync)
+            {
+                if (Reserved + bytes > Budget) return false;
+
+                Reserved += bytes;
+                HitBytes += bytes;
+                return true;
+            }
+        }
+
+        /// <summary>
+        /// An intermediate that outgrew its reservation was moved to disk after all.
+        /// </summary>
+        public void Spill(long reserved, long size)
+        {
+            lock (Sync)
+            {
+                Reserved -= reserved;
+                Hits--;
+                HitBytes -= reserved;
+                Spills++;
+                SpillBytes += size;
+            }
+        }
+
+        public void Release(long bytes)
+        {
+            lock (Sync)
+            {
+                Reserved -= bytes;
+            }
+        }
+
+        /// <summary>
+        /// One summary line per tier used: how many intermediates stayed in memory and how many spilled.
+        /// </summary>
+        public static List<String> DescribeTotals()
+        {
+            var lines = new List<String>();
+
+            lock (Tiers)
+            {
+                foreach (MemoryTier tier in Tiers.Values)
+                {
+                    lock (tier.Sync)
+                    {
+                        if (tier.Hits + tier.Spills == 0) continue;
+
+                        long total = tier.HitBytes + tier.SpillBytes;
+                        lines.Add(String.Format(CultureInfo.InvariantCulture,
+                                                "Memory scratch '{0}': {1} intermediate(s) in memory, {2} spilled to disk; hit ratio {3:0.0}% ({4:0.0} of {5:0.0} MB).",
+                                                tier.Path, tier.Hits, tier.Spills, (total > 0) ? 100.0 * tier.HitBytes / total : 0,
+                                                tier.HitBytes / 1048576.0, total / 1048576.0));
+                    }
+                }
+            }
+
+            return lines;
+        }
+
+        #endregion
+    }
+}
@@ -0,0 +1,420 @@
+﻿/*
+ * ps3m2ts
+ *
+ * Copyright (R) 2009-> Henning M. Stephansen
+ * Feel free to use the code by any means, hopefully you can submit your improvements, ideas etc
+ * to henningms@gmail.com or leave a comment at my blog http://www.henning.ms
+ *
+ */
+
+using System;
+using System.Collections.Generic;
+using System.Globalization;
+using System.IO;
+using System.Text;
+using System.Threading;
+
+namespace ps3m2ts
+{
+    /// <summary>
+    /// Counter with optional labels. Children are created once per label set; counting is a single
+    /// Interlocked.Add, so hot paths keep a reference to their child.
+    /// </summary>
+    class Counter
+    {
+        #region Constructor
+
+        public Counter(String Name, String Help, params String[] LabelNames)
+        {
+            this.Name = Name;
+            this.Help = Help;
+            this.LabelNames = LabelNames;
+
+            Children = new Dictionary<String, Child>();
+        }
+
+        #endregion
+
+        #region Private Fields
+
+        public class Child
+        {
+            internal String Labels;
+            internal long Count;
+
+            public void Add(long value)
+            {
+                Interlocked.Add(ref Count, value);
+            }
+
+            public void Increment()
+            {
+                Interlocked.Increment(ref Count);
+            }
+
+            public long Value
+            {
+                get { return Interlocked.Read(ref Count); }
+            }
+        }
+
+        private readonly String[] LabelNames;
+        private readonly Dictionary<String, Child> Children;
+
+        #endregion
+
+        #region Public Properties
+
+        public String Name { get; private set; }
+        public String Help { get; private set; }
+
+        #endregion
+
+        #region Public Methods
+
+        public Child Labels(params String[] values)
+        {
+            String labels = Metrics.FormatLabels(LabelNames, values);
+
+            lock (Children)
+            {
+                Child child;
+                if (!Children.TryGetValue(labels, out child))
+                {
+                    child = new Child();
+                    child.Labels = labels;
+                    Children.Add(labels, child);
+                }
+
+                return child;
+            }
+        }
+
+        public void Write(StringBuilder text)
+        {
+            text.Append("# HELP ").Append(Name).Append(' ').Append(Help).Append('\n');
+            text.Append("# TYPE ").Append(Name).Append(" counter\n");
+
+            lock (Children)
+            {
+                foreach (Child child in Children.Values)
+                    text.Append(Name).Append(child.Labels).Append(' ').Append(Interlocked.Read(ref child.Count).ToString(CultureInfo.InvariantCulture)).Append('\n');
+            }
+        }
+
+        #endregion
+    }
+
+    /// <summary>
+    /// Histogram of durations in seconds with fixed buckets, labelled like Counter.
+    /// </summary>
+    class Histogram
+    {
+        #region Constructor
+
+        public Histogram(String Name, String Help, double[] Buckets, params String[] LabelNames)
+        {
+            this.Name = Name;
+            this.Help = Help;
+            this.Buckets = Buckets;
+            this.LabelNames = LabelNames;
+
+            Children = new Dictionary<String, Child>();
+        }
+
+        #endregion
+
+        #region Private Fields
+
+        public class Child
+        {
+            internal String Labels;
+            internal double[] Buckets;
+            internal long[] Counts;
+            internal long Count;
+            internal long SumMicroseconds;
+
+            public void Observe(TimeSpan duration)
+            {
+                double seconds = duration.TotalSeconds;
+
+                // non-cumulative here, summed up when written
+                int bucket = 0;
+                while (bucket < Buckets.Length && seconds > Buckets[bucket]) bucket++;
+                if (bucket < Buckets.Length) Interlocked.Increment(ref Counts[bucket]);
+
+                Interlocked.Increment(ref Count);
+                Interlocked.Add(ref SumMicroseconds, (long)(seconds * 1000000));
+            }
+        }
+
+        private readonly double[] Buckets;
+        private readonly String[] LabelNames;
+        private readonly Dictionary<String, Child> Children;
+
+        #endregion
+
+        #region Public Properties
+
+        public String Name { get; private set; }
+        public String Help { get; private set; }
+
+        #endregion
+
+        #region Public Methods
+
+        public Child Labels(params String[] values)
+        {
+            String labels = Metrics.FormatLabels(LabelNames, values);
+
+            lock (Children)
+            {
+                Child child;
+                if (!Children.TryGetValue(labels, out child))
+                {
+                    child = new Child();
+                    child.Labels = labels;
+                    child.Buckets = Buckets;
+                    child.Counts = new long[Buckets.Length];
+                    Children.Add(labels, child);
+                }
+
+                return child;
+            }
+        }
+
+        public void Write(StringBuilder text)
+        {
+            text.Append("# HELP ").Append(Name).Append(' ').Append(Help).Append('\n');
+            text.Append("# TYPE ").Append(Name).Append(" histogram\n");
+
+            lock (Children)
+            {
+                foreach (Child child in Children.Values)
+                {
+                    // the "le" label goes after the others
+                    String prefix = (child.Labels.Length > 0) ? child.Labels.Substring(0, child.Labels.Length - 1) + "," : "{";
+
+                    long cumulative = 0;
+                    for (int i = 0; i < Buckets.Length; i++)
+                    {
+                        cumulative += Interlocked.Read(ref child.Counts[i]);
+                        text.Append(Name).Append("_bucket").Append(prefix).Append("le=\"").Append(Buckets[i].ToString(CultureInfo.InvariantCulture))
+                            .Append("\"} ").Append(cumulative.ToString(CultureInfo.InvariantCulture)).Append('\n');
+                    }
+
+                    long count = Interlocked.Read(ref child.Count);
+                    text.Append(Name).Append("_bucket").Append(prefix).Append("le=\"+Inf\"} ").Append(count.ToString(CultureInfo.InvariantCulture)).Append('\n');
+                    text.Append(Name).Append("_sum").Append(child.Labels).Append(' ')
+                        .Append((Interlocked.Read(ref child.SumMicroseconds) / 1000000.0).ToString("0.######", CultureInfo.InvariantCulture)).Append('\n');
+                    text.Append(Name).Append("_count").Append(child.Labels).Append(' ').Append(count.ToString(CultureInfo.InvariantCulture)).Append('\n');
+                }
+            }
+        }
+
+        #endregion
+    }
+
+    /// <summary>
+    /// The metrics of a run, written in the Prometheus text format for the node exporter's textfile
+    /// collector (/metrics=file.prom). Queue depths, slot usage, the buffer pool's counters and GC
+    /// collections are read when the file is written; everything else is counted where it happens.
+    /// </summary>
+    static class Metrics
+    {
+        #region Public Fields
+
+        public static readonly Counter Files = new Counter("ps3m2ts_files_total", "Input files finished, by outcome.", "status");
+
+        public static readonly Counter BytesRead = new Counter("ps3m2ts_bytes_read_total", "Bytes read by each stage.", "stage");
+
+        public static readonly Counter BytesWritten = new Counter("ps3m2ts_bytes_written_total", "Bytes of intermediates and output written by each stage.", "stage");
+
+        public static readonly Counter TranscodesSkipped = new Counter("ps3m2ts_transcodes_skipped_total", "Files that needed no audio transcode, by reason.", "reason");
+
+        public static readonly Counter Failures = new Counter("ps3m2ts_failures_total", "Failed stages.", "stage");
+
+        public static readonly Histogram StageSeconds = new Histogram("ps3m2ts_stage_seconds", "Duration of each stage in seconds.",
+                                                                      new[] { 1.0, 5, 15, 30, 60, 120, 300, 600, 1200, 1800, 3600 }, "stage");
+
+        #endregion
+
+        #region Private Fields
+
+        private class GaugeFamily
+        {
+            public String Name;
+            public String Help;
+            public List<KeyValuePair<String, Func<double>>> Values = new List<KeyValuePair<String, Func<double>>>();
+        }
+
+        private static readonly List<GaugeFamily> Gauges = new List<GaugeFamily>();
+
+        private static String Path;
+        private static Thread Exporter;
+
+        #endregion
+
+        #region Public Methods
+
+        /// <summary>
+        /// Adds a gauge read each time the metrics are written; one name can have several label sets.
+        /// </summary>
+        public static void Gauge(String name, String help, String labelName, String labelValue, Func<double> read)
+        {
+            lock (Gauges)
+            {
+                GaugeFamily gauge = Gauges.Find(g => g.Name == name);
+                if (gauge == null)
+                {
+                    gauge = new GaugeFamily();
+                    gauge.Name = name;
+                    gauge.Help = help;
+                    Gauges.Add(gauge);
+                }
+
+                String labels = FormatLabels(new[] { labelName }, new[] { labelValue });
+                gauge.Values.RemoveAll(v => v.Key == labels);
+                gauge.Values.Add(new KeyValuePair<String, Func<double>>(labels, read));
+            }
+        }
+
+        /// <summary>
+        /// Current value of a gauge, summed over its label sets; 0 if there is none.
+        /// </summary>
+        public static double Read(String name)
+        {
+            double sum = 0;
+
+            lock (Gauges)
+            {
+                GaugeFamily gauge = Gauges.Find(g => g.Name == name);
+                if (gauge != null) foreach (KeyValuePair<String, Func<double>> value in gauge.Values) sum += value.Value();
+            }
+
+            return sum;
+        }
+
+        /// <summary>
+        /// Writes the metrics to path now and then every interval until the process ends.
+        /// </summary>
+        public static void StartExport(String path, TimeSpan interval)
+        {
+            Path = path;
+            Write();
+
+            Exporter = new Thread(delegate()
+                {
+                    while (true)
+                    {
+                        Thread.Sleep(interval);
+                        Write();
+                    }
+                });
+            Exporter.Name = "metrics";
+            Exporter.IsBackground = true;
+            Exporter.Start();
+        }
+
+        /// <summary>
+        /// Writes the file, if exporting. The collector may read it at any time, so it is written next to
+        /// it and renamed over it.
+        /// </summary>
+        public static void Write()
+        {
+            if (Path == null) return;
+
+            var text = new StringBuilder();
+            Files.Write(text);
+            BytesRead.Write(text);
+            BytesWritten.Write(text);
+            TranscodesSkipped.Write(text);
+            Failures.Write(text);
+            StageSeconds.Write(text);
+            WritePool(text);
+
+            lock (Gauges)
+            {
+                foreach (GaugeFamily gauge in Gauges)
+                {
+                    text.Append("# HELP ").Append(gauge.Name).Append(' ').Append(gauge.Help).Append('\n');
+                    text.Append("# TYPE ").Append(gauge.Name).Append(" gauge\n");
+
+                    foreach (KeyValuePair<String, Func<double>> value in gauge.Values)
+                        text.Append(gauge.Name).Append(value.Key).Append(' ').Append(value.Value().ToString(CultureInfo.InvariantCulture)).Append('\n');
+                }
+            }
+
+            try
+            {
+                lock (Gauges)
+                {
+                    String temporary = Path + ".tmp";
+                    File.WriteAllText(temporary, text.ToString());
+
+                    // replaced in one step, so a scrape never finds the file missing
+                    if (File.Exists(Path)) File.Replace(temporary, Path, null);
+                    else File.Move(temporary, Path);
+                }
+            }
+            catch (IOException)
+            {
+            }
+            catch (UnauthorizedAccessException)
+            {
+            }
+        }
+
+        #endregion
+
+        #region Private Methods
+
+        /// <summary>
+        /// The shared buffer pool's counters and the GC collection counts, so allocation regressions of
+        /// the native stages show on a graph and not only in the log line of each remux.
+        /// </summary>
+        private static void WritePool(StringBuilder text)
+        {
+            BufferPoolStatistics pool = BufferPool.Shared.GetStatistics();
+
+            WriteValue(text, "ps3m2ts_pool_rents_total", "Buffers rented from the buffer pool.", "counter", pool.Rents);
+            WriteValue(text, "ps3m2ts_pool_allocations_total", "Buffers the pool allocated because it had none free.", "counter", pool.Allocations);
+            WriteValue(text, "ps3m2ts_pool_allocated_bytes_total", "Bytes of the buffers the pool allocated.", "counter", pool.AllocatedBytes);
+            WriteValue(text, "ps3m2ts_pool_outstanding", "Buffers rented and not returned yet.", "gauge", pool.Rents - pool.Returns);
+
+            text.Append("# HELP ps3m2ts_gc_collections Garbage collections since the start, by generation.\n");
+            text.Append("# TYPE ps3m2ts_gc_collections gauge\n");
+            for (int generation = 0; generation <= GC.MaxGeneration; generation++)
+                text.Append("ps3m2ts_gc_collections").Append(FormatLabels(new[] { "generation" }, new[] { generation.ToString(CultureInfo.InvariantCulture) }))
+                    .Append(' ').Append(GC.CollectionCount(generation).ToString(CultureInfo.InvariantCulture)).Append('\n');
+        }
+
+        private static void WriteValue(StringBuilder text, String name, String help, String type, long value)
+        {
+            text.Append("# HELP ").Append(name).Append(' ').Append(help).Append('\n');
+            text.Append("# TYPE ").Append(name).Append(' ').Append(type).Append('\n');
+            text.Append(name).Append(' ').Append(value.ToString(CultureInfo.InvariantCulture)).Append('\n');
+        }
+
+        /// <summary>
+        /// {name="value",...}, or nothing without labels.
+        /// </summary>
+        internal static String FormatLabels(String[] names, String[] values)
+        {
+            if (names.Length == 0) return "";
+
+            var labels = new StringBuilder("{");
+            for (int i = 0; i < names.Length; i++)
+            {
+                if (i > 0) labels.Append(',');
+
+                String value = (i < values.Length && values[i] != null) ? values[i] : "";
+                labels.Append(names[i]).Append("=\"").Append(value.Replace("\\", "\\\\").Replace("\"", "\\\"").Replace("\n", "\\n")).Append('"');
+            }
+
+            return labels.Append('}').ToString();
+        }
+
+        #endregion
+    }
+}
@@ -0,0 +1,408 @@
+﻿/*
+ * ps3m2ts
+ *
+ * Copyright (R) 2009-> Henning M. Stephansen
+ * Feel free to use the code by any means, hopefully you can submit your improvements, ideas etc
+ * to henningms@gmail.com or leave a comment at my blog http://www.henning.ms
+ *
+ */
+
+using System;
+using System.Collections.Generic;
+using System.Diagnostics;
+using System.Globalization;
+using System.IO;
+using System.Threading;
+
+namespace ps3m2ts
+{
+    /// <summary>
+    /// Fast path for files that are already PS3 compatible (H.264 up to level 4.1 with AC-3 audio).
+    /// Matroska blocks are streamed straight into the transport stream packetizer, skipping the
+    /// meta file and the tsMuxeR pass over the whole file.
+    /// </summary>
+    class NativeRemuxer
+    {
+        #region Constants
+
+        private const int IOBufferSize = 1 << 20;
+
+        /// <summary>Frames held back to derive decoding time stamps from presentation order.</summary>
+        private const int ReorderDepth = 4;
+
+        /// <summary>Decoding time stamps run this many frames ahead of presentation, room for B-frame reordering.</summary>
+        private const int ReorderDelayFrames = 2;
+
+        /// <summary>
+        /// Offset added to every time stamp so the stream doesn't start at zero (1 s); it also keeps the
+        /// first DTS, ReorderDelayFrames before its PTS, positive.
+        /// </summary>
+        private const long TimestampOffset = 90000;
+
+        /// <summary>Blocks the demux thread may run ahead of the muxer.</summary>
+        private const int DemuxQueueDepth = 64;
+
+        #endregion
+
+        #region Constructor
+
+        internal NativeRemuxer(Support.MediaInfo Video, Support.MediaInfo Audio, bool M2TS)
+        {
+            this.Video = Video;
+            this.Audio = Audio;
+            this.M2TS = M2TS;
+            this.PendingFrames = new Queue<VideoFrame>();
+            this.PendingPts = new List<long>();
+        }
+
+        #endregion
+
+        #region Private Fields
+
+        private struct VideoFrame
+        {
+            public BufferLease Lease;
+            public long Pts;
+            public bool Keyframe;
+        }
+
+        private struct DemuxedBlock
+        {
+            public int TrackNumber;
+            public long TimecodeNs;
+            public bool Keyframe;
+            public int FrameCount;
+            public BufferLease Lease;
+        }
+
+        private readonly Support.MediaInfo Video;
+        private readonly Support.MediaInfo Audio;
+        private readonly bool M2TS;
+
+        private TSPacketizer Packetizer;
+        private H264.DecoderConfig AvcConfig;
+        private int VideoTrackNumber;
+        private int AudioTrackNumber;
+        private long FrameDuration;
+        private long LastDts = long.MinValue;
+
+        private readonly Queue<VideoFrame> PendingFrames;
+        private readonly List<long> PendingPts;
+
+        #endregion
+
+        #region Public Methods
+
+        /// <summary>
+        /// Decides from the probed tracks whether the file can skip tsMuxeR. Only plain .m2ts/.ts output
+        /// qualifies; splitting, Blu-ray and AVCHD structures still need tsMuxeR.
+        /// </summary>
+        public static bool CanRemux(List<Support.MediaInfo> tracks, string outputformat, bool split)
+        {
+            if (split || ((outputformat != "m2ts") && (outputformat != "ts"))) return false;
+            if (tracks == null || tracks.Count != 2) return false;
+
+            Support.MediaInfo video = tracks[0];
+            Support.MediaInfo audio = tracks[1];
+
+            if (video.Type != Support.MediaType.Video || video.CodecID != "V_MPEG4/ISO/AVC") return false;
+            if (audio.Type != Support.MediaType.Audio || audio.CodecID != "A_AC3") return false;
+
+            double level = ParseLevel(video.Level);
+            return (level > 0) && (level <= 4.1);
+        }
+
+        /// <summary>
+        /// Remuxes the first video and audio track of the file into outputfile. Returns false (and removes
+        /// any partial output) if the file turned out to be something the fast path can't handle, so the
+        /// caller can fall back to tsMuxeR.
+        /// </summary>
+        public static bool Remux(string file, string outputfile, List<Support.MediaInfo> tracks, string outputformat, Logger Log,
+                                 ProgressTracker Progress)
+        {
+            var remuxer = new NativeRemuxer(tracks[0], tracks[1], outputformat == "m2ts");
+            remuxer.Progress = Progress;
+            var watch = Stopwatch.StartNew();
+            BufferPoolStatistics poolBefore = BufferPool.Shared.GetStatistics();
+            long bytesRead = 0;
+
+            try
+            {
+                using (Stream input = ResourceGovernor.Throttle(new FileStream(file, FileMode.Open, FileAccess.Read, FileShare.Read, IOBufferSize)))
+                using (Stream output = ResourceGovernor.Throttle(new FileStream(outputfile, FileMode.Create, FileAccess.Write, FileShare.None, IOBufferSize)))
+                {
+                    remuxer.Run(input, output);
+                    bytesRead = input.Length;
+                }
+            }
+            catch (Exception ex)
+            {
+                Log.Log("Fast path: unable to remux '" + file + "' natively (" + ex.Message + "), falling back to tsMuxeR.");
+
+                try
+                {
+                    if (File.Exists(outputfile)) File.Delete(outputfile);
+                }
+                catch
+                {
+                }
+
+                return false;
+            }
+
+            double seconds = Math.Max(watch.Elapsed.TotalSeconds, 0.001);
+            Log.Log(String.Format(CultureInfo.InvariantCulture, "Fast path: remuxed {0:0.0} MB in {1:0.0} s ({2:0.0} MB/s).",
+                                  bytesRead / 1048576.0, seconds, bytesRead / 1048576.0 / seconds));
+            Log.Log(BufferPool.Shared.GetStatistics().Describe(poolBefore));
+            return true;
+        }
+
+        /// <summary>
+        /// Parses the level out of a MediaInfo format profile such as "High@L4.1". Returns 0 if unknown.
+        /// </summary>
+        public static double ParseLevel(string profile)
+        {
+            if (String.IsNullOrEmpty(profile)) return 0;
+
+            int index = profile.IndexOf("@L");
+            if (index < 0) return 0;
+
+            string level = profile.Substring(index + 2);
+            int end = 0;
+            while (end < level.Length && (Char.IsDigit(level[end]) || level[end] == '.')) end++;
+
+            double value;
+            if (!Double.TryParse(level.Substring(0, end), NumberStyles.Float, CultureInfo.InvariantCulture, out value)) return 0;
+            return value;
+        }
+
+        #endregion
+
+        #region Private Methods
+
+        private void Run(Stream input, Stream output)
+        {
+            var reader = new MatroskaReader(input);
+            reader.ReadHeaders();
+            Open(reader);
+
+            using (var packetizer = new TSPacketizer(output, M2TS))
+            {
+                Mux(reader, packetizer);
+            }
+        }
+
+        /// <summary>
+        /// Locates the tracks to remux in an opened reader and checks that the bitstream agrees with the probe.
+        /// </summary>
+        internal void Open(MatroskaReader reader)
+        {
+            MatroskaTrack videoTrack = FindTrack(reader, Video.TrackID, MatroskaTrack.VideoType, "V_MPEG4/ISO/AVC");
+            MatroskaTrack audioTrack = FindTrack(reader, Audio.TrackID, MatroskaTrack.AudioType, "A_AC3");
+
+            AvcConfig = H264.ParseAvcC(videoTrack.CodecPrivate);
+            if (AvcConfig.Level > 41)
+                throw new NotSupportedException("H.264 level " + (AvcConfig.Level / 10.0).ToString(CultureInfo.InvariantCulture) + " in the bitstream");
+
+            VideoTrackNumber = videoTrack.Number;
+            AudioTrackNumber = audioTrack.Number;
+
+            // fall back to 24 fps when the track doesn't say; it only sizes the reordering delay
+            FrameDuration = (videoTrack.DefaultDurationNs > 0) ? NsTo90kHz(videoTrack.DefaultDurationNs) : 90000 / 24;
+        }
+
+        /// <summary>
+        /// Streams every block between the reader's position and its EndPosition into the packetizer.
+        /// Demuxing runs on its own thread and hands pooled block leases over through a bounded queue.
+        /// </summary>
+        internal void Mux(MatroskaReader reader, TSPacketizer packetizer)
+        {
+            Packetizer = packetizer;
+            Packetizer.AddStream(TSPacketizer.VideoPid, TSPacketizer.StreamTypeH264, 0xE0);
+            Packetizer.AddStream(TSPacketizer.AudioPid, TSPacketizer.StreamTypeAC3, 0xBD);
+
+            var queue = new BoundedQueue<DemuxedBlock>(DemuxQueueDepth);
+            Exception demuxError = null;
+            Logger.Context context = Logger.Current;
+
+            var demuxer = new Thread(delegate()
+                {
+                    var block = new MatroskaBlock();
+                    long position = reader.Position;
+                    try
+                    {
+                        using (ResourceAccounting.Measure(context, false))
+                        using (TraceRecorder.Span("demux", "native"))
+                        while (reader.ReadBlock(block))
+                        {
+                            if (Progress != null)
+                            {
+                                Progress.Add(reader.Position - position);
+                                position = reader.Position;
+                            }
+
+                            if (block.TrackNumber != VideoTrackNumber && block.TrackNumber != AudioTrackNumber) continue;
+
+                            var item = new DemuxedBlock();
+                            item.TrackNumber = block.TrackNumber;
+                            item.TimecodeNs = block.TimecodeNs;
+                            item.Keyframe = block.Keyframe;
+                            item.FrameCount = block.FrameCount;
+                            item.Lease = block.Detach();
+
+                            if (!queue.Enqueue(item))
+                            {
+                                item.Lease.Release();
+                                break;
+                            }
+                        }
+                    }
+                    catch (Exception ex)
+                    {
+                        demuxError = ex;
+                    }
+                    finally
+                    {
+                        block.Release();
+                        queue.Complete();
+                    }
+                });
+
+            demuxer.Name = "demux";
+            demuxer.IsBackground = true;
+            demuxer.Start();
+
+            try
+            {
+                DemuxedBlock item;
+                using (TraceRecorder.Span("packetize", "native"))
+                while (queue.TryDequeue(out item))
+                {
+                    try
+                    {
+                        if (item.TrackNumber == VideoTrackNumber)
+                        {
+                            if (item.FrameCount != 1) throw new NotSupportedException("laced video blocks");
+                            QueueVideoFrame(item);
+                        }
+                        else
+                        {
+                            // laced AC-3 frames are simply concatenated into one PES; its PTS belongs to the first frame
+                            long pts = NsTo90kHz(item.TimecodeNs) + TimestampOffset;
+                            Packetizer.WritePes(TSPacketizer.AudioPid, item.Lease.Buffer, 0, item.Lease.Length, pts, pts, false);
+                        }
+                    }
+                    finally
+                    {
+                        item.Lease.Release();
+                    }
+                }
+
+                if (demuxError != null) throw demuxError;
+
+                while (PendingFrames.Count > 0) WriteVideoFrame();
+
+                Packetizer.Flush();
+            }
+            finally
+            {
+                queue.Complete();
+                demuxer.Join();
+
+                foreach (DemuxedBlock left in queue.Drain()) left.Lease.Release();
+                foreach (VideoFrame frame in PendingFrames) frame.Lease.Release();
+                PendingFrames.Clear();
+            }
+        }
+
+        internal int VideoTrack
+        {
+            get { return VideoTrackNumber; }
+        }
+
+        /// <summary>Receives the input bytes consumed by the demuxer; may be null.</summary>
+        internal ProgressTracker Progress { get; set; }
+
+        private static MatroskaTrack FindTrack(MatroskaReader reader, int number, int type, string codec)
+        {
+            // MediaInfo reports the Matroska track number as ID, but don't trust it blindly
+            MatroskaTrack track = reader.FindTrack(number);
+
+            if (track == null || track.CodecID != codec)
+            {
+                track = null;
+                foreach (MatroskaTrack candidate in reader.TrackList)
+                {
+                    if (candidate.Type == type && candidate.CodecID == codec)
+                    {
+                        track = candidate;
+                        break;
+                    }
+                }
+            }
+
+            if (track == null) throw new NotSupportedException("no " + codec + " track");
+            if (track.Unsupported != null) throw new NotSupportedException(track.Unsupported);
+
+            return track;
+        }
+
+        private void QueueVideoFrame(DemuxedBlock block)
+        {
+            var frame = new VideoFrame();
+            frame.Lease = BufferPool.Shared.Rent(H264.MaxAnnexBLength(AvcConfig, block.Lease.Length));
+
+            try
+            {
+                frame.Lease.Length = H264.AvccToAnnexB(AvcConfig, block.Lease.Buffer, 0, block.Lease.Length, block.Keyframe, frame.Lease.Buffer);
+            }
+            catch
+            {
+                // a malformed NAL length; the frame never reaches PendingFrames, so nothing else releases it
+                frame.Lease.Release();
+                throw;
+            }
+            frame.Pts = NsTo90kHz(block.TimecodeNs) + TimestampOffset;
+            frame.Keyframe = block.Keyframe;
+
+            PendingFrames.Enqueue(frame);
+
+            int index = PendingPts.BinarySearch(frame.Pts);
+            PendingPts.Insert((index < 0) ? ~index : index, frame.Pts);
+
+            if (PendingFrames.Count > ReorderDepth) WriteVideoFrame();
+        }
+
+        /// <summary>
+        /// Writes the oldest queued frame. Its DTS is the smallest presentation time not yet used, shifted
+        /// back by the reordering delay, which recovers decode timing from Matroska's presentation stamps.
+        /// </summary>
+        private void WriteVideoFrame()
+        {
+            VideoFrame frame = PendingFrames.Dequeue();
+
+            long dts = PendingPts[0] - ReorderDelayFrames * FrameDuration;
+            PendingPts.RemoveAt(0);
+
+            if (dts > frame.Pts) dts = frame.Pts;
+            if (dts <= LastDts) dts = LastDts + 1;
+            LastDts = dts;
+
+            try
+            {
+                Packetizer.WritePes(TSPacketizer.VideoPid, frame.Lease.Buffer, 0, frame.Lease.Length, frame.Pts, dts, frame.Keyframe);
+            }
+            finally
+            {
+                frame.Lease.Release();
+            }
+        }
+
+        private static long NsTo90kHz(long ns)
+        {
+            return ns * 9 / 100000;
+        }
+
+        #endregion
+    }
+}
@@ -0,0 +1,471 @@
+﻿/*
+ * ps3m2ts
+ *
+ * Copyright (R) 2009-> Henning M. Stephansen
+ * Feel free to use the code by any means, hopefully you can submit your improvements, ideas etc
+ * to henningms@gmail.com or leave a comment at my blog http://www.henning.ms
+ *
+ */
+
+using System;
+using System.Collections.Generic;
+using System.Diagnostics;
+using System.Globalization;
+using System.IO;
+using System.Text;
+using System.Threading;
+
+namespace ps3m2ts
+{
+    /// <summary>
+    /// Runs one helper tool (MediaInfo, mkvextract, eac3to, tsMuxeR). Both pipes are drained on their own
+    /// threads so a chatty tool can never block on a full pipe, the run is killed when it exceeds its
+    /// wall-clock limit or stops making progress, and the exit code, CPU time, peak RSS, I/O and page
+    /// faults are reported and added to the resource accounting of the job and stage that ran it.
+    /// Under a bandwidth limit (/maxmbps) the tool's reads and writes are taken from the shared bucket
+    /// and the tool is paused while the bucket is in debt.
+    /// </summary>
+    class ProcessSupervisor
+    {
+        #region Constants
+
+        private const int PollInterval = 250;
+        private const int TailLines = 50;
+        private const int MaxCaptureChars = 16 << 20;
+        private const int KillDrainTimeout = 2000;
+
+        #endregion
+
+        #region Constructor
+
+        public ProcessSupervisor(String Stage, String FileName, String Arguments)
+        {
+            this.Stage = Stage;
+            this.FileName = FileName;
+            this.Arguments = Arguments;
+            this.NoProgressTimeout = DefaultNoProgressTimeout;
+            this.AcceptedExitCodes = new[] { 0 };
+        }
+
+        #endregion
+
+        #region Public Properties
+
+        /// <summary>No-progress limit used by new supervisors; set from /stalltimeout.</summary>
+        public static TimeSpan DefaultNoProgressTimeout = TimeSpan.FromMinutes(10);
+
+        /// <summary>Wall-clock limit for the long stages (extract, transcode, mux); set from /timeout.</summary>
+        public static TimeSpan DefaultWallClockTimeout = TimeSpan.Zero;
+
+        public String Stage { get; private set; }
+        public String FileName { get; private set; }
+        public String Arguments { get; private set; }
+
+        /// <summary>Kill the tool after this long. Zero means no limit.</summary>
+        public TimeSpan WallClockTimeout { get; set; }
+
+        /// <summary>
+        /// Kill the tool when it neither writes output nor uses CPU for this long. Zero means no limit.
+        /// </summary>
+        public TimeSpan NoProgressTimeout { get; set; }
+
+        /// <summary>Keep the complete standard output (up to 16M characters) in the result.</summary>
+        public bool CaptureOutput { get; set; }
+
+        /// <summary>Exit codes that count as success; mkvextract for instance uses 1 for warnings.</summary>
+        public int[] AcceptedExitCodes { get; set; }
+
+        /// <summary>Called on the drain thread for every line the tool writes to standard output.</summary>
+        public Action<String> OutputLine { get; set; }
+
+        /// <summary>Called on the drain thread for every line the tool writes to standard error.</summary>
+        public Action<String> ErrorLine { get; set; }
+
+        /// <summary>
+        /// Checked on every poll; a non-null result kills the tool and becomes the reason it failed.
+        /// </summary>
+        public Func<String> Limit { get; set; }
+
+        /// <summary>Where the run summary goes; may be null.</summary>
+        public Logger Log { get; set; }
+
+        /// <summary>Run the tool on the cores set aside for CPU-heavy work (/cpuset).</summary>
+        public bool CpuHeavy { get; set; }
+
+        #endregion
+
+        #region Private Fields
+
+        private long LastActivityTicks;
+
+        #endregion
+
+        #region Public Methods
+
+        /// <summary>
+        /// Runs the tool to completion. Throws ProcessFailedException if it times out, stalls or exits
+        /// with a code outside AcceptedExitCodes.
+        /// </summary>
+        public ProcessResult Run()
+        {
+            var result = new ProcessResult();
+            result.Stage = Stage;
+            result.FileName = FileName;
+
+            var p = new Process();
+            p.StartInfo.FileName = FileName;
+            p.StartInfo.Arguments = Arguments;
+            p.StartInfo.UseShellExecute = false;
+            p.StartInfo.RedirectStandardError = true;
+            p.StartInfo.RedirectStandardOutput = true;
+            p.StartInfo.CreateNoWindow = true;
+            p.StartInfo.WorkingDirectory = Environment.CurrentDirectory;
+
+            var watch = Stopwatch.StartNew();
+            p.Start();
+            ResourceGovernor.Apply(p, CpuHeavy);
+            Touch();
+
+            var stdout = new PipeDrain(this, p.StandardOutput, OutputLine, CaptureOutput);
+            var stderr = new PipeDrain(this, p.StandardError, ErrorLine, false);
+
+            TimeSpan lastCpu = TimeSpan.Zero;
+            long lastBytes = 0;
+            bool suspended = false;
+
+            try
+            {
+                while (!p.WaitForExit(PollInterval))
+                {
+                    Sample(p, result, ref lastCpu);
+
+                    if (ResourceGovernor.Bandwidth != null) suspended = Throttle(p, result, ref lastBytes, suspended);
+
+                    if (WallClockTimeout > TimeSpan.Zero && watch.Elapsed > WallClockTimeout)
+                    {
+                        result.TimedOut = true;
+                        Kill(p);
+                        break;
+                    }
+
+                    String exceeded = (Limit != null) ? Limit() : null;
+                    if (exceeded != null)
+                    {
+                        result.LimitExceeded = exceeded;
+                        Kill(p);
+                        break;
+                    }
+
+                    if (NoProgressTimeout > TimeSpan.Zero &&
+                        DateTime.UtcNow.Ticks - Interlocked.Read(ref LastActivityTicks) > NoProgressTimeout.Ticks)
+                    {
+                        result.Stalled = true;
+                        Kill(p);
+                        break;
+                    }
+                }
+
+                p.WaitForExit();
+                suspended = false;
+
+                // a killed tool's children can keep the pipes open, so don't wait for them forever
+                if (result.TimedOut || result.Stalled || result.LimitExceeded != null)
+                {
+                    var drainWatch = Stopwatch.StartNew();
+                    stdout.Join(KillDrainTimeout);
+                    stderr.Join(Math.Max(0, KillDrainTimeout - (int)drainWatch.ElapsedMilliseconds));
+                }
+                else
+                {
+                    stdout.Join(Timeout.Infinite);
+                    stderr.Join(Timeout.Infinite);
+                }
+
+                Sample(p, result, ref lastCpu);
+                result.ExitCode = p.ExitCode;
+            }
+            finally
+            {
+                // only left paused when something threw mid-run
+                if (suspended) ResourceGovernor.Suspend(p, false);
+                p.Close();
+            }
+
+            result.WallTime = watch.Elapsed;
+            result.Output = stdout.Captured;
+            result.OutputTail = stdout.Tail;
+            result.ErrorTail = stderr.Tail;
+            result.Succeeded = !result.TimedOut && !result.Stalled && result.LimitExceeded == null && Array.IndexOf(AcceptedExitCodes, result.ExitCode) >= 0;
+
+            // the stage's wall time is measured around the whole stage, the tool only adds what it used
+            Logger.Context context = Logger.Current;
+            if (context != null) ResourceAccounting.Record(context.Job, context.Stage ?? Stage, result.Usage);
+
+            if (Log != null)
+            {
+                Log.Log(result.Describe());
+                TraceRecorder.Record(Path.GetFileName(FileName), "process", result.WallTime, "exit_code", result.ExitCode);
+                Log.Event("process", "tool", Path.GetFileName(FileName), "exit_code", result.ExitCode, "succeeded", result.Succeeded,
+                          "wall_ms", result.WallTime, "cpu_ms", result.CpuTime, "user_ms", result.Usage.UserTime,
+                          "system_ms", result.Usage.SystemTime, "peak_rss_bytes", result.PeakRss,
+                          "read_bytes", result.Usage.ReadBytes, "write_bytes", result.Usage.WriteBytes,
+                          "minor_faults", result.Usage.MinorFaults, "major_faults", result.Usage.MajorFaults,
+                          "timed_out", result.TimedOut, "stalled", result.Stalled);
+            }
+
+            if (!result.Succeeded) throw new ProcessFailedException(result);
+            return result;
+        }
+
+        #endregion
+
+        #region Private Methods
+
+        private void Touch()
+        {
+            Interlocked.Exchange(ref LastActivityTicks, DateTime.UtcNow.Ticks);
+        }
+
+        /// <summary>
+        /// Records CPU time, peak RSS, I/O and page faults. A tool that burns CPU without printing is still
+        /// making progress. On Linux an exited tool can't be read anymore, so the last poll's totals stand
+        /// (at most PollInterval short).
+        /// </summary>
+        private void Sample(Process p, ProcessResult result, ref TimeSpan lastCpu)
+        {
+            try
+            {
+                p.Refresh();
+            }
+            catch
+            {
+            }
+
+            ResourceUsage usage = ResourceUsage.Of(p);
+            if (usage == null) return;
+
+            TimeSpan cpu = usage.CpuTime;
+            if (cpu > lastCpu)
+            {
+                lastCpu = cpu;
+                Touch();
+            }
+
+            usage.PeakRss = Math.Max(result.PeakRss, usage.PeakRss);
+            result.Usage = usage;
+            result.CpuTime = cpu;
+            result.PeakRss = usage.PeakRss;
+        }
+
+        /// <summary>
+        /// Takes what the tool moved since the last poll from the bandwidth bucket and pauses the tool
+        /// while the bucket is in debt. A paused tool counts as making progress. Returns whether the
+        /// tool is paused now.
+        /// </summary>
+        private bool Throttle(Process p, ProcessResult result, ref long lastBytes, bool suspended)
+        {
+            long bytes = result.Usage.ReadBytes + result.Usage.WriteBytes;
+            ResourceGovernor.Bandwidth.Take(bytes - lastBytes);
+            lastBytes = bytes;
+
+            bool indebted = ResourceGovernor.Bandwidth.Debt > TimeSpan.Zero;
+            if (indebted != suspended && ResourceGovernor.Suspend(p, indebted)) suspended = indebted;
+
+            if (suspended) Touch();
+            return suspended;
+        }
+
+        private static void Kill(Process p)
+        {
+            try
+            {
+                p.Kill();
+            }
+            catch
+            {
+            }
+        }
+
+        /// <summary>
+        /// Reads one pipe on a background thread. Lines end at CR, LF or a backspace run (eac3to redraws
+        /// its progress with backspaces); only the last TailLines are kept unless capturing.
+        /// </summary>
+        private class PipeDrain
+        {
+            private readonly ProcessSupervisor Owner;
+            private readonly TextReader Reader;
+            private readonly Action<String> Callback;
+            private readonly StringBuilder Capture;
+            private readonly Queue<String> TailQueue = new Queue<String>();
+            private readonly Thread Thread;
+
+            public PipeDrain(ProcessSupervisor Owner, TextReader Reader, Action<String> Callback, bool Capture)
+            {
+                this.Owner = Owner;
+                this.Reader = Reader;
+                this.Callback = Callback;
+                if (Capture) this.Capture = new StringBuilder();
+
+                // the tool's output belongs to the job and stage that started it
+                Logger.Context context = Logger.Current;
+                Thread = new Thread(delegate()
+                    {
+                        using (Logger.Enter(context)) Drain();
+                    });
+                Thread.Name = Owner.Stage + " pipe";
+                Thread.IsBackground = true;
+                Thread.Start();
+            }
+
+            public String Captured
+            {
+                get { return (Capture != null) ? Capture.ToString() : null; }
+            }
+
+            public List<String> Tail
+            {
+                get
+                {
+                    lock (TailQueue)
+                    {
+                        return new List<String>(TailQueue);
+                    }
+                }
+            }
+
+            public void Join(int timeout)
+            {
+                Thread.Join(timeout);
+            }
+
+            private void Drain()
+            {
+                var buffer = new char[4096];
+                var line = new StringBuilder();
+                char previous = '\0';
+
+                try
+                {
+                    int read;
+                    while ((read = Reader.Read(buffer, 0, buffer.Length)) > 0)
+                    {
+                        Owner.Touch();
+
+                        for (int i = 0; i < read; i++)
+                        {
+                            char c = buffer[i];
+
+                            if (c == '\n' && previous == '\r')
+                            {
+                                // second half of CRLF
+                            }
+                            else if (c == '\r' || c == '\n')
+                            {
+                                Emit(line.ToString());
+                                line.Length = 0;
+                            }
+                            else if (c == '\b')
+                            {
+                                if (line.Length > 0) Emit(line.ToString());
+                                line.Length = 0;
+                            }
+                            else line.Append(c);
+
+                            previous = c;
+                        }
+                    }
+                }
+                catch (IOException)
+                {
+                    // pipe broken because the process was killed
+                }
+
+                if (line.Length > 0) Emit(line.ToString());
+            }
+
+            private void Emit(String text)
+            {
+                if (Capture != null && Capture.Length < MaxCaptureChars)
+                    Capture.Append(text).Append(Environment.NewLine);
+
+                lock (TailQueue)
+                {
+                    TailQueue.Enqueue(text);
+                    if (TailQueue.Count > TailLines) TailQueue.Dequeue();
+                }
+
+                if (Callback != null)
+                {
+                    try
+                    {
+                        Callback(text);
+                    }
+                    catch
+                    {
+                    }
+                }
+            }
+        }
+
+        #endregion
+    }
+
+    class ProcessResult
+    {
+        public String Stage;
+        public String FileName;
+        public int ExitCode;
+        public bool Succeeded;
+        public bool TimedOut;
+        public bool Stalled;
+
+        /// <summary>Why the Limit check killed the tool, if it did.</summary>
+        public String LimitExceeded;
+        public TimeSpan WallTime;
+        public TimeSpan CpuTime;
+        public long PeakRss;
+
+        /// <summary>Everything sampled while the tool ran; CpuTime and PeakRss are taken from it.</summary>
+        public ResourceUsage Usage = new ResourceUsage();
+
+        /// <summary>Complete standard output, only when CaptureOutput was set.</summary>
+        public String Output;
+        public List<String> OutputTail;
+        public List<String> ErrorTail;
+
+        public String Describe()
+        {
+            String outcome = TimedOut ? "timed out" : Stalled ? "stalled and was killed" :
+                             (LimitExceeded != null) ? "was killed, " + LimitExceeded + "," : "exited with code " + ExitCode;
+
+            return String.Format(CultureInfo.InvariantCulture, "{0}: {1} {2} after {3:0.0} s (CPU {4:0.0} s, peak RSS {5:0.0} MB, read {6:0.0} MB, written {7:0.0} MB).",
+                                 Stage, Path.GetFileName(FileName), outcome, WallTime.TotalSeconds, CpuTime.TotalSeconds,
+                                 PeakRss / 1048576.0, Usage.ReadBytes / 1048576.0, Usage.WriteBytes / 1048576.0);
+        }
+    }
+
+    class ProcessFailedException : Exception
+    {
+        public ProcessFailedException(ProcessResult Result)
+            : base(BuildMessage(Result))
+        {
+            this.Result = Result;
+        }
+
+        public ProcessResult Result { get; private set; }
+
+        private static String BuildMessage(ProcessResult result)
+        {
+            var message = new StringBuilder(result.Describe());
+
+            List<String> tail = (result.ErrorTail != null && result.ErrorTail.Count > 0) ? result.ErrorTail : result.OutputTail;
+            if (tail != null && tail.Count > 0)
+            {
+                message.Append(" Last output: ");
+                message.Append(tail[tail.Count - 1]);
+            }
+
+            return message.ToString();
+        }
+    }
+}
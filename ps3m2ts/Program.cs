@@ -37,6 +37,10 @@ namespace ps3m2ts
 
             var log = new Logger("ps3m2ts", (options.ContainsKey("log")), logDirectory);
 
+            if (options.ContainsKey("jsonlog")) log.OpenEventLog(options["jsonlog"]);
+            if (options.ContainsKey("trace")) TraceRecorder.Start(options["trace"]);
+            if (options.ContainsKey("metrics")) Metrics.StartExport(options["metrics"], TimeSpan.FromSeconds(int.Parse(options["metricsinterval"])));
+
             log.Log("ps3m2ts started...");
 
             if ((options == null) || (!options.ContainsKey("input")))
@@ -45,6 +49,12 @@ namespace ps3m2ts
                 Environment.Exit(1);
             }
 
+            if (options.ContainsKey("invalid"))
+            {
+                log.Log("Error: " + options["invalid"]);
+                Environment.Exit(1);
+            }
+
             
             // check the destination is valid
             if (options.ContainsKey("destination"))
@@ -79,8 +89,8 @@ namespace ps3m2ts
 
                 inputFiles.AddRange(filesInDir.Select(fileInDir => fileInDir.FullName));
 
-                // were there any .mkv files in the directory?
-                if (inputFiles.Count == 0)
+                // were there any .mkv files in the directory? (in /watch mode they may come later)
+                if ((inputFiles.Count == 0) && (!options.ContainsKey("watch")))
                 {
                     log.Log("Error: No .mkv files in directory '" + options["input"] + "'.");
                     Environment.Exit(1);
@@ -103,68 +113,138 @@ namespace ps3m2ts
                 Environment.Exit(1);
             }
 
-            // process the input file(s)
-            log.Log("Processing input '" + options["input"] + "'...");
+            ProcessSupervisor.DefaultWallClockTimeout = TimeSpan.FromMinutes(int.Parse(options["timeout"]));
+            ProcessSupervisor.DefaultNoProgressTimeout = TimeSpan.FromMinutes(int.Parse(options["stalltimeout"]));
 
-            foreach (var inputFile in inputFiles)
+            ResourceGovernor.Nice = int.Parse(options["nice"]);
+            if (options.ContainsKey("ionice")) ResourceGovernor.IOClass = options["ionice"];
+            if (options.ContainsKey("cpuset"))
             {
-                log.Log("Processing file '" + inputFile + "'...");
+                ResourceGovernor.CpuHeavyCores = ResourceGovernor.ParseCores(options["cpuset"]);
+                if (ResourceGovernor.CpuHeavyCores == 0) log.Log("Warning: Invalid /cpuset '" + options["cpuset"] + "', transcodes aren't pinned.");
+            }
+            if (int.Parse(options["maxmbps"]) > 0) ResourceGovernor.Bandwidth = new TokenBucket(int.Parse(options["maxmbps"]) * 1048576L);
+            ResourceGovernor.Apply(int.Parse(options["maxcores"]), log);
+
+            if ((int.Parse(options["ramscratch"]) > 0) && (!options.ContainsKey("ramdir")) && (MemoryTier.DefaultPath == null))
+                log.Log("Warning: No memory-backed directory found, /ramscratch needs /ramdir here; intermediates stay on disk.");
 
-                var destination = string.Empty;
+            if ((options.ContainsKey("watch")) && (!Directory.Exists(options["input"])))
+            {
+                log.Log("Error: /watch needs an input directory.");
+                Environment.Exit(1);
+            }
 
-                if (options.ContainsKey("destination")) destination = options["destination"];
+            if ((options.ContainsKey("watch")) &&
+                ((options["outputformat"] == "blu-ray") || (options["outputformat"] == "avchd")))
+            {
+                // every file would be written to the same folder, replacing the one before
+                log.Log("Error: Can't watch for files with blu-ray or avchd format.");
+                Environment.Exit(1);
+            }
 
-                if (destination == string.Empty) destination = Path.GetDirectoryName(inputFile);
-                if (destination == string.Empty) destination = ".";
+            // process the input file(s)
+            var scheduler = new JobScheduler(int.Parse(options["jobs"]), int.Parse(options["cpujobs"]), int.Parse(options["iojobs"]),
+                                             int.Parse(options["hddjobs"]), int.Parse(options["ssdjobs"]));
 
-                var fileTrackList = Support.ReadMediaFile(inputFile);
+            log.Log("Processing input '" + options["input"] + "'" +
+                    ((scheduler.Jobs > 1) ? " with " + scheduler.Jobs + " parallel jobs" : "") + "...");
 
-                if (fileTrackList != null && fileTrackList.Count > 0)
+            // one throttled status line per job and stage
+            ProgressTracker.Changed += e => { if (!e.Completed) log.Status(e.Describe()); };
+            ProgressTracker.Changed += e =>
                 {
-                    var video = false;
-                    var audio = false;
-                    var dts = false;
+                    if (e.Completed) log.Event("transfer", "work", e.Stage, "bytes", e.Bytes, "duration_ms", e.Elapsed, "mbps", e.MBps);
+                };
 
-                    var trackList = new List<Support.MediaInfo>();
+            // every finished stage improves the cost estimates of later runs
+            var costModel = new JobCostModel(JobCostModel.FileName);
+            ProgressTracker.Changed += e => { if (e.Completed) costModel.Learn(e.Stage, e.Bytes, e.Elapsed); };
 
-                    foreach (var TrackInfo in fileTrackList)
-                    {
-                        if (TrackInfo.Type == Support.MediaType.Video && video == false)
-                        {
-                            trackList.Add(TrackInfo);
-                            video = true;
-                        }
-                        else if (TrackInfo.Type == Support.MediaType.Audio && audio == false)
-                        {
-                            trackList.Add(TrackInfo);
-                            audio = true;
-                        }
-                    }
+            var tuner = new ConcurrencyTuner(scheduler, TimeSpan.FromSeconds(int.Parse(options["tuneinterval"])), log);
+            if (options.ContainsKey("autotune")) tuner.Start();
 
-                    if (trackList[1].Type == Support.MediaType.Audio && trackList[1].CodecID == "A_DTS")
-                        dts = true;
+            var dashboard = new Dashboard(scheduler, options.ContainsKey("scratch") ? options["scratch"] : null, log);
+            if ((options.ContainsKey("tui")) && (!dashboard.Start()))
+                log.Log("Warning: The console isn't a terminal, /tui is ignored.");
 
-                    if (dts)
-                    {
-                        Support.ExtractMKV(inputFile, trackList);
-                        List<Support.MediaInfo> NewTrackList = Support.ConvertDTS(inputFile, trackList);
-                        if (NewTrackList != null) trackList = NewTrackList;
-                    }
-
-                    String metafile = Support.WriteTSMuxerMetaFile(inputFile, trackList, (options.ContainsKey("split")), options["outputformat"]);
-                    log.Log("Written .meta file:" + Environment.NewLine + metafile);
+            if (options.ContainsKey("watch"))
+            {
+                new WatchFolder(options["input"], options, scheduler, log).Run();
+
+                tuner.Stop();
+                dashboard.Stop();
+                costModel.Save();
+                foreach (String line in ProgressTracker.DescribeTotals()) log.Log(line);
+                foreach (String line in MemoryTier.DescribeTotals()) log.Log(line);
+                foreach (String line in ResourceAccounting.DescribeTotals()) log.Log(line);
+                foreach (String line in scheduler.DescribeDevices()) log.Log(line);
+                TraceRecorder.Save(log);
+                Metrics.Write();
+                log.Log("ps3m2ts finished.");
+                return;
+            }
 
-                    Support.TSMuxerMuxFile(inputFile, destination, options["outputformat"], log);
-                    log.Log("Finished processing file '" + inputFile + "'.");
-                    log.Log("-------------------------------------------------------------------");
+            var jobs = new List<ConversionJob>();
+            var skipped = 0;
+            long skippedBytes = 0;
 
-                    // conversion must have been successful to be down here so clean up can delete the source (if requested).
-                    Support.Cleanup(inputFile, (options.ContainsKey("deletesource")));
+            // inputs whose outputs are up to date for these options aren't even probed
+            foreach (var inputFile in inputFiles)
+            {
+                var job = new ConversionJob(inputFile, options, log);
 
+                if (job.IsUpToDate())
+                {
+                    skipped++;
+                    skippedBytes += new FileInfo(inputFile).Length;
+                    Metrics.Files.Labels("up_to_date").Increment();
                 }
+                else jobs.Add(job);
+            }
 
-                log.Log("ps3m2ts finished.");
+            var estimatedMakespan = TimeSpan.Zero;
+            var started = DateTime.UtcNow;
+
+            if (options.ContainsKey("order"))
+            {
+                estimatedMakespan = costModel.Order(jobs, options["order"], scheduler.Jobs);
+                log.Log("Ordered " + jobs.Count + " file(s) " + ((options["order"] == "lpt") ? "longest" : "shortest") + " first.");
             }
+
+            // check the estimated intermediates and outputs against the free space up front; /pipeline
+            // probes while it muxes, so it only checks when /order has probed every file already
+            if ((!options.ContainsKey("pipeline")) || (options.ContainsKey("order"))) DiskSpaceGate.Plan(jobs, log);
+
+            if (options.ContainsKey("pipeline"))
+            {
+                // overlap the stages of consecutive files instead of running whole files side by side
+                new StagePipeline(scheduler, int.Parse(options["pipeline"]), log).Run(jobs);
+            }
+            else
+            {
+                scheduler.Run(jobs, job => job.Run(scheduler),
+                              (job, ex) => log.Log("Error: Converting '" + job.InputFile + "' failed: " + ex.Message));
+            }
+
+            tuner.Stop();
+            dashboard.Stop();
+            costModel.Save();
+            foreach (String line in ProgressTracker.DescribeTotals()) log.Log(line);
+            foreach (String line in MemoryTier.DescribeTotals()) log.Log(line);
+            foreach (String line in ResourceAccounting.DescribeTotals()) log.Log(line);
+            foreach (String line in scheduler.DescribeDevices()) log.Log(line);
+
+            if (options.ContainsKey("order")) JobCostModel.Report(jobs, started, estimatedMakespan, log);
+
+            TraceRecorder.Save(log);
+            Metrics.Write();
+
+            if (skipped > 0)
+                log.Log(String.Format(System.Globalization.CultureInfo.InvariantCulture,
+                                      "Skipped {0} up-to-date file(s), {1:0.0} MB not converted again.", skipped, skippedBytes / 1048576.0));
+
+            log.Log("ps3m2ts finished.");
         }
     }
 }
@@ -0,0 +1,287 @@
+﻿/*
+ * ps3m2ts
+ *
+ * Copyright (R) 2009-> Henning M. Stephansen
+ * Feel free to use the code by any means, hopefully you can submit your improvements, ideas etc
+ * to henningms@gmail.com or leave a comment at my blog http://www.henning.ms
+ *
+ */
+
+using System;
+using System.Collections.Generic;
+using System.Diagnostics;
+using System.Globalization;
+using System.Text.RegularExpressions;
+using System.Threading;
+
+namespace ps3m2ts
+{
+    /// <summary>
+    /// Snapshot of one job's progress through a stage.
+    /// </summary>
+    class ProgressEvent
+    {
+        /// <summary>Id of the job; file names of different jobs can be the same.</summary>
+        public int JobId;
+
+        /// <summary>File name of the job's input, for display.</summary>
+        public String Job;
+        public String Stage;
+
+        /// <summary>0-100, or -1 when neither the tool nor the byte count tells.</summary>
+        public double Percent;
+        public long Bytes;
+        public long TotalBytes;
+        public double MBps;
+        public TimeSpan Elapsed;
+
+        /// <summary>Estimated time left; null until there is something to extrapolate from.</summary>
+        public TimeSpan? Eta;
+        public bool Completed;
+
+        public String Describe()
+        {
+            var text = String.Format(CultureInfo.InvariantCulture, "[{0}] {1}", Job, Stage);
+
+            if (Percent >= 0) text += String.Format(CultureInfo.InvariantCulture, " {0:0.0}%", Percent);
+
+            text += String.Format(CultureInfo.InvariantCulture, " {0:0.0} MB, {1:0.0} MB/s", Bytes / 1048576.0, MBps);
+
+            if (Eta.HasValue)
+                text += String.Format(CultureInfo.InvariantCulture, ", ETA {0:00}:{1:00}:{2:00}",
+                                      (int)Eta.Value.TotalHours, Eta.Value.Minutes, Eta.Value.Seconds);
+
+            return text;
+        }
+    }
+
+    /// <summary>
+    /// Tracks one job through one stage. Helper tools report a percentage parsed from their output,
+    /// native stages add the bytes they consumed; both end up as throttled ProgressEvents and, once the
+    /// stage completes, in the per-stage throughput totals.
+    /// </summary>
+    class ProgressTracker
+    {
+        #region Constants
+
+        /// <summary>Minimum time between two events of the same tracker.</summary>
+        private const long ReportIntervalMs = 1000;
+
+        /// <summary>tsMuxeR: "23.5% complete".</summary>
+        public static readonly Regex TsMuxerProgress = new Regex(@"^\s*(\d+(?:\.\d+)?)% complete", RegexOptions.IgnoreCase);
+
+        /// <summary>mkvextract: "Progress: 45%".</summary>
+        public static readonly Regex MkvExtractProgress = new Regex(@"^\s*Progress:\s*(\d+(?:\.\d+)?)%", RegexOptions.IgnoreCase);
+
+        /// <summary>eac3to: "analyze: 12%" or "process: 45%", redrawn with backspaces.</summary>
+        public static readonly Regex Eac3toProgress = new Regex(@"^\s*(?:analyze|process)\w*:\s*(\d+(?:\.\d+)?)%", RegexOptions.IgnoreCase);
+
+        #endregion
+
+        #region Constructor
+
+        public ProgressTracker(int JobId, String Job, String Stage, long TotalBytes)
+        {
+            this.JobId = JobId;
+            this.Job = Job;
+            this.Stage = Stage;
+            this.TotalBytes = TotalBytes;
+            this.Watch = Stopwatch.StartNew();
+            this.LastReportMs = -ReportIntervalMs;
+            this.Percent = -1;
+            this.ReadCounter = Metrics.BytesRead.Labels(Stage);
+        }
+
+        #endregion
+
+        #region Private Fields
+
+        private class StageTotal
+        {
+            public int Files;
+            public long Bytes;
+            public double Seconds;
+        }
+
+        private static readonly Dictionary<String, StageTotal> Totals = new Dictionary<String, StageTotal>();
+        private static readonly List<String> StageOrder = new List<String>();
+
+        private readonly Stopwatch Watch;
+        private readonly Counter.Child ReadCounter;
+        private long BytesDone;
+        private long BytesCounted;
+        private long LastReportMs;
+        private double Percent;
+
+        #endregion
+
+        #region Public Properties
+
+        /// <summary>Raised at most once a second per tracker, and once more when the stage completes.</summary>
+        public static event Action<ProgressEvent> Changed;
+
+        public int JobId { get; private set; }
+        public String Job { get; private set; }
+        public String Stage { get; private set; }
+        public long TotalBytes { get; private set; }
+
+        public long Bytes
+        {
+            get { return Interlocked.Read(ref BytesDone); }
+        }
+
+        #endregion
+
+        #region Public Methods
+
+        /// <summary>
+        /// Feeds one line of tool output through pattern. Returns true if it was a progress line, which
+        /// the caller then doesn't need to log.
+        /// </summary>
+        public bool Parse(Regex pattern, String line)
+        {
+            Match match = pattern.Match(line);
+            if (!match.Success) return false;
+
+            double percent;
+            if (Double.TryParse(match.Groups[1].Value, NumberStyles.Float, CultureInfo.InvariantCulture, out percent))
+                Report(percent);
+
+            return true;
+        }
+
+        /// <summary>
+        /// Records a percentage reported by a tool. The byte count is derived from the stage's total.
+        /// </summary>
+        public void Report(double percent)
+        {
+            percent = Math.Max(0, Math.Min(100, percent));
+            Percent = percent;
+
+            if (TotalBytes > 0) Interlocked.Exchange(ref BytesDone, (long)(TotalBytes * percent / 100));
+
+            Count();
+            Raise(false);
+        }
+
+        /// <summary>
+        /// Records bytes consumed by a native stage. Safe to call from several threads.
+        /// </summary>
+        public void Add(long bytes)
+        {
+            Interlocked.Add(ref BytesDone, bytes);
+            Count();
+            Raise(false);
+        }
+
+        /// <summary>
+        /// Ends the stage and adds it to the throughput totals.
+        /// </summary>
+        public void Complete()
+        {
+            Watch.Stop();
+            Percent = 100;
+            if (TotalBytes > 0) Interlocked.Exchange(ref BytesDone, TotalBytes);
+            Count();
+
+            lock (Totals)
+            {
+                StageTotal total;
+                if (!Totals.TryGetValue(Stage, out total))
+                {
+                    total = new StageTotal();
+                    Totals.Add(Stage, total);
+                    StageOrder.Add(Stage);
+                }
+
+                total.Files++;
+                total.Bytes += Bytes;
+                total.Seconds += Watch.Elapsed.TotalSeconds;
+            }
+
+            Raise(true);
+        }
+
+        /// <summary>
+        /// One line per stage with the files, bytes and average throughput of every completed run.
+        /// </summary>
+        public static List<String> DescribeTotals()
+        {
+            var lines = new List<String>();
+
+            lock (Totals)
+            {
+                foreach (String stage in StageOrder)
+                {
+                    StageTotal total = Totals[stage];
+                    lines.Add(String.Format(CultureInfo.InvariantCulture, "Throughput: {0} {1} file(s), {2:0.0} MB in {3:0.0} s ({4:0.0} MB/s).",
+                                            stage, total.Files, total.Bytes / 1048576.0, total.Seconds,
+                                            total.Bytes / 1048576.0 / Math.Max(total.Seconds, 0.001)));
+                }
+            }
+
+            return lines;
+        }
+
+        #endregion
+
+        #region Private Methods
+
+        /// <summary>
+        /// Adds the bytes not counted yet to the stage's bytes-read metric. A tool can report a slightly
+        /// lower percentage than before; only growth is counted.
+        /// </summary>
+        private void Count()
+        {
+            long bytes = Bytes;
+            long counted;
+            do
+            {
+                counted = Interlocked.Read(ref BytesCounted);
+                if (bytes <= counted) return;
+            } while (Interlocked.CompareExchange(ref BytesCounted, bytes, counted) != counted);
+
+            ReadCounter.Add(bytes - counted);
+        }
+
+        private void Raise(bool completed)
+        {
+            long now = Watch.ElapsedMilliseconds;
+            long last = Interlocked.Read(ref LastReportMs);
+
+            if (!completed)
+            {
+                // only the thread that wins the slot reports; the others just counted their bytes
+                if (now - last < ReportIntervalMs) return;
+                if (Interlocked.CompareExchange(ref LastReportMs, now, last) != last) return;
+            }
+
+            Action<ProgressEvent> handler = Changed;
+            if (handler == null) return;
+
+            var e = new ProgressEvent();
+            e.JobId = JobId;
+            e.Job = Job;
+            e.Stage = Stage;
+            e.Bytes = Bytes;
+            e.TotalBytes = TotalBytes;
+            e.Elapsed = Watch.Elapsed;
+            e.Completed = completed;
+            e.Percent = (Percent >= 0) ? Percent : (TotalBytes > 0) ? Math.Min(100.0, e.Bytes * 100.0 / TotalBytes) : -1;
+            e.MBps = e.Bytes / 1048576.0 / Math.Max(e.Elapsed.TotalSeconds, 0.001);
+
+            if (!completed && e.Percent > 0)
+                e.Eta = TimeSpan.FromSeconds(e.Elapsed.TotalSeconds * (100 - e.Percent) / e.Percent);
+
+            try
+            {
+                handler(e);
+            }
+            catch
+            {
+            }
+        }
+
+        #endregion
+    }
+}
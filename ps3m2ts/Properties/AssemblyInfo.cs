@@ -22,6 +22,9 @@ using System.Runtime.InteropServices;
 // The following GUID is for the ID of the typelib if this project is exposed to COM
 [assembly: Guid("41c847c6-61b8-41e8-8804-de4062a5335f")]
 
+// the benchmark drives the demuxer and the supervisor directly
+[assembly: InternalsVisibleTo("ps3m2ts.Bench")]
+
 // Version information for an assembly consists of the following four values:
 //
 //      Major Version
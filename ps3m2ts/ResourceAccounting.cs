@@ -0,0 +1,225 @@
+﻿/*
+ * ps3m2ts
+ *
+ * Copyright (R) 2009-> Henning M. Stephansen
+ * Feel free to use the code by any means, hopefully you can submit your improvements, ideas etc
+ * to henningms@gmail.com or leave a comment at my blog http://www.henning.ms
+ *
+ */
+
+using System;
+using System.Collections.Generic;
+using System.Diagnostics;
+using System.Globalization;
+
+namespace ps3m2ts
+{
+    /// <summary>
+    /// Adds up what every stage of every job used: the helper tools it ran and the time our own threads
+    /// spent on it (the stage thread, the pipe readers and the native demuxer). Whether a stage was
+    /// CPU-, I/O- or memory-bound shows in its row of the per-file table and in the batch totals.
+    /// </summary>
+    static class ResourceAccounting
+    {
+        #region Constants
+
+        /// <summary>Stages doing at least this much CPU per second of wall time count as CPU-bound.</summary>
+        private const double CpuBoundShare = 0.75;
+
+        /// <summary>More major faults per second than this means the stage waited for paging.</summary>
+        private const double MajorFaultsPerSecond = 50;
+
+        /// <summary>Column headings for Describe.</summary>
+        public const String Header = "  stage       wall s   user s    sys s  CPU %  peak RSS MB   read MB  written MB  faults min/maj  bound by";
+
+        #endregion
+
+        #region Private Fields
+
+        private class StageTotal
+        {
+            public readonly ResourceUsage Usage = new ResourceUsage();
+            public int Files;
+        }
+
+        private static readonly object Sync = new object();
+        private static readonly Dictionary<int, List<KeyValuePair<String, ResourceUsage>>> Jobs = new Dictionary<int, List<KeyValuePair<String, ResourceUsage>>>();
+        private static readonly Dictionary<String, StageTotal> Totals = new Dictionary<String, StageTotal>();
+        private static readonly List<String> StageOrder = new List<String>();
+
+        #endregion
+
+        #region Public Methods
+
+        /// <summary>
+        /// Adds usage to stage of job and to the batch totals.
+        /// </summary>
+        public static void Record(int job, String stage, ResourceUsage usage)
+        {
+            lock (Sync)
+            {
+                List<KeyValuePair<String, ResourceUsage>> stages;
+                if (!Jobs.TryGetValue(job, out stages))
+                {
+                    stages = new List<KeyValuePair<String, ResourceUsage>>();
+                    Jobs.Add(job, stages);
+                }
+
+                ResourceUsage used = null;
+                foreach (KeyValuePair<String, ResourceUsage> pair in stages)
+                    if (pair.Key == stage) used = pair.Value;
+
+                StageTotal total;
+                if (!Totals.TryGetValue(stage, out total))
+                {
+                    total = new StageTotal();
+                    Totals.Add(stage, total);
+                    StageOrder.Add(stage);
+                }
+
+                if (used == null)
+                {
+                    used = new ResourceUsage();
+                    stages.Add(new KeyValuePair<String, ResourceUsage>(stage, used));
+                    total.Files++;
+                }
+
+                used.Add(usage);
+                total.Usage.Add(usage);
+            }
+        }
+
+        /// <summary>
+        /// Measures the calling thread's share of context's stage until the returned object is disposed.
+        /// With wall set the elapsed time counts as the stage's wall time, so only the thread running the
+        /// stage sets it; helper threads only add their CPU, I/O and faults.
+        /// </summary>
+        public static IDisposable Measure(Logger.Context context, bool wall)
+        {
+            if (context == null || context.Stage == null) return new Measurement(null, false);
+
+            return new Measurement(context, wall);
+        }
+
+        /// <summary>
+        /// The stages of job in the order they first used something, removed from the running jobs.
+        /// </summary>
+        public static List<KeyValuePair<String, ResourceUsage>> Take(int job)
+        {
+            lock (Sync)
+            {
+                List<KeyValuePair<String, ResourceUsage>> stages;
+                if (!Jobs.TryGetValue(job, out stages)) return new List<KeyValuePair<String, ResourceUsage>>();
+
+                Jobs.Remove(job);
+                return stages;
+            }
+        }
+
+        /// <summary>
+        /// The highest peak RSS a helper tool of stage has shown so far, over all files; 0 if none yet.
+        /// </summary>
+        public static long PeakRss(String stage)
+        {
+            lock (Sync)
+            {
+                StageTotal total;
+                return Totals.TryGetValue(stage, out total) ? total.Usage.PeakRss : 0;
+            }
+        }
+
+        /// <summary>
+        /// One row under Header.
+        /// </summary>
+        public static String Describe(String stage, ResourceUsage usage)
+        {
+            double wall = usage.WallTime.TotalSeconds;
+
+            return String.Format(CultureInfo.InvariantCulture, "  {0,-10} {1,7:0.0}  {2,7:0.0}  {3,7:0.0}  {4,5}  {5,11}  {6,8:0.0}  {7,10:0.0}  {8,14}  {9}",
+                                 stage, wall, usage.UserTime.TotalSeconds, usage.SystemTime.TotalSeconds,
+                                 (wall > 0) ? (100.0 * usage.CpuTime.TotalSeconds / wall).ToString("0", CultureInfo.InvariantCulture) : "-",
+                                 (usage.PeakRss > 0) ? (usage.PeakRss / 1048576.0).ToString("0.0", CultureInfo.InvariantCulture) : "-",
+                                 usage.ReadBytes / 1048576.0, usage.WriteBytes / 1048576.0,
+                                 usage.MinorFaults.ToString(CultureInfo.InvariantCulture) + "/" + usage.MajorFaults.ToString(CultureInfo.InvariantCulture),
+                                 BoundBy(usage));
+        }
+
+        /// <summary>
+        /// What every stage used over all files so far, as a table.
+        /// </summary>
+        public static List<String> DescribeTotals()
+        {
+            var lines = new List<String>();
+
+            lock (Sync)
+            {
+                if (StageOrder.Count == 0) return lines;
+
+                var all = new ResourceUsage();
+                lines.Add("Resources by stage, all files:");
+                lines.Add(Header);
+
+                foreach (String stage in StageOrder)
+                {
+                    StageTotal total = Totals[stage];
+                    lines.Add(Describe(stage, total.Usage) + " (" + total.Files + " file(s))");
+                    all.Add(total.Usage);
+                }
+
+                lines.Add(Describe("all", all));
+            }
+
+            return lines;
+        }
+
+        #endregion
+
+        #region Private Methods
+
+        /// <summary>
+        /// "memory" when paging held the stage up, "CPU" when it computed most of the time, otherwise
+        /// "I/O" (which includes waiting for a slot or a pipe).
+        /// </summary>
+        private static String BoundBy(ResourceUsage usage)
+        {
+            double wall = usage.WallTime.TotalSeconds;
+            if (wall <= 0) return "-";
+
+            if (usage.MajorFaults / wall > MajorFaultsPerSecond) return "memory";
+            if (usage.CpuTime.TotalSeconds / wall >= CpuBoundShare) return "CPU";
+            return "I/O";
+        }
+
+        private class Measurement : IDisposable
+        {
+            private Logger.Context Context;
+            private readonly bool Wall;
+            private readonly ResourceUsage Start;
+            private readonly Stopwatch Watch;
+
+            public Measurement(Logger.Context Context, bool Wall)
+            {
+                this.Context = Context;
+                this.Wall = Wall;
+
+                if (Context == null) return;
+
+                Start = ResourceUsage.OfCurrentThread();
+                Watch = Stopwatch.StartNew();
+            }
+
+            public void Dispose()
+            {
+                if (Context == null) return;
+
+                ResourceUsage used = ResourceUsage.OfCurrentThread().Since(Start);
+                used.WallTime = Wall ? Watch.Elapsed : TimeSpan.Zero;
+                Record(Context.Job, Context.Stage, used);
+
+                Context = null;
+            }
+        }
+
+        #endregion
+    }
+}
@@ -0,0 +1,374 @@
+﻿/*
+ * ps3m2ts
+ *
+ * Copyright (R) 2009-> Henning M. Stephansen
+ * Feel free to use the code by any means, hopefully you can submit your improvements, ideas etc
+ * to henningms@gmail.com or leave a comment at my blog http://www.henning.ms
+ *
+ */
+
+using System;
+using System.Collections.Generic;
+using System.ComponentModel;
+using System.Diagnostics;
+using System.Globalization;
+using System.IO;
+using System.Runtime.InteropServices;
+
+namespace ps3m2ts
+{
+    /// <summary>
+    /// Keeps a batch from crowding out the rest of the machine: CPU and I/O priority (/nice, /ionice),
+    /// the cores all work may use (/maxcores) and the ones transcodes are pinned to (/cpuset), and a
+    /// disk bandwidth limit (/maxmbps). Priority and cores are set on our own process at startup, so
+    /// every worker thread and every helper tool started from one inherits them; helpers are set again
+    /// after they start, which is also where transcodes get their cores. On Linux priority, I/O class
+    /// and affinity are per thread, so every thread of a process is set.
+    /// </summary>
+    static class ResourceGovernor
+    {
+        #region Constants
+
+        private const int PriorityProcess = 0;
+        private const int IoPriorityWhoProcess = 1;
+        private const int IoPriorityClassBestEffort = 2;
+        private const int IoPriorityClassIdle = 3;
+        private const int IoPriorityClassShift = 13;
+        private const int SignalContinue = 18;
+        private const int SignalStop = 19;
+
+        /// <summary>Windows' NtSetInformationProcess class for the I/O priority and its "very low" and "low" levels.</summary>
+        private const int ProcessIoPriority = 33;
+        private const int IoPriorityVeryLow = 0;
+        private const int IoPriorityLow = 1;
+
+        #endregion
+
+        #region Private Fields
+
+        /// <summary>Number of the ioprio_set system call; -2 until looked up.</summary>
+        private static int ioPrioritySetCall = -2;
+
+        #endregion
+
+        #region Public Properties
+
+        /// <summary>Niceness from 0 (normal) to 19 (lowest); set from /nice.</summary>
+        public static int Nice { get; set; }
+
+        /// <summary>"idle" (only when the disk is otherwise unused), "low" (lowest best-effort level) or null; set from /ionice.</summary>
+        public static String IOClass { get; set; }
+
+        /// <summary>Cores, as a bit mask, that transcodes run on; 0 for no pinning. Set from /cpuset.</summary>
+        public static ulong CpuHeavyCores { get; set; }
+
+        /// <summary>Cores, as a bit mask, that everything runs on; 0 for all. Set by Apply from /maxcores.</summary>
+        public static ulong Cores { get; private set; }
+
+        /// <summary>Shared by every read and write of every job; null for no limit. Set from /maxmbps.</summary>
+        public static TokenBucket Bandwidth { get; set; }
+
+        /// <summary>How many cores the batch may use.</summary>
+        public static int CoreCount
+        {
+            get { return (Cores != 0) ? CountBits(Cores) : Environment.ProcessorCount; }
+        }
+
+        #endregion
+
+        #region Public Methods
+
+        /// <summary>
+        /// Sets the priority, I/O class and cores of our own process: maxCores of the cores it may run
+        /// on now (0 for all of them).
+        /// </summary>
+        public static void Apply(int maxCores, Logger log)
+        {
+            Nice = Math.Max(0, Math.Min(19, Nice));
+
+            if (maxCores > 0)
+            {
+                ulong allowed = CurrentCores();
+                ulong cores = 0;
+                for (int core = 0; core < 64 && CountBits(cores) < maxCores; core++)
+                    if ((allowed & (1UL << core)) != 0) cores |= 1UL << core;
+
+                Cores = cores;
+            }
+
+            if (Cores != 0 && CpuHeavyCores != 0 && (CpuHeavyCores & Cores) == 0)
+            {
+                log.Log("Warning: /cpuset has none of the " + CoreCount + " core(s) /maxcores allows, transcodes run on those instead.");
+                CpuHeavyCores = 0;
+            }
+
+            if (Nice == 0 && IOClass == null && Cores == 0 && CpuHeavyCores == 0 && Bandwidth == null) return;
+
+            if (!Set(Process.GetCurrentProcess(), Cores))
+                log.Log("Warning: Unable to lower the priority or limit the cores of ps3m2ts; /nice, /ionice or /maxcores may not apply.");
+
+            var limits = new List<String>();
+            if (Nice > 0) limits.Add("nice " + Nice);
+            if (IOClass != null) limits.Add(IOClass + " I/O priority");
+            if (Cores != 0) limits.Add("cores " + DescribeCores(Cores));
+            if (CpuHeavyCores != 0) limits.Add("transcodes on cores " + DescribeCores(CpuHeavyCores));
+            if (Bandwidth != null) limits.Add(String.Format(CultureInfo.InvariantCulture, "{0:0} MB/s disk", Bandwidth.BytesPerSecond / 1048576.0));
+
+            log.Log("Limits: " + String.Join(", ", limits.ToArray()) + ".");
+            log.Event("limits", "nice", Nice, "ionice", IOClass, "cores", (long)Cores, "cpuset", (long)CpuHeavyCores,
+                      "max_bytes_per_second", (Bandwidth != null) ? Bandwidth.BytesPerSecond : 0);
+        }
+
+        /// <summary>
+        /// Sets a helper tool that just started; cpuHeavy tools go to CpuHeavyCores.
+        /// </summary>
+        public static void Apply(Process process, bool cpuHeavy)
+        {
+            ulong cores = (cpuHeavy && CpuHeavyCores != 0) ? ((Cores != 0) ? CpuHeavyCores & Cores : CpuHeavyCores) : Cores;
+            if (Nice == 0 && IOClass == null && cores == 0) return;
+
+            Set(process, cores);
+        }
+
+        /// <summary>
+        /// stream, counted against Bandwidth when there is a limit.
+        /// </summary>
+        public static Stream Throttle(Stream stream)
+        {
+            return (Bandwidth != null) ? new ThrottledStream(stream, Bandwidth) : stream;
+        }
+
+        /// <summary>
+        /// Stops or continues all threads of a helper tool, so it can be held while the bandwidth limit
+        /// is in debt. Returns false if that isn't possible.
+        /// </summary>
+        public static bool Suspend(Process process, bool suspend)
+        {
+            try
+            {
+                if (Environment.OSVersion.Platform == PlatformID.Win32NT)
+                    return (suspend ? NtSuspendProcess(process.Handle) : NtResumeProcess(process.Handle)) == 0;
+
+                return kill(process.Id, suspend ? SignalStop : SignalContinue) == 0;
+            }
+            catch
+            {
+                // no libc/ntdll entry point or the process is gone
+                return false;
+            }
+        }
+
+        /// <summary>
+        /// Parses a core list such as "2-3" or "0,2,4-7" into a bit mask; 0 if it isn't one.
+        /// </summary>
+        public static ulong ParseCores(String list)
+        {
+            ulong cores = 0;
+
+            foreach (String part in list.Split(','))
+            {
+                String[] range = part.Split('-');
+                int first;
+                int last;
+
+                if (range.Length > 2 || !int.TryParse(range[0].Trim(), NumberStyles.None, CultureInfo.InvariantCulture, out first)) return 0;
+                if (range.Length == 1) last = first;
+                else if (!int.TryParse(range[1].Trim(), NumberStyles.None, CultureInfo.InvariantCulture, out last)) return 0;
+
+                if (last < first || last > 63) return 0;
+                for (int core = first; core <= last; core++) cores |= 1UL << core;
+            }
+
+            return cores;
+        }
+
+        #endregion
+
+        #region Private Methods
+
+        /// <summary>
+        /// Sets every thread of process. Returns false if any part failed.
+        /// </summary>
+        private static bool Set(Process process, ulong cores)
+        {
+            try
+            {
+                if (Environment.OSVersion.Platform == PlatformID.Win32NT) return SetWindows(process, cores);
+
+                String tasks = "/proc/" + process.Id.ToString(CultureInfo.InvariantCulture) + "/task";
+                if (!Directory.Exists(tasks)) return false;
+
+                bool succeeded = true;
+                foreach (String task in Directory.GetDirectories(tasks))
+                {
+                    int thread;
+                    if (!int.TryParse(Path.GetFileName(task), NumberStyles.None, CultureInfo.InvariantCulture, out thread)) continue;
+
+                    // a thread that ended since the listing fails with ESRCH, which doesn't matter
+                    if (Nice > 0 && setpriority(PriorityProcess, thread, Nice) != 0) succeeded &= Directory.Exists(task);
+                    if (IOClass != null && !SetIOClass(thread)) succeeded &= Directory.Exists(task);
+                    if (cores != 0 && sched_setaffinity(thread, (IntPtr)sizeof(ulong), ref cores) != 0) succeeded &= Directory.Exists(task);
+                }
+
+                return succeeded;
+            }
+            catch (DllNotFoundException)
+            {
+            }
+            catch (EntryPointNotFoundException)
+            {
+            }
+            catch (InvalidOperationException)
+            {
+                // exited before it could be set
+            }
+            catch (IOException)
+            {
+            }
+            catch (Win32Exception)
+            {
+                // access denied, or no such core on Windows
+            }
+
+            return false;
+        }
+
+        private static bool SetWindows(Process process, ulong cores)
+        {
+            bool succeeded = true;
+
+            if (Nice >= 15) process.PriorityClass = ProcessPriorityClass.Idle;
+            else if (Nice > 0) process.PriorityClass = ProcessPriorityClass.BelowNormal;
+
+            if (IOClass != null)
+            {
+                int priority = (IOClass == "idle") ? IoPriorityVeryLow : IoPriorityLow;
+                succeeded = NtSetInformationProcess(process.Handle, ProcessIoPriority, ref priority, sizeof(int)) == 0;
+            }
+
+            if (cores != 0) process.ProcessorAffinity = (IntPtr)(long)cores;
+            return succeeded;
+        }
+
+        private static bool SetIOClass(int thread)
+        {
+            int number = IoPrioritySetCall();
+            if (number < 0) return false;
+
+            int priority = (IOClass == "idle") ? IoPriorityClassIdle << IoPriorityClassShift : (IoPriorityClassBestEffort << IoPriorityClassShift) | 7;
+            return syscall((IntPtr)number, IoPriorityWhoProcess, thread, priority) == 0;
+        }
+
+        /// <summary>
+        /// ioprio_set has no libc wrapper and its number differs per architecture, which the ELF header
+        /// of our own executable tells. -1 on an architecture not listed.
+        /// </summary>
+        private static int IoPrioritySetCall()
+        {
+            if (ioPrioritySetCall != -2) return ioPrioritySetCall;
+
+            int machine = -1;
+            try
+            {
+                using (var exe = new FileStream("/proc/self/exe", FileMode.Open, FileAccess.Read, FileShare.Read))
+                {
+                    // e_machine, little-endian on every architecture below
+                    var header = new byte[20];
+                    if (exe.Read(header, 0, header.Length) == header.Length) machine = header[18] | (header[19] << 8);
+                }
+            }
+            catch (IOException)
+            {
+            }
+            catch (UnauthorizedAccessException)
+            {
+            }
+
+            switch (machine)
+            {
+                case 62: ioPrioritySetCall = 251; break;     // x86-64
+                case 183: ioPrioritySetCall = 30; break;     // AArch64
+                case 3: ioPrioritySetCall = 289; break;      // i386
+                case 40: ioPrioritySetCall = 314; break;     // ARM
+                default: ioPrioritySetCall = -1; break;
+            }
+
+            return ioPrioritySetCall;
+        }
+
+        /// <summary>
+        /// The cores our process may run on now; all of them if that can't be told.
+        /// </summary>
+        private static ulong CurrentCores()
+        {
+            try
+            {
+                if (Environment.OSVersion.Platform == PlatformID.Win32NT)
+                    return (ulong)(long)Process.GetCurrentProcess().ProcessorAffinity;
+
+                ulong mask;
+                if (sched_getaffinity(0, (IntPtr)sizeof(ulong), out mask) == 0 && mask != 0) return mask;
+            }
+            catch
+            {
+            }
+
+            int count = Math.Min(64, Environment.ProcessorCount);
+            return (count == 64) ? ulong.MaxValue : (1UL << count) - 1;
+        }
+
+        private static int CountBits(ulong mask)
+        {
+            int count = 0;
+            for (; mask != 0; mask &= mask - 1) count++;
+            return count;
+        }
+
+        /// <summary>
+        /// A mask as a core list, e.g. "0-3,6".
+        /// </summary>
+        private static String DescribeCores(ulong cores)
+        {
+            var ranges = new List<String>();
+
+            for (int core = 0; core < 64; core++)
+            {
+                if ((cores & (1UL << core)) == 0) continue;
+
+                int last = core;
+                while (last < 63 && (cores & (1UL << (last + 1))) != 0) last++;
+
+                ranges.Add((last > core) ? core + "-" + last : core.ToString(CultureInfo.InvariantCulture));
+                core = last;
+            }
+
+            return String.Join(",", ranges.ToArray());
+        }
+
+        [DllImport("libc", SetLastError = true)]
+        private static extern int setpriority(int which, int who, int priority);
+
+        [DllImport("libc", SetLastError = true)]
+        private static extern int syscall(IntPtr number, int which, int who, int priority);
+
+        [DllImport("libc", SetLastError = true)]
+        private static extern int sched_setaffinity(int thread, IntPtr size, ref ulong mask);
+
+        [DllImport("libc", SetLastError = true)]
+        private static extern int sched_getaffinity(int thread, IntPtr size, out ulong mask);
+
+        [DllImport("libc", SetLastError = true)]
+        private static extern int kill(int process, int signal);
+
+        [DllImport("ntdll.dll")]
+        private static extern int NtSetInformationProcess(IntPtr process, int informationClass, ref int information, int length);
+
+        [DllImport("ntdll.dll")]
+        private static extern int NtSuspendProcess(IntPtr process);
+
+        [DllImport("ntdll.dll")]
+        private static extern int NtResumeProcess(IntPtr process);
+
+        #endregion
+    }
+}
@@ -0,0 +1,267 @@
+﻿/*
+ * ps3m2ts
+ *
+ * Copyright (R) 2009-> Henning M. Stephansen
+ * Feel free to use the code by any means, hopefully you can submit your improvements, ideas etc
+ * to henningms@gmail.com or leave a comment at my blog http://www.henning.ms
+ *
+ */
+
+using System;
+using System.Diagnostics;
+using System.Globalization;
+using System.IO;
+using System.Runtime.InteropServices;
+
+namespace ps3m2ts
+{
+    /// <summary>
+    /// CPU, memory, I/O and page faults of a helper process or of one of our own threads. On Linux they
+    /// come from /proc/&lt;pid&gt;/stat and io (/proc/thread-self for a thread); on Windows from the
+    /// process and thread times and the process I/O and memory counters. What a platform can't tell
+    /// stays zero.
+    /// </summary>
+    class ResourceUsage
+    {
+        #region Constants
+
+        /// <summary>Unit of the times in /proc/&lt;pid&gt;/stat (USER_HZ, 100 on every Linux port).</summary>
+        private const double ClockTicksPerSecond = 100.0;
+
+        #endregion
+
+        #region Public Fields
+
+        public TimeSpan WallTime;
+        public TimeSpan UserTime;
+        public TimeSpan SystemTime;
+        public long PeakRss;
+
+        /// <summary>Bytes passed through read and write calls, whether or not they reached the disk.</summary>
+        public long ReadBytes;
+        public long WriteBytes;
+
+        /// <summary>Faults served from memory and faults that had to wait for the disk.</summary>
+        public long MinorFaults;
+        public long MajorFaults;
+
+        #endregion
+
+        #region Public Properties
+
+        public TimeSpan CpuTime
+        {
+            get { return UserTime + SystemTime; }
+        }
+
+        #endregion
+
+        #region Public Methods
+
+        /// <summary>
+        /// Current totals of a running process; null once it is gone.
+        /// </summary>
+        public static ResourceUsage Of(Process process)
+        {
+            try
+            {
+                var usage = new ResourceUsage();
+
+                if (File.Exists("/proc/self/stat"))
+                {
+                    // an exited tool's pid may already belong to someone else
+                    if (process.HasExited) return null;
+
+                    String directory = "/proc/" + process.Id.ToString(CultureInfo.InvariantCulture);
+                    if (!ReadProc(directory, usage)) return null;
+                }
+                else
+                {
+                    usage.UserTime = process.UserProcessorTime;
+                    usage.SystemTime = process.PrivilegedProcessorTime;
+                    ReadWindowsCounters(process.Handle, usage);
+                }
+
+                usage.PeakRss = process.PeakWorkingSet64;
+                return usage;
+            }
+            catch
+            {
+                // exited or never started
+                return null;
+            }
+        }
+
+        /// <summary>
+        /// Current totals of the calling thread; take one before and one after some work and subtract.
+        /// </summary>
+        public static ResourceUsage OfCurrentThread()
+        {
+            var usage = new ResourceUsage();
+
+            try
+            {
+                if (File.Exists("/proc/thread-self/stat"))
+                {
+                    ReadProc("/proc/thread-self", usage);
+                }
+                else if (Environment.OSVersion.Platform == PlatformID.Win32NT)
+                {
+                    long creation, exit, kernel, user;
+                    if (GetThreadTimes(GetCurrentThread(), out creation, out exit, out kernel, out user))
+                    {
+                        usage.UserTime = TimeSpan.FromTicks(user);
+                        usage.SystemTime = TimeSpan.FromTicks(kernel);
+                    }
+                }
+            }
+            catch
+            {
+                // no accounting on this platform; the stage still gets its wall time
+            }
+
+            return usage;
+        }
+
+        /// <summary>
+        /// What was used between start and this sample. Peak RSS isn't a counter and is kept as it is.
+        /// </summary>
+        public ResourceUsage Since(ResourceUsage start)
+        {
+            var usage = new ResourceUsage();
+            usage.WallTime = WallTime - start.WallTime;
+            usage.UserTime = UserTime - start.UserTime;
+            usage.SystemTime = SystemTime - start.SystemTime;
+            usage.PeakRss = PeakRss;
+            usage.ReadBytes = ReadBytes - start.ReadBytes;
+            usage.WriteBytes = WriteBytes - start.WriteBytes;
+            usage.MinorFaults = MinorFaults - start.MinorFaults;
+            usage.MajorFaults = MajorFaults - start.MajorFaults;
+            return usage;
+        }
+
+        /// <summary>
+        /// Adds other's counters to this one and keeps the higher peak RSS.
+        /// </summary>
+        public void Add(ResourceUsage other)
+        {
+            WallTime += other.WallTime;
+            UserTime += other.UserTime;
+            SystemTime += other.SystemTime;
+            PeakRss = Math.Max(PeakRss, other.PeakRss);
+            ReadBytes += other.ReadBytes;
+            WriteBytes += other.WriteBytes;
+            MinorFaults += other.MinorFaults;
+            MajorFaults += other.MajorFaults;
+        }
+
+        #endregion
+
+        #region Private Methods
+
+        /// <summary>
+        /// Fills usage from directory/stat and directory/io; false when the process has gone away.
+        /// </summary>
+        private static bool ReadProc(String directory, ResourceUsage usage)
+        {
+            String stat;
+            try
+            {
+                stat = File.ReadAllText(directory + "/stat");
+            }
+            catch (IOException)
+            {
+                return false;
+            }
+
+            // pid (comm) state ppid ...; comm may contain anything, so count from the last ')'
+            String[] fields = stat.Substring(stat.LastIndexOf(')') + 2).Split(' ');
+            if (fields.Length > 12)
+            {
+                usage.MinorFaults = long.Parse(fields[7], CultureInfo.InvariantCulture);
+                usage.MajorFaults = long.Parse(fields[9], CultureInfo.InvariantCulture);
+                usage.UserTime = TimeSpan.FromSeconds(long.Parse(fields[11], CultureInfo.InvariantCulture) / ClockTicksPerSecond);
+                usage.SystemTime = TimeSpan.FromSeconds(long.Parse(fields[12], CultureInfo.InvariantCulture) / ClockTicksPerSecond);
+            }
+
+            // io is only readable for our own processes (and not at all without task accounting)
+            try
+            {
+                foreach (String line in File.ReadAllLines(directory + "/io"))
+                {
+                    int colon = line.IndexOf(':');
+                    if (colon < 0) continue;
+
+                    String key = line.Substring(0, colon);
+                    if (key == "rchar") usage.ReadBytes = long.Parse(line.Substring(colon + 1).Trim(), CultureInfo.InvariantCulture);
+                    else if (key == "wchar") usage.WriteBytes = long.Parse(line.Substring(colon + 1).Trim(), CultureInfo.InvariantCulture);
+                }
+            }
+            catch (IOException)
+            {
+            }
+            catch (UnauthorizedAccessException)
+            {
+            }
+
+            return true;
+        }
+
+        private static void ReadWindowsCounters(IntPtr handle, ResourceUsage usage)
+        {
+            if (Environment.OSVersion.Platform != PlatformID.Win32NT) return;
+
+            IoCounters io;
+            if (GetProcessIoCounters(handle, out io))
+            {
+                usage.ReadBytes = (long)io.ReadTransferCount;
+                usage.WriteBytes = (long)io.WriteTransferCount;
+            }
+
+            // Windows doesn't tell soft from hard faults here; they all count as minor
+            var memory = new MemoryCounters();
+            memory.Size = Marshal.SizeOf(typeof(MemoryCounters));
+            if (GetProcessMemoryInfo(handle, out memory, memory.Size)) usage.MinorFaults = memory.PageFaultCount;
+        }
+
+        [StructLayout(LayoutKind.Sequential)]
+        private struct IoCounters
+        {
+            public ulong ReadOperationCount;
+            public ulong WriteOperationCount;
+            public ulong OtherOperationCount;
+            public ulong ReadTransferCount;
+            public ulong WriteTransferCount;
+            public ulong OtherTransferCount;
+        }
+
+        [StructLayout(LayoutKind.Sequential)]
+        private struct MemoryCounters
+        {
+            public int Size;
+            public int PageFaultCount;
+            public UIntPtr PeakWorkingSetSize;
+            public UIntPtr WorkingSetSize;
+            public UIntPtr QuotaPeakPagedPoolUsage;
+            public UIntPtr QuotaPagedPoolUsage;
+            public UIntPtr QuotaPeakNonPagedPoolUsage;
+            public UIntPtr QuotaNonPagedPoolUsage;
+            public UIntPtr PagefileUsage;
+            public UIntPtr PeakPagefileUsage;
+        }
+
+        [DllImport("kernel32.dll", SetLastError = true)]
+        private static extern bool GetProcessIoCounters(IntPtr process, out IoCounters counters);
+
+        [DllImport("psapi.dll", SetLastError = true)]
+        private static extern bool GetProcessMemoryInfo(IntPtr process, out MemoryCounters counters, int size);
+
+        [DllImport("kernel32.dll")]
+        private static extern IntPtr GetCurrentThread();
+
+        [DllImport("kernel32.dll", SetLastError = true)]
+        private static extern bool GetThreadTimes(IntPtr thread, out long creation, out long exit, out long kernel, out long user);
+
+        #endregion
+    }
+}
@@ -0,0 +1,259 @@
+﻿/*
+ * ps3m2ts
+ *
+ * Copyright (R) 2009-> Henning M. Stephansen
+ * Feel free to use the code by any means, hopefully you can submit your improvements, ideas etc
+ * to henningms@gmail.com or leave a comment at my blog http://www.henning.ms
+ *
+ */
+
+using System;
+using System.Collections.Generic;
+using System.Globalization;
+using System.IO;
+using System.Security.Cryptography;
+using System.Text;
+
+namespace ps3m2ts
+{
+    /// <summary>
+    /// Where a job keeps its intermediates (.h264, .dts, .ac3, .meta, " - Log.txt"). Without /scratch that
+    /// is the working directory, as it always was; with /scratch every input gets a directory of its own
+    /// under the scratch root, named after the input's full path so a rerun finds it again. With a memory
+    /// tier, intermediates that fit its budget are placed in a directory of the same name there instead.
+    /// </summary>
+    class ScratchDirectory
+    {
+        #region Constructor
+
+        private ScratchDirectory(String Path, bool Owned, long Budget)
+        {
+            this.Path = Path;
+            this.Owned = Owned;
+            this.Budget = Budget;
+
+            InMemory = new Dictionary<String, long>(StringComparer.OrdinalIgnoreCase);
+        }
+
+        #endregion
+
+        #region Private Fields
+
+        private MemoryTier Memory;
+        private String MemoryPath;
+
+        /// <summary>Extensions of the intermediates placed in memory, with the bytes reserved for them.</summary>
+        private readonly Dictionary<String, long> InMemory;
+
+        #endregion
+
+        #region Public Properties
+
+        public String Path { get; private set; }
+
+        /// <summary>True for a per-job directory, which is deleted as a whole on cleanup.</summary>
+        public bool Owned { get; private set; }
+
+        /// <summary>Bytes the intermediates may take; 0 means no limit.</summary>
+        public long Budget { get; private set; }
+
+        #endregion
+
+        #region Public Methods
+
+        /// <summary>
+        /// The shared working directory.
+        /// </summary>
+        public static ScratchDirectory WorkingDirectory()
+        {
+            return new ScratchDirectory(Environment.CurrentDirectory, false, 0);
+        }
+
+        /// <summary>
+        /// The directory of file under root. It is only created by Ensure.
+        /// </summary>
+        public static ScratchDirectory For(String root, String file, long budget)
+        {
+            return new ScratchDirectory(System.IO.Path.Combine(System.IO.Path.GetFullPath(root), DirectoryName(file)), true, budget);
+        }
+
+        /// <summary>
+        /// Lets Place put file's intermediates in tier.
+        /// </summary>
+        public void UseMemory(MemoryTier tier, String file)
+        {
+            Memory = tier;
+            MemoryPath = System.IO.Path.Combine(tier.Path, DirectoryName(file));
+        }
+
+        public void Ensure()
+        {
+            if (!Directory.Exists(Path)) Directory.CreateDirectory(Path);
+            if (InMemory.Count > 0 && !Directory.Exists(MemoryPath)) Directory.CreateDirectory(MemoryPath);
+        }
+
+        /// <summary>
+        /// Decides where the intermediate with the given extension goes, from its estimated size. Call
+        /// it with the smallest intermediates first; they are the likeliest to fit.
+        /// </summary>
+        public void Place(String file, String extension, long estimated)
+        {
+            if (Memory == null || InMemory.ContainsKey(extension) || estimated <= 0) return;
+
+            String memoryFile = System.IO.Path.Combine(MemoryPath, System.IO.Path.GetFileNameWithoutExtension(file)) + extension;
+
+            // left over from an interrupted run: stay wherever it is
+            if (File.Exists(memoryFile))
+            {
+                long size = new FileInfo(memoryFile).Length;
+                Memory.Reserve(size, true);
+                InMemory[extension] = size;
+                return;
+            }
+
+            if (File.Exists(GetIntermediateName(file) + extension)) return;
+
+            if (Memory.Reserve(estimated, false)) InMemory[extension] = estimated;
+        }
+
+        public bool IsInMemory(String extension)
+        {
+            return InMemory.ContainsKey(extension);
+        }
+
+        /// <summary>
+        /// Where the intermediate of file with the given extension is: in memory if Place put it there,
+        /// otherwise in this directory.
+        /// </summary>
+        public String GetIntermediatePath(String file, String extension)
+        {
+            if (InMemory.ContainsKey(extension))
+                return System.IO.Path.Combine(MemoryPath, System.IO.Path.GetFileNameWithoutExtension(file)) + extension;
+
+            return GetIntermediateName(file) + extension;
+        }
+
+        /// <summary>
+        /// Moves intermediates that turned out larger than their reservation and don't fit the memory
+        /// budget any more to disk. Called after each stage, before the journal records their paths.
+        /// </summary>
+        public void Spill(String file)
+        {
+            foreach (String extension in new List<String>(InMemory.Keys))
+            {
+                String memoryFile = GetIntermediatePath(file, extension);
+                if (!File.Exists(memoryFile)) continue;
+
+                long reserved = InMemory[extension];
+                long size = new FileInfo(memoryFile).Length;
+                if (size <= reserved) continue;
+
+                if (Memory.Grow(size - reserved))
+                {
+                    InMemory[extension] = size;
+                    continue;
+                }
+
+                InMemory.Remove(extension);
+                Memory.Spill(reserved, size);
+
+                String diskFile = GetIntermediatePath(file, extension);
+                if (File.Exists(diskFile)) File.Delete(diskFile);
+                File.Move(memoryFile, diskFile);
+            }
+        }
+
+        /// <summary>
+        /// Path prefix of file's intermediates; the extension is appended by the caller.
+        /// </summary>
+        public String GetIntermediateName(String file)
+        {
+            return System.IO.Path.Combine(Path, System.IO.Path.GetFileNameWithoutExtension(file));
+        }
+
+        /// <summary>
+        /// Bytes used by the directory. The shared working directory isn't measured.
+        /// </summary>
+        public long UsedBytes()
+        {
+            if (!Owned || !Directory.Exists(Path)) return 0;
+
+            long used = 0;
+            foreach (String file in Directory.GetFiles(Path, "*", SearchOption.AllDirectories))
+            {
+                try
+                {
+                    used += new FileInfo(file).Length;
+                }
+                catch (IOException)
+                {
+                }
+            }
+
+            return used;
+        }
+
+        /// <summary>
+        /// Null while the directory is within its budget, otherwise why it isn't.
+        /// </summary>
+        public String CheckBudget()
+        {
+            if (Budget <= 0) return null;
+
+            long used = UsedBytes();
+            if (used <= Budget) return null;
+
+            return String.Format(CultureInfo.InvariantCulture, "scratch budget of {0:0} MB exceeded ({1:0} MB used)",
+                                 Budget / 1048576.0, used / 1048576.0);
+        }
+
+        /// <summary>
+        /// Removes a per-job directory and the job's memory directory with everything in them, and gives
+        /// the memory back to the tier.
+        /// </summary>
+        public void Delete()
+        {
+            foreach (long reserved in InMemory.Values) Memory.Release(reserved);
+            InMemory.Clear();
+
+            if (MemoryPath != null) DeleteDirectory(MemoryPath);
+            if (Owned) DeleteDirectory(Path);
+        }
+
+        #endregion
+
+        #region Private Methods
+
+        /// <summary>
+        /// "ps3m2ts-name-hash": the hash of the full path tells same-named inputs apart.
+        /// </summary>
+        private static String DirectoryName(String file)
+        {
+            String fullPath = System.IO.Path.GetFullPath(file);
+
+            using (var md5 = MD5.Create())
+            {
+                byte[] hash = md5.ComputeHash(Encoding.UTF8.GetBytes(fullPath.ToLowerInvariant()));
+                String tag = BitConverter.ToString(hash, 0, 4).Replace("-", "").ToLowerInvariant();
+
+                return "ps3m2ts-" + System.IO.Path.GetFileNameWithoutExtension(file) + "-" + tag;
+            }
+        }
+
+        private static void DeleteDirectory(String path)
+        {
+            try
+            {
+                if (Directory.Exists(path)) Directory.Delete(path, true);
+            }
+            catch (IOException)
+            {
+            }
+            catch (UnauthorizedAccessException)
+            {
+            }
+        }
+
+        #endregion
+    }
+}
@@ -0,0 +1,548 @@
+﻿/*
+ * ps3m2ts
+ *
+ * Copyright (R) 2009-> Henning M. Stephansen
+ * Feel free to use the code by any means, hopefully you can submit your improvements, ideas etc
+ * to henningms@gmail.com or leave a comment at my blog http://www.henning.ms
+ *
+ */
+
+using System;
+using System.Collections.Generic;
+using System.Diagnostics;
+using System.Globalization;
+using System.IO;
+using System.Threading;
+
+namespace ps3m2ts
+{
+    /// <summary>
+    /// Parallel variant of the native fast path for very large files. The timeline is cut at video cue
+    /// points (keyframe clusters) into segments and the segments are muxed in parallel, as many at once
+    /// as the job can get I/O slots for. The first segment is muxed straight into the output, the others
+    /// into fragments in the job's scratch directory, which are then stitched in place behind it:
+    /// continuity counters are carried over, the clock (PCR, arrival and PES time stamps) is kept
+    /// monotonic across the seams and PAT/PMT versions are unified.
+    /// </summary>
+    class SegmentedRemuxer
+    {
+        #region Constants
+
+        private const int IOBufferSize = 1 << 20;
+
+        /// <summary>27 MHz ticks per 90 kHz tick.</summary>
+        private const long ClockScale = 300;
+        private const int CopyPackets = 8192;
+
+        /// <summary>How often a worker without a slot looks for a free one, in milliseconds.</summary>
+        private const int SlotPollInterval = 250;
+
+        private static readonly int[] ContinuityPids =
+            {
+                TSPacketizer.PatPid, TSPacketizer.PmtPid, TSPacketizer.VideoPid, TSPacketizer.AudioPid
+            };
+
+        #endregion
+
+        #region Private Fields
+
+        private class Fragment
+        {
+            public int Index;
+            public string Path;
+            public long Start;
+            public long End;
+            public long Length;
+            public long FirstClock;
+            public long EndClock;
+            public int TableVersion;
+            public Dictionary<int, int> Continuity = new Dictionary<int, int>();
+
+            // filled in by the stitch planner
+            public long OutputOffset;
+            public long ClockShift;
+            public Dictionary<int, int> ContinuityShift = new Dictionary<int, int>();
+
+            public Exception Error;
+        }
+
+        #endregion
+
+        #region Public Methods
+
+        /// <summary>
+        /// Remuxes file into outputfile in up to segments pieces. Fragments are written to fragmentPrefix
+        /// plus ".segN". Every worker after the first needs a slot from extraSlot (null when none is free
+        /// right now, or no extraSlot for no limit). Falls back to a single segment when the file has no
+        /// usable cue points. Returns false if the fast path can't handle the file, in which case nothing
+        /// is left behind.
+        /// </summary>
+        public static bool Remux(string file, string outputfile, string fragmentPrefix, List<Support.MediaInfo> tracks, string outputformat,
+                                 int segments, Func<IDisposable> extraSlot, Logger Log, ProgressTracker Progress)
+        {
+            bool m2ts = (outputformat == "m2ts");
+            var fragments = new List<Fragment>();
+            var watch = Stopwatch.StartNew();
+            BufferPoolStatistics poolBefore = BufferPool.Shared.GetStatistics();
+
+            try
+            {
+                List<long> starts;
+                long end;
+
+                using (var input = new FileStream(file, FileMode.Open, FileAccess.Read, FileShare.Read, IOBufferSize))
+                {
+                    var reader = new MatroskaReader(input);
+                    reader.ReadHeaders();
+
+                    var remuxer = new NativeRemuxer(tracks[0], tracks[1], m2ts);
+                    remuxer.Open(reader);
+
+                    starts = PlanCuts(reader, remuxer.VideoTrack, segments);
+                    end = reader.EndPosition;
+                }
+
+                if (starts.Count < 2)
+                {
+                    Log.Log("Segmented remux: no usable cue points in '" + file + "', muxing in one piece.");
+                    return NativeRemuxer.Remux(file, outputfile, tracks, outputformat, Log, Progress);
+                }
+
+                for (int i = 0; i < starts.Count; i++)
+                {
+                    var fragment = new Fragment();
+                    fragment.Index = i;
+                    fragment.Path = (i == 0) ? outputfile : fragmentPrefix + ".seg" + i.ToString(CultureInfo.InvariantCulture);
+                    fragment.Start = starts[i];
+                    fragment.End = (i + 1 < starts.Count) ? starts[i + 1] : end;
+                    fragments.Add(fragment);
+                }
+
+                Log.Log("Segmented remux: muxing '" + file + "' as " + fragments.Count + " segments in parallel...");
+
+                RunAll(fragments, "mux", extraSlot, delegate(Fragment fragment) { MuxFragment(file, tracks, m2ts, fragment, Progress); });
+
+                foreach (Fragment fragment in fragments)
+                {
+                    if (fragment.Error != null) throw fragment.Error;
+                }
+
+                double muxSeconds = watch.Elapsed.TotalSeconds;
+                long total = PlanStitch(fragments);
+
+                // the first segment is already in place and needs no fixing; the rest go behind it
+                using (var output = new FileStream(outputfile, FileMode.Open, FileAccess.Write, FileShare.ReadWrite))
+                {
+                    output.SetLength(total);
+                }
+
+                int packetSize = m2ts ? TSPacketizer.M2TSPacketSize : TSPacketizer.TSPacketSize;
+                int tableVersion = fragments[0].TableVersion;
+
+                RunAll(fragments.GetRange(1, fragments.Count - 1), "stitch", extraSlot,
+                       delegate(Fragment fragment) { StitchFragment(outputfile, fragment, packetSize, tableVersion); });
+
+                foreach (Fragment fragment in fragments)
+                {
+                    if (fragment.Error != null) throw fragment.Error;
+                }
+
+                DeleteFragments(fragments);
+
+                double seconds = Math.Max(watch.Elapsed.TotalSeconds, 0.001);
+                long inputLength = new FileInfo(file).Length;
+                Log.Log(String.Format(CultureInfo.InvariantCulture,
+                                      "Segmented remux: {0} segments muxed in {1:0.0} s, stitched in {2:0.0} s ({3:0.0} MB/s overall).",
+                                      fragments.Count, muxSeconds, seconds - muxSeconds, inputLength / 1048576.0 / seconds));
+                Log.Log(BufferPool.Shared.GetStatistics().Describe(poolBefore));
+                return true;
+            }
+            catch (Exception ex)
+            {
+                Log.Log("Segmented remux: unable to remux '" + file + "' natively (" + ex.Message + "), falling back to tsMuxeR.");
+
+                DeleteFragments(fragments);
+                try
+                {
+                    if (File.Exists(outputfile)) File.Delete(outputfile);
+                }
+                catch
+                {
+                }
+
+                return false;
+            }
+        }
+
+        #endregion
+
+        #region Private Methods
+
+        /// <summary>
+        /// Picks segment start offsets: the first cluster, then the video cue point nearest to each even
+        /// split of the file, as long as that cluster really starts with a keyframe.
+        /// </summary>
+        private static List<long> PlanCuts(MatroskaReader reader, int videoTrack, int segments)
+        {
+            var starts = new List<long>();
+            starts.Add(reader.FirstClusterPosition);
+
+            List<MatroskaCuePoint> cuePoints = reader.ReadCues(videoTrack);
+            if (cuePoints.Count == 0) return starts;
+
+            long first = reader.FirstClusterPosition;
+            long end = reader.EndPosition;
+            int cue = 0;
+
+            for (int k = 1; k < segments; k++)
+            {
+                long target = first + (end - first) * k / segments;
+
+                // advance to the cue nearest the target that lies after the previous cut
+                while (cue + 1 < cuePoints.Count &&
+                       Math.Abs(cuePoints[cue + 1].ClusterPosition - target) <= Math.Abs(cuePoints[cue].ClusterPosition - target))
+                    cue++;
+
+                while (cue < cuePoints.Count &&
+                       (cuePoints[cue].ClusterPosition <= starts[starts.Count - 1] ||
+                        !StartsWithKeyframe(reader, cuePoints[cue].ClusterPosition, videoTrack)))
+                    cue++;
+
+                if (cue >= cuePoints.Count) break;
+                if (cuePoints[cue].ClusterPosition < end) starts.Add(cuePoints[cue].ClusterPosition);
+            }
+
+            reader.SeekCluster(first);
+            return starts;
+        }
+
+        private static bool StartsWithKeyframe(MatroskaReader reader, long clusterPosition, int videoTrack)
+        {
+            var block = new MatroskaBlock();
+            reader.SeekCluster(clusterPosition);
+
+            try
+            {
+                while (reader.ReadBlock(block))
+                {
+                    if (block.TrackNumber == videoTrack) return block.Keyframe;
+                }
+            }
+            finally
+            {
+                block.Release();
+            }
+
+            return false;
+        }
+
+        private static void MuxFragment(string file, List<Support.MediaInfo> tracks, bool m2ts, Fragment fragment, ProgressTracker progress)
+        {
+            using (Stream input = ResourceGovernor.Throttle(new FileStream(file, FileMode.Open, FileAccess.Read, FileShare.Read, IOBufferSize)))
+            using (Stream output = ResourceGovernor.Throttle(new FileStream(fragment.Path, FileMode.Create, FileAccess.Write, FileShare.None, IOBufferSize)))
+            {
+                var reader = new MatroskaReader(input);
+                reader.ReadHeaders();
+                reader.SeekCluster(fragment.Start);
+                reader.EndPosition = fragment.End;
+
+                var remuxer = new NativeRemuxer(tracks[0], tracks[1], m2ts);
+                remuxer.Progress = progress;
+                remuxer.Open(reader);
+
+                using (var packetizer = new TSPacketizer(output, m2ts))
+                {
+                    remuxer.Mux(reader, packetizer);
+
+                    fragment.Length = output.Length;
+                    fragment.FirstClock = packetizer.FirstClock;
+                    fragment.EndClock = packetizer.CurrentClock;
+                    fragment.TableVersion = packetizer.TableVersion;
+
+                    foreach (int pid in ContinuityPids) fragment.Continuity[pid] = packetizer.GetContinuity(pid);
+                }
+            }
+        }
+
+        /// <summary>
+        /// Works out where each fragment lands in the output and how its counters and clock must be
+        /// shifted to continue where the previous fragment stopped. Returns the total output length.
+        /// </summary>
+        private static long PlanStitch(List<Fragment> fragments)
+        {
+            long offset = 0;
+            Fragment previous = null;
+
+            foreach (Fragment fragment in fragments)
+            {
+                fragment.OutputOffset = offset;
+                offset += fragment.Length;
+
+                foreach (int pid in ContinuityPids)
+                {
+                    fragment.ContinuityShift[pid] = (previous == null)
+                        ? 0
+                        : (previous.ContinuityShift[pid] + previous.Continuity[pid]) & 0x0F;
+                }
+
+                // segments are muxed independently, so the next one may start a little before the
+                // previous one's clock ended; push it forward just enough to stay monotonic, in whole
+                // 90 kHz ticks so the PES time stamps move exactly as far as PCR and arrival time
+                long shift = (previous == null) ? 0 : Math.Max(0, previous.EndClock + previous.ClockShift - fragment.FirstClock);
+                fragment.ClockShift = (shift + ClockScale - 1) / ClockScale * ClockScale;
+
+                previous = fragment;
+            }
+
+            return offset;
+        }
+
+        /// <summary>
+        /// Copies a fragment into its slot of the preallocated output, fixing continuity counters, PCR,
+        /// arrival and PES time stamps and table versions on the way through.
+        /// </summary>
+        private static void StitchFragment(string outputfile, Fragment fragment, int packetSize, int tableVersion)
+        {
+            int header = packetSize - TSPacketizer.TSPacketSize;
+            BufferLease lease = BufferPool.Shared.Rent(packetSize * CopyPackets);
+            byte[] buffer = lease.Buffer;
+
+            try
+            {
+                CopyFragment(outputfile, fragment, buffer, packetSize * CopyPackets, packetSize, header, tableVersion);
+            }
+            finally
+            {
+                lease.Release();
+            }
+        }
+
+        private static void CopyFragment(string outputfile, Fragment fragment, byte[] buffer, int bufferLength,
+                                         int packetSize, int header, int tableVersion)
+        {
+            using (Stream input = ResourceGovernor.Throttle(new FileStream(fragment.Path, FileMode.Open, FileAccess.Read, FileShare.Read, IOBufferSize)))
+            using (Stream output = ResourceGovernor.Throttle(new FileStream(outputfile, FileMode.Open, FileAccess.Write, FileShare.ReadWrite, IOBufferSize)))
+            {
+                output.Position = fragment.OutputOffset;
+
+                int read;
+                while ((read = ReadPackets(input, buffer, bufferLength)) > 0)
+                {
+                    for (int packet = 0; packet + packetSize <= read; packet += packetSize)
+                    {
+                        FixPacket(buffer, packet, header, fragment, tableVersion);
+                    }
+
+                    output.Write(buffer, 0, read);
+                }
+            }
+        }
+
+        private static void FixPacket(byte[] buffer, int packet, int header, Fragment fragment, int tableVersion)
+        {
+            if (header > 0 && fragment.ClockShift > 0)
+            {
+                long ats = ((long)(buffer[packet] & 0x3F) << 24) | ((long)buffer[packet + 1] << 16) |
+                           ((long)buffer[packet + 2] << 8) | buffer[packet + 3];
+                ats = (ats + fragment.ClockShift) & 0x3FFFFFFF;
+
+                buffer[packet] = (byte)((buffer[packet] & 0xC0) | (int)(ats >> 24));
+                buffer[packet + 1] = (byte)(ats >> 16);
+                buffer[packet + 2] = (byte)(ats >> 8);
+                buffer[packet + 3] = (byte)ats;
+            }
+
+            int ts = packet + header;
+            int pid = ((buffer[ts + 1] & 0x1F) << 8) | buffer[ts + 2];
+            int adaptationControl = (buffer[ts + 3] >> 4) & 0x03;
+
+            int shift;
+            if ((adaptationControl & 0x01) != 0 && fragment.ContinuityShift.TryGetValue(pid, out shift) && shift != 0)
+            {
+                buffer[ts + 3] = (byte)((buffer[ts + 3] & 0xF0) | ((buffer[ts + 3] + shift) & 0x0F));
+            }
+
+            if ((adaptationControl & 0x02) != 0 && buffer[ts + 4] >= 7 && (buffer[ts + 5] & 0x10) != 0 && fragment.ClockShift > 0)
+            {
+                ShiftPcr(buffer, ts + 6, fragment.ClockShift);
+            }
+
+            bool unitStart = (buffer[ts + 1] & 0x40) != 0;
+            if (unitStart && (pid == TSPacketizer.VideoPid || pid == TSPacketizer.AudioPid) && (adaptationControl & 0x01) != 0 && fragment.ClockShift > 0)
+            {
+                int payload = ts + 4 + (((adaptationControl & 0x02) != 0) ? 1 + buffer[ts + 4] : 0);
+                ShiftPesTimestamps(buffer, payload, ts + TSPacketizer.TSPacketSize, fragment.ClockShift / ClockScale);
+            }
+
+            if (unitStart && (pid == TSPacketizer.PatPid || pid == TSPacketizer.PmtPid) && adaptationControl == 0x01)
+            {
+                FixTableVersion(buffer, ts + 5 + buffer[ts + 4], tableVersion);
+            }
+        }
+
+        private static void ShiftPcr(byte[] buffer, int offset, long shift)
+        {
+            long pcrBase = ((long)buffer[offset] << 25) | ((long)buffer[offset + 1] << 17) | ((long)buffer[offset + 2] << 9) |
+                           ((long)buffer[offset + 3] << 1) | ((long)buffer[offset + 4] >> 7);
+            long pcrExtension = ((buffer[offset + 4] & 0x01) << 8) | buffer[offset + 5];
+            long clock = pcrBase * 300 + pcrExtension + shift;
+
+            pcrBase = (clock / 300) & 0x1FFFFFFFFL;
+            pcrExtension = clock % 300;
+
+            buffer[offset] = (byte)(pcrBase >> 25);
+            buffer[offset + 1] = (byte)(pcrBase >> 17);
+            buffer[offset + 2] = (byte)(pcrBase >> 9);
+            buffer[offset + 3] = (byte)(pcrBase >> 1);
+            buffer[offset + 4] = (byte)(((pcrBase & 1) << 7) | 0x7E | (pcrExtension >> 8));
+            buffer[offset + 5] = (byte)pcrExtension;
+        }
+
+        /// <summary>
+        /// Moves the PTS and DTS of the PES header starting at pes (if there is one before end) by shift
+        /// 90 kHz ticks.
+        /// </summary>
+        private static void ShiftPesTimestamps(byte[] buffer, int pes, int end, long shift)
+        {
+            if (pes + 19 > end || buffer[pes] != 0 || buffer[pes + 1] != 0 || buffer[pes + 2] != 1) return;
+
+            int flags = buffer[pes + 7] >> 6;
+            if ((flags & 0x02) != 0) ShiftTimestamp(buffer, pes + 9, shift);
+            if (flags == 0x03) ShiftTimestamp(buffer, pes + 14, shift);
+        }
+
+        /// <summary>
+        /// 33 bit time stamp in the five byte PES layout, marker bits and the four bit prefix kept.
+        /// </summary>
+        private static void ShiftTimestamp(byte[] buffer, int offset, long shift)
+        {
+            long stamp = ((long)((buffer[offset] >> 1) & 0x07) << 30) | ((long)buffer[offset + 1] << 22) |
+                         ((long)(buffer[offset + 2] >> 1) << 15) | ((long)buffer[offset + 3] << 7) | ((long)buffer[offset + 4] >> 1);
+            stamp = (stamp + shift) & 0x1FFFFFFFFL;
+
+            buffer[offset] = (byte)((buffer[offset] & 0xF0) | (int)((stamp >> 29) & 0x0E) | 0x01);
+            buffer[offset + 1] = (byte)(stamp >> 22);
+            buffer[offset + 2] = (byte)(((stamp >> 14) & 0xFE) | 0x01);
+            buffer[offset + 3] = (byte)(stamp >> 7);
+            buffer[offset + 4] = (byte)(((stamp << 1) & 0xFE) | 0x01);
+        }
+
+        private static void FixTableVersion(byte[] buffer, int section, int tableVersion)
+        {
+            int version = (buffer[section + 5] >> 1) & 0x1F;
+            if (version == tableVersion) return;
+
+            int sectionLength = ((buffer[section + 1] & 0x0F) << 8) | buffer[section + 2];
+            int crcOffset = section + 3 + sectionLength - 4;
+
+            buffer[section + 5] = (byte)((buffer[section + 5] & 0xC1) | ((tableVersion & 0x1F) << 1));
+
+            uint crc = Crc32Mpeg2.Compute(buffer, section, crcOffset - section);
+            buffer[crcOffset] = (byte)(crc >> 24);
+            buffer[crcOffset + 1] = (byte)(crc >> 16);
+            buffer[crcOffset + 2] = (byte)(crc >> 8);
+            buffer[crcOffset + 3] = (byte)crc;
+        }
+
+        private static int ReadPackets(Stream input, byte[] buffer, int count)
+        {
+            int total = 0;
+            while (total < count)
+            {
+                int read = input.Read(buffer, total, count - total);
+                if (read <= 0) break;
+                total += read;
+            }
+
+            return total;
+        }
+
+        /// <summary>
+        /// Runs work for every fragment and waits for all of them. The first worker runs on the slots the
+        /// stage already holds; each further one starts only once extraSlot hands it a slot, and gives up
+        /// when the others have taken all the work. Exceptions are stored on the fragment instead of
+        /// tearing down the process.
+        /// </summary>
+        private static void RunAll(List<Fragment> fragments, String name, Func<IDisposable> extraSlot, Action<Fragment> work)
+        {
+            var pending = new Queue<Fragment>(fragments);
+            var threads = new List<Thread>();
+            Logger.Context context = Logger.Current;
+
+            for (int worker = 0; worker < fragments.Count; worker++)
+            {
+                bool extra = (worker > 0 && extraSlot != null);
+                var thread = new Thread(delegate()
+                    {
+                        IDisposable slot = null;
+
+                        try
+                        {
+                            while (extra && slot == null)
+                            {
+                                lock (pending) if (pending.Count == 0) return;
+
+                                slot = extraSlot();
+                                if (slot == null) Thread.Sleep(SlotPollInterval);
+                            }
+
+                            using (ResourceAccounting.Measure(context, false))
+                            {
+                                Fragment current;
+                                while ((current = Next(pending)) != null)
+                                {
+                                    try
+                                    {
+                                        using (TraceRecorder.Span(name + " segment " + current.Index, "native")) work(current);
+                                    }
+                                    catch (Exception ex)
+                                    {
+                                        current.Error = ex;
+                                    }
+                                }
+                            }
+                        }
+                        finally
+                        {
+                            if (slot != null) slot.Dispose();
+                        }
+                    });
+
+                thread.Name = name + " worker " + (worker + 1);
+                thread.Start();
+                threads.Add(thread);
+            }
+
+            foreach (Thread thread in threads) thread.Join();
+        }
+
+        private static Fragment Next(Queue<Fragment> pending)
+        {
+            lock (pending)
+            {
+                return (pending.Count > 0) ? pending.Dequeue() : null;
+            }
+        }
+
+        /// <summary>
+        /// Deletes the fragments in scratch; the first segment is the output itself.
+        /// </summary>
+        private static void DeleteFragments(List<Fragment> fragments)
+        {
+            foreach (Fragment fragment in fragments)
+            {
+                if (fragment.Index == 0) continue;
+
+                try
+                {
+                    if (File.Exists(fragment.Path)) File.Delete(fragment.Path);
+                }
+                catch
+                {
+                }
+            }
+        }
+
+        #endregion
+    }
+}
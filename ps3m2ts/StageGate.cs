@@ -0,0 +1,180 @@
+﻿/*
+ * ps3m2ts
+ *
+ * Copyright (R) 2009-> Henning M. Stephansen
+ * Feel free to use the code by any means, hopefully you can submit your improvements, ideas etc
+ * to henningms@gmail.com or leave a comment at my blog http://www.henning.ms
+ *
+ */
+
+using System;
+using System.Threading;
+
+namespace ps3m2ts
+{
+    /// <summary>
+    /// Counting gate limiting how many jobs run a class of stage at once. The limit can be changed while
+    /// jobs are waiting.
+    /// </summary>
+    class StageGate
+    {
+        private readonly object Sync = new object();
+        private int LimitValue;
+        private int ActiveCount;
+        private int WaitingCount;
+        private int EnteredCount;
+        private int PeakCount;
+        private DateTime BusySince;
+        private TimeSpan BusyTotal;
+
+        public StageGate(String Name, int Limit)
+        {
+            this.Name = Name;
+            this.LimitValue = Math.Max(1, Limit);
+        }
+
+        public String Name { get; private set; }
+
+        public int Limit
+        {
+            get
+            {
+                lock (Sync)
+                {
+                    return LimitValue;
+                }
+            }
+            set
+            {
+                lock (Sync)
+                {
+                    LimitValue = Math.Max(1, value);
+                    Monitor.PulseAll(Sync);
+                }
+            }
+        }
+
+        public int Active
+        {
+            get
+            {
+                lock (Sync)
+                {
+                    return ActiveCount;
+                }
+            }
+        }
+
+        /// <summary>Jobs queued for a slot right now.</summary>
+        public int Waiting
+        {
+            get
+            {
+                lock (Sync)
+                {
+                    return WaitingCount;
+                }
+            }
+        }
+
+        /// <summary>How many times a slot was taken.</summary>
+        public int Entered
+        {
+            get
+            {
+                lock (Sync)
+                {
+                    return EnteredCount;
+                }
+            }
+        }
+
+        /// <summary>Most slots held at once.</summary>
+        public int Peak
+        {
+            get
+            {
+                lock (Sync)
+                {
+                    return PeakCount;
+                }
+            }
+        }
+
+        /// <summary>How long at least one slot was held, up to now.</summary>
+        public TimeSpan Busy
+        {
+            get
+            {
+                lock (Sync)
+                {
+                    return (ActiveCount > 0) ? BusyTotal + (DateTime.UtcNow - BusySince) : BusyTotal;
+                }
+            }
+        }
+
+        /// <summary>
+        /// Waits for a free slot and holds it until the returned object is disposed.
+        /// </summary>
+        public IDisposable Enter()
+        {
+            lock (Sync)
+            {
+                WaitingCount++;
+                while (ActiveCount >= LimitValue) Monitor.Wait(Sync);
+                WaitingCount--;
+
+                if (ActiveCount == 0) BusySince = DateTime.UtcNow;
+                ActiveCount++;
+                EnteredCount++;
+                PeakCount = Math.Max(PeakCount, ActiveCount);
+            }
+
+            return new Slot(this);
+        }
+
+        /// <summary>
+        /// Takes a slot if one is free right now, otherwise returns null without waiting.
+        /// </summary>
+        public IDisposable TryEnter()
+        {
+            lock (Sync)
+            {
+                if (ActiveCount >= LimitValue) return null;
+
+                if (ActiveCount == 0) BusySince = DateTime.UtcNow;
+                ActiveCount++;
+                EnteredCount++;
+                PeakCount = Math.Max(PeakCount, ActiveCount);
+            }
+
+            return new Slot(this);
+        }
+
+        private void Exit()
+        {
+            lock (Sync)
+            {
+                ActiveCount--;
+                if (ActiveCount == 0) BusyTotal += DateTime.UtcNow - BusySince;
+                Monitor.PulseAll(Sync);
+            }
+        }
+
+        private class Slot : IDisposable
+        {
+            private StageGate Gate;
+
+            public Slot(StageGate Gate)
+            {
+                this.Gate = Gate;
+            }
+
+            public void Dispose()
+            {
+                if (Gate != null) Gate.Exit();
+                Gate = null;
+            }
+        }
+    }
+}
@@ -0,0 +1,171 @@
+﻿/*
+ * ps3m2ts
+ *
+ * Copyright (R) 2009-> Henning M. Stephansen
+ * Feel free to use the code by any means, hopefully you can submit your improvements, ideas etc
+ * to henningms@gmail.com or leave a comment at my blog http://www.henning.ms
+ *
+ */
+
+using System;
+using System.Collections.Generic;
+using System.Threading;
+
+namespace ps3m2ts
+{
+    /// <summary>
+    /// Runs jobs through probe -> extract -> transcode -> mux -> cleanup with a bounded queue between
+    /// every two stages, so file N+1 is probed, extracted and transcoded while file N is being muxed.
+    /// Each stage has its own worker threads (one per scheduler job) and still takes the scheduler's CPU
+    /// or I/O slot, so the stage limits hold across the whole pipeline.
+    /// </summary>
+    class StagePipeline
+    {
+        #region Constructor
+
+        public StagePipeline(JobScheduler Scheduler, int Depth, Logger Log)
+        {
+            this.Scheduler = Scheduler;
+            this.Depth = Math.Max(1, Depth);
+            this.Log = Log;
+
+            Stages = new List<Stage>();
+            Stages.Add(new Stage("probe", null, delegate(ConversionJob job)
+                {
+                    job.NameReservation = Scheduler.ReserveName(job.ReservedNames);
+                    job.Probe();
+                    if (job.Convertible) job.PlaceIntermediates();
+                    if (job.Convertible) job.SpaceReservation = Scheduler.ReserveSpace(job.EstimateSpace(), job.WrittenSpace, job.InputFile, Log);
+                }));
+            Stages.Add(new Stage("extract", StageClass.IO, delegate(ConversionJob job) { job.Extract(); }));
+            Stages.Add(new Stage("transcode", StageClass.Cpu, delegate(ConversionJob job) { job.Transcode(); }));
+            Stages.Add(new Stage("mux", StageClass.IO, delegate(ConversionJob job) { job.Mux(Scheduler); }));
+            Stages.Add(new Stage("cleanup", null, delegate(ConversionJob job) { job.Cleanup(); }));
+        }
+
+        #endregion
+
+        #region Private Fields
+
+        private class Stage
+        {
+            public readonly String Name;
+            public readonly StageClass? Class;
+            public readonly Action<ConversionJob> Work;
+
+            public Stage(String Name, StageClass? Class, Action<ConversionJob> Work)
+            {
+                this.Name = Name;
+                this.Class = Class;
+                this.Work = Work;
+            }
+        }
+
+        private readonly JobScheduler Scheduler;
+        private readonly int Depth;
+        private readonly Logger Log;
+        private readonly List<Stage> Stages;
+
+        #endregion
+
+        #region Public Methods
+
+        /// <summary>
+        /// Pushes every job through all stages and returns once the last one has been cleaned up.
+        /// </summary>
+        public void Run(IList<ConversionJob> jobs)
+        {
+            // queue i feeds stage i; the first one is filled up front with every job
+            var queues = new List<BoundedQueue<ConversionJob>>();
+            queues.Add(new BoundedQueue<ConversionJob>(Math.Max(1, jobs.Count)));
+            for (int i = 1; i < Stages.Count; i++) queues.Add(new BoundedQueue<ConversionJob>(Depth));
+
+            for (int i = 0; i < Stages.Count; i++)
+            {
+                BoundedQueue<ConversionJob> queue = queues[i];
+                Metrics.Gauge("ps3m2ts_queue_depth", "Jobs waiting for a stage.", "stage", Stages[i].Name, () => queue.Count);
+            }
+
+            foreach (ConversionJob job in jobs) queues[0].Enqueue(job);
+            queues[0].Complete();
+
+            var stageThreads = new List<List<Thread>>();
+
+            for (int i = 0; i < Stages.Count; i++)
+            {
+                Stage stage = Stages[i];
+                BoundedQueue<ConversionJob> input = queues[i];
+                BoundedQueue<ConversionJob> output = (i + 1 < queues.Count) ? queues[i + 1] : null;
+
+                var threads = new List<Thread>();
+                for (int worker = 0; worker < Scheduler.Jobs; worker++)
+                {
+                    var thread = new Thread(delegate() { RunStage(stage, input, output); });
+                    thread.Name = stage.Name + " " + (worker + 1);
+                    thread.Start();
+                    threads.Add(thread);
+                }
+
+                stageThreads.Add(threads);
+            }
+
+            // a stage is finished once all of its workers are; only then can the next queue be closed
+            for (int i = 0; i < Stages.Count; i++)
+            {
+                foreach (Thread thread in stageThreads[i]) thread.Join();
+                if (i + 1 < queues.Count) queues[i + 1].Complete();
+            }
+        }
+
+        #endregion
+
+        #region Private Methods
+
+        private void RunStage(Stage stage, BoundedQueue<ConversionJob> input, BoundedQueue<ConversionJob> output)
+        {
+            ConversionJob job;
+            while (input.TryDequeue(out job))
+            {
+                bool last = (output == null);
+
+                // failed and unconvertible jobs only pass through to cleanup
+                if (last || (job.Error == null && (job.Convertible || stage.Name == "probe")))
+                {
+                    using (Logger.Enter(job.Context))
+                    try
+                    {
+                        if (stage.Class.HasValue && job.NeedsSlot(stage.Name))
+                        {
+                            using (Scheduler.EnterStage(stage.Class.Value, job.StagePaths(stage.Name)))
+                            using (Log.BeginStage(job.Id, stage.Name)) stage.Work(job);
+                        }
+                        else
+                        {
+                            using (Log.BeginStage(job.Id, stage.Name)) stage.Work(job);
+                        }
+                    }
+                    catch (Exception ex)
+                    {
+                        job.Error = ex;
+                        Metrics.Failures.Labels(stage.Name).Increment();
+                        Log.Log("Error: " + stage.Name + " of '" + job.InputFile + "' failed: " + ex.Message);
+                    }
+                }
+
+                if (last)
+                {
+                    job.ReportResources();
+
+                    if (job.SpaceReservation != null) job.SpaceReservation.Dispose();
+                    job.SpaceReservation = null;
+
+                    if (job.NameReservation != null) job.NameReservation.Dispose();
+                    job.NameReservation = null;
+                }
+                else output.Enqueue(job);
+            }
+        }
+
+        #endregion
+    }
+}
@@ -25,6 +25,8 @@ namespace ps3m2ts
             Subtitle = 2
         }
         
+        private const string PartialSuffix = ".partial";
+
         public struct MediaInfo
         {
             // General mediainfo
@@ -48,7 +50,12 @@ namespace ps3m2ts
             public string Filename;
         }
 
-        public static List<MediaInfo> ReadMediaFile(string file)
+        /// <summary>
+        /// MediaInfo is given a fixed two minutes; it only reads the headers.
+        /// </summary>
+        private static readonly TimeSpan ProbeTimeout = TimeSpan.FromMinutes(2);
+
+        public static List<MediaInfo> ReadMediaFile(string file, Logger Log)
         {
             try
             {
@@ -62,24 +69,15 @@ namespace ps3m2ts
 
 
                     // Ok, so MediaInfo exists, lets start doing some work then
-                    Process p = new Process();
-                    p.StartInfo.FileName = "MediaInfo.exe";
-                    p.StartInfo.Arguments = "-f \"" + file + "\"";
-                    p.StartInfo.UseShellExecute = false;
-                    p.StartInfo.RedirectStandardError = true;
-                    p.StartInfo.RedirectStandardOutput = true;
-                    p.StartInfo.CreateNoWindow = true;
-                    p.StartInfo.WorkingDirectory = Environment.CurrentDirectory;
-                    p.Start();
-
-                    StringBuilder MediaInfoOutput = new StringBuilder();
-                    while (!p.StandardOutput.EndOfStream)
-                    {
-                        MediaInfoOutput.AppendLine(p.StandardOutput.ReadLine());
-                    }
+                    var mediainfo = new ProcessSupervisor("probe", "MediaInfo.exe", "-f \"" + file + "\"");
+                    mediainfo.CaptureOutput = true;
+                    mediainfo.WallClockTimeout = ProbeTimeout;
+                    mediainfo.Log = Log;
+
+                    ProcessResult result = mediainfo.Run();
 
                     String line = "";
-                    String[] MediaInfoLines = MediaInfoOutput.ToString().Split(new String[] { Environment.NewLine }, StringSplitOptions.None);
+                    String[] MediaInfoLines = result.Output.Split(new String[] { Environment.NewLine }, StringSplitOptions.None);
                     List<MediaInfo> TrackList = new List<MediaInfo>();
 
                     for (int i= 0; i < MediaInfoLines.Length; i++)
@@ -210,182 +208,303 @@ namespace ps3m2ts
             }
             catch (Exception ex)
             {
-                Console.WriteLine(ex.Message + ex.StackTrace);
-                Cleanup(file);
-                Environment.Exit(1);
-                return null;
+                // the job records the failure; exiting here would take every other job down with it
+                Log.Log("Error: Reading '" + file + "' with MediaInfo failed: " + ex.Message);
+                throw;
             }
         }
 
-        public static string WriteTSMuxerMetaFile(string file, List<MediaInfo> tracks, bool split, string outputformat)
+        public static string WriteTSMuxerMetaFile(string file, ScratchDirectory scratch, List<MediaInfo> tracks, bool split, string outputformat)
         {
             string MetaFile = String.Empty;
-            try
+
+            if (tracks != null && tracks.Count > 0)
             {
-                if (tracks != null && tracks.Count > 0)
-                {
-                    StreamWriter sw = new StreamWriter(Path.GetFileNameWithoutExtension(file) + ".meta");
+                StreamWriter sw = new StreamWriter(scratch.GetIntermediateName(file) + ".meta");
 
-                    MetaFile = "MUXOPT --no-pcr-on-video-pid --new-audio-pes --vbr --vbv-len=500";
+                MetaFile = "MUXOPT --no-pcr-on-video-pid --new-audio-pes --vbr --vbv-len=500";
 
-                    if (split) MetaFile += " --split-size=4GB";
-                    if ((outputformat == "blu-ray") || (outputformat == "avchd")) MetaFile += " --" + outputformat;
-                       // sw.WriteLine("MUXOPT --no-pcr-on-video-pid --new-audio-pes --vbr --split-size=4GB --vbv-len=500");
-                    //else
-                      //  sw.WriteLine("MUXOPT --no-pcr-on-video-pid --new-audio-pes --vbr  --vbv-len=500");
+                if (split) MetaFile += " --split-size=4GB";
+                if ((outputformat == "blu-ray") || (outputformat == "avchd")) MetaFile += " --" + outputformat;
+                   // sw.WriteLine("MUXOPT --no-pcr-on-video-pid --new-audio-pes --vbr --split-size=4GB --vbv-len=500");
+                //else
+                  //  sw.WriteLine("MUXOPT --no-pcr-on-video-pid --new-audio-pes --vbr  --vbv-len=500");
 
-                    MetaFile += Environment.NewLine;
-                    //sw.WriteLine(muxopt);
+                MetaFile += Environment.NewLine;
+                //sw.WriteLine(muxopt);
 
-                    file = file.Insert(0, "\"");
-                    file = file.Insert(file.Length, "\"");
+                file = file.Insert(0, "\"");
+                file = file.Insert(file.Length, "\"");
 
-                    foreach (MediaInfo trackItem in tracks)
+                foreach (MediaInfo trackItem in tracks)
+                {
+                    if (trackItem.Type == MediaType.Video)
                     {
-                        if (trackItem.Type == MediaType.Video)
-                        {
-                            string level = "";
-                            if (trackItem.Level.Contains("5.1"))
-                                level = "4.1";
-
-                            if (level != "")
-                                MetaFile += trackItem.CodecID + ", " + file + ", fps=" + trackItem.VideoFrameRate 
-                                    + ", level=4.1, insertSEI, contSPS, ar=As source, track=" + trackItem.TrackID.ToString() + Environment.NewLine;
-                            //sw.WriteLine(trackItem.CodecID + ", " + file + ", fps=" + trackItem.VideoFrameRate + ", level=4.1, insertSEI, contSPS, ar=As source, track=" + trackItem.TrackID.ToString());
-                            else
-                                MetaFile += trackItem.CodecID + ", " + file + ", fps=" + trackItem.VideoFrameRate 
-                                    + ", insertSEI, contSPS, ar=As source, track=" + trackItem.TrackID.ToString() + Environment.NewLine;
+                        string level = "";
+                        if (trackItem.Level.Contains("5.1"))
+                            level = "4.1";
+
+                        if (level != "")
+                            MetaFile += trackItem.CodecID + ", " + file + ", fps=" + trackItem.VideoFrameRate 
+                                + ", level=4.1, insertSEI, contSPS, ar=As source, track=" + trackItem.TrackID.ToString() + Environment.NewLine;
+                        //sw.WriteLine(trackItem.CodecID + ", " + file + ", fps=" + trackItem.VideoFrameRate + ", level=4.1, insertSEI, contSPS, ar=As source, track=" + trackItem.TrackID.ToString());
+                        else
+                            MetaFile += trackItem.CodecID + ", " + file + ", fps=" + trackItem.VideoFrameRate 
+                                + ", insertSEI, contSPS, ar=As source, track=" + trackItem.TrackID.ToString() + Environment.NewLine;
 
 
-                                //sw.WriteLine(trackItem.CodecID + ", " + file + ", fps=" + trackItem.VideoFrameRate + ", insertSEI, contSPS, ar=As source, track=" + trackItem.TrackID.ToString());
+                            //sw.WriteLine(trackItem.CodecID + ", " + file + ", fps=" + trackItem.VideoFrameRate + ", insertSEI, contSPS, ar=As source, track=" + trackItem.TrackID.ToString());
+                    }
+                    else if (trackItem.Type == MediaType.Audio)
+                    {
+                        if (trackItem.TrackID == 0)
+                        {
+                            // An external file
+                            MetaFile += trackItem.CodecID + ", \"" + trackItem.Filename + "\"" + Environment.NewLine;
+                            //sw.WriteLine(trackItem.CodecID + ", \"" + trackItem.Filename + "\"");
                         }
-                        else if (trackItem.Type == MediaType.Audio)
+                        else
                         {
-                            if (trackItem.TrackID == 0)
-                            {
-                                // An external file
-                                MetaFile += trackItem.CodecID + ", \"" + trackItem.Filename + "\"" + Environment.NewLine;
-                                //sw.WriteLine(trackItem.CodecID + ", \"" + trackItem.Filename + "\"");
-                            }
-                            else
-                            {
-                                MetaFile += trackItem.CodecID + ", " + file + ", track=" + trackItem.TrackID.ToString() + Environment.NewLine;
-                                //sw.WriteLine(trackItem.CodecID + ", " + file + ", track=" + trackItem.TrackID.ToString());
-                            }
+                            MetaFile += trackItem.CodecID + ", " + file + ", track=" + trackItem.TrackID.ToString() + Environment.NewLine;
+                            //sw.WriteLine(trackItem.CodecID + ", " + file + ", track=" + trackItem.TrackID.ToString());
                         }
                     }
+                }
 
-                    sw.Write(MetaFile);
-                    sw.Close();
+                sw.Write(MetaFile);
+                sw.Close();
 
-                }
-            }
-            catch (Exception ex)
-            {
-                Console.WriteLine(ex.Message);
-                Cleanup(file);
-                Environment.Exit(1);
             }
 
             return MetaFile;
         }
 
-        public static void TSMuxerMuxFile(string file, string destination, string outputformat, Logger Log)
+        public static void TSMuxerMuxFile(string file, ScratchDirectory scratch, string outputfile, Logger Log, ProgressTracker Progress)
         {
             try
             {
                 if (File.Exists(file))
                 {
-                    string metafile = Path.GetFileNameWithoutExtension(file) + ".meta";
-                    string outputfile = destination + ((destination.EndsWith("\\")) ? "" : "\\");
-                    if ((outputformat == "m2ts") || (outputformat == "ts"))
-                        outputfile += Path.GetFileNameWithoutExtension(file) + ".";
-                    outputfile += outputformat;
+                    string metafile = scratch.GetIntermediateName(file) + ".meta";
 
                     Log.Log("Starting tsMuxeR with output '" + outputfile + "'...");
 
                     if (File.Exists("tsmuxer.exe"))
                     {
-                        Process p = new Process();
-                        p.StartInfo.FileName = "tsmuxer.exe";
-                        p.StartInfo.Arguments = "\"" + metafile + "\" \"" + outputfile + "\"";
-                        p.StartInfo.UseShellExecute = false;
-                        p.StartInfo.RedirectStandardError = true;
-                        p.StartInfo.RedirectStandardOutput = true;
-                        p.StartInfo.CreateNoWindow = true;
-                        p.StartInfo.WorkingDirectory = Environment.CurrentDirectory;
-
-                        
-                        p.Start();
-
-                        while (p.StandardOutput.EndOfStream != true)
-                        {
-                            Log.Log("tsMuxeR: " + p.StandardOutput.ReadLine());
-                        }
+                        var tsmuxer = new ProcessSupervisor("mux", "tsmuxer.exe", "\"" + metafile + "\" \"" + outputfile + "\"");
+                        tsmuxer.WallClockTimeout = ProcessSupervisor.DefaultWallClockTimeout;
+                        tsmuxer.OutputLine = delegate(string line)
+                            {
+                                if (!Progress.Parse(ProgressTracker.TsMuxerProgress, line)) Log.Log("tsMuxeR: " + line);
+                            };
+                        tsmuxer.ErrorLine = line => Log.Log("tsMuxeR: " + line);
+                        tsmuxer.Log = Log;
+                        tsmuxer.Run();
                     }
                 }
             }
             catch (Exception ex)
             {
-                Console.WriteLine(ex.Message);
-                Cleanup(file);
-                Environment.Exit(1);
+                Log.Log("Error: tsMuxeR failed on '" + file + "': " + ex.Message);
+                throw;
+            }
+        }
+
+        /// <summary>
+        /// Path of the muxed output: a .m2ts/.ts file, or the blu-ray/avchd folder inside destination.
+        /// </summary>
+        public static string GetOutputFile(string file, string destination, string outputformat)
+        {
+            if ((outputformat == "m2ts") || (outputformat == "ts"))
+                return Path.Combine(destination, Path.GetFileNameWithoutExtension(file) + "." + outputformat);
+
+            return Path.Combine(destination, outputformat);
+        }
+
+        /// <summary>
+        /// Where the output is written until it's complete: "name.partial.m2ts" (tsMuxeR picks the format
+        /// from the extension, so it stays last) or the "blu-ray.partial" folder.
+        /// </summary>
+        public static string GetPartialOutputFile(string file, string destination, string outputformat)
+        {
+            if ((outputformat == "m2ts") || (outputformat == "ts"))
+                return Path.Combine(destination, Path.GetFileNameWithoutExtension(file) + PartialSuffix + "." + outputformat);
+
+            return Path.Combine(destination, outputformat + PartialSuffix);
+        }
+
+        /// <summary>
+        /// The partial output files of a .m2ts/.ts conversion: "name.partial.m2ts", or with /split
+        /// "name.partial.split.1.m2ts" and so on. Partials of other inputs whose name merely starts the
+        /// same ("name.partial" of "name.partial.mkv") don't match.
+        /// </summary>
+        private static List<string> GetPartialOutputFiles(string file, string destination, string outputformat)
+        {
+            var partials = new List<string>();
+            if (!Directory.Exists(destination)) return partials;
+
+            string prefix = Path.GetFileNameWithoutExtension(file) + PartialSuffix;
+            string extension = "." + outputformat;
+
+            foreach (string partial in Directory.GetFiles(destination, prefix + ".*"))
+            {
+                // what is left between the prefix and the extension: nothing, or ".split.<n>"
+                string rest = Path.GetFileName(partial).Substring(prefix.Length);
+                if (!rest.EndsWith(extension, StringComparison.OrdinalIgnoreCase)) continue;
+
+                rest = rest.Substring(0, rest.Length - extension.Length);
+                if ((rest.Length == 0) ||
+                    (rest.StartsWith(".split.") && (rest.Length > 7) && rest.Substring(7).All(char.IsDigit)))
+                    partials.Add(partial);
+            }
+
+            return partials;
+        }
+
+        /// <summary>
+        /// Bytes written to the partial output so far.
+        /// </summary>
+        public static long PartialOutputBytes(string file, string destination, string outputformat)
+        {
+            long bytes = 0;
+
+            if ((outputformat == "m2ts") || (outputformat == "ts"))
+            {
+                foreach (string partial in GetPartialOutputFiles(file, destination, outputformat))
+                    bytes += new FileInfo(partial).Length;
+            }
+            else
+            {
+                string partial = GetPartialOutputFile(file, destination, outputformat);
+                if (!Directory.Exists(partial)) return 0;
+
+                foreach (string written in Directory.GetFiles(partial, "*", SearchOption.AllDirectories))
+                    bytes += new FileInfo(written).Length;
+            }
+
+            return bytes;
+        }
+
+        /// <summary>
+        /// Renames the finished partial output over the final one and returns the final paths. Split
+        /// output ("name.partial.split.1.m2ts" and so on) is renamed file by file.
+        /// </summary>
+        public static List<string> CommitPartialOutput(string file, string destination, string outputformat)
+        {
+            var outputs = new List<string>();
+
+            if ((outputformat == "m2ts") || (outputformat == "ts"))
+            {
+                string prefix = Path.GetFileNameWithoutExtension(file) + PartialSuffix;
+
+                foreach (string partial in GetPartialOutputFiles(file, destination, outputformat))
+                {
+                    string final = Path.Combine(destination, Path.GetFileNameWithoutExtension(file) +
+                                                             Path.GetFileName(partial).Substring(prefix.Length));
+
+                    if (File.Exists(final)) File.Replace(partial, final, null);
+                    else File.Move(partial, final);
+
+                    outputs.Add(final);
+                }
+            }
+            else
+            {
+                string partial = GetPartialOutputFile(file, destination, outputformat);
+                string final = GetOutputFile(file, destination, outputformat);
+
+                if (!Directory.Exists(partial)) return outputs;
+                if (Directory.Exists(final)) Directory.Delete(final, true);
+                Directory.Move(partial, final);
+
+                outputs.Add(final);
+            }
+
+            return outputs;
+        }
+
+        /// <summary>
+        /// Deletes whatever partial output a failed conversion left: every file of a split output, or the
+        /// blu-ray/avchd folder.
+        /// </summary>
+        public static void DeletePartialOutput(string file, string destination, string outputformat)
+        {
+            if ((outputformat == "m2ts") || (outputformat == "ts"))
+            {
+                foreach (string partial in GetPartialOutputFiles(file, destination, outputformat))
+                    File.Delete(partial);
+            }
+            else
+            {
+                string partial = GetPartialOutputFile(file, destination, outputformat);
+                if (Directory.Exists(partial)) Directory.Delete(partial, true);
             }
         }
 
-        public static void ExtractMKV(string file, List<MediaInfo> tracks)
+        /// <summary>
+        /// True if the final output of a conversion is in place.
+        /// </summary>
+        public static bool OutputExists(string file, string destination, string outputformat)
+        {
+            string final = GetOutputFile(file, destination, outputformat);
+            if ((outputformat == "m2ts") || (outputformat == "ts"))
+                return File.Exists(final) || Directory.GetFiles(destination, Path.GetFileNameWithoutExtension(file) + ".split.*").Length > 0;
+
+            return Directory.Exists(final);
+        }
+
+        public static void ExtractMKV(string file, ScratchDirectory scratch, List<MediaInfo> tracks, Logger Log, ProgressTracker Progress)
         {
             try
             {
                 if (File.Exists(file))
                 {
                     string arguments = "";
-                    string fileWoEx = Path.GetFileNameWithoutExtension(file);
 
+                    // quoted, the scratch directory may contain spaces
                     foreach (MediaInfo tmptrack in tracks)
                     {
                         if (tmptrack.CodecID == "V_MPEG4/ISO/AVC")
-                            arguments += tmptrack.TrackID.ToString() + ":" + fileWoEx + ".h264 ";
+                            arguments += "\"" + tmptrack.TrackID.ToString() + ":" + scratch.GetIntermediatePath(file, ".h264") + "\" ";
                         else if (tmptrack.CodecID == "A_AC3")
-                            arguments += tmptrack.TrackID.ToString() + ":" + fileWoEx + ".ac3 ";
+                            arguments += "\"" + tmptrack.TrackID.ToString() + ":" + scratch.GetIntermediatePath(file, ".ac3") + "\" ";
                         else if (tmptrack.CodecID == "A_DTS")
-                            arguments += tmptrack.TrackID.ToString() + ":" + fileWoEx + ".dts ";
+                            arguments += "\"" + tmptrack.TrackID.ToString() + ":" + scratch.GetIntermediatePath(file, ".dts") + "\" ";
                     }
 
                     if (File.Exists("mkvextract.exe"))
                     {
-                        Process p = new Process();
-                        p.StartInfo.FileName = "mkvextract.exe";
-                        p.StartInfo.Arguments = "tracks \"" + file + "\" " + arguments; 
-                        p.StartInfo.UseShellExecute = false;
-                        p.StartInfo.RedirectStandardError = true;
-                        p.StartInfo.RedirectStandardOutput = true;
-                        p.StartInfo.CreateNoWindow = true;
-                        p.StartInfo.WorkingDirectory = Environment.CurrentDirectory;
-                        p.Start();
-
-                        while (!p.StandardOutput.EndOfStream)
-                        {
-                            Console.WriteLine(p.StandardOutput.ReadLine());
-                        }
+                        var mkvextract = new ProcessSupervisor("extract", "mkvextract.exe", "tracks \"" + file + "\" " + arguments);
+                        mkvextract.WallClockTimeout = ProcessSupervisor.DefaultWallClockTimeout;
+                        mkvextract.OutputLine = delegate(string line)
+                            {
+                                if (!Progress.Parse(ProgressTracker.MkvExtractProgress, line)) Log.Status(line);
+                            };
+                        mkvextract.ErrorLine = line => Log.Log("mkvextract: " + line);
+                        mkvextract.Log = Log;
+                        mkvextract.Limit = scratch.CheckBudget;
+
+                        // mkvextract exits with 1 when it only printed warnings
+                        mkvextract.AcceptedExitCodes = new[] { 0, 1 };
+                        mkvextract.Run();
                     }
                 }
             }
             catch (Exception ex)
             {
-                Console.WriteLine(ex.Message);
-                Cleanup(file);
-                Environment.Exit(1);
+                Log.Log("Error: Extracting '" + file + "' failed: " + ex.Message);
+                throw;
             }
         }
 
-        public static List<MediaInfo> ConvertDTS(string file, List<MediaInfo> tracks)
+        public static List<MediaInfo> ConvertDTS(string file, ScratchDirectory scratch, List<MediaInfo> tracks, Logger Log, ProgressTracker Progress)
         {
             try
             {
                 if (File.Exists(file))
                 {
-                    string fileWoEx = Path.GetFileNameWithoutExtension(file);
+                    string dtsFile = scratch.GetIntermediatePath(file, ".dts");
+                    string ac3File = scratch.GetIntermediatePath(file, ".ac3");
                     List<MediaInfo> tmpList = new List<MediaInfo>();
 
                     foreach (MediaInfo audioTracks in tracks)
@@ -396,28 +515,25 @@ namespace ps3m2ts
 
                             if (File.Exists("eac3to\\eac3to.exe"))
                             {
-                                Process p = new Process();
-                                p.StartInfo.FileName = "eac3to\\eac3to.exe";
-                                p.StartInfo.Arguments = "\"" + fileWoEx + ".dts\" \"" + fileWoEx + ".ac3\"";
-                                p.StartInfo.UseShellExecute = false;
-                                p.StartInfo.RedirectStandardError = true;
-                                p.StartInfo.RedirectStandardOutput = true;
-                                p.StartInfo.CreateNoWindow = true;
-                                p.StartInfo.WorkingDirectory = Environment.CurrentDirectory;
-                                p.Start();
-
-                                while (!p.StandardOutput.EndOfStream)
-                                {
-                                    Console.WriteLine(p.StandardOutput.ReadLine());
-                                }
+                                var eac3to = new ProcessSupervisor("transcode", "eac3to\\eac3to.exe", "\"" + dtsFile + "\" \"" + ac3File + "\"");
+                                eac3to.WallClockTimeout = ProcessSupervisor.DefaultWallClockTimeout;
+                                eac3to.OutputLine = delegate(string line)
+                                    {
+                                        if (!Progress.Parse(ProgressTracker.Eac3toProgress, line)) Log.Status(line);
+                                    };
+                                eac3to.ErrorLine = line => Log.Log("eac3to: " + line);
+                                eac3to.Log = Log;
+                                eac3to.Limit = scratch.CheckBudget;
+                                eac3to.CpuHeavy = true;
+                                eac3to.Run();
                             }
 
-                            if (File.Exists(fileWoEx + ".ac3"))
+                            if (File.Exists(ac3File))
                             {
 
                                 tmpAudioTrack.CodecID = "A_AC3";
                                 tmpAudioTrack.TrackID = 0;
-                                tmpAudioTrack.Filename = fileWoEx + ".ac3";
+                                tmpAudioTrack.Filename = ac3File;
                             }
 
                             tmpList.Add(tmpAudioTrack);
@@ -434,33 +550,29 @@ namespace ps3m2ts
             }
             catch (Exception ex)
             {
-                Console.WriteLine(ex.Message);
-                Cleanup(file);
-                Environment.Exit(1);
+                Log.Log("Error: Converting the DTS track of '" + file + "' failed: " + ex.Message);
+                throw;
             }
 
             return null;
         }
 
-        public static void Cleanup(string file)
+        public static void Cleanup(string file, ScratchDirectory scratch)
         {
-            Support.Cleanup(file, false);
+            Support.Cleanup(file, scratch, false);
         }
 
-        public static void Cleanup(string file, bool deletesource)
+        public static void Cleanup(string file, ScratchDirectory scratch, bool deletesource)
         {
             // Lets try to free some space
 
-            string fileWoEx = Path.GetFileNameWithoutExtension(file);
-
-            if (File.Exists(fileWoEx + ".h264"))
-                File.Delete(fileWoEx + ".h264");
-
-            if (File.Exists(fileWoEx + ".ac3"))
-                File.Delete(fileWoEx + ".ac3");
+            string fileWoEx = scratch.GetIntermediateName(file);
 
-            if (File.Exists(fileWoEx + ".dts"))
-                File.Delete(fileWoEx + ".dts");
+            foreach (string extension in new[] { ".h264", ".ac3", ".dts" })
+            {
+                if (File.Exists(scratch.GetIntermediatePath(file, extension)))
+                    File.Delete(scratch.GetIntermediatePath(file, extension));
+            }
 
             if (File.Exists(fileWoEx + ".meta"))
                 File.Delete(fileWoEx + ".meta");
@@ -468,6 +580,9 @@ namespace ps3m2ts
             if (File.Exists(fileWoEx + " - Log.txt"))
                 File.Delete(fileWoEx + " - Log.txt");
 
+            // a job's own scratch directory (and its memory directory) goes as a whole
+            scratch.Delete();
+
             if ((deletesource) && (File.Exists(file)))
                 File.Delete(file);
         }
@@ -514,23 +629,159 @@ namespace ps3m2ts
                         if (i < args.Length) options.Add("destination", args[i]);
                         break;
 
+                    case "/scratch":
+                        i++;
+                        if (i < args.Length) options.Add("scratch", args[i]);
+                        break;
+
+                    case "/jsonlog":
+                        i++;
+                        if (i < args.Length) options.Add("jsonlog", args[i]);
+                        break;
+
+                    case "/ramdir":
+                        i++;
+                        if (i < args.Length) options.Add("ramdir", args[i]);
+                        break;
+
                     case "/delsource":
                     case "/deletesource":
                         options.Add("deletesource", "true");
                         break;
+
+                    case "/watch":
+                        options.Add("watch", "true");
+                        break;
+
+                    case "/order=sjf":
+                        options["order"] = "sjf";
+                        break;
+
+                    case "/order=lpt":
+                        options["order"] = "lpt";
+                        break;
+
+                    case "/force":
+                        options.Add("force", "true");
+                        break;
+
+                    case "/hashinputs":
+                        options.Add("hashinputs", "true");
+                        break;
+
+                    case "/pipeline":
+                        options["pipeline"] = "2";
+                        break;
+
+                    case "/tui":
+                        options.Add("tui", "true");
+                        break;
+
+                    case "/jobs=auto":
+                        options["autotune"] = "true";
+                        break;
+
+                    case "/ionice=idle":
+                        options["ionice"] = "idle";
+                        break;
+
+                    case "/ionice=low":
+                        options["ionice"] = "low";
+                        break;
+
+                    default:
+                        if (args[i].ToLower().StartsWith("/trace="))
+                        {
+                            options["trace"] = args[i].Substring(7).Trim('"');
+                            break;
+                        }
+
+                        if (args[i].ToLower().StartsWith("/metrics="))
+                        {
+                            options["metrics"] = args[i].Substring(9).Trim('"');
+                            break;
+                        }
+
+                        if (args[i].ToLower().StartsWith("/cpuset="))
+                        {
+                            options["cpuset"] = args[i].Substring(8).Trim('"');
+                            break;
+                        }
+
+                        if (ParseNumberOption(args[i], "segments", 2, options)) break;
+                        if (ParseNumberOption(args[i], "jobs", 1, options)) break;
+                        if (ParseNumberOption(args[i], "cpujobs", 1, options)) break;
+                        if (ParseNumberOption(args[i], "pipeline", 1, options)) break;
+                        if (ParseNumberOption(args[i], "timeout", 0, options)) break;
+                        if (ParseNumberOption(args[i], "stalltimeout", 0, options)) break;
+                        if (ParseNumberOption(args[i], "settle", 1, options)) break;
+                        if (ParseNumberOption(args[i], "scratchbudget", 0, options)) break;
+                        if (ParseNumberOption(args[i], "ramscratch", 0, options)) break;
+                        if (ParseNumberOption(args[i], "hddjobs", 1, options)) break;
+                        if (ParseNumberOption(args[i], "ssdjobs", 1, options)) break;
+                        if (ParseNumberOption(args[i], "metricsinterval", 1, options)) break;
+                        if (ParseNumberOption(args[i], "tuneinterval", 1, options)) break;
+                        if (ParseNumberOption(args[i], "nice", 0, options)) break;
+                        if (ParseNumberOption(args[i], "maxcores", 1, options)) break;
+                        if (ParseNumberOption(args[i], "maxmbps", 1, options)) break;
+                        ParseNumberOption(args[i], "iojobs", 1, options);
+                        break;
                 }
             }
 
             // set defaults
             if (!options.ContainsKey("outputformat")) options.Add("outputformat", "m2ts");
+            if (!options.ContainsKey("jobs")) options.Add("jobs", options.ContainsKey("autotune") ? Math.Max(4, Environment.ProcessorCount + 2).ToString() : "1");
+            if (!options.ContainsKey("cpujobs")) options.Add("cpujobs", (options.ContainsKey("maxcores") ? Math.Min(Environment.ProcessorCount, int.Parse(options["maxcores"])) : Environment.ProcessorCount).ToString());
+            if (!options.ContainsKey("iojobs")) options.Add("iojobs", "2");
+            if (!options.ContainsKey("hddjobs")) options.Add("hddjobs", "1");
+            if (!options.ContainsKey("ssdjobs")) options.Add("ssdjobs", options["iojobs"]);
+            if (!options.ContainsKey("timeout")) options.Add("timeout", "0");
+            if (!options.ContainsKey("stalltimeout")) options.Add("stalltimeout", "10");
+            if (!options.ContainsKey("settle")) options.Add("settle", "5");
+            if (!options.ContainsKey("scratchbudget")) options.Add("scratchbudget", "0");
+            if (!options.ContainsKey("ramscratch")) options.Add("ramscratch", "0");
+            if (!options.ContainsKey("metricsinterval")) options.Add("metricsinterval", "15");
+            if (!options.ContainsKey("tuneinterval")) options.Add("tuneinterval", "20");
+            if (!options.ContainsKey("nice")) options.Add("nice", "0");
+            if (!options.ContainsKey("maxcores")) options.Add("maxcores", "0");
+            if (!options.ContainsKey("maxmbps")) options.Add("maxmbps", "0");
 
             return options;
         }
 
+        /// <summary>
+        /// Handles "/name=number" switches. Returns true if arg was the named switch. A value that isn't a
+        /// number of at least minimum is recorded as "invalid", which Main reports before doing anything.
+        /// </summary>
+        private static bool ParseNumberOption(string arg, string name, int minimum, Dictionary<string, string> options)
+        {
+            string prefix = "/" + name + "=";
+            if (!arg.ToLower().StartsWith(prefix)) return false;
+
+            int value;
+            if (int.TryParse(arg.Substring(prefix.Length).Trim('"'), out value) && (value >= minimum))
+                options[name] = value.ToString();
+            else if (!options.ContainsKey("invalid"))
+                options["invalid"] = "Invalid value in '" + arg + "', /" + name + " must be a whole number of at least " + minimum + ".";
+
+            return true;
+        }
+
         public static void DisplayHelp()
         {
             Console.WriteLine("ps3m2ts usage: ps3m2ts \"<input-path>\" [/split] [/dest \"<output-path>\"]");
-            Console.WriteLine("    [/format=<format>] [/delsource] [/log]");
+            Console.WriteLine("    [/format=<format>] [/delsource] [/log] [/segments=<n>]");
+            Console.WriteLine("    [/jobs=<n>|auto [/tuneinterval=<sec>]] [/cpujobs=<n>] [/iojobs=<n>]");
+            Console.WriteLine("    [/pipeline[=<n>]]");
+            Console.WriteLine("    [/hddjobs=<n>] [/ssdjobs=<n>] [/jsonlog \"<file>\"] [/trace=<file>]");
+            Console.WriteLine("    [/timeout=<min>] [/stalltimeout=<min>] [/force] [/hashinputs]");
+            Console.WriteLine("    [/watch [/settle=<sec>]] [/order=<policy>]");
+            Console.WriteLine("    [/scratch \"<scratch-path>\" [/scratchbudget=<MB>]]");
+            Console.WriteLine("    [/ramscratch=<MB> [/ramdir \"<ram-path>\"]]");
+            Console.WriteLine("    [/metrics=<file> [/metricsinterval=<sec>]] [/tui]");
+            Console.WriteLine("    [/nice=<n>] [/ionice=<class>] [/cpuset=<cores>] [/maxcores=<n>]");
+            Console.WriteLine("    [/maxmbps=<n>]");
             Console.WriteLine("");
 
             Console.WriteLine("  \"<input-path>\"\t The .mkv file or directory of files to convert.");
@@ -542,6 +793,66 @@ namespace ps3m2ts
             Console.WriteLine("\t\t\t \"m2ts\" (default), \"ts\", \"blu-ray\", or \"avchd\".");
             Console.WriteLine("  /delsource\t\t Delete the input file(s) after conversion.");
             Console.WriteLine("  /log\t\t\t Enable conversion log (saves to input directory).");
+            Console.WriteLine("  /tui\t\t\t Show the running jobs, throughput and queue on one screen");
+            Console.WriteLine("\t\t\t instead of scrolling the log (which still goes to /log).");
+            Console.WriteLine("  /jsonlog \"<file>\"\t Append every log line and event (jobs, stages, helper");
+            Console.WriteLine("\t\t\t tools, transfers) to <file> as one JSON object per line.");
+            Console.WriteLine("  /trace=<file>\t\t Write a timeline of every job, stage, wait and helper");
+            Console.WriteLine("\t\t\t tool to <file> (Chrome trace format, for chrome://tracing");
+            Console.WriteLine("\t\t\t or Perfetto).");
+            Console.WriteLine("  /metrics=<file>\t Write counters (files, bytes per stage, failures, buffer");
+            Console.WriteLine("\t\t\t pool allocations, GC) and queue depths to <file> in the");
+            Console.WriteLine("\t\t\t Prometheus text format, e.g. for the node exporter's");
+            Console.WriteLine("\t\t\t textfile collector.");
+            Console.WriteLine("  /metricsinterval=<sec> Rewrite the metrics file every <sec> seconds");
+            Console.WriteLine("\t\t\t (default 15).");
+            Console.WriteLine("  /segments=<n>\t\t Remux compatible files as <n> segments in parallel.");
+            Console.WriteLine("  /jobs=<n>\t\t Convert up to <n> files at once (default 1).");
+            Console.WriteLine("  /jobs=auto\t\t Find the best number of concurrent transcodes and");
+            Console.WriteLine("\t\t\t extracts/muxes while converting, starting from /cpujobs");
+            Console.WriteLine("\t\t\t and /iojobs; combine with /jobs=<n> to cap the files at");
+            Console.WriteLine("\t\t\t once (default: cores + 2).");
+            Console.WriteLine("  /tuneinterval=<sec>\t Measure <sec> seconds before each adjustment of");
+            Console.WriteLine("\t\t\t /jobs=auto (default 20).");
+            Console.WriteLine("  /cpujobs=<n>\t\t Limit concurrent audio transcodes (default: cores).");
+            Console.WriteLine("  /iojobs=<n>\t\t Limit concurrent extracts and muxes (default 2).");
+            Console.WriteLine("  /nice=<n>\t\t Run ps3m2ts and its helper tools at CPU priority <n>,");
+            Console.WriteLine("\t\t\t 0 (normal, default) to 19 (lowest).");
+            Console.WriteLine("  /ionice=<class>\t Run ps3m2ts and its helper tools at disk priority");
+            Console.WriteLine("\t\t\t \"low\" or \"idle\" (only when the disk is otherwise unused).");
+            Console.WriteLine("  /cpuset=<cores>\t Run audio transcodes on these cores only, e.g. \"2-3\".");
+            Console.WriteLine("  /maxcores=<n>\t\t Use at most <n> cores for everything (also the default");
+            Console.WriteLine("\t\t\t for /cpujobs).");
+            Console.WriteLine("  /maxmbps=<n>\t\t Read and write at most <n> MB/s in total; helper tools");
+            Console.WriteLine("\t\t\t are paused while over the limit.");
+            Console.WriteLine("  /hddjobs=<n>\t\t Limit concurrent extracts and muxes per spinning disk");
+            Console.WriteLine("\t\t\t (default 1).");
+            Console.WriteLine("  /ssdjobs=<n>\t\t Limit concurrent extracts and muxes per SSD or other");
+            Console.WriteLine("\t\t\t device (default: /iojobs).");
+            Console.WriteLine("  /pipeline[=<n>]\t Overlap the stages of consecutive files, queueing up");
+            Console.WriteLine("\t\t\t to <n> files between stages (default 2).");
+            Console.WriteLine("  /timeout=<min>\t Kill a helper tool running longer than <min> minutes");
+            Console.WriteLine("\t\t\t (default 0, no limit).");
+            Console.WriteLine("  /stalltimeout=<min>\t Kill a helper tool that shows no progress for <min>");
+            Console.WriteLine("\t\t\t minutes (default 10, 0 disables).");
+            Console.WriteLine("  /force\t\t Convert files even if their output is up to date.");
+            Console.WriteLine("  /hashinputs\t\t Also compare sampled content hashes, not just the size");
+            Console.WriteLine("\t\t\t and timestamp, to decide whether a file changed.");
+            Console.WriteLine("  /watch\t\t Keep running and convert .mkv files as they arrive in");
+            Console.WriteLine("\t\t\t the input directory (Ctrl+C to stop); m2ts or ts only.");
+            Console.WriteLine("  /settle=<sec>\t\t Queue a new file once its size hasn't changed for");
+            Console.WriteLine("\t\t\t <sec> seconds (default 5).");
+            Console.WriteLine("  /order=<policy>\t Order files by estimated conversion time: \"sjf\"");
+            Console.WriteLine("\t\t\t (shortest first) or \"lpt\" (longest first, best with /jobs).");
+            Console.WriteLine("  /scratch \"<scratch-path>\"");
+            Console.WriteLine("\t\t\t Keep each file's intermediates in a directory of its own");
+            Console.WriteLine("\t\t\t below <scratch-path> (default: the working directory).");
+            Console.WriteLine("  /scratchbudget=<MB>\t Fail a file whose intermediates outgrow <MB> (default 0,");
+            Console.WriteLine("\t\t\t no limit).");
+            Console.WriteLine("  /ramscratch=<MB>\t Keep intermediates in memory while they fit in <MB>");
+            Console.WriteLine("\t\t\t (all jobs together); the rest goes to disk (default 0, off).");
+            Console.WriteLine("  /ramdir \"<ram-path>\"\t Memory-backed directory for /ramscratch, e.g. a RAM");
+            Console.WriteLine("\t\t\t disk (default /dev/shm where it exists).");
             Console.WriteLine("");
 
             Console.WriteLine("Press any key to exit. . .");
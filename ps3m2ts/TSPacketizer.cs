@@ -0,0 +1,470 @@
+﻿/*
+ * ps3m2ts
+ *
+ * Copyright (R) 2009-> Henning M. Stephansen
+ * Feel free to use the code by any means, hopefully you can submit your improvements, ideas etc
+ * to henningms@gmail.com or leave a comment at my blog http://www.henning.ms
+ *
+ */
+
+using System;
+using System.Collections.Generic;
+using System.IO;
+
+namespace ps3m2ts
+{
+    /// <summary>
+    /// Writes PES payloads as an MPEG-2 transport stream, either plain 188 byte packets (.ts) or 192 byte
+    /// packets with an arrival time stamp in front (.m2ts). PCR goes on its own PID, the same layout
+    /// tsMuxeR produces with --no-pcr-on-video-pid.
+    /// </summary>
+    class TSPacketizer : IDisposable
+    {
+        #region Constants
+
+        public const int PatPid = 0x0000;
+        public const int PmtPid = 0x0100;
+        public const int PcrPid = 0x1001;
+        public const int VideoPid = 0x1011;
+        public const int AudioPid = 0x1100;
+
+        public const byte StreamTypeH264 = 0x1B;
+        public const byte StreamTypeAC3 = 0x81;
+
+        public const int TSPacketSize = 188;
+        public const int M2TSPacketSize = 192;
+
+        /// <summary>27 MHz ticks per 90 kHz tick.</summary>
+        private const long ClockScale = 300;
+
+        /// <summary>How far the system clock runs behind the decoding time stamps (0.7 s).</summary>
+        private const long MuxDelay = 27000000L * 7 / 10;
+
+        /// <summary>Clock advance per packet, equivalent to a 80 Mbit/s mux rate.</summary>
+        public const long ClockPerPacket = 27000000L * TSPacketSize * 8 / 80000000;
+
+        private const long PcrInterval = 27000000L / 25;
+        private const long TableInterval = 27000000L / 10;
+        private const int BatchPackets = 4096;
+
+        #endregion
+
+        #region Constructor
+
+        public TSPacketizer(Stream Output, bool M2TS)
+        {
+            this.Output = Output;
+            this.M2TS = M2TS;
+            this.PacketSize = M2TS ? M2TSPacketSize : TSPacketSize;
+            this.BatchLease = BufferPool.Shared.Rent(PacketSize * BatchPackets);
+            this.Batch = BatchLease.Buffer;
+            this.Streams = new List<ElementaryStream>();
+        }
+
+        #endregion
+
+        #region Private Fields
+
+        private class ElementaryStream
+        {
+            public int Pid;
+            public byte StreamType;
+            public byte StreamId;
+            public byte[] Descriptors;
+            public int Continuity;
+        }
+
+        private readonly Stream Output;
+        private readonly bool M2TS;
+        private readonly int PacketSize;
+        private BufferLease BatchLease;
+        private readonly byte[] Batch;
+        private int BatchLength;
+        private readonly List<ElementaryStream> Streams;
+        private readonly byte[] PesHeader = new byte[19];
+        private readonly byte[] Section = new byte[TSPacketSize];
+
+        private bool ClockStarted;
+        private long Clock;
+        private long LastPcr;
+        private long LastTables;
+        private int PatContinuity;
+        private int PmtContinuity;
+
+        #endregion
+
+        #region Public Properties
+
+        public int PacketLength
+        {
+            get { return PacketSize; }
+        }
+
+        public long PacketsWritten { get; private set; }
+
+        /// <summary>PAT/PMT version_number, 0-31.</summary>
+        public int TableVersion { get; set; }
+
+        /// <summary>System clock (27 MHz) of the first packet written.</summary>
+        public long FirstClock { get; private set; }
+
+        /// <summary>System clock (27 MHz) of the next packet.</summary>
+        public long CurrentClock
+        {
+            get { return Clock; }
+        }
+
+        #endregion
+
+        #region Public Methods
+
+        public void AddStream(int Pid, byte StreamType, byte StreamId)
+        {
+            var stream = new ElementaryStream();
+            stream.Pid = Pid;
+            stream.StreamType = StreamType;
+            stream.StreamId = StreamId;
+
+            if (StreamType == StreamTypeAC3)
+            {
+                // registration descriptor so demuxers outside the Blu-ray world know what 0x81 is
+                stream.Descriptors = new byte[] { 0x05, 0x04, (byte)'A', (byte)'C', (byte)'-', (byte)'3' };
+            }
+
+            Streams.Add(stream);
+        }
+
+        /// <summary>
+        /// Packetizes one PES. Time stamps are in 90 kHz units; pass dts == pts when there is no reordering.
+        /// </summary>
+        public void WritePes(int Pid, byte[] data, int offset, int count, long pts, long dts, bool randomAccess)
+        {
+            ElementaryStream stream = FindStream(Pid);
+            int headerLength = BuildPesHeader(stream, count, pts, dts);
+
+            long target = dts * ClockScale - MuxDelay;
+            if (!ClockStarted)
+            {
+                Clock = Math.Max(0, target);
+                FirstClock = Clock;
+                LastPcr = Clock - PcrInterval;
+                LastTables = Clock - TableInterval;
+                ClockStarted = true;
+            }
+            else if (target > Clock)
+            {
+                Clock = target;
+            }
+
+            int total = headerLength + count;
+            int consumed = 0;
+            bool first = true;
+
+            while (consumed < total)
+            {
+                WriteServicePackets();
+
+                int packet = BeginPacket();
+                int remaining = total - consumed;
+                int adaptation = (first && randomAccess) ? 2 : 0;
+
+                if (remaining < 184 - adaptation) adaptation = 184 - remaining;
+
+                Batch[packet] = 0x47;
+                Batch[packet + 1] = (byte)((first ? 0x40 : 0x00) | ((Pid >> 8) & 0x1F));
+                Batch[packet + 2] = (byte)Pid;
+                Batch[packet + 3] = (byte)(((adaptation > 0) ? 0x30 : 0x10) | stream.Continuity);
+                stream.Continuity = (stream.Continuity + 1) & 0x0F;
+
+                int position = packet + 4;
+                if (adaptation > 0)
+                {
+                    Batch[position] = (byte)(adaptation - 1);
+                    if (adaptation > 1)
+                    {
+                        Batch[position + 1] = (byte)((first && randomAccess) ? 0x40 : 0x00);
+                        for (int i = 2; i < adaptation; i++) Batch[position + i] = 0xFF;
+                    }
+
+                    position += adaptation;
+                }
+
+                int payload = 184 - adaptation;
+                int fromHeader = Math.Max(0, Math.Min(payload, headerLength - consumed));
+
+                if (fromHeader > 0)
+                {
+                    Buffer.BlockCopy(PesHeader, consumed, Batch, position, fromHeader);
+                    position += fromHeader;
+                }
+
+                int fromData = payload - fromHeader;
+                if (fromData > 0)
+                {
+                    Buffer.BlockCopy(data, offset + consumed + fromHeader - headerLength, Batch, position, fromData);
+                }
+
+                consumed += payload;
+                first = false;
+                Clock += ClockPerPacket;
+            }
+        }
+
+        /// <summary>
+        /// Continuity counter the next payload packet on this PID would carry.
+        /// </summary>
+        public int GetContinuity(int Pid)
+        {
+            if (Pid == PatPid) return PatContinuity;
+            if (Pid == PmtPid) return PmtContinuity;
+            if (Pid == PcrPid) return 0;
+
+            return FindStream(Pid).Continuity;
+        }
+
+        /// <summary>
+        /// Writes any buffered packets to the output stream.
+        /// </summary>
+        public void Flush()
+        {
+            if (BatchLength > 0)
+            {
+                Output.Write(Batch, 0, BatchLength);
+                BatchLength = 0;
+            }
+
+            Output.Flush();
+        }
+
+        /// <summary>
+        /// Returns the packet batch buffer to the pool. Call Flush first to keep buffered packets.
+        /// </summary>
+        public void Dispose()
+        {
+            if (BatchLease != null) BatchLease.Release();
+            BatchLease = null;
+        }
+
+        #endregion
+
+        #region Private Methods
+
+        private ElementaryStream FindStream(int Pid)
+        {
+            foreach (ElementaryStream stream in Streams)
+            {
+                if (stream.Pid == Pid) return stream;
+            }
+
+            throw new ArgumentException("PID " + Pid + " has not been added.");
+        }
+
+        private int BuildPesHeader(ElementaryStream stream, int count, long pts, long dts)
+        {
+            bool withDts = (dts != pts);
+            int headerLength = withDts ? 19 : 14;
+            int pesLength = count + headerLength - 6;
+
+            // unbounded length is only allowed for video
+            if (pesLength > 0xFFFF) pesLength = 0;
+
+            PesHeader[0] = 0;
+            PesHeader[1] = 0;
+            PesHeader[2] = 1;
+            PesHeader[3] = stream.StreamId;
+            PesHeader[4] = (byte)(pesLength >> 8);
+            PesHeader[5] = (byte)pesLength;
+            PesHeader[6] = 0x84; // data_alignment_indicator
+            PesHeader[7] = (byte)(withDts ? 0xC0 : 0x80);
+            PesHeader[8] = (byte)(headerLength - 9);
+
+            WriteTimestamp(PesHeader, 9, withDts ? 0x03 : 0x02, pts);
+            if (withDts) WriteTimestamp(PesHeader, 14, 0x01, dts);
+
+            return headerLength;
+        }
+
+        private static void WriteTimestamp(byte[] buffer, int offset, int prefix, long timestamp)
+        {
+            buffer[offset] = (byte)((prefix << 4) | (int)((timestamp >> 29) & 0x0E) | 1);
+            buffer[offset + 1] = (byte)(timestamp >> 22);
+            buffer[offset + 2] = (byte)(((timestamp >> 14) & 0xFE) | 1);
+            buffer[offset + 3] = (byte)(timestamp >> 7);
+            buffer[offset + 4] = (byte)(((timestamp << 1) & 0xFE) | 1);
+        }
+
+        /// <summary>
+        /// Emits PAT/PMT and PCR packets whenever their repetition interval has passed.
+        /// </summary>
+        private void WriteServicePackets()
+        {
+            if (Clock - LastTables >= TableInterval)
+            {
+                WriteSection(PatPid, BuildPat(), ref PatContinuity);
+                WriteSection(PmtPid, BuildPmt(), ref PmtContinuity);
+                LastTables = Clock;
+            }
+
+            if (Clock - LastPcr >= PcrInterval)
+            {
+                WritePcr();
+                LastPcr = Clock;
+            }
+        }
+
+        private void WritePcr()
+        {
+            int packet = BeginPacket();
+
+            Batch[packet] = 0x47;
+            Batch[packet + 1] = (byte)((PcrPid >> 8) & 0x1F);
+            Batch[packet + 2] = (byte)(PcrPid & 0xFF);
+            Batch[packet + 3] = 0x20; // adaptation field only, continuity counter doesn't advance
+            Batch[packet + 4] = 183;
+            Batch[packet + 5] = 0x10; // PCR_flag
+
+            long pcrBase = Clock / ClockScale;
+            long pcrExtension = Clock % ClockScale;
+
+            Batch[packet + 6] = (byte)(pcrBase >> 25);
+            Batch[packet + 7] = (byte)(pcrBase >> 17);
+            Batch[packet + 8] = (byte)(pcrBase >> 9);
+            Batch[packet + 9] = (byte)(pcrBase >> 1);
+            Batch[packet + 10] = (byte)(((pcrBase & 1) << 7) | 0x7E | (pcrExtension >> 8));
+            Batch[packet + 11] = (byte)pcrExtension;
+
+            for (int i = 12; i < TSPacketSize; i++) Batch[packet + i] = 0xFF;
+        }
+
+        private int BuildPat()
+        {
+            int length = 0;
+            Section[length++] = 0x00; // table_id
+            length += 2;              // section_length, filled in by FinishSection
+            Section[length++] = 0x00; // transport_stream_id
+            Section[length++] = 0x01;
+            Section[length++] = (byte)(0xC1 | ((TableVersion & 0x1F) << 1));
+            Section[length++] = 0x00;
+            Section[length++] = 0x00;
+            Section[length++] = 0x00; // program_number 1
+            Section[length++] = 0x01;
+            Section[length++] = (byte)(0xE0 | (PmtPid >> 8));
+            Section[length++] = (byte)(PmtPid & 0xFF);
+
+            return FinishSection(length);
+        }
+
+        private int BuildPmt()
+        {
+            int length = 0;
+            Section[length++] = 0x02; // table_id
+            length += 2;
+            Section[length++] = 0x00; // program_number 1
+            Section[length++] = 0x01;
+            Section[length++] = (byte)(0xC1 | ((TableVersion & 0x1F) << 1));
+            Section[length++] = 0x00;
+            Section[length++] = 0x00;
+            Section[length++] = (byte)(0xE0 | (PcrPid >> 8));
+            Section[length++] = (byte)(PcrPid & 0xFF);
+
+            if (M2TS)
+            {
+                // HDMV registration descriptor, as written by Blu-ray muxers
+                Section[length++] = 0xF0;
+                Section[length++] = 6;
+                Section[length++] = 0x05;
+                Section[length++] = 0x04;
+                Section[length++] = (byte)'H';
+                Section[length++] = (byte)'D';
+                Section[length++] = (byte)'M';
+                Section[length++] = (byte)'V';
+            }
+            else
+            {
+                Section[length++] = 0xF0;
+                Section[length++] = 0;
+            }
+
+            foreach (ElementaryStream stream in Streams)
+            {
+                int descriptorLength = (stream.Descriptors != null) ? stream.Descriptors.Length : 0;
+
+                Section[length++] = stream.StreamType;
+                Section[length++] = (byte)(0xE0 | (stream.Pid >> 8));
+                Section[length++] = (byte)stream.Pid;
+                Section[length++] = (byte)(0xF0 | (descriptorLength >> 8));
+                Section[length++] = (byte)descriptorLength;
+
+                if (descriptorLength > 0)
+                {
+                    Buffer.BlockCopy(stream.Descriptors, 0, Section, length, descriptorLength);
+                    length += descriptorLength;
+                }
+            }
+
+            return FinishSection(length);
+        }
+
+        private int FinishSection(int length)
+        {
+            int sectionLength = length - 3 + 4;
+            Section[1] = (byte)(0xB0 | (sectionLength >> 8));
+            Section[2] = (byte)sectionLength;
+
+            uint crc = Crc32Mpeg2.Compute(Section, 0, length);
+            Section[length++] = (byte)(crc >> 24);
+            Section[length++] = (byte)(crc >> 16);
+            Section[length++] = (byte)(crc >> 8);
+            Section[length++] = (byte)crc;
+
+            return length;
+        }
+
+        private void WriteSection(int Pid, int length, ref int continuity)
+        {
+            int packet = BeginPacket();
+
+            Batch[packet] = 0x47;
+            Batch[packet + 1] = (byte)(0x40 | ((Pid >> 8) & 0x1F));
+            Batch[packet + 2] = (byte)Pid;
+            Batch[packet + 3] = (byte)(0x10 | continuity);
+            Batch[packet + 4] = 0x00; // pointer_field
+            continuity = (continuity + 1) & 0x0F;
+
+            Buffer.BlockCopy(Section, 0, Batch, packet + 5, length);
+            for (int i = 5 + length; i < TSPacketSize; i++) Batch[packet + i] = 0xFF;
+        }
+
+        /// <summary>
+        /// Reserves the next packet in the batch buffer, writes the m2ts arrival time stamp if needed and
+        /// returns the offset of the 0x47 sync byte.
+        /// </summary>
+        private int BeginPacket()
+        {
+            if (BatchLength + PacketSize > PacketSize * BatchPackets)
+            {
+                Output.Write(Batch, 0, BatchLength);
+                BatchLength = 0;
+            }
+
+            int packet = BatchLength;
+            BatchLength += PacketSize;
+            PacketsWritten++;
+
+            if (M2TS)
+            {
+                // copy_permission_indicator 0, 30 bit arrival_time_stamp on the 27 MHz clock
+                long ats = Clock & 0x3FFFFFFF;
+                Batch[packet] = (byte)(ats >> 24);
+                Batch[packet + 1] = (byte)(ats >> 16);
+                Batch[packet + 2] = (byte)(ats >> 8);
+                Batch[packet + 3] = (byte)ats;
+                packet += 4;
+            }
+
+            return packet;
+        }
+
+        #endregion
+    }
+}
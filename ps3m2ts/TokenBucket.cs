@@ -0,0 +1,194 @@
+﻿/*
+ * ps3m2ts
+ *
+ * Copyright (R) 2009-> Henning M. Stephansen
+ * Feel free to use the code by any means, hopefully you can submit your improvements, ideas etc
+ * to henningms@gmail.com or leave a comment at my blog http://www.henning.ms
+ *
+ */
+
+using System;
+using System.Diagnostics;
+using System.IO;
+using System.Threading;
+
+namespace ps3m2ts
+{
+    /// <summary>
+    /// Bandwidth limit shared by every job: tokens (bytes) flow in at a fixed rate up to one second's
+    /// worth, and whoever moves bytes takes them out. Taking more than there is goes into debt, which
+    /// the caller pays off by waiting (native stages) or by being paused (helper tools).
+    /// </summary>
+    class TokenBucket
+    {
+        #region Constructor
+
+        public TokenBucket(long BytesPerSecond)
+        {
+            this.BytesPerSecond = Math.Max(1, BytesPerSecond);
+            this.Tokens = this.BytesPerSecond;
+            this.Clock = Stopwatch.StartNew();
+        }
+
+        #endregion
+
+        #region Private Fields
+
+        private readonly object Sync = new object();
+        private readonly Stopwatch Clock;
+        private double Tokens;
+        private double LastRefill;
+
+        #endregion
+
+        #region Public Properties
+
+        public long BytesPerSecond { get; private set; }
+
+        /// <summary>How long until the bucket is out of debt; zero when it isn't in debt.</summary>
+        public TimeSpan Debt
+        {
+            get
+            {
+                lock (Sync)
+                {
+                    Refill();
+                    return (Tokens < 0) ? TimeSpan.FromSeconds(-Tokens / BytesPerSecond) : TimeSpan.Zero;
+                }
+            }
+        }
+
+        #endregion
+
+        #region Public Methods
+
+        /// <summary>
+        /// Takes bytes without waiting; see Debt for what that cost.
+        /// </summary>
+        public void Take(long bytes)
+        {
+            if (bytes <= 0) return;
+
+            lock (Sync)
+            {
+                Refill();
+                Tokens -= bytes;
+            }
+        }
+
+        /// <summary>
+        /// Takes bytes and sleeps off any debt.
+        /// </summary>
+        public void Wait(long bytes)
+        {
+            Take(bytes);
+
+            TimeSpan debt = Debt;
+            if (debt > TimeSpan.Zero) Thread.Sleep(debt);
+        }
+
+        #endregion
+
+        #region Private Methods
+
+        private void Refill()
+        {
+            double now = Clock.Elapsed.TotalSeconds;
+            Tokens = Math.Min(BytesPerSecond, Tokens + (now - LastRefill) * BytesPerSecond);
+            LastRefill = now;
+        }
+
+        #endregion
+    }
+
+    /// <summary>
+    /// Passes reads and writes through to a stream, waiting on a TokenBucket for every byte moved.
+    /// </summary>
+    class ThrottledStream : Stream
+    {
+        #region Constructor
+
+        public ThrottledStream(Stream Inner, TokenBucket Bucket)
+        {
+            this.Inner = Inner;
+            this.Bucket = Bucket;
+        }
+
+        #endregion
+
+        #region Private Fields
+
+        private readonly Stream Inner;
+        private readonly TokenBucket Bucket;
+
+        #endregion
+
+        #region Public Properties
+
+        public override bool CanRead
+        {
+            get { return Inner.CanRead; }
+        }
+
+        public override bool CanSeek
+        {
+            get { return Inner.CanSeek; }
+        }
+
+        public override bool CanWrite
+        {
+            get { return Inner.CanWrite; }
+        }
+
+        public override long Length
+        {
+            get { return Inner.Length; }
+        }
+
+        public override long Position
+        {
+            get { return Inner.Position; }
+            set { Inner.Position = value; }
+        }
+
+        #endregion
+
+        #region Public Methods
+
+        public override int Read(byte[] buffer, int offset, int count)
+        {
+            int read = Inner.Read(buffer, offset, count);
+            Bucket.Wait(read);
+            return read;
+        }
+
+        public override void Write(byte[] buffer, int offset, int count)
+        {
+            Bucket.Wait(count);
+            Inner.Write(buffer, offset, count);
+        }
+
+        public override void Flush()
+        {
+            Inner.Flush();
+        }
+
+        public override long Seek(long offset, SeekOrigin origin)
+        {
+            return Inner.Seek(offset, origin);
+        }
+
+        public override void SetLength(long value)
+        {
+            Inner.SetLength(value);
+        }
+
+        protected override void Dispose(bool disposing)
+        {
+            if (disposing) Inner.Dispose();
+            base.Dispose(disposing);
+        }
+
+        #endregion
+    }
+}
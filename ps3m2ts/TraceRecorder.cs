@@ -0,0 +1,257 @@
+﻿/*
+ * ps3m2ts
+ *
+ * Copyright (R) 2009-> Henning M. Stephansen
+ * Feel free to use the code by any means, hopefully you can submit your improvements, ideas etc
+ * to henningms@gmail.com or leave a comment at my blog http://www.henning.ms
+ *
+ */
+
+using System;
+using System.Collections.Generic;
+using System.Diagnostics;
+using System.Globalization;
+using System.IO;
+using System.Text;
+using System.Threading;
+
+namespace ps3m2ts
+{
+    /// <summary>
+    /// Records spans (stages, waits for a slot, helper processes, native remux threads) for /trace and
+    /// writes them in Chrome Trace Event format, which chrome://tracing and Perfetto show as a timeline.
+    /// Spans of a thread working on a job go on that job's row; other threads get a row of their own.
+    /// While not recording, Span costs one null check.
+    /// </summary>
+    class TraceRecorder
+    {
+        #region Constants
+
+        /// <summary>Rows of threads without a job are numbered from here, so they sort below the jobs.</summary>
+        private const int ThreadLaneBase = 100000;
+
+        #endregion
+
+        #region Constructor
+
+        private TraceRecorder(String Path)
+        {
+            this.Path = Path;
+            Clock = Stopwatch.StartNew();
+            Events = new List<String>();
+            Lanes = new Dictionary<int, String>();
+        }
+
+        #endregion
+
+        #region Private Fields
+
+        private static volatile TraceRecorder Current;
+
+        private readonly Stopwatch Clock;
+        private readonly List<String> Events;
+        private readonly Dictionary<int, String> Lanes;
+
+        private class NoSpan : IDisposable
+        {
+            public void Dispose()
+            {
+            }
+        }
+
+        private static readonly IDisposable Nothing = new NoSpan();
+
+        #endregion
+
+        #region Public Properties
+
+        public String Path { get; private set; }
+
+        public static bool Recording
+        {
+            get { return Current != null; }
+        }
+
+        #endregion
+
+        #region Public Methods
+
+        /// <summary>
+        /// Starts recording; Save writes everything recorded to path.
+        /// </summary>
+        public static void Start(String path)
+        {
+            Current = new TraceRecorder(path);
+        }
+
+        /// <summary>
+        /// Names the row of job, e.g. after its input file.
+        /// </summary>
+        public static void NameJob(int job, String name)
+        {
+            TraceRecorder trace = Current;
+            if (trace == null) return;
+
+            lock (trace.Events) trace.Lanes[job] = "job " + job + ": " + name;
+        }
+
+        /// <summary>
+        /// A span from now until the returned object is disposed. args are key/value pairs shown with it.
+        /// </summary>
+        public static IDisposable Span(String name, String category, params object[] args)
+        {
+            TraceRecorder trace = Current;
+            if (trace == null) return Nothing;
+
+            return new OpenSpan(trace, name, category, args);
+        }
+
+        /// <summary>
+        /// A span that ended just now and lasted duration, for waits that are only worth showing once it's
+        /// known they were long.
+        /// </summary>
+        public static void Record(String name, String category, TimeSpan duration, params object[] args)
+        {
+            TraceRecorder trace = Current;
+            if (trace == null) return;
+
+            double end = trace.Now();
+            trace.Add(name, category, end - duration.TotalMilliseconds * 1000, end, args);
+        }
+
+        /// <summary>
+        /// Writes the trace file, if recording.
+        /// </summary>
+        public static void Save(Logger Log)
+        {
+            TraceRecorder trace = Current;
+            if (trace == null) return;
+
+            try
+            {
+                using (var writer = new StreamWriter(trace.Path, false, new UTF8Encoding(false)))
+                {
+                    writer.WriteLine("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+
+                    lock (trace.Events)
+                    {
+                        bool first = true;
+                        foreach (KeyValuePair<int, String> lane in trace.Lanes)
+                        {
+                            writer.Write(first ? "" : ",\n");
+                            writer.Write("{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":1,\"tid\":" +
+                                         lane.Key.ToString(CultureInfo.InvariantCulture) + ",\"args\":{\"name\":" + Quote(lane.Value) + "}}");
+                            first = false;
+                        }
+
+                        foreach (String e in trace.Events)
+                        {
+                            writer.Write(first ? "" : ",\n");
+                            writer.Write(e);
+                            first = false;
+                        }
+                    }
+
+                    writer.WriteLine("]}");
+                }
+
+                Log.Log("Trace written to '" + trace.Path + "'.");
+            }
+            catch (Exception ex)
+            {
+                Log.Log("Error: Unable to write trace '" + trace.Path + "': " + ex.Message);
+            }
+        }
+
+        #endregion
+
+        #region Private Methods
+
+        /// <summary>
+        /// Microseconds since recording started.
+        /// </summary>
+        private double Now()
+        {
+            return Clock.ElapsedTicks * 1000000.0 / Stopwatch.Frequency;
+        }
+
+        private void Add(String name, String category, double start, double end, object[] args)
+        {
+            int lane;
+            Logger.Context context = Logger.Current;
+
+            if (context != null) lane = context.Job;
+            else lane = ThreadLaneBase + Thread.CurrentThread.ManagedThreadId;
+
+            var e = new StringBuilder(160);
+            e.Append("{\"ph\":\"X\",\"name\":").Append(Quote(name));
+            e.Append(",\"cat\":").Append(Quote(category));
+            e.Append(",\"ts\":").Append(start.ToString("0.#", CultureInfo.InvariantCulture));
+            e.Append(",\"dur\":").Append(Math.Max(0, end - start).ToString("0.#", CultureInfo.InvariantCulture));
+            e.Append(",\"pid\":1,\"tid\":").Append(lane.ToString(CultureInfo.InvariantCulture));
+
+            if (args != null && args.Length > 1)
+            {
+                e.Append(",\"args\":{");
+                for (int i = 0; i + 1 < args.Length; i += 2)
+                {
+                    if (i > 0) e.Append(',');
+                    e.Append(Quote(Convert.ToString(args[i], CultureInfo.InvariantCulture))).Append(':');
+                    e.Append(Quote(Convert.ToString(args[i + 1], CultureInfo.InvariantCulture)));
+                }
+                e.Append('}');
+            }
+
+            e.Append('}');
+
+            lock (Events)
+            {
+                Events.Add(e.ToString());
+
+                if (!Lanes.ContainsKey(lane))
+                    Lanes[lane] = (context != null) ? "job " + lane : (Thread.CurrentThread.Name ?? "thread " + Thread.CurrentThread.ManagedThreadId);
+            }
+        }
+
+        private static String Quote(String text)
+        {
+            var quoted = new StringBuilder(text.Length + 2);
+            quoted.Append('"');
+
+            foreach (char c in text)
+            {
+                if (c == '"' || c == '\\') quoted.Append('\\').Append(c);
+                else if (c < ' ') quoted.Append("\\u").Append(((int)c).ToString("x4"));
+                else quoted.Append(c);
+            }
+
+            return quoted.Append('"').ToString();
+        }
+
+        private class OpenSpan : IDisposable
+        {
+            private TraceRecorder Trace;
+            private readonly String Name;
+            private readonly String Category;
+            private readonly object[] Args;
+            private readonly double Start;
+
+            public OpenSpan(TraceRecorder Trace, String Name, String Category, object[] Args)
+            {
+                this.Trace = Trace;
+                this.Name = Name;
+                this.Category = Category;
+                this.Args = Args;
+                this.Start = Trace.Now();
+            }
+
+            public void Dispose()
+            {
+                if (Trace != null) Trace.Add(Name, Category, Start, Trace.Now(), Args);
+                Trace = null;
+            }
+        }
+
+        #endregion
+    }
+}
@@ -0,0 +1,279 @@
+﻿/*
+ * ps3m2ts
+ *
+ * Copyright (R) 2009-> Henning M. Stephansen
+ * Feel free to use the code by any means, hopefully you can submit your improvements, ideas etc
+ * to henningms@gmail.com or leave a comment at my blog http://www.henning.ms
+ *
+ */
+
+using System;
+using System.Collections.Generic;
+using System.IO;
+using System.Threading;
+
+namespace ps3m2ts
+{
+    /// <summary>
+    /// /watch mode: keeps converting .mkv files as they arrive in the input directory. File system
+    /// notifications (inotify on Linux) mark files as candidates. A candidate is queued once its size and
+    /// timestamp have not changed for the settle time and it can be opened. The scheduler's workers stay
+    /// up the whole time and take queued files as soon as they're free.
+    /// </summary>
+    class WatchFolder
+    {
+        #region Constants
+
+        private const int PollInterval = 1000;
+        private const int QueueDepth = 256;
+
+        #endregion
+
+        #region Constructor
+
+        public WatchFolder(String Directory, Dictionary<string, string> Options, JobScheduler Scheduler, Logger Log)
+        {
+            this.Directory = Directory;
+            this.Options = Options;
+            this.Scheduler = Scheduler;
+            this.Log = Log;
+            this.Settle = TimeSpan.FromSeconds(int.Parse(Options["settle"]));
+
+            Candidates = new Dictionary<String, Candidate>(StringComparer.OrdinalIgnoreCase);
+            InFlight = new Dictionary<String, bool>(StringComparer.OrdinalIgnoreCase);
+            Queue = new BoundedQueue<ConversionJob>(QueueDepth);
+
+            Metrics.Gauge("ps3m2ts_queue_depth", "Jobs waiting for a stage.", "stage", "watch", () => Queue.Count);
+        }
+
+        #endregion
+
+        #region Private Fields
+
+        private class Candidate
+        {
+            public long Size;
+            public DateTime LastWrite;
+            public DateTime StableSince;
+        }
+
+        private readonly Dictionary<string, string> Options;
+        private readonly JobScheduler Scheduler;
+        private readonly Logger Log;
+        private readonly TimeSpan Settle;
+
+        private readonly Dictionary<String, Candidate> Candidates;
+        private readonly Dictionary<String, bool> InFlight;
+        private readonly BoundedQueue<ConversionJob> Queue;
+
+        private volatile bool Stopping;
+        private bool Rescan;
+        private int Converted;
+        private int Skipped;
+
+        #endregion
+
+        #region Public Properties
+
+        public String Directory { get; private set; }
+
+        #endregion
+
+        #region Public Methods
+
+        /// <summary>
+        /// Watches until Ctrl+C, then lets the jobs already running finish. Queued files that haven't
+        /// started are dropped; they are picked up again by the next run.
+        /// </summary>
+        public void Run()
+        {
+            Console.CancelKeyPress += delegate(object sender, ConsoleCancelEventArgs e)
+                {
+                    e.Cancel = true;
+                    Stopping = true;
+
+                    // completed first, so nothing is queued behind the drain (and a blocked Enqueue returns)
+                    Queue.Complete();
+                    List<ConversionJob> dropped = Queue.Drain();
+                    foreach (ConversionJob job in dropped) Done(job.InputFile);
+
+                    Log.Log("Stopping, waiting for running conversions to finish" +
+                            ((dropped.Count > 0) ? " (" + dropped.Count + " queued file(s) left for the next run)" : "") + "...");
+                };
+
+            var workers = new Thread(delegate()
+                {
+                    Scheduler.Run(Queue, Convert,
+                                  (job, ex) => Log.Log("Error: Converting '" + job.InputFile + "' failed: " + ex.Message));
+                });
+            workers.Name = "watch workers";
+            workers.Start();
+
+            using (var watcher = new FileSystemWatcher(Directory, "*.mkv"))
+            {
+                watcher.IncludeSubdirectories = true;
+                watcher.NotifyFilter = NotifyFilters.FileName | NotifyFilters.Size | NotifyFilters.LastWrite;
+                watcher.Created += delegate(object sender, FileSystemEventArgs e) { Touch(e.FullPath); };
+                watcher.Changed += delegate(object sender, FileSystemEventArgs e) { Touch(e.FullPath); };
+                watcher.Renamed += delegate(object sender, RenamedEventArgs e) { Touch(e.FullPath); };
+
+                // the notification buffer overflowed; fall back to a full scan
+                watcher.Error += delegate { lock (Candidates) Rescan = true; };
+                watcher.EnableRaisingEvents = true;
+
+                Log.Log("Watching '" + Directory + "' for new .mkv files (Ctrl+C to stop)...");
+
+                // files that were already there when we started
+                ScanDirectory();
+
+                while (!Stopping)
+                {
+                    Thread.Sleep(PollInterval);
+
+                    bool rescan;
+                    lock (Candidates)
+                    {
+                        rescan = Rescan;
+                        Rescan = false;
+                    }
+
+                    if (rescan) ScanDirectory();
+                    QueueSettledFiles();
+                }
+            }
+
+            Queue.Complete();
+            workers.Join();
+
+            Log.Log("Watch stopped: " + Converted + " file(s) converted, " + Skipped + " up to date.");
+        }
+
+        #endregion
+
+        #region Private Methods
+
+        private void ScanDirectory()
+        {
+            foreach (String file in System.IO.Directory.GetFiles(Directory, "*.mkv", SearchOption.AllDirectories)) Touch(file);
+        }
+
+        /// <summary>
+        /// Marks file as a candidate, or restarts its settle time if it is one already.
+        /// </summary>
+        private void Touch(String file)
+        {
+            lock (Candidates)
+            {
+                if (InFlight.ContainsKey(file)) return;
+
+                Candidate candidate;
+                if (!Candidates.TryGetValue(file, out candidate))
+                {
+                    candidate = new Candidate();
+                    Candidates.Add(file, candidate);
+                }
+
+                candidate.Size = -1;
+                candidate.StableSince = DateTime.UtcNow;
+            }
+        }
+
+        private void QueueSettledFiles()
+        {
+            var settled = new List<String>();
+
+            lock (Candidates)
+            {
+                var gone = new List<String>();
+
+                foreach (KeyValuePair<String, Candidate> pair in Candidates)
+                {
+                    var info = new FileInfo(pair.Key);
+                    if (!info.Exists)
+                    {
+                        gone.Add(pair.Key);
+                        continue;
+                    }
+
+                    Candidate candidate = pair.Value;
+                    if (info.Length != candidate.Size || info.LastWriteTimeUtc != candidate.LastWrite)
+                    {
+                        candidate.Size = info.Length;
+                        candidate.LastWrite = info.LastWriteTimeUtc;
+                        candidate.StableSince = DateTime.UtcNow;
+                    }
+                    else if (DateTime.UtcNow - candidate.StableSince >= Settle && CanOpen(pair.Key))
+                    {
+                        settled.Add(pair.Key);
+                    }
+                }
+
+                foreach (String file in gone) Candidates.Remove(file);
+
+                foreach (String file in settled)
+                {
+                    Candidates.Remove(file);
+                    InFlight[file] = true;
+                }
+            }
+
+            foreach (String file in settled)
+            {
+                var job = new ConversionJob(file, Options, Log);
+
+                if (job.IsUpToDate())
+                {
+                    Interlocked.Increment(ref Skipped);
+                    Metrics.Files.Labels("up_to_date").Increment();
+                    Done(file);
+                }
+                else if (!Queue.Enqueue(job)) Done(file);
+            }
+        }
+
+        private void Convert(ConversionJob job)
+        {
+            try
+            {
+                job.Run(Scheduler);
+                if (job.Convertible && job.Error == null) Interlocked.Increment(ref Converted);
+            }
+            finally
+            {
+                Done(job.InputFile);
+            }
+        }
+
+        private void Done(String file)
+        {
+            lock (Candidates)
+            {
+                InFlight.Remove(file);
+            }
+        }
+
+        /// <summary>
+        /// A copy still in progress on Windows holds a write lock; this is the last check before queueing.
+        /// </summary>
+        private static bool CanOpen(String file)
+        {
+            try
+            {
+                using (new FileStream(file, FileMode.Open, FileAccess.Read, FileShare.Read))
+                {
+                    return true;
+                }
+            }
+            catch (IOException)
+            {
+                return false;
+            }
+            catch (UnauthorizedAccessException)
+            {
+                return false;
+            }
+        }
+
+        #endregion
+    }
+}